@@ -21,20 +21,60 @@
 // Game
 #define BUZZER_ACTIVE_TIME                 5000
 #define BUZZER_DISABLED_TIME               3000
+#define BUZZ_ARBITRATION_WINDOW_US         5000 // Buzz claims are collected this long after the earliest press before the winner is decided
+#define BUZZ_MAX_CLAIMS                    16
+#define BUZZ_DECISION_DELAY_MS             10   // The arbiter decides this much later than the window, claims delayed by collisions still count
+#define BUZZ_DECISION_TIMEOUT_MS           700  // Without the arbiter's decision this long after the window, nodes decide the round on their own
+#define BUZZ_CLAIM_COPIES                  2    // Claims are sent this many more times right away, against collisions in a close race
+#define BUZZ_CLAIM_COPY_MAX_DELAY_MS       4    // ... each 1 to this many ms after the previous one
 
 // Comm
-#define VERSION_CODE                       0x13      // Increment in case of breaking struct changes in communication
+#define VERSION_CODE                       0x1A      // Increment in case of breaking struct changes in communication
 #define SECONDS_TO_REMEMBER_PEERS          30
 #define ACCOUNCEMENT_INTERVAL_SECONDS      10
 #define ACCOUNCEMENT_INTERVAL_WHILE_ACTIVE 200       // [ms]
+#define STATE_KEYFRAME_INTERVAL            10        // Send a full state update at the latest after this many delta updates
+#define JOIN_JITTER_MS                     500       // Join announcements are delayed randomly by up to this, so nodes switched on together don't collide
+#define JOIN_REPLY_MIN_DELAY_MS            20        // Replies to join announcements are delayed randomly between these,
+#define JOIN_REPLY_MAX_DELAY_MS            300       // so that one reply covers all joins of a burst
 #define SHUTDOWN_TIME_NO_BUZZING_SECONDS   (60 * 20) // 20 minutes without buzzing, even when others are around -> shut down
 #define SHUTDOWN_TIME_NO_COMMS_SECONDS     (60 * 5)  // 5 minutes without another nearby buzzer -> shutdown
-#define DEFAULT_PING_INTERVAL              10000     // Ping interval
+#define DEFAULT_PING_INTERVAL              10000     // Ping interval (at most one ping per interval, the peer is chosen by link stability)
+#define PING_MAX_INTERVAL_FACTOR           16        // Stable links are pinged down to every PING_MAX_INTERVAL_FACTOR * ping interval
+#define TIMESYNC_INTERVAL_MS               2000      // How often to exchange a time sample with our time source
+#define COMMAND_RETRY_INITIAL_MS           20        // First retransmission of an unacknowledged command, doubled on each retry
+#define COMMAND_MAX_ATTEMPTS               6         // Transmissions of a command before it is reported as failed
+#define COMMAND_BROADCAST_REPEATS          3         // Transmissions of a broadcast command (these are not acknowledged)
+#define RELAY_MAX_HOPS                     3         // Transmissions of a relayed frame (not counting the original one)
+#define RELAY_SEEN_TIMEOUT_MS              640       // How long copies of a relayed frame are suppressed (outlasts all retransmissions of a command)
+#define CHANNEL_SELECT_ON_BOOT             1         // Controllers move the network to the quietest channel when switched on
+#define CHANNEL_SWITCH_DELAY_MS            1500      // Time between announcing a channel switch and switching
+#define CHANNEL_SWITCH_MIN_GAIN            150       // Scan load another channel must save at least to move the network (a -70 dBm access point on ours)
+#define CHANNEL_SWITCH_MIN_GAIN_PERCENT    25        // ... and at least this share of our channel's load
+#define CHANNEL_LOST_TIMEOUT_MS            15000     // Buzzers that did not hear anyone for this long search the other channels
+#define CHANNEL_SEARCH_DWELL_MS            400       // Time spent on each channel while searching (must cover JOIN_REPLY_MAX_DELAY_MS)
+#define RELAY_DIRECT_TIMEOUT_MS            20000     // A peer not heard directly for this long (two announcements) is reached through relays
+#define PHY_SWITCH_DELAY_MS                1500      // Time between announcing a PHY switch and switching
+#define PHY_EVALUATE_INTERVAL_MS           10000     // How often the controller checks whether the links ask for another PHY
+#define PHY_FALLBACK_TIMEOUT_MS            25000     // Peers not heard again this long after a PHY switch count as lost (covers two announcements)
+#define PHY_HOLD_OFF_MS                    300000    // No new PHY switch for this long after one had to be undone
+#define POWER_SAVE_WAKE_WINDOW_MS          40        // Dozing buzzers listen this long per wake interval (must exceed COMMAND_RETRY_INITIAL_MS)
+#define POWER_SAVE_DEFAULT_BUZZ_LATENCY_MS 200       // Worst-case extra latency of a buzz claim to a dozing buzzer (the rest of the wake interval)
+#define POWER_SAVE_MIN_BUZZ_LATENCY_MS     20        // Range of the latency set with COMMAND_SET_POWER_SAVE
+#define POWER_SAVE_MAX_BUZZ_LATENCY_MS     1000
+#define POWER_SAVE_IDLE_TIMEOUT_MS         10000     // Buzzers start dozing after this long without buzz activity (outside of a round)
+#define POWER_SAVE_ROUND_TIMEOUT_MS        3600000   // A round without COMMAND_ROUND_END counts as ended after this long
+#define POWER_SAVE_REMEMBER_FACTOR         10        // Dozing buzzers hear few announcements and remember peers this much longer
 #define BLUETOOTH_AUTO_DISABLE_TIME        30000     // [ms]
 
 // Task priorities
 #define TASK_PRIO_LED                      2
 #define TASK_PRIO_COMM                     3
+#define TASK_PRIO_BUTTON                   4
+
+// Task stacks [bytes]
+#define COMM_TASK_STACK_SIZE               4096 // Frames, relaying, delivery, journal and trace all run in comm_task
+#define COMM_TASK_STACK_MARGIN             768  // Warn when less than this was ever left unused
 
 // Led
 #define NUM_LEDS                           38
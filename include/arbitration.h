@@ -0,0 +1,36 @@
+#pragma once
+
+#include "comm.h"
+
+/* The comm_task side of the buzz arbitration (the rounds themselves are ModeDefault's).
+ *
+ * Every node ranks the claims it hears by press time, but one node has the final word: the arbiter, the controller with
+ * the lowest MAC we have heard of. BUZZ_DECISION_DELAY_MS after the window of a round, it broadcasts its decision (the
+ * ranking, winner first) COMMAND_BROADCAST_REPEATS times, for a whole wake interval while the network dozes, and the
+ * other nodes act on it. A claim that arrives after the decision is ranked behind the winner, and the arbiter broadcasts
+ * the new ranking.
+ *
+ * Claims of a close race collide easily, so every claim is followed by BUZZ_CLAIM_COPIES copies at random delays
+ * (dozing networks repeat it anyway). Claims are not acknowledged one by one, the decision is their acknowledgement: a
+ * claimant retransmits its claim (COMMAND_RETRY_INITIAL_MS after the decision is due, doubled on each retry,
+ * COMMAND_MAX_ATTEMPTS transmissions) until a decision lists it, and the arbiter answers a claim it has already ranked
+ * with the decision again. Claims and decisions
+ * are taken from any node, whether or not it fits into our peer table. Without an arbiter, or if it stays silent for
+ * BUZZ_DECISION_TIMEOUT_MS after the window, every node decides the round on its own. */
+
+/* Only to be called from comm_task */
+void arbitration_node_info(const uint8_t *mac_addr, const payload_node_info_t *node_info, unsigned long time);
+/* A claim was received at rx_local_us (esp_timer_get_time()). Returns whether it is new, retransmissions of a claim are
+ * handled here. A new claim is to be ranked by press_time_us, which differs from the claim's if its sender is unsynced. */
+bool arbitration_claim_received(const uint8_t *mac_addr, const payload_buzz_t *buzz, int64_t rx_local_us, int64_t *press_time_us);
+/* Our own claim was sent, retransmits it until it is decided */
+void arbitration_claim_sent(const payload_buzz_t *buzz, unsigned long time);
+/* Sends the decision that arbitration_set_decision left */
+void arbitration_send_decision(unsigned long time);
+void arbitration_decision_received(const uint8_t *mac_addr, const payload_buzz_decision_t *decision, int len);
+
+/* Any task */
+bool arbitration_is_arbiter();
+bool arbitration_has_arbiter(); // Whether we or another node decide the rounds
+/* Leaves our decision for arbitration_send_decision */
+void arbitration_set_decision(const payload_buzz_decision_t *decision);
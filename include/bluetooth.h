@@ -2,10 +2,12 @@
 #pragma once
 
 #include <BLEServer.h>
+#include "comm.h"
 
 void bluetooth_init();
 bool bluetooth_connected();
 void bluetooth_notify_peer_list_changed();
+void bluetooth_notify_command_delivery(const command_delivery_t *delivery);
 
 void bluetooth_set_state(bool state);
 void bluetooth_loop();
\ No newline at end of file
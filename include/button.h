@@ -19,5 +19,24 @@ typedef struct {
     uint16_t crc;                             // CRC-16/GENIBUS of the game config (using esp_rom_crc16_be over all previous bytes)
 } __attribute__((packed)) game_config_t;
 
+/* The buttons raise an interrupt on every edge. (Level interrupts that the ISR flips to the opposite level, because on
+ * the ESP32-C3 only those can wake it from light sleep.) The ISR takes the time and queues the edge, the button task debounces it
+ * and hands presses and releases to the current mode right away (IMode::onButtonEdge, and IMode::onButton through the
+ * dispatcher). The first edge of a press counts, so its time is the moment the contacts closed; the contacts then bounce
+ * for up to BUTTON_DEBOUNCE_US, during which further edges are ignored. Once that is over, the level is read again in
+ * case the last edge was missed. */
+
+#define BUTTON_DEBOUNCE_US 20000
+#define BUTTON_QUEUE_SIZE  16
+
+enum button_t : uint8_t {
+    BUTTON_BUZZER,
+    BUTTON_BACK,
+    BUTTON_NUM
+};
+
 void button_setup();
-void button_loop();
\ No newline at end of file
+void button_loop();
+
+/* Debounced state, any task */
+bool button_pressed(button_t button);
\ No newline at end of file
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "comm.h"
+
+/* End-to-end latency of buzzes, from the button read on the buzzer to the key press sent to the host.
+ *
+ * Every claim carries a trace ID (counting up per sender, so it is unique together with the sender's MAC) and the time the
+ * sender took from reading the button to handing the claim to the transport. The receiver stamps the claim when it
+ * arrives (in the receive callback) and when comm_task dispatches it, and keeps the trace until the key for the claim is
+ * pressed. Each stage then goes into a histogram:
+ *
+ *   press -> send       sender's local clock, carried in the claim
+ *   send -> receive     network time (see timesync.h), only if both ends are synced
+ *   receive -> dispatch receiver's local clock, i.e. the receive queue
+ *   dispatch -> key     receiver's local clock, includes waiting for the arbitration window
+ *   press -> key        network time, the whole way, only if both ends are synced
+ *
+ * Buckets are logarithmic with BUZZ_TRACE_SUB_BUCKETS buckets per power of two, so percentiles are accurate to about 20%.
+ * Only nodes that press keys (controllers) complete traces. All functions may be used from any task. */
+
+#define BUZZ_TRACE_SUB_BUCKETS 4
+#define BUZZ_TRACE_BUCKETS     92 // Up to 2^24us (16.7s), beyond goes into the last bucket
+#define BUZZ_TRACE_PENDING     BUZZ_MAX_CLAIMS
+
+enum buzz_trace_stage_t : uint8_t {
+    BUZZ_TRACE_PRESS_TO_SEND,
+    BUZZ_TRACE_SEND_TO_RECEIVE,
+    BUZZ_TRACE_RECEIVE_TO_DISPATCH,
+    BUZZ_TRACE_DISPATCH_TO_KEY,
+    BUZZ_TRACE_PRESS_TO_KEY,
+    BUZZ_TRACE_STAGES,
+};
+
+typedef struct {
+    uint32_t count;
+    uint32_t max_us;
+    uint64_t sum_us;
+    uint32_t buckets[BUZZ_TRACE_BUCKETS];
+} __attribute__((packed)) buzz_trace_histogram_t;
+
+/* The response to USB hosts */
+typedef struct {
+    uint8_t stages;           // BUZZ_TRACE_STAGES
+    uint8_t buckets;          // BUZZ_TRACE_BUCKETS
+    uint8_t sub_buckets;      // BUZZ_TRACE_SUB_BUCKETS
+    uint8_t reserved;
+    uint32_t traces_started;  // Claims received (first copies only)
+    uint32_t traces_unsynced; // Claims whose network time stages could not be measured
+    uint32_t traces_keyed;    // Traces that made it to a key press
+    buzz_trace_histogram_t histograms[BUZZ_TRACE_STAGES];
+} __attribute__((packed)) buzz_trace_stats_t;
+
+/* Bucket of a latency: below 2^2 us one per microsecond, then BUZZ_TRACE_SUB_BUCKETS per power of two */
+uint8_t buzz_trace_bucket(uint32_t latency_us);
+
+/* Sender side: the next trace ID */
+uint16_t buzz_trace_next_id();
+
+/* Receiver side, from comm_task when the first copy of a claim is dispatched. rx_local_us is the local time the receive
+ * callback got the frame. */
+void buzz_trace_received(const uint8_t *mac_addr, const payload_buzz_t *buzz, int64_t rx_local_us);
+/* Right before the key of mac_addr's claim is pressed. Does nothing if there is no trace for it. */
+void buzz_trace_key_pressed(const uint8_t *mac_addr);
+
+void buzz_trace_read(buzz_trace_stats_t *stats);
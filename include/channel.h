@@ -0,0 +1,31 @@
+#pragma once
+
+#include "comm.h"
+
+/* Radio channel management.
+ *
+ * The controller picks the quietest channel by a WiFi scan (access points weighted by signal strength and channel
+ * overlap). If it is clearly quieter than the current one (CHANNEL_SWITCH_MIN_GAIN, CHANNEL_SWITCH_MIN_GAIN_PERCENT),
+ * the controller moves the whole network with COMMAND_SWITCH_CHANNEL, a broadcast telling every node to switch at the
+ * same network time. Buzzers that missed it no longer hear anyone and search the channels for the network again:
+ * they announce themselves on each channel and wait briefly for the join replies. The channel is kept in nvm.
+ *
+ * The scan does not block comm_task, the migration continues on WIFI_EVENT_SCAN_DONE (channel_scan_done()). While a
+ * round is open (COMMAND_ROUND_START until COMMAND_ROUND_END), a migration is deferred until the round is over, and a
+ * scan in progress is stopped and done again then. */
+
+#define CHANNEL_MIN             1
+#define CHANNEL_MAX             11   // 12 and 13 are not allowed everywhere
+#define CHANNEL_SCAN_MAX_APS    32   // Access points considered in a scan
+#define CHANNEL_SCAN_TIMEOUT_MS 5000 // A scan takes about a second, its result is given up on after this long
+
+void channel_init(); // Before ESP-NOW is initialized
+uint8_t channel_current();
+
+/* Only to be called from comm_task */
+void channel_start();
+void channel_heard_peer(unsigned long time);
+void channel_migrate(uint8_t channel); // Moves the network, 0: to the quietest channel
+void channel_scan_done();              // On WIFI_EVENT_SCAN_DONE
+void channel_set_round(bool open, unsigned long time);
+void channel_schedule_switch(uint8_t channel, int64_t at_us);
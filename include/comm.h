@@ -22,25 +22,6 @@
 // The channel on which sending and receiving ESPNOW data.
 #define CONFIG_ESPNOW_CHANNEL           1
 
-// Enable Long Range
-// When enable long range, the PHY rate of ESP32 will be 512Kbps or 256Kbps
-#define CONFIG_ESPNOW_ENABLE_LONG_RANGE 0
-
-#if CONFIG_ESPNOW_WIFI_MODE_STATION
-// Enable ESPNOW Power Save
-// With ESPNOW power save enabled, chip would be able to wakeup and sleep periodically
-// Notice ESP_WIFI_STA_DISCONNECTED_PM_ENABLE is essential at Wi-Fi disconnected
-#define CONFIG_ESPNOW_ENABLE_POWER_SAVE 0
-
-#if CONFIG_ESPNOW_ENABLE_POWER_SAVE
-// ESPNOW wake window, unit in millisecond (0..65535)
-#define CONFIG_ESPNOW_WAKE_WINDOW   50
-
-// ESPNOW wake interval, unit in millisecond (1..65535)
-#define CONFIG_ESPNOW_WAKE_INTERVAL 100
-#endif
-#endif
-
 //////////////////////////////////////////////////////////////////////////////////////
 
 /* ESPNOW can work in both station and softap mode. It is configured in menuconfig. */
@@ -54,7 +35,13 @@ enum espnow_data_type_t : uint8_t {
     ESP_DATA_TYPE_JOIN_ANNOUNCEMENT, /* payload type: payload_node_info_t */
     ESP_DATA_TYPE_STATE_UPDATE,      /* payload type: payload_node_info_t */
     ESP_DATA_TYPE_PING_PONG,         /* payload type: payload_ping_pong_t */
-    ESP_DATA_TYPE_COMMAND,
+    ESP_DATA_TYPE_COMMAND,           /* payload type: payload_command_frame_t */
+    ESP_DATA_TYPE_STATE_DELTA,       /* payload type: payload_node_info_delta_t */
+    ESP_DATA_TYPE_BUZZ,              /* payload type: payload_buzz_t */
+    ESP_DATA_TYPE_COMMAND_ACK,       /* payload type: payload_command_ack_t */
+    ESP_DATA_TYPE_MULTICAST_COMMAND, /* payload type: payload_multicast_command_t */
+    ESP_DATA_TYPE_RELAY,             /* payload type: payload_relay_t */
+    ESP_DATA_TYPE_BUZZ_DECISION,     /* payload type: payload_buzz_decision_t */
     ESP_DATA_TYPE_MAX
 };
 
@@ -82,6 +69,14 @@ typedef struct {
     uint32_t buzzer_active_remaining_ms;
 } __attribute__((packed)) payload_node_info_t;
 
+/* Bit i of changed_fields is set if the i-th field of payload_node_info_t is contained in data.
+ * The contained fields are stored back to back, in declaration order. */
+typedef struct {
+    uint16_t base_crc;       /* CRC of the full node info (keyframe) this delta is relative to */
+    uint16_t changed_fields; /* Fields that differ from the keyframe */
+    uint8_t data[sizeof(payload_node_info_t)];
+} __attribute__((packed)) payload_node_info_delta_t;
+
 typedef struct {
     uint8_t mac_addr[ESP_NOW_ETH_ALEN]; // The peer's MAC address
     unsigned long last_seen;            // The last millis() that we received a (non-ping) packet from this peer
@@ -92,12 +87,43 @@ typedef struct {
     payload_node_info_t node_info;      // The peer's last known node info (i.e. state)
 } __attribute__((packed)) peer_data_t;
 
+/* Link quality of a peer, extends peer_data_t for hosts (see link_stats.h) */
+typedef struct {
+    uint8_t mac_addr[ESP_NOW_ETH_ALEN];
+    uint16_t latency_avg_us;    // EWMA of the RTT
+    uint16_t latency_jitter_us; // EWMA of the RTT's deviation from the average
+    uint16_t latency_min_us;
+    uint16_t latency_max_us;
+    uint16_t loss_permille;     // EWMA of lost pings
+    uint16_t pings_sent;
+    uint16_t pings_lost;
+    uint32_t ping_interval_ms;  // Current adaptive ping interval
+    int8_t rssi_avg;            // EWMA of the RSSI
+    int8_t rssi_min;            // Over the recent samples
+    int8_t rssi_max;            // Over the recent samples
+    uint8_t relay_hops;         // 0 if the peer is heard directly, otherwise the transmissions its frames take
+    uint16_t relay_latency_us;  // Latency of the last relayed frame of the peer
+    uint8_t tx_in_flight;       // Frames to the peer not yet confirmed by the send callback (see tx.h)
+    uint32_t tx_sent;           // Frames to the peer handed to the driver
+    uint32_t tx_acked;          // Frames to the peer acknowledged by it
+    uint32_t tx_failed;         // Frames to the peer never acknowledged
+    uint32_t tx_airtime_ms;     // Estimated airtime of the frames to the peer
+} __attribute__((packed)) peer_link_stats_t;
+
 #define ESP_NOTIFY_MTU 514
 #ifndef MIN
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #endif
-#define PEER_DATA_TABLE_ENTRIES (MIN(ESP_NOW_MAX_TOTAL_PEER_NUM, (MIN(ESP_NOTIFY_MTU, ESP_GATT_MAX_ATTR_LEN) / sizeof(peer_data_t))))
+#define PEER_DATA_TABLE_ENTRIES ESP_NOW_MAX_TOTAL_PEER_NUM
 extern peer_data_t peer_data_table[PEER_DATA_TABLE_ENTRIES];
+
+/* The peer list is transferred in pages (the whole table does not fit into one bluetooth attribute) */
+typedef struct {
+    uint8_t first; // Table index of the page's first entry
+    uint8_t total; // Number of entries in the table
+} __attribute__((packed)) peer_list_page_header_t;
+
+#define PEER_LIST_PAGE_ENTRIES ((MIN(ESP_NOTIFY_MTU, ESP_GATT_MAX_ATTR_LEN) - sizeof(peer_list_page_header_t)) / sizeof(peer_data_t))
 extern uint8_t my_mac_addr[ESP_NOW_ETH_ALEN];
 
 enum ping_pong_stage_t : uint8_t {
@@ -107,25 +133,77 @@ enum ping_pong_stage_t : uint8_t {
     PING_PONG_STAGE_DATA2
 };
 
+/* Besides latency and RSSI, every stage of the exchange carries an NTP-style time sample (see timesync.h) */
 typedef struct {
     ping_pong_stage_t stage; /* 0: ping, 1: pong, 2: data1, 3: data2 */
     uint16_t latency_us;     /* measured latency (data1: ping to pong, data2: pong to data1) */
     int8_t rssi;             /* measured latency of last packet */
+    uint8_t stratum;         /* Sender's distance from the time master (0: master, TIMESYNC_STRATUM_UNSYNCED: no network time) */
+    uint32_t tx_local_us;    /* Sender's local clock when sending this frame (lower 32 bits), echoed in the answer */
+    uint32_t echo_us;        /* tx_local_us of the frame this one answers, 0 for a new ping */
+    uint32_t hold_us;        /* Time the sender held the answered frame before sending this one */
+    int64_t tx_network_us;   /* Sender's network time when sending this frame */
 } __attribute__((packed)) payload_ping_pong_t;
 
+/* Claim of a buzzer press, ranked by all nodes and decided by the arbiter (see arbitration.h) */
+typedef struct {
+    int64_t press_time_us;  /* Network time (see timesync.h) at which the button was pressed */
+    uint8_t stratum;        /* Sender's time sync stratum, TIMESYNC_STRATUM_UNSYNCED if press_time_us is just its local clock */
+    uint16_t trace_id;      /* Sender's buzz counter, identifies the claim in latency traces (see buzz_trace.h) */
+    uint32_t send_delay_us; /* Time from the button read to handing the claim to the transport */
+    uint8_t attempt;        /* Repetitions of the claim before this one (see arbitration.h) */
+} __attribute__((packed)) payload_buzz_t;
+
+typedef struct {
+    uint8_t mac_addr[ESP_NOW_ETH_ALEN];
+    int32_t delay_us; /* Press time after the winner's */
+} __attribute__((packed)) buzz_decision_entry_t;
+
+/* The arbiter's decision of a buzz round (see arbitration.h) */
+typedef struct {
+    uint16_t round;                                 /* Arbiter's round counter */
+    uint8_t attempt;                                /* Transmissions of the round's decision before this one, updates included */
+    uint8_t num_ranked;                             /* 1..BUZZ_MAX_CLAIMS, only these entries are sent */
+    int64_t press_time_us;                          /* Network time of the winner's press */
+    buzz_decision_entry_t ranking[BUZZ_MAX_CLAIMS]; /* Winner first */
+} __attribute__((packed)) payload_buzz_decision_t;
+
+#define BUZZ_DECISION_SIZE(num_ranked) (offsetof(espnow_data_t, payload.buzz_decision.ranking) + (num_ranked) * sizeof(buzz_decision_entry_t))
+
 enum command_t : uint8_t {
     COMMAND_SET_PING_INTERVAL = 0x10,
     COMMAND_SET_COLOR         = 0x20,
     COMMAND_SET_GAME_CONFIG   = 0x21,
     COMMAND_SET_KEY_CONFIG    = 0x22,
+    COMMAND_SET_RELAY_MODE    = 0x23,
+    COMMAND_SWITCH_CHANNEL    = 0x24,
+    COMMAND_SET_PHY           = 0x25,
+    COMMAND_SET_POWER_SAVE    = 0x26,
     COMMAND_BUZZ              = 0x30,
     COMMAND_SET_INACTIVE      = 0x31,
     COMMAND_SET_ACTIVE        = 0x32,
+    COMMAND_ROUND_START       = 0x33,
+    COMMAND_ROUND_END         = 0x34,
     COMMAND_RESET             = 0x40,
     COMMAND_SHUTDOWN          = 0x50,
     COMMAND_SET_MODE          = 0x60,
 };
 
+enum relay_mode_t : uint8_t {
+    RELAY_MODE_OFF = 0,
+    RELAY_MODE_ON  = 1, /* Forward frames for nodes out of the controller's range (see relay.h) */
+};
+
+enum phy_mode_t : uint8_t {
+    PHY_MODE_FAST       = 0,
+    PHY_MODE_LONG_RANGE = 1, /* ESP-NOW long range rate, slower but reaches further (see phy.h) */
+};
+
+enum power_save_mode_t : uint8_t {
+    POWER_SAVE_OFF = 0,
+    POWER_SAVE_ON  = 1, /* Buzzers doze between rounds (see power_save.h) */
+};
+
 typedef struct {
     command_t command;
     union {
@@ -136,14 +214,96 @@ typedef struct {
         game_config_t game_config;
         key_config_t key_config;
         node_mode_t mode;
+        relay_mode_t relay_mode;
+        struct {
+            power_save_mode_t mode;
+            uint16_t max_buzz_latency_ms; /* Optional, 0: keep the current one (see power_save.h) */
+        } __attribute__((packed)) power_save;
+        struct {
+            uint8_t channel;
+            int64_t at_us; /* Network time of the switch */
+        } __attribute__((packed)) switch_channel;
+        struct {
+            phy_mode_t mode;
+            int64_t at_us; /* Network time of the switch */
+        } __attribute__((packed)) set_phy;
         uint8_t raw[0];
     } __attribute__((packed)) args;
 } __attribute__((packed)) payload_command_t;
 
+#define COMMAND_FLAG_ACK_REQUESTED (1 << 0)
+
+/* A command on the air. seq identifies it for acknowledgement and duplicate suppression of retransmissions,
+ * attempt tells the retransmissions apart (relays must forward each of them, see relay.h) */
+typedef struct {
+    uint16_t seq;
+    uint8_t flags;
+    uint8_t attempt; /* Transmissions of the command before this one */
+    payload_command_t command;
+} __attribute__((packed)) payload_command_frame_t;
+
+enum command_result_t : uint8_t {
+    COMMAND_RESULT_OK,
+    COMMAND_RESULT_REJECTED,  /* The command was received, but not executed (e.g. invalid arguments) */
+    COMMAND_RESULT_DUPLICATE, /* A retransmission of a command that was already executed */
+};
+
+typedef struct {
+    uint16_t seq;
+    uint8_t attempt; /* Of the acknowledged transmission, so the acknowledgement of a retransmission is relayed as well */
+    command_result_t result;
+} __attribute__((packed)) payload_command_ack_t;
+
+#define MULTICAST_MAX_TARGETS    32
+#define MULTICAST_FLAG_EXCLUDE   (1 << 0) /* Apply the command to everyone but the targets */
+
+/* A command for a set of nodes in a single broadcast. Only the used entries of targets are sent. */
+typedef struct {
+    uint16_t seq; /* Shares the sequence numbers of payload_command_frame_t */
+    uint8_t flags;
+    uint8_t attempt; /* As in payload_command_frame_t */
+    uint8_t num_targets;
+    payload_command_t command;
+    uint8_t targets[MULTICAST_MAX_TARGETS][ESP_NOW_ETH_ALEN];
+} __attribute__((packed)) payload_multicast_command_t;
+
+enum command_status_t : uint8_t {
+    COMMAND_STATUS_PENDING,   /* Waiting for an acknowledgement */
+    COMMAND_STATUS_DELIVERED, /* Acknowledged and executed */
+    COMMAND_STATUS_REJECTED,  /* Acknowledged, but not executed by the peer */
+    COMMAND_STATUS_FAILED,    /* No acknowledgement after all retransmissions */
+    COMMAND_STATUS_SENT,      /* Broadcast, these are repeated but not acknowledged */
+};
+
+/* Delivery status of a relayed command, as reported to USB and bluetooth hosts */
+typedef struct {
+    uint8_t mac_addr[ESP_NOW_ETH_ALEN];
+    uint16_t seq;
+    command_t command;
+    command_status_t status;
+    uint8_t attempts;
+} __attribute__((packed)) command_delivery_t;
+
+/* A frame forwarded by relay nodes (see relay.h) */
+typedef struct {
+    uint8_t ttl;                      /* Remaining forwards */
+    uint8_t hops;                     /* Transmissions of the envelope so far, including this one */
+    uint8_t origin[ESP_NOW_ETH_ALEN]; /* Sender of the inner frame */
+    uint8_t dst[ESP_NOW_ETH_ALEN];    /* Receiver of the inner frame, broadcast for everyone */
+    int64_t stamp_us;                 /* Network time at which the envelope was created, 0 if the creator was not synced */
+    uint8_t frame[0];                 /* The inner frame (an espnow_data_t, up to RELAY_MAX_FRAME_LEN bytes) */
+} __attribute__((packed)) payload_relay_t;
+
 typedef union {
     payload_node_info_t node_info;
+    payload_node_info_delta_t node_info_delta;
     payload_ping_pong_t ping_pong;
-    payload_command_t command;
+    payload_buzz_t buzz;
+    payload_command_frame_t command_frame;
+    payload_command_ack_t command_ack;
+    payload_multicast_command_t multicast_command;
+    payload_relay_t relay;
+    payload_buzz_decision_t buzz_decision;
     uint8_t raw[0];
 } __attribute__((packed)) espnow_data_payload_t;
 
@@ -153,16 +313,64 @@ typedef struct {
     espnow_data_payload_t payload;
 } __attribute__((packed)) espnow_data_t;
 
+static_assert(sizeof(espnow_data_t) <= ESP_NOW_MAX_DATA_LEN, "espnow_data_t does not fit into an ESP-NOW frame");
+
+/* Size of a frame carrying the given member of espnow_data_payload_t, without the padding of the union */
+#define ESPNOW_DATA_SIZE(payload_member) (offsetof(espnow_data_t, payload) + sizeof(((espnow_data_payload_t *)0)->payload_member))
+
+typedef struct {
+    uint32_t rx_frames;          // Frames handed from the WiFi task to comm_task (both lanes)
+    uint32_t rx_pool_exhausted;  // Low priority frames dropped because no (unreserved) packet slot was free
+    uint32_t rx_queue_full;      // Low priority frames dropped because the low priority lane was full
+    uint32_t rx_oversized;       // Frames dropped because they are larger than espnow_data_t
+    uint8_t rx_pool_peak_in_use; // Most packet slots in use at the same time
+    uint32_t tx_keyframes;       // Full state updates sent
+    uint32_t tx_deltas;          // Delta state updates sent
+    uint32_t rx_deltas_dropped;  // Delta state updates dropped because we did not have their keyframe
+    uint32_t tx_command_retries; // Command retransmissions
+    uint32_t tx_command_failed;  // Commands that were never acknowledged
+    uint32_t rx_command_dups;    // Retransmitted commands received again and not executed
+    uint32_t rx_high_frames;     // Frames handed to comm_task in the high priority lane
+    uint32_t rx_high_dropped;    // High priority frames dropped (packet pool or lane full)
+    uint32_t tx_cb_queue_full;   // Send callbacks dropped because the low priority lane was full
+    uint32_t rx_joins;           // Join announcements received
+    uint32_t tx_join_replies;    // Full state updates sent in reply to join announcements
+    uint32_t join_replies_saved; // Replies to join announcements that were covered by another full state update
+    uint32_t rx_relayed;         // Relay envelopes received (and not dropped as duplicates)
+    uint32_t tx_relayed;         // Relay envelopes sent (forwarded frames and unicasts to peers out of range)
+    uint32_t rx_relay_dups;      // Relay envelopes dropped because their frame was already seen
+    uint32_t relay_latency_us;   // EWMA of the latency per relay hop
+    uint32_t phy_switches;       // Switches between the fast and the long range PHY
+    uint32_t phy_fallbacks;      // PHY switches undone because peers went silent
+    uint32_t buzz_latency_us;    // EWMA of the time from a button press to its buzz claim arriving here
+    uint32_t buzz_latency_max;   // [us] Largest of these latencies
+    uint32_t buzz_claims_late;   // Buzz claims arriving later than the arbitration window (including power save) allows
+    uint32_t ps_dozing_ms;       // Time spent dozing (power save)
+    uint32_t tx_failed;          // Frames the send callback reported as failed (unicasts not acknowledged)
+    uint32_t tx_deferred;        // Low priority frames deferred because the driver's buffers were close to full
+    uint32_t tx_no_mem;          // Frames the driver had no memory for (high priority ones after retrying)
+    uint32_t tx_airtime_us;      // Estimated airtime of everything sent
+    uint8_t tx_in_flight_peak;   // Most frames in flight at the same time
+    uint32_t rx_peer_table_full; // Node infos of new peers ignored because the peer table was full
+} __attribute__((packed)) comm_stats_t;
+
+extern comm_stats_t comm_stats;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-void cleanup_peer_list();
 void comm_setup();
 void update_my_info();
 void send_state_update();
+void send_buzz_claim(int64_t press_time_us, int64_t press_local_us);
+void send_buzz_decision(const payload_buzz_decision_t *decision);
+esp_err_t send_join_announcement();
 void reset_shutdown_timer();
-boolean executeCommand(uint8_t mac_addr[6], payload_command_t *command, uint32_t len);
+/* seq: the sequence number the command is relayed with (see command_delivery_t), -1 if it is not relayed */
+boolean executeCommand(uint8_t mac_addr[6], payload_command_t *command, uint32_t len, int32_t *seq = NULL);
+boolean executeMulticastCommand(const uint8_t *request, uint32_t len, int32_t *seq = NULL);
+boolean requestChannelMigration(uint8_t channel);
 
 #ifdef __cplusplus
 }
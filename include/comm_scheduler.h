@@ -0,0 +1,29 @@
+#pragma once
+
+#include <Arduino.h>
+
+/* Deadline scheduler for the housekeeping jobs of comm_task.
+ * comm_task blocks on its queue exactly until the next job is due and runs all due jobs after every wakeup,
+ * so jobs neither starve under steady traffic nor cause wakeups while nothing is due.
+ * Must only be used from comm_task. */
+
+#define COMM_SCHEDULER_MAX_JOBS 16
+#define COMM_JOB_STOP           ((unsigned long)-1) // Return value of a job that should not run again
+
+/* Runs the job, returns the delay [ms] until it should run again (or COMM_JOB_STOP) */
+typedef unsigned long (*comm_job_fn_t)(unsigned long time);
+
+typedef struct {
+    const char *name;
+    comm_job_fn_t run;
+    unsigned long due; // millis() at which the job is due
+    int8_t heap_index; // Position in the scheduler's heap, -1 if not scheduled
+} comm_job_t;
+
+#define COMM_JOB(name, fn) { name, fn, 0, -1 }
+
+void comm_schedule(comm_job_t *job, unsigned long delay_ms);
+void comm_unschedule(comm_job_t *job);
+bool comm_is_scheduled(const comm_job_t *job);
+TickType_t comm_scheduler_ticks_until_next(unsigned long time);
+void comm_scheduler_run_due(unsigned long time);
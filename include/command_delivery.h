@@ -0,0 +1,28 @@
+#pragma once
+
+#include "peer_table.h"
+
+/* Reliable delivery of relayed commands.
+ *
+ * Unicast commands are retransmitted with exponential backoff until the target acknowledges them, broadcast commands are
+ * repeated a fixed number of times. Receivers suppress retransmissions they have already executed using a small window of
+ * sequence numbers per peer. The outcome of the last few commands is kept for hosts to query via USB and bluetooth.
+ *
+ * Except for the status history and command_delivery_next_seq(), everything here must only be used from comm_task. */
+
+#define COMMAND_MAX_PENDING      8
+#define COMMAND_DELIVERY_HISTORY 8
+#define COMMAND_SEQ_WINDOW       16 // Must match the bits of peer_state_t::command_seq_window
+
+uint16_t command_delivery_next_seq();
+
+/* Starts delivering a command frame (len bytes, including the espnow_data_t header) with the given sequence number */
+void command_delivery_start(const uint8_t *mac_addr, uint16_t seq, command_t command, const espnow_data_t *frame, int len);
+void command_delivery_receive_ack(const uint8_t *mac_addr, const payload_command_ack_t *ack);
+/* Returns true if the command was already received from this peer, and marks it as received otherwise */
+bool command_delivery_is_duplicate(peer_state_t *peer_state, uint16_t seq);
+
+/* Records a new command in the status history (any task) */
+void command_delivery_record(const uint8_t *mac_addr, uint16_t seq, command_t command, command_status_t status);
+/* Copies the status history, newest first. Returns the number of entries. */
+uint8_t get_command_deliveries(command_delivery_t *deliveries, uint8_t max_entries);
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "button.h"
+#include "peer_table.h"
+
+/* Event dispatcher of the main loop.
+ *
+ * loop() blocks on the dispatcher's queue until an event arrives or the next timer is due, so the CPU idles in between
+ * (and, with CONFIG_PM_ENABLE, battery powered nodes enter light sleep). There are two timers: the mode's, whose delay
+ * IMode::onTimer returns, and the housekeeping of battery, back button and bluetooth, every DISPATCHER_HOUSEKEEPING_MS
+ * (DISPATCHER_BUTTON_HELD_MS while the back button is held, for its long press timings).
+ *
+ * Other tasks post events: button changes from the button task go to IMode::onButton (and run the housekeeping), buzz
+ * claims, buzz decisions and peer state changes from comm_task to IMode::onReceiveBuzz, IMode::onBuzzDecision and
+ * IMode::onPeerState, the host's commands for the mode to IMode::onCommand. Anything else that may move the mode's next
+ * deadline forward just wakes the dispatcher: after every event, onTimer is called again and returns a new delay.
+ *
+ * Both timers and all of these callbacks run in the main loop task, so the mode's state is only ever changed there
+ * (see IMode.h). */
+
+#define DISPATCHER_QUEUE_SIZE       16
+#define DISPATCHER_HOUSEKEEPING_MS  500
+#define DISPATCHER_BUTTON_HELD_MS   50
+#define DISPATCHER_NO_TIMER         ((unsigned long)-1) // Return value of IMode::onTimer without anything to wait for
+
+enum dispatcher_event_type_t : uint8_t {
+    DISPATCHER_EVENT_WAKE,
+    DISPATCHER_EVENT_BUTTON,
+    DISPATCHER_EVENT_PEER_STATE,
+    DISPATCHER_EVENT_BUZZ,
+    DISPATCHER_EVENT_COMMAND,
+    DISPATCHER_EVENT_DECISION,
+};
+
+typedef struct {
+    dispatcher_event_type_t type;
+    union {
+        struct {
+            button_t button;
+            bool pressed;
+            bool to_mode;    // Whether the mode gets it (not while the config menu reads the buttons itself)
+            int64_t time_us; // esp_timer_get_time() of the edge
+        } button;
+        struct {
+            uint8_t mac_addr[ESP_NOW_ETH_ALEN];
+            payload_buzz_t buzz;
+        } buzz;
+        uint8_t mac_addr[ESP_NOW_ETH_ALEN];
+        command_t command;
+    } info;
+} dispatcher_event_t;
+
+void dispatcher_setup();
+/* Main loop task: dispatches the events and due timers, blocking for at most max_ticks until there are any */
+void dispatcher_run(TickType_t max_ticks);
+
+/* Any task but the ISRs. Events are dropped if the queue is full, a pending one will wake the dispatcher anyway. */
+void dispatcher_wake();
+void dispatcher_post_button(button_t button, bool pressed, int64_t time_us, bool to_mode);
+void dispatcher_post_peer_state(const uint8_t *mac_addr);
+void dispatcher_post_buzz(const uint8_t *mac_addr, const payload_buzz_t *buzz);
+/* Returns false if the command was dropped */
+bool dispatcher_post_command(command_t command);
+/* Decisions are too large for the queue, only the latest one is kept */
+void dispatcher_post_decision(const uint8_t *arbiter, const payload_buzz_decision_t *decision);
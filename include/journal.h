@@ -0,0 +1,50 @@
+#pragma once
+
+#include "comm.h"
+
+/* Buzz event journal of the controller.
+ *
+ * The peer table only shows the current state, so the controller additionally records every buzz claim, arbitration
+ * decision, buzzer state change and mode change in a ring of JOURNAL_ENTRIES entries. Entries are numbered with a
+ * sequence number that keeps counting up, so USB hosts can fetch the journal incrementally: they ask for everything from
+ * the sequence number after the last entry they have. If older entries have been overwritten meanwhile, the response
+ * starts with the oldest one still available, which the host recognizes by the gap.
+ *
+ * Only controllers record anything. All functions may be used from any task. */
+
+#define JOURNAL_ENTRIES         128
+#define JOURNAL_LATENCY_UNKNOWN UINT32_MAX
+
+enum journal_event_t : uint8_t {
+    JOURNAL_BUZZ_CLAIM,    /* mac_addr claimed a buzz, time_us is its press time, value the claim's latency [us] */
+    JOURNAL_ROUND_DECIDED, /* mac_addr won the arbitration, arg is the number of claims */
+    JOURNAL_BUZZER_ACTIVE, /* mac_addr became active, value is how long it stays active [ms] */
+    JOURNAL_LOCKOUT,       /* mac_addr got disabled (by another buzz, or by a command) */
+    JOURNAL_RELEASED,      /* mac_addr is idle (and can buzz) again */
+    JOURNAL_MODE_CHANGE,   /* mac_addr switched to mode arg */
+    JOURNAL_ROUND_START,   /* COMMAND_ROUND_START was executed */
+    JOURNAL_ROUND_END,     /* COMMAND_ROUND_END was executed */
+};
+
+typedef struct {
+    uint32_t seq;
+    int64_t time_us;                    // Network time of the event (see timesync.h)
+    uint8_t mac_addr[ESP_NOW_ETH_ALEN]; // The node the event is about
+    journal_event_t event;
+    uint8_t arg;
+    uint32_t value;
+} __attribute__((packed)) journal_entry_t;
+
+/* Precedes the entries in a response to USB hosts */
+typedef struct {
+    uint32_t first_seq; // Oldest entry still in the journal
+    uint32_t next_seq;  // Sequence number the next entry will get
+} __attribute__((packed)) journal_page_header_t;
+
+void journal_record(journal_event_t event, const uint8_t *mac_addr, uint8_t arg, uint32_t value);
+/* As above, for events that did not happen just now */
+void journal_record_at(journal_event_t event, int64_t time_us, const uint8_t *mac_addr, uint8_t arg, uint32_t value);
+
+/* Copies up to max_entries entries, starting at sequence number cursor (or the oldest one, if that is gone). Fills in the
+ * header and returns the number of entries. */
+uint8_t journal_read(uint32_t cursor, journal_page_header_t *header, journal_entry_t *entries, uint8_t max_entries);
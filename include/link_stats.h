@@ -0,0 +1,26 @@
+#pragma once
+
+#include "peer_table.h"
+
+/* Link quality statistics per peer, measured by the ping-pong exchange.
+ *
+ * Every link gets an adaptive ping interval: it is halved whenever a ping is lost or the RTT jumps outside of its usual
+ * jitter, and grows slowly while the link is stable. The ping job sends at most one ping per ping interval and picks the
+ * most overdue peer, so unstable links get more of the same airtime and nothing is sent while all links are stable. */
+
+#define LINK_LATENCY_GAIN_SHIFT 3     // EWMA gain 1/8 for the RTT (as in RFC 6298)
+#define LINK_JITTER_GAIN_SHIFT  2     // EWMA gain 1/4 for the RTT's deviation
+#define LINK_LOSS_GAIN_SHIFT    3     // EWMA gain 1/8 for lost pings
+#define LINK_JITTER_FLOOR_US    300   // RTT changes below this are never considered unstable
+#define LINK_UNSTABLE_LOSS      6554  // 10% loss (of 65535)
+
+void link_stats_ping_sent(peer_link_t *link, unsigned long time);
+void link_stats_pong_received(peer_link_t *link);
+void link_stats_latency_sample(peer_link_t *link, uint16_t rtt_us);
+
+/* How overdue a ping to the peer is, 256 = exactly due */
+uint32_t link_stats_ping_urgency(peer_link_t *link, unsigned long time);
+
+/* Any task, from the published snapshot (see peer_table.h). ESP_ERR_NOT_FOUND if entry index is not used,
+ * ESP_ERR_INVALID_STATE if it was just reassigned to another peer. */
+esp_err_t get_peer_link_stats(uint8_t index, peer_link_stats_t *stats);
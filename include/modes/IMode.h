@@ -1,6 +1,8 @@
 #pragma once
 #include "mode.h"
 #include "comm.h"
+#include "button.h"
+#include "dispatcher.h"
 
 class IMode {
   protected:
@@ -16,15 +18,37 @@ class IMode {
     template <typename T>
     void setState(T state) { this->_setState({ .raw = (uint8_t)state }); }
 
+    /* Any task may read the state, only the main loop changes it */
     template <typename T = node_mode_state_t>
-    T getState() { return *reinterpret_cast<T *>(&this->state); }
+    T getState() {
+        node_mode_state_t state = { .raw = __atomic_load_n(&this->state.raw, __ATOMIC_RELAXED) };
+        return *reinterpret_cast<T *>(&state);
+    }
 
     unsigned long getTimeSinceLastStateChange();
 
+    /* The callbacks run in the main loop task (the dispatcher, see dispatcher.h), one at a time, and only they change the
+     * mode's state. The exceptions are onButtonEdge, and update_my_info, onReceiveState and cleanup_peer_data, which
+     * comm_task calls while it updates the peer table: they may read the mode's state, but must not change it. */
     virtual void setup();
     virtual void update_my_info(payload_node_info_t *node_info) {};
     virtual void onReceiveState(peer_data_t *previous_state, payload_node_info_t *received_state) {};
-    virtual void loop() {};
+    /* A buzz claim of another node */
+    virtual void onReceiveBuzz(const uint8_t *mac_addr, const payload_buzz_t *buzz) {};
+    /* A new or updated decision of a buzz round (see arbitration.h) */
+    virtual void onBuzzDecision(const uint8_t *arbiter, const payload_buzz_decision_t *decision) {};
+    /* From the button task, right at an edge and before onButton: only for what must not wait for the main loop
+     * (sending a timestamped buzz claim) */
+    virtual void onButtonEdge(button_t button, bool pressed, int64_t time_us) {};
+    /* time_us is the local esp_timer_get_time() of the (first) edge */
+    virtual void onButton(button_t button, bool pressed, int64_t time_us) {};
+    /* A command of the host for the mode (COMMAND_BUZZ, COMMAND_SET_ACTIVE and COMMAND_SET_INACTIVE) */
+    virtual void onCommand(command_t command) {};
+    /* After a peer's mode state changed */
+    virtual void onPeerState(peer_data_t *peer_data) {};
+    /* Once the delay it returned last has passed and after every dispatcher event. Does whatever is due and returns the
+     * delay [ms] until it is due again, or DISPATCHER_NO_TIMER. */
+    virtual unsigned long onTimer(unsigned long time) { return DISPATCHER_NO_TIMER; };
     virtual bool cleanup_peer_data(peer_data_t *cleanup_peer_data) { return false; };
     virtual void display() = 0;
 };
@@ -2,10 +2,38 @@
 
 #include "IMode.h"
 
+typedef struct {
+    uint8_t mac_addr[ESP_NOW_ETH_ALEN];
+    int64_t press_time_us; // Network time of the press
+} buzz_claim_t;
+
+/* Buzz arbitration: a press is broadcast as a claim carrying its network time. Every node collects the claims until
+ * BUZZ_ARBITRATION_WINDOW_US after the earliest one and ranks them by (press time, MAC). The arbiter then broadcasts its
+ * ranking, which everyone follows (see arbitration.h); without an arbiter, every node follows its own. Claims arriving
+ * after the decision are ranked behind the winner. */
 class ModeDefault : public IMode {
   public:
-    unsigned long buzzer_active_until;
-    unsigned long buzzer_disabled_until;
+    unsigned long buzzer_active_until   = 0;
+    unsigned long buzzer_disabled_until = 0;
+
+    buzz_claim_t claims[BUZZ_MAX_CLAIMS]; // Claims of the current (or last) round, sorted by rank
+    uint8_t num_claims             = 0;
+    bool round_open                = false; // Whether a round is in progress (collecting claims or decided)
+    bool round_decided             = false; // Whether the winner of the current round has been decided
+    bool claim_pending             = false; // Whether we have a claim in the current round that is not decided yet
+    bool claim_unregistered        = false; // Whether our claim was sent, but registerClaim did not add it yet
+    int64_t claim_press_time_us    = 0;     // Network time of the press of our last claim
+    bool round_won                 = false; // Whether we buzzed for the current round
+    bool round_lost                = false; // Whether we were locked out as a runner-up of the current round
+    bool round_by_arbiter          = false; // Whether the current round follows the last decision of the arbiter
+    bool has_decision              = false; // Whether we received a decision of the arbiter
+    uint8_t decision_arbiter[ESP_NOW_ETH_ALEN]; // The arbiter of the last decision received
+    uint16_t decision_round        = 0;     // Its round counter
+    uint16_t rounds_decided        = 0;     // Rounds we decided as the arbiter
+    int64_t round_deadline_us      = 0;     // Network time at which the winner is decided
+    unsigned long round_decided_at = 0;     // millis() of the decision
+    int64_t last_press_local_us    = 0;     // esp_timer_get_time() of the press of our last claim
+    unsigned long state_update_at  = 0;     // millis() of the next state update while we are active
 
     ModeDefault();
     ~ModeDefault() {};
@@ -13,11 +41,31 @@ class ModeDefault : public IMode {
     void setup();
     void update_my_info(payload_node_info_t *node_info);
     void onReceiveState(peer_data_t *previous_state, payload_node_info_t *received_state);
-    void loop();
+    void onReceiveBuzz(const uint8_t *mac_addr, const payload_buzz_t *buzz);
+    void onBuzzDecision(const uint8_t *arbiter, const payload_buzz_decision_t *decision);
+    void onButtonEdge(button_t button, bool pressed, int64_t time_us);
+    void onButton(button_t button, bool pressed, int64_t time_us);
+    void onCommand(command_t command);
+    void onPeerState(peer_data_t *peer_data);
+    unsigned long onTimer(unsigned long time);
     void display();
     void setActive(bool active);
     void buzz();
+    /* Sends a claim for the press at the local esp_timer_get_time() press_local_us if we may buzz, from any task.
+     * Returns whether it did; registerClaim then adds it to the round in the main loop. */
+    bool sendClaim(int64_t press_local_us);
     bool cleanup_peer_data(peer_data_t *peer_data);
+
+    /* Copies the ranking of the current (or last) round, winner first. Returns the number of ranked claims. */
+    uint8_t getRanking(buzz_claim_t *ranking, uint8_t max_entries);
+
+  private:
+    void registerClaim();
+    bool addClaim(const uint8_t *mac_addr, int64_t press_time_us);
+    void decideRound(unsigned long time);
+    void sendDecision();
+    void followRanking(bool newly_decided);
+    void loseRound(); // Runner-up of the decided round
 };
 
-extern ModeDefault *modeDefault;
\ No newline at end of file
+extern ModeDefault *modeDefault;
@@ -10,8 +10,11 @@ class ModeSimonSays : public IMode {
     void setup();
     void update_my_info(payload_node_info_t *node_info);
     void onReceiveState(peer_data_t *previous_state, payload_node_info_t *received_state);
-    void loop();
+    unsigned long onTimer(unsigned long time);
     void display();
+
+  private:
+    unsigned long next_color_at = 0;
 };
 
 extern ModeSimonSays *modeSimonSays;
\ No newline at end of file
@@ -13,6 +13,11 @@ typedef struct {
     node_mode_t mode;
     game_config_t game_config;
     key_config_t key_config;
+    relay_mode_t relay_mode;
+    uint8_t channel;
+    phy_mode_t phy_mode;
+    power_save_mode_t power_save;
+    uint16_t power_save_latency_ms; // Worst-case extra buzz latency of dozing buzzers (see power_save.h)
 } nvm_data_t;
 
 extern nvm_data_t nvm_data;
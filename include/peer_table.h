@@ -0,0 +1,78 @@
+#pragma once
+
+#include "comm.h"
+
+/* Peer data is kept in peer_data_table (the layout exported via USB and bluetooth).
+ * Lookups by MAC address go through a small open-addressing index, so their cost
+ * does not grow with the number of table entries.
+ *
+ * Only comm_task may touch the table. Other tasks (USB, bluetooth) read a snapshot that comm_task publishes after every
+ * change: two buffers and a sequence counter, so readers never wait for comm_task and never see a half-written entry.
+ * The index is guarded by a sequence counter as well, so the WiFi task can look up peers with
+ * get_peer_info_concurrent(): a lookup that overlaps an insertion or removal fails rather than waiting for comm_task.
+ * Adding and removing entries marks the table changed, anything else that writes a published field (peer_data_t, the
+ * link and relay fields of peer_state_t, our own entry) calls peer_table_changed(). */
+
+#ifndef PEER_INDEX_BUCKETS
+#define PEER_INDEX_BUCKETS 64 // Must be a power of two, at least twice PEER_DATA_TABLE_ENTRIES and at most 256
+#endif
+
+/* Link quality of a peer, updated by link_stats.cpp */
+typedef struct {
+    uint16_t latency_avg_us;    // EWMA of the RTT
+    uint16_t latency_jitter_us; // EWMA of the RTT's deviation from latency_avg_us
+    uint16_t latency_min_us;
+    uint16_t latency_max_us;
+    uint16_t loss;              // EWMA of lost pings (65535: all lost)
+    uint16_t pings_sent;
+    uint16_t pings_lost;
+    bool has_latency;           // Whether the latency fields are valid
+    bool ping_outstanding;      // Whether our last ping is still waiting for its pong
+    unsigned long last_ping_at; // millis() of our last ping
+    uint32_t ping_interval_ms;  // How often the peer should be pinged, adapted to the link's stability (0: not yet known)
+} peer_link_t;
+
+/* Per-peer bookkeeping that is not part of the exported peer_data_t layout */
+typedef struct {
+    payload_node_info_t keyframe; // The last full node info received from the peer, deltas are applied on top of it
+    uint16_t keyframe_crc;        // CRC of keyframe
+    bool has_keyframe;            // Whether keyframe is valid
+    uint8_t stratum;              // The peer's last advertised time sync stratum
+    bool has_stratum;             // Whether stratum is valid
+    uint32_t ping_echo_us;        // tx_local_us of the last ping frame received from the peer
+    uint32_t ping_rx_us;          // Our local clock when that frame was received (lower 32 bits)
+    uint16_t command_seq;         // Highest command sequence number received from the peer
+    uint16_t command_seq_window;  // Bit i is set if command_seq - i has been received
+    bool has_command_seq;         // Whether command_seq is valid
+    peer_link_t link;             // Link quality, measured by pinging (see link_stats.h)
+    bool heard_direct;            // Whether a frame of the peer was ever received directly
+    unsigned long last_direct_at; // millis() of the last frame received directly from the peer
+    uint8_t relay_hops;           // 0 if the peer is heard directly, otherwise the transmissions its frames take (see relay.h)
+    uint16_t relay_latency_us;    // Latency of the last relayed frame of the peer
+} peer_state_t;
+
+/* What other tasks may read of a peer's bookkeeping, published together with the snapshot of peer_data_table */
+typedef struct {
+    bool used;                 // Whether the entry belonged to a peer
+    uint32_t generation;       // get_peer_generation() of the entry
+    peer_link_t link;
+    uint8_t relay_hops;
+    uint16_t relay_latency_us;
+} peer_link_snapshot_t;
+
+void peer_table_init();
+peer_state_t *get_peer_state(const peer_data_t *peer_data);
+uint32_t get_peer_generation(const peer_data_t *peer_data); // Changes whenever the entry is assigned to a peer
+esp_err_t get_peer_info(const uint8_t *mac_addr, peer_data_t **data);
+esp_err_t get_or_create_peer_info(const uint8_t *mac_addr, peer_data_t **data);
+esp_err_t remove_peer_info(const uint8_t *mac_addr);
+/* Any task. ESP_ERR_INVALID_STATE while comm_task is changing the index. The entry may be reassigned right after,
+ * see get_peer_generation(). */
+esp_err_t get_peer_info_concurrent(const uint8_t *mac_addr, peer_data_t **data);
+
+void peer_table_changed(); // Any task
+bool peer_table_snapshot_due();
+void peer_table_publish_snapshot();
+void peer_table_read_snapshot(peer_data_t *dst, uint8_t first, uint8_t count);
+/* Entry index of the snapshot, both parts from the same publish */
+void peer_table_read_link_snapshot(uint8_t index, peer_data_t *data, peer_link_snapshot_t *link);
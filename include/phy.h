@@ -0,0 +1,26 @@
+#pragma once
+
+#include "comm.h"
+
+/* Runtime selection between the fast PHY and long range (LR).
+ *
+ * Every node accepts both (the LR protocol is enabled next to 11b/g/n), so only the rate frames are sent with differs:
+ * nobody becomes deaf to a node sending with the other one. The controller picks the PHY from the link statistics it
+ * collects anyway: LR as soon as a directly heard peer is weak (low filtered RSSI or lost pings), the fast PHY again once
+ * all of them are strong. Switching is announced with COMMAND_SET_PHY for a common network time, like a channel switch.
+ *
+ * If fewer peers are heard after a switch than before it, the switch is undone (and no new one is tried for
+ * PHY_HOLD_OFF_MS). Buzzers that do not hear anyone after a switch go back on their own. The PHY is kept in nvm. */
+
+#define PHY_LR_RSSI_DBM   -82  // A peer weaker than this asks for long range
+#define PHY_FAST_RSSI_DBM -70  // All peers stronger than this allow the fast PHY again
+#define PHY_LR_LOSS       9830 // 15% ping loss (of 65535) asks for long range
+#define PHY_FAST_LOSS     1311 // 2% ping loss allows the fast PHY again
+
+void phy_init(); // After WiFi is started
+phy_mode_t phy_current();
+
+/* Only to be called from comm_task */
+void phy_start();
+void phy_heard_peer(unsigned long time);
+void phy_schedule_switch(phy_mode_t mode, int64_t at_us);
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "comm.h"
+
+/* ESP-NOW power save for idle buzzers.
+ *
+ * With power save enabled (COMMAND_SET_POWER_SAVE, kept in nvm), battery powered buzzers doze while the game is idle:
+ * the radio only listens for POWER_SAVE_WAKE_WINDOW_MS of every POWER_SAVE_WAKE_WINDOW_MS + the maximum buzz latency.
+ * The latency is part of COMMAND_SET_POWER_SAVE as well (nvm_data.power_save_latency_ms, POWER_SAVE_DEFAULT_BUZZ_LATENCY_MS
+ * until set), a shorter one costs battery life. Sending is not affected. The radio is fully on again while a round is open (COMMAND_ROUND_START until
+ * COMMAND_ROUND_END) and for POWER_SAVE_IDLE_TIMEOUT_MS after any buzz activity (a buzz claim, a peer becoming active).
+ * Controllers and relays never doze.
+ *
+ * A frame only reaches a dozing buzzer if it is sent during its wake window, so while the network dozes, broadcast
+ * commands, buzz claims and decisions are repeated for a whole wake interval (see arbitration.h). This bounds the extra
+ * latency of a buzz claim to the configured maximum, and dozing buzzers extend their arbitration window by as much.
+ * Every node must use the same latency, so the controller applies a broadcast COMMAND_SET_POWER_SAVE to itself as well.
+ * The actual claim latencies are measured in comm_stats.
+ *
+ * Requires CONFIG_ESP_WIFI_STA_DISCONNECTED_PM_ENABLE. */
+
+/* Only to be called from comm_task */
+void power_save_start();
+void power_save_activity(unsigned long time);
+void power_save_set_round(bool open, unsigned long time);
+void power_save_update(); // Re-evaluates after the power save mode changed
+/* Whether the buzzers of the network are expected to doze right now (as far as we can tell) */
+bool power_save_network_dozing(unsigned long time);
+/* Transmissions needed for a broadcast to reach every dozing buzzer, at COMMAND_RETRY_INITIAL_MS intervals */
+uint8_t power_save_broadcast_repeats(unsigned long time);
+/* Measures the delivery latency of a buzz claim received at rx_local_us (esp_timer_get_time()). Returns it, or
+ * JOURNAL_LATENCY_UNKNOWN without a common time base. */
+uint32_t power_save_claim_received(const payload_buzz_t *buzz, int64_t rx_local_us);
+
+/* Any task */
+bool power_save_dozing();
+uint32_t power_save_extra_latency_us(); // How much later than usual buzz claims may arrive right now
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "peer_table.h"
+
+/* Optional multi-hop relaying, for venues larger than the radio range.
+ *
+ * Nodes in relay mode (nvm_data.relay_mode) rebroadcast the broadcast frames they hear directly (state, buzz claims and
+ * decisions, broadcast and multicast commands) in a payload_relay_t envelope, and forward the envelopes they receive
+ * until their TTL runs out. Every node handles the envelopes addressed to it as if the inner frame came from its origin.
+ * A small cache of recently seen frames keeps copies arriving over several paths from being forwarded or handled again.
+ * Frames are keyed on their origin and sequence number (the command or claim sequence number, the round of a decision,
+ * a CRC for frames without one) and remembered for RELAY_SEEN_TIMEOUT_MS, which covers all retransmissions of a
+ * command. Retransmissions carry the attempt they are, a later attempt than the one remembered is forwarded and handled
+ * like a new frame.
+ *
+ * Unicast frames (commands and their acknowledgements) for peers that are only heard through relays are sent as
+ * envelopes, see relay_send. Pings are never relayed, they measure the direct link. */
+
+#define RELAY_SEEN_CACHE_SIZE 64
+#define RELAY_FRAME_OFFSET    offsetof(espnow_data_t, payload.relay.frame)
+#define RELAY_MAX_FRAME_LEN   (sizeof(espnow_data_t) - RELAY_FRAME_OFFSET)
+
+void relay_init();
+bool relay_enabled();
+void relay_set_mode(relay_mode_t mode);
+
+/* A frame received directly from src: remembers it and forwards it if we are a relay */
+void relay_handle_direct(const uint8_t *src, const espnow_data_t *data, int len, int64_t rx_time_us, unsigned long time);
+
+/* An envelope received from a neighbour: forwards it if we are a relay. Returns true if the inner frame is to be
+ * handled by us, it is then moved to the start of data, and origin and len are set to its sender and length. */
+bool relay_handle_envelope(espnow_data_t *data, int *len, uint8_t *origin, int64_t rx_time_us, unsigned long time);
+
+/* Sends a frame to dst, as an envelope if dst is only reachable through relays */
+esp_err_t relay_send(const uint8_t *dst, const espnow_data_t *data, size_t len);
+
+bool relay_is_indirect(const peer_state_t *peer_state);
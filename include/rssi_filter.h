@@ -0,0 +1,26 @@
+#pragma once
+
+#include "comm.h"
+
+/* Filtered RSSI per peer.
+ * The filters are only ever written by the promiscuous callback (WiFi task). Other tasks read them through a sequence
+ * counter instead of a lock, so they never block the radio path: a reader simply retries if an update happened while it
+ * was copying. A per-entry generation (see get_peer_generation) discards samples of a peer whose table entry was reused. */
+
+#define RSSI_WINDOW_SIZE      8 // min/max are taken over this many recent samples
+#define RSSI_EWMA_GAIN_SHIFT  3 // EWMA gain 1/8
+#define RSSI_READ_MAX_RETRIES 8
+
+typedef struct {
+    int8_t avg;       // EWMA of the RSSI
+    int8_t min;       // Over the last RSSI_WINDOW_SIZE samples
+    int8_t max;       // Over the last RSSI_WINDOW_SIZE samples
+    int8_t last;      // The latest sample
+    uint16_t samples; // Number of samples (saturating)
+} rssi_stats_t;
+
+/* Only to be called from the promiscuous callback */
+void rssi_filter_update(const peer_data_t *peer_data, int8_t rssi);
+
+/* Returns false if there is no sample of the peer yet, or no consistent copy could be taken */
+bool rssi_filter_read(const peer_data_t *peer_data, rssi_stats_t *stats);
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "peer_table.h"
+
+/* Network-wide time base, shared with the time master of the network.
+ *
+ * The master is a controller if one is present (the lowest MAC among the controllers), otherwise the buzzer with the lowest MAC.
+ * Every other node picks the synced peer closest to the master as its time source, and estimates offset and drift of its local
+ * clock against the source from the time samples carried by the ping-pong exchange (keeping the sample with the smallest RTT of
+ * the recent ones, as in NTP). Network time is in microseconds; until a node is synced, it is just its local clock.
+ *
+ * Network time never goes backwards. A new estimate is not applied at once but slewed in, at TIMESYNC_SLEW_PPM over at
+ * most TIMESYNC_MAX_SLEW_US: our clock runs a little faster or slower until it has caught up. A correction too large for
+ * that (when we first sync) is applied at once if it is ahead, and slewed in at half the clock rate if it is behind. */
+
+#define TIMESYNC_STRATUM_UNSYNCED 0xFF
+#define TIMESYNC_SAMPLES          8          // Number of recent samples the min-RTT filter chooses from
+#define TIMESYNC_MAX_RTT_US       20000      // Samples with a larger RTT are discarded (stale echo or congestion)
+#define TIMESYNC_MIN_DRIFT_BASE   5000000LL  // [us] Minimum time between two samples to estimate drift from them
+#define TIMESYNC_MAX_DRIFT_PPB    200000     // Crystals are spec'd with a few 10ppm, anything beyond is a measurement error
+#define TIMESYNC_SLEW_PPM         50000      // Rate at which corrections are slewed in (5%, i.e. over 20 times their size)
+#define TIMESYNC_MAX_SLEW_US      1000000LL  // Longest a correction is slewed in at that rate
+
+void timesync_init();
+
+/* Network time, i.e. the time master's clock [us] */
+int64_t timesync_now_us();
+/* Converts a local esp_timer_get_time() timestamp to network time */
+int64_t timesync_local_to_network_us(int64_t local_us);
+
+bool timesync_is_synced();
+bool timesync_is_master();
+uint8_t timesync_stratum();
+/* The MAC of our current time source, or NULL if we have none (we're the master or not synced) */
+const uint8_t *timesync_source();
+
+/* Re-evaluates master and time source from the peer table */
+void timesync_select_source();
+
+/* Fills the time sample fields of a ping frame to the given peer, right before sending it */
+void timesync_prepare_ping(const peer_state_t *peer_state, payload_ping_pong_t *ping);
+/* Feeds a received ping frame into the estimator. rx_local_us is the local esp_timer_get_time() when the frame arrived */
+void timesync_receive_ping(const peer_data_t *peer_data, peer_state_t *peer_state, const payload_ping_pong_t *ping, int64_t rx_local_us);
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "esp_now.h"
+
+/* The link comm.cpp sends and receives frames over, and the registry of the peers it may send them to.
+ *
+ * The nodes use ESP-NOW (TransportEspNow). TransportUdp carries the same frames by UDP multicast, so the firmware can run
+ * as Linux processes on one host (see sim/README.md). Backends report errors with the ESP-NOW codes comm.cpp already
+ * handles (ESP_ERR_ESPNOW_NO_MEM, ESP_ERR_ESPNOW_FULL, ...) and call the callbacks from a task of their own, like the
+ * WiFi task does. */
+
+typedef struct {
+    void (*receive)(const uint8_t *mac_addr, const uint8_t *data, int len);
+    void (*send_done)(const uint8_t *mac_addr, esp_now_send_status_t status);
+    void (*rssi)(const uint8_t *mac_addr, int8_t rssi); // Signal strength of any frame heard from mac_addr
+} transport_callbacks_t;
+
+class ITransport {
+  public:
+    virtual ~ITransport() {};
+
+    virtual void start() = 0;                                           // Before the channel and the PHY are set up
+    virtual esp_err_t init(const transport_callbacks_t *callbacks) = 0; // Starts delivering frames, adds the broadcast peer
+
+    /* Any task. The frame is handed over, its outcome is reported through send_done. */
+    virtual esp_err_t send(const uint8_t *mac_addr, const uint8_t *data, size_t len) = 0;
+
+    virtual esp_err_t addPeer(const uint8_t *mac_addr) = 0;
+    virtual esp_err_t delPeer(const uint8_t *mac_addr) = 0;
+    virtual bool hasPeer(const uint8_t *mac_addr) = 0;
+    virtual esp_err_t fetchPeer(bool from_head, uint8_t *mac_addr) = 0; // Iterates the peers, except the broadcast peer
+    virtual uint8_t peerCount() = 0;                                    // Not counting the broadcast peer
+};
+
+extern ITransport *transport;
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "ITransport.h"
+
+/* ESP-NOW in station mode. The signal strength comes from the promiscuous callback, which sees every ESP-NOW frame. */
+class TransportEspNow : public ITransport {
+  public:
+    TransportEspNow() {};
+    ~TransportEspNow() {};
+
+    void start();
+    esp_err_t init(const transport_callbacks_t *callbacks);
+    esp_err_t send(const uint8_t *mac_addr, const uint8_t *data, size_t len);
+    esp_err_t addPeer(const uint8_t *mac_addr);
+    esp_err_t delPeer(const uint8_t *mac_addr);
+    bool hasPeer(const uint8_t *mac_addr);
+    esp_err_t fetchPeer(bool from_head, uint8_t *mac_addr);
+    uint8_t peerCount();
+};
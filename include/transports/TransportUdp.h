@@ -0,0 +1,30 @@
+#pragma once
+
+#include "ITransport.h"
+
+/* Frames as UDP datagrams to a multicast group, for the firmware running as Linux processes (built with TRANSPORT_UDP).
+ *
+ * Every datagram carries the source and destination MAC before the frame, receivers drop what is neither for them nor
+ * broadcast. Sends are queued to a task of their own, which plays the driver: the queue has as many entries as the
+ * driver has buffers, and every datagram sent counts as acknowledged. All frames are on one "channel" and share the
+ * same signal strength. */
+
+#define TRANSPORT_UDP_GROUP      "239.255.66.66"
+#define TRANSPORT_UDP_PORT       46600
+#define TRANSPORT_UDP_TX_BUFFERS 8
+#define TRANSPORT_UDP_RSSI       -50 // [dBm]
+
+class TransportUdp : public ITransport {
+  public:
+    TransportUdp() {};
+    ~TransportUdp() {};
+
+    void start();
+    esp_err_t init(const transport_callbacks_t *callbacks);
+    esp_err_t send(const uint8_t *mac_addr, const uint8_t *data, size_t len);
+    esp_err_t addPeer(const uint8_t *mac_addr);
+    esp_err_t delPeer(const uint8_t *mac_addr);
+    bool hasPeer(const uint8_t *mac_addr);
+    esp_err_t fetchPeer(bool from_head, uint8_t *mac_addr);
+    uint8_t peerCount();
+};
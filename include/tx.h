@@ -0,0 +1,32 @@
+#pragma once
+
+#include "peer_table.h"
+
+/* All transmissions go through tx_send, which keeps track of the frames the driver still holds.
+ *
+ * A frame is in flight from ITransport::send until its send callback. ESP-NOW has no notion of priorities and only few
+ * buffers, so low priority frames (pings, periodic announcements) are deferred while TX_LOW_PRIO_MAX_IN_FLIGHT frames are
+ * in flight, keeping the remaining buffers free for high priority ones (buzz claims, commands, state changes). Should
+ * the driver still be out of memory, high priority frames are retried briefly instead of being dropped.
+ *
+ * Per peer (and for broadcasts), frames sent, acknowledged and failed are counted, together with an estimate of the
+ * airtime they took. The counters are updated from the sending tasks and the WiFi task, so they are atomic. */
+
+#define TX_LOW_PRIO_MAX_IN_FLIGHT 4  // Low priority frames are deferred while this many frames are in flight
+#define TX_HIGH_PRIO_RETRIES      3  // High priority frames are retried this often (a tick apart) if the driver is out of memory
+#define TX_DEFER_RETRY_MS         10 // Deferred periodic frames are tried again after this long
+#define TX_FRAME_OVERHEAD         43 // Bytes around the ESP-NOW payload: MAC header, vendor specific action frame header, FCS
+#define TX_PREAMBLE_US            192
+
+enum tx_prio_t : uint8_t {
+    TX_PRIO_LOW,
+    TX_PRIO_HIGH,
+};
+
+/* Any task. Returns ESP_ERR_ESPNOW_NO_MEM if a low priority frame was deferred. */
+esp_err_t tx_send(const uint8_t *mac_addr, const espnow_data_t *data, size_t len, tx_prio_t prio);
+/* Only to be called from the send callback */
+void tx_send_done(const uint8_t *mac_addr, esp_now_send_status_t status);
+
+uint8_t tx_in_flight();
+void get_peer_tx_stats(const peer_data_t *peer_data, peer_link_stats_t *stats);
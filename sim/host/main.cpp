@@ -0,0 +1,511 @@
+/* Simulates a network of buzzers: boots them, waits until they know each other, lets them buzz in a number of rounds and
+ * reports how long that took, how fast the other buzzers were locked out and how many frames it cost. See README.md. */
+
+#include "simulator.h"
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#ifndef SIM_NODE_MODULE
+#define SIM_NODE_MODULE "buzzer_node.so"
+#endif
+
+/* node_state_default_t */
+#define STATE_DISABLED 1
+#define STATE_ACTIVE   2
+
+
+static const char *FRAME_TYPES[] = { "join", "state", "ping", "command", "delta", "buzz", "ack", "multicast", "relay", "decision" };
+#define NUM_FRAME_TYPES (sizeof(FRAME_TYPES) / sizeof(FRAME_TYPES[0]))
+
+typedef struct {
+    const char *module = SIM_NODE_MODULE;
+    int nodes          = 20;
+    int controllers    = 1;
+    uint64_t seed      = 1;
+    double area_m      = 20;
+    double drift_ppm   = 20;
+    uint32_t loop_ms   = 5;
+    uint32_t boot_spread_ms     = 2000;
+    uint32_t converge_timeout_s = 120;
+    uint32_t settle_s           = 10;
+    int buzzes                  = 20;
+    uint32_t buzz_interval_ms   = 10000;
+    int contenders              = 3;
+    uint32_t press_spread_us    = 2000;
+    uint32_t press_gap_us       = 0;
+    uint32_t press_ms           = 200;
+    char log_level              = 'W';
+    int log_node                = -1;
+    bool json                   = false;
+    bool check                  = false;
+} options_t;
+
+typedef struct {
+    sim_time_t start;
+    std::vector<std::pair<int, sim_time_t>> presses; // Node and time
+    std::vector<sim_time_t> lockout_at;              // First lockout of every node in the round (< 0: none)
+    std::vector<sim_time_t> active_at;               // First time every node became active in the round (< 0: never)
+    std::vector<int> decided_winner;                 // Winner every node decided on in the round (< 0: none)
+} round_t;
+
+static options_t s_options;
+static int s_target_peers;
+static std::vector<sim_time_t> s_converged_at; // When every node knew all peers it can (< 0: not yet)
+static std::vector<sim_time_t> s_synced_at;    // When every node was first synced (< 0: not yet)
+static int s_converged;
+static int s_synced;
+static round_t *s_round;
+
+static void on_observation(sim_node_t *node, const sim_node_observation_t *previous) {
+    const sim_node_observation_t *observation = &node->observation;
+
+    if (s_converged_at[node->index] < 0 && observation->known_peers >= s_target_peers) {
+        s_converged_at[node->index] = sim_now();
+        s_converged++;
+    }
+    if (s_synced_at[node->index] < 0 && observation->time_synced) {
+        s_synced_at[node->index] = sim_now();
+        s_synced++;
+    }
+
+    if (s_round == NULL) { return; }
+
+    if (observation->mode_state != previous->mode_state) {
+        if (observation->mode_state == STATE_DISABLED && s_round->lockout_at[node->index] < 0) {
+            s_round->lockout_at[node->index] = sim_now();
+        }
+        if (observation->mode_state == STATE_ACTIVE && s_round->active_at[node->index] < 0) {
+            s_round->active_at[node->index] = sim_now();
+        }
+    }
+
+    if (observation->round_decided && (!previous->round_decided || memcmp(observation->winner, previous->winner, SIM_MAC_LEN) != 0)) {
+        sim_node_t *winner                   = sim_find_node(observation->winner);
+        s_round->decided_winner[node->index] = winner != NULL ? winner->index : -1;
+    }
+}
+
+/* Statistics */
+
+static double percentile(std::vector<double> values, double p) {
+    if (values.empty()) { return NAN; }
+    std::sort(values.begin(), values.end());
+    size_t index = std::min(values.size() - 1, (size_t)ceil(p / 100 * values.size()) - (p > 0 ? 1 : 0));
+    return values[index];
+}
+
+static double median(const std::vector<double> &values) {
+    return percentile(values, 50);
+}
+
+/* When the last of the nodes got there, if all of them did */
+static double all(const std::vector<double> &values, int count) {
+    return count == s_options.nodes ? percentile(values, 100) : NAN;
+}
+
+static std::string number(double value) {
+    return std::isnan(value) ? std::string("null") : std::to_string(value);
+}
+
+typedef struct {
+    int rounds;
+    int agreed;       // All nodes that decided the round decided on the node that became active
+    int fair;         // The earliest press won
+    int double_buzz;  // More than one node became active
+    int no_winner;    // No node became active
+    int undecided;    // Nodes (summed over the rounds) that never decided the round
+    int missed;       // Nodes (summed over the rounds) that were never locked out
+    std::vector<double> active_ms;  // Press of the winner until it became active
+    std::vector<double> lockout_ms; // Press of the winner until another node was locked out
+    double frames;                  // Sum over the rounds
+    double frames_by_type[NUM_FRAME_TYPES];
+} buzz_stats_t;
+
+static void evaluate_round(const round_t &round, buzz_stats_t *stats) {
+    stats->rounds++;
+
+    int winner = -1;
+    int active = 0;
+    for (sim_node_t *node : sim_nodes) {
+        if (round.active_at[node->index] >= 0) {
+            active++;
+            if (winner < 0 || round.active_at[node->index] < round.active_at[winner]) {
+                winner = node->index;
+            }
+        }
+    }
+    if (active == 0) {
+        stats->no_winner++;
+        return;
+    }
+    stats->double_buzz += active > 1;
+
+    sim_time_t winner_press = -1;
+    sim_time_t first_press  = -1;
+    int first_presser       = -1;
+    for (const auto &press : round.presses) {
+        if (press.first == winner) { winner_press = press.second; }
+        if (first_press < 0 || press.second < first_press) {
+            first_press   = press.second;
+            first_presser = press.first;
+        }
+    }
+    stats->fair += first_presser == winner;
+    if (winner_press < 0) { return; } // Cannot happen, only contenders buzz
+
+    stats->active_ms.push_back((round.active_at[winner] - winner_press) / 1000.0);
+
+    bool agreed = true;
+    for (sim_node_t *node : sim_nodes) {
+        if (!node->running) { continue; }
+
+        if (round.decided_winner[node->index] < 0) {
+            stats->undecided++;
+        } else if (round.decided_winner[node->index] != winner) {
+            agreed = false;
+        }
+
+        if (node->index == winner) { continue; }
+        if (round.lockout_at[node->index] >= 0) {
+            stats->lockout_ms.push_back((round.lockout_at[node->index] - winner_press) / 1000.0);
+        } else {
+            stats->missed++;
+        }
+    }
+    stats->agreed += agreed;
+}
+
+/* Scenario */
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --nodes N               Nodes in the network (%d)\n"
+            "  --controllers N         Of these, externally powered controllers (%d)\n"
+            "  --seed N                Seed of all random numbers (%llu)\n"
+            "  --area M                [m] Side of the square the nodes are placed in (%.0f)\n"
+            "  --loss P                Probability that a receiver loses a frame (%.2f)\n"
+            "  --latency-us US         From the end of a frame to its receive callback (%lld)\n"
+            "  --jitter-us US          Random extra latency (%lld)\n"
+            "  --no-collisions         Overlapping frames do not destroy each other\n"
+            "  --tx-buffers N          Frames the driver of a node takes at once (%d)\n"
+            "  --retries N             Retransmissions of unacknowledged unicasts (%d)\n"
+            "  --fading-db DB          Standard deviation of the RSSI per frame (%.1f)\n"
+            "  --drift-ppm PPM         Clock drift of the nodes, uniformly distributed within +-PPM (%.0f)\n"
+            "  --loop-ms MS            Longest the nodes' main loop sleeps (%u)\n"
+            "  --boot-spread-ms MS     The nodes are switched on within this time (%u)\n"
+            "  --converge-timeout-s S  Give up waiting for the nodes to know each other (%u)\n"
+            "  --settle-s S            Idle time before the first buzz, to measure the background traffic (%u)\n"
+            "  --buzzes N              Buzz rounds (%d)\n"
+            "  --buzz-interval-ms MS   Time between buzz rounds (%u)\n"
+            "  --contenders N          Buzzers pressed in every round (%d)\n"
+            "  --press-spread-us US    The contenders press within this time (%u)\n"
+            "  --press-gap-us US       Presses of different contenders are at least this far apart (%u)\n"
+            "  --press-ms MS           How long the buttons are held (%u)\n"
+            "  --log-level L           Log level of the nodes: E, W, I, D or V (%c)\n"
+            "  --log-node N            Only log this node\n"
+            "  --json                  Print the report as JSON\n"
+            "  --check                 Exit with 1 if the earliest press lost, or another node buzzed too, in any round\n"
+            "  --module PATH           The node module (%s)\n",
+            name, s_options.nodes, s_options.controllers, (unsigned long long)s_options.seed, s_options.area_m, sim_radio_config.loss,
+            (long long)sim_radio_config.latency_us, (long long)sim_radio_config.jitter_us, sim_radio_config.tx_buffers,
+            sim_radio_config.retries, sim_radio_config.fading_db, s_options.drift_ppm, s_options.loop_ms, s_options.boot_spread_ms,
+            s_options.converge_timeout_s, s_options.settle_s, s_options.buzzes, s_options.buzz_interval_ms, s_options.contenders,
+            s_options.press_spread_us, s_options.press_gap_us, s_options.press_ms, s_options.log_level, s_options.module);
+    exit(2);
+}
+
+static void parse_options(int argc, char **argv) {
+    enum {
+        OPT_NODES = 256, OPT_CONTROLLERS, OPT_SEED, OPT_AREA, OPT_LOSS, OPT_LATENCY, OPT_JITTER, OPT_NO_COLLISIONS, OPT_TX_BUFFERS,
+        OPT_RETRIES, OPT_FADING, OPT_DRIFT, OPT_LOOP, OPT_BOOT_SPREAD, OPT_CONVERGE_TIMEOUT, OPT_SETTLE, OPT_BUZZES, OPT_BUZZ_INTERVAL,
+        OPT_CONTENDERS, OPT_PRESS_SPREAD, OPT_PRESS_GAP, OPT_PRESS, OPT_LOG_LEVEL, OPT_LOG_NODE, OPT_JSON, OPT_CHECK, OPT_MODULE, OPT_HELP
+    };
+    static const struct option long_options[] = {
+        { "nodes", required_argument, NULL, OPT_NODES },
+        { "controllers", required_argument, NULL, OPT_CONTROLLERS },
+        { "seed", required_argument, NULL, OPT_SEED },
+        { "area", required_argument, NULL, OPT_AREA },
+        { "loss", required_argument, NULL, OPT_LOSS },
+        { "latency-us", required_argument, NULL, OPT_LATENCY },
+        { "jitter-us", required_argument, NULL, OPT_JITTER },
+        { "no-collisions", no_argument, NULL, OPT_NO_COLLISIONS },
+        { "tx-buffers", required_argument, NULL, OPT_TX_BUFFERS },
+        { "retries", required_argument, NULL, OPT_RETRIES },
+        { "fading-db", required_argument, NULL, OPT_FADING },
+        { "drift-ppm", required_argument, NULL, OPT_DRIFT },
+        { "loop-ms", required_argument, NULL, OPT_LOOP },
+        { "boot-spread-ms", required_argument, NULL, OPT_BOOT_SPREAD },
+        { "converge-timeout-s", required_argument, NULL, OPT_CONVERGE_TIMEOUT },
+        { "settle-s", required_argument, NULL, OPT_SETTLE },
+        { "buzzes", required_argument, NULL, OPT_BUZZES },
+        { "buzz-interval-ms", required_argument, NULL, OPT_BUZZ_INTERVAL },
+        { "contenders", required_argument, NULL, OPT_CONTENDERS },
+        { "press-spread-us", required_argument, NULL, OPT_PRESS_SPREAD },
+        { "press-gap-us", required_argument, NULL, OPT_PRESS_GAP },
+        { "press-ms", required_argument, NULL, OPT_PRESS },
+        { "log-level", required_argument, NULL, OPT_LOG_LEVEL },
+        { "log-node", required_argument, NULL, OPT_LOG_NODE },
+        { "json", no_argument, NULL, OPT_JSON },
+        { "check", no_argument, NULL, OPT_CHECK },
+        { "module", required_argument, NULL, OPT_MODULE },
+        { "help", no_argument, NULL, OPT_HELP },
+        { NULL, 0, NULL, 0 },
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+            case OPT_NODES: s_options.nodes = atoi(optarg); break;
+            case OPT_CONTROLLERS: s_options.controllers = atoi(optarg); break;
+            case OPT_SEED: s_options.seed = strtoull(optarg, NULL, 0); break;
+            case OPT_AREA: s_options.area_m = atof(optarg); break;
+            case OPT_LOSS: sim_radio_config.loss = atof(optarg); break;
+            case OPT_LATENCY: sim_radio_config.latency_us = atoll(optarg); break;
+            case OPT_JITTER: sim_radio_config.jitter_us = atoll(optarg); break;
+            case OPT_NO_COLLISIONS: sim_radio_config.collisions = false; break;
+            case OPT_TX_BUFFERS: sim_radio_config.tx_buffers = atoi(optarg); break;
+            case OPT_RETRIES: sim_radio_config.retries = atoi(optarg); break;
+            case OPT_FADING: sim_radio_config.fading_db = atof(optarg); break;
+            case OPT_DRIFT: s_options.drift_ppm = atof(optarg); break;
+            case OPT_LOOP: s_options.loop_ms = atoi(optarg); break;
+            case OPT_BOOT_SPREAD: s_options.boot_spread_ms = atoi(optarg); break;
+            case OPT_CONVERGE_TIMEOUT: s_options.converge_timeout_s = atoi(optarg); break;
+            case OPT_SETTLE: s_options.settle_s = atoi(optarg); break;
+            case OPT_BUZZES: s_options.buzzes = atoi(optarg); break;
+            case OPT_BUZZ_INTERVAL: s_options.buzz_interval_ms = atoi(optarg); break;
+            case OPT_CONTENDERS: s_options.contenders = atoi(optarg); break;
+            case OPT_PRESS_SPREAD: s_options.press_spread_us = atoi(optarg); break;
+            case OPT_PRESS_GAP: s_options.press_gap_us = atoi(optarg); break;
+            case OPT_PRESS: s_options.press_ms = atoi(optarg); break;
+            case OPT_LOG_LEVEL: s_options.log_level = optarg[0]; break;
+            case OPT_LOG_NODE: s_options.log_node = atoi(optarg); break;
+            case OPT_JSON: s_options.json = true; break;
+            case OPT_CHECK: s_options.check = true; break;
+            case OPT_MODULE: s_options.module = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if (optind < argc || s_options.nodes < 2 || s_options.nodes > 0xFFFF || s_options.controllers < 0 ||
+        s_options.controllers > s_options.nodes || s_options.loop_ms == 0 || s_options.buzz_interval_ms == 0 ||
+        (uint64_t)s_options.press_gap_us * std::max(s_options.contenders - 1, 0) > s_options.press_spread_us) {
+        usage(argv[0]);
+    }
+}
+
+/* --check: in every round the earliest press won, by it alone, and every node agreed on the winner. Presses closer than
+ * the time sync error cannot be ordered, give the scenario a --press-gap-us beyond it. */
+static int check(const buzz_stats_t &buzz) {
+    if (!s_options.check) { return 0; }
+    if (buzz.fair == buzz.rounds && buzz.agreed == buzz.rounds && buzz.double_buzz == 0 && buzz.no_winner == 0) {
+        return 0;
+    }
+    fprintf(stderr, "Check failed: earliest press won %d/%d, agreed %d/%d, double buzzes %d, no winner %d\n", buzz.fair, buzz.rounds,
+            buzz.agreed, buzz.rounds, buzz.double_buzz, buzz.no_winner);
+    return 1;
+}
+
+static void create_nodes() {
+    for (int i = 0; i < s_options.nodes; i++) {
+        sim_node_config_t config = {};
+        uint8_t mac_addr[SIM_MAC_LEN] = { 0x02, 0x00, 0x00, 0x00, (uint8_t)(i >> 8), (uint8_t)i }; // Locally administered
+        memcpy(config.mac_addr, mac_addr, SIM_MAC_LEN);
+        config.controller       = i < s_options.controllers;
+        config.button_interrupt = true;
+        config.loop_ms          = s_options.loop_ms;
+
+        /* Controllers in the middle, the buzzers around them */
+        double x = config.controller ? s_options.area_m / 2 : sim_uniform() * s_options.area_m;
+        double y = config.controller ? s_options.area_m / 2 : sim_uniform() * s_options.area_m;
+        double drift = (2 * sim_uniform() - 1) * s_options.drift_ppm * 1e-6;
+
+        sim_node_t *node = sim_add_node(&config, drift, x, y);
+        sim_at(sim_random(s_options.boot_spread_ms * 1000 + 1), [node]() { sim_boot(node); });
+    }
+}
+
+static void set_button(sim_node_t *node, bool pressed) {
+    node->button = pressed;
+    sim_call(node, node->boot, [node]() { node->api->button_changed(); });
+}
+
+static void run_round(round_t *round) {
+    round->start = sim_now();
+    round->lockout_at.assign(sim_nodes.size(), -1);
+    round->active_at.assign(sim_nodes.size(), -1);
+    round->decided_winner.assign(sim_nodes.size(), -1);
+
+    std::vector<int> buzzers;
+    for (sim_node_t *node : sim_nodes) {
+        if (!node->config.controller && node->running) {
+            buzzers.push_back(node->index);
+        }
+    }
+    /* Spread the presses over what the gaps leave, then insert the gaps between them */
+    int contenders = std::min(s_options.contenders, (int)buzzers.size());
+    uint32_t free_us = s_options.press_spread_us - s_options.press_gap_us * std::max(contenders - 1, 0);
+    std::vector<sim_time_t> offsets;
+    for (int i = 0; i < contenders; i++) {
+        offsets.push_back(sim_random(free_us + 1));
+    }
+    std::sort(offsets.begin(), offsets.end());
+
+    for (int i = 0; i < contenders; i++) {
+        int pick = sim_random(buzzers.size());
+        int node = buzzers[pick];
+        buzzers.erase(buzzers.begin() + pick);
+
+        sim_time_t press_at = round->start + offsets[i] + (sim_time_t)i * s_options.press_gap_us;
+        round->presses.push_back({ node, press_at });
+        sim_at(press_at, [node]() { set_button(sim_nodes[node], true); });
+        sim_at(press_at + s_options.press_ms * 1000, [node]() { set_button(sim_nodes[node], false); });
+    }
+
+    s_round = round;
+    sim_run_until(round->start + s_options.buzz_interval_ms * 1000);
+    s_round = NULL;
+}
+
+static void print_distribution(const char *name, const std::vector<double> &values) {
+    printf("  %-26s p50 %7.2f  p90 %7.2f  p99 %7.2f  max %7.2f  (%zu samples)\n", name, percentile(values, 50), percentile(values, 90),
+           percentile(values, 99), percentile(values, 100), values.size());
+}
+
+static void json_distribution(const char *name, const std::vector<double> &values, bool last = false) {
+    printf("    \"%s\": {\"p50\": %s, \"p90\": %s, \"p99\": %s, \"max\": %s, \"samples\": %zu}%s\n", name, number(percentile(values, 50)).c_str(),
+           number(percentile(values, 90)).c_str(), number(percentile(values, 99)).c_str(), number(percentile(values, 100)).c_str(), values.size(),
+           last ? "" : ",");
+}
+
+int main(int argc, char **argv) {
+    parse_options(argc, argv);
+
+    sim_init(s_options.module, s_options.seed, on_observation);
+    sim_set_log(s_options.log_level, s_options.log_node);
+
+    /* Neither the peer table nor the driver take more peers */
+    s_target_peers = std::min(s_options.nodes - 1, SIM_MAX_PEERS - 1);
+    s_converged_at.assign(s_options.nodes, -1);
+    s_synced_at.assign(s_options.nodes, -1);
+    create_nodes();
+
+    /* Convergence: every node knows all others (or as many as it can), and shares the network time */
+    sim_run_until((sim_time_t)s_options.converge_timeout_s * 1000000, []() { return s_converged == s_options.nodes && s_synced == s_options.nodes; });
+    std::vector<double> converged_s, synced_s;
+    for (int i = 0; i < s_options.nodes; i++) {
+        if (s_converged_at[i] >= 0) { converged_s.push_back(s_converged_at[i] / 1e6); }
+        if (s_synced_at[i] >= 0) { synced_s.push_back(s_synced_at[i] / 1e6); }
+    }
+
+    /* Background traffic without buzzing */
+    sim_radio_stats_t before = sim_radio_stats;
+    sim_run_until(sim_now() + (sim_time_t)s_options.settle_s * 1000000);
+    double background_frames = (sim_radio_stats.frames - before.frames) / (double)std::max(1u, s_options.settle_s);
+    double background_by_type[NUM_FRAME_TYPES];
+    for (size_t t = 0; t < NUM_FRAME_TYPES; t++) {
+        background_by_type[t] = (sim_radio_stats.frames_by_type[t] - before.frames_by_type[t]) / (double)std::max(1u, s_options.settle_s);
+    }
+    double background_airtime = (sim_radio_stats.airtime_us - before.airtime_us) / (std::max(1u, s_options.settle_s) * 1e6);
+
+    /* Buzz rounds */
+    buzz_stats_t buzz = {};
+    for (int r = 0; r < s_options.buzzes; r++) {
+        round_t round;
+        before = sim_radio_stats;
+        run_round(&round);
+        evaluate_round(round, &buzz);
+
+        buzz.frames += sim_radio_stats.frames - before.frames;
+        for (size_t t = 0; t < NUM_FRAME_TYPES; t++) {
+            buzz.frames_by_type[t] += sim_radio_stats.frames_by_type[t] - before.frames_by_type[t];
+        }
+    }
+    bool converged            = s_converged == s_options.nodes && s_synced == s_options.nodes;
+    double interval_s         = s_options.buzz_interval_ms / 1000.0;
+    double frames_per_buzz    = buzz.rounds > 0 ? buzz.frames / buzz.rounds : 0;
+    double excess_per_buzz    = buzz.rounds > 0 ? frames_per_buzz - background_frames * interval_s : 0;
+    uint32_t halts            = 0;
+    for (sim_node_t *node : sim_nodes) {
+        halts += node->halts;
+    }
+
+    if (s_options.json) {
+        printf("{\n");
+        printf("  \"nodes\": %d, \"controllers\": %d, \"seed\": %llu, \"max_peers\": %d,\n", s_options.nodes, s_options.controllers,
+               (unsigned long long)s_options.seed, SIM_MAX_PEERS);
+        printf("  \"convergence\": {\"converged\": %s, \"target_peers\": %d,\n", converged ? "true" : "false", s_target_peers);
+        printf("    \"peers\": {\"nodes\": %d, \"all_s\": %s, \"median_s\": %s},\n", s_converged, number(all(converged_s, s_converged)).c_str(),
+               number(median(converged_s)).c_str());
+        printf("    \"synced\": {\"nodes\": %d, \"all_s\": %s, \"median_s\": %s}},\n", s_synced, number(all(synced_s, s_synced)).c_str(),
+               number(median(synced_s)).c_str());
+        printf("  \"background\": {\"frames_per_s\": %f, \"airtime\": %f, \"by_type\": {", background_frames, background_airtime);
+        for (size_t t = 0; t < NUM_FRAME_TYPES; t++) {
+            printf("%s\"%s\": %f", t > 0 ? ", " : "", FRAME_TYPES[t], background_by_type[t]);
+        }
+        printf("}},\n");
+        printf("  \"buzzes\": {\n");
+        printf("    \"rounds\": %d, \"agreed\": %d, \"fair\": %d, \"double_buzz\": %d, \"no_winner\": %d, \"undecided\": %d, \"missed_lockouts\": %d,\n",
+               buzz.rounds, buzz.agreed, buzz.fair, buzz.double_buzz, buzz.no_winner, buzz.undecided, buzz.missed);
+        json_distribution("press_to_active_ms", buzz.active_ms);
+        json_distribution("press_to_lockout_ms", buzz.lockout_ms);
+        printf("    \"frames_per_buzz\": %f, \"excess_frames_per_buzz\": %f, \"by_type\": {", frames_per_buzz, excess_per_buzz);
+        for (size_t t = 0; t < NUM_FRAME_TYPES; t++) {
+            printf("%s\"%s\": %f", t > 0 ? ", " : "", FRAME_TYPES[t], buzz.rounds > 0 ? buzz.frames_by_type[t] / buzz.rounds : 0);
+        }
+        printf("}\n  },\n");
+        printf("  \"radio\": {\"sends\": %llu, \"no_mem\": %llu, \"frames\": %llu, \"retransmissions\": %llu, \"unicasts_failed\": %llu, "
+               "\"receptions\": %llu, \"lost_collision\": %llu, \"lost_random\": %llu, \"lost_dozing\": %llu, \"lost_transmitting\": %llu},\n",
+               (unsigned long long)sim_radio_stats.sends, (unsigned long long)sim_radio_stats.no_mem, (unsigned long long)sim_radio_stats.frames,
+               (unsigned long long)sim_radio_stats.retransmissions, (unsigned long long)sim_radio_stats.unicasts_failed,
+               (unsigned long long)sim_radio_stats.receptions, (unsigned long long)sim_radio_stats.lost_collision,
+               (unsigned long long)sim_radio_stats.lost_random, (unsigned long long)sim_radio_stats.lost_dozing,
+               (unsigned long long)sim_radio_stats.lost_transmitting);
+        printf("  \"halts\": %u\n}\n", halts);
+        return check(buzz);
+    }
+
+    printf("Network: %d nodes (%d controller%s), %.0fx%.0fm, loss %.2f, latency %lld+%lldus, collisions %s, seed %llu\n", s_options.nodes,
+           s_options.controllers, s_options.controllers == 1 ? "" : "s", s_options.area_m, s_options.area_m, sim_radio_config.loss, (long long)sim_radio_config.latency_us,
+           (long long)sim_radio_config.jitter_us, sim_radio_config.collisions ? "on" : "off", (unsigned long long)s_options.seed);
+    if (s_converged == s_options.nodes) {
+        printf("Convergence: all nodes know %d peers after %.3fs (median node %.3fs)\n", s_target_peers, all(converged_s, s_converged), median(converged_s));
+    } else {
+        printf("Convergence: only %d of %d nodes knew %d peers after %us\n", s_converged, s_options.nodes, s_target_peers, s_options.converge_timeout_s);
+    }
+    if (s_synced == s_options.nodes) {
+        printf("Time sync: all nodes synced after %.3fs (median node %.3fs)\n", all(synced_s, s_synced), median(synced_s));
+    } else {
+        printf("Time sync: only %d of %d nodes synced after %us\n", s_synced, s_options.nodes, s_options.converge_timeout_s);
+    }
+    printf("Background: %.1f frames/s, %.2f%% airtime\n", background_frames, 100 * background_airtime);
+    printf("Buzzes: %d rounds, %d contenders within %uus\n", buzz.rounds, s_options.contenders, s_options.press_spread_us);
+    printf("  Winner agreed by all %d/%d, earliest press won %d/%d, double buzzes %d, no winner %d, undecided nodes %d\n", buzz.agreed,
+           buzz.rounds, buzz.fair, buzz.rounds, buzz.double_buzz, buzz.no_winner, buzz.undecided);
+    print_distribution("Press to active [ms]:", buzz.active_ms);
+    print_distribution("Press to lockout [ms]:", buzz.lockout_ms);
+    printf("  Missed lockouts: %d\n", buzz.missed);
+    printf("  Frames per buzz: %.1f (%.1f above background):", frames_per_buzz, excess_per_buzz);
+    for (size_t t = 0; t < NUM_FRAME_TYPES; t++) {
+        double frames = buzz.rounds > 0 ? buzz.frames_by_type[t] / buzz.rounds - background_by_type[t] * interval_s : 0;
+        if (fabs(frames) >= 0.05) {
+            printf(" %s %+.1f", FRAME_TYPES[t], frames);
+        }
+    }
+    printf("\n");
+    printf("Radio: %llu frames, %llu retransmissions, %llu unicasts failed, %llu sends rejected (no memory)\n",
+           (unsigned long long)sim_radio_stats.frames, (unsigned long long)sim_radio_stats.retransmissions,
+           (unsigned long long)sim_radio_stats.unicasts_failed, (unsigned long long)sim_radio_stats.no_mem);
+    printf("  Receptions: %llu, lost to collisions %llu, to loss %llu, while dozing %llu, while transmitting %llu\n",
+           (unsigned long long)sim_radio_stats.receptions, (unsigned long long)sim_radio_stats.lost_collision,
+           (unsigned long long)sim_radio_stats.lost_random, (unsigned long long)sim_radio_stats.lost_dozing,
+           (unsigned long long)sim_radio_stats.lost_transmitting);
+    printf("Halts (panics, restarts and shutdowns): %u\n", halts);
+    return check(buzz);
+}
@@ -0,0 +1,280 @@
+#include "radio.h"
+#include "simulator.h"
+#include "esp_err.h"
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+/* 802.11b timing (1 Mbit/s, long preamble), as assumed by the firmware's airtime estimate (see tx.h) */
+#define PREAMBLE_US          192
+#define FRAME_OVERHEAD       43 // MAC header, vendor specific action frame header and FCS
+#define SLOT_US              20
+#define SIFS_US              10
+#define DIFS_US              (SIFS_US + 2 * SLOT_US)
+#define CONTENTION_WINDOW    31
+#define CCA_US               15 // A node only notices a transmission this long after it started
+#define ACK_BYTES            14
+#define ACK_TIMEOUT_US       (SIFS_US + PREAMBLE_US + ACK_BYTES * 8 + SLOT_US)
+#define SCAN_RETRY_US        10000
+
+#define RSSI_AT_1M           -40 // [dBm]
+#define SENSITIVITY_FAST     -90 // [dBm]
+#define SENSITIVITY_LR       -98 // [dBm]
+#define CAPTURE_DB           10  // A frame survives an overlapping one this much weaker
+
+sim_radio_config_t sim_radio_config = {
+    .loss               = 0,
+    .latency_us         = 200,
+    .jitter_us          = 100,
+    .collisions         = true,
+    .tx_buffers         = 8,
+    .retries            = 7,
+    .path_loss_exponent = 3,
+    .fading_db          = 2,
+};
+sim_radio_stats_t sim_radio_stats;
+
+typedef struct {
+    uint64_t id;
+    sim_node_t *src;
+    sim_time_t start;
+    sim_time_t end;
+    uint8_t channel;
+    bool long_range;
+} transmission_t;
+
+static std::vector<transmission_t> s_on_air; // Transmissions that ended recently or are still going on
+static uint64_t s_next_transmission_id;
+
+static const uint8_t BROADCAST_MAC[SIM_MAC_LEN] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+
+static void attempt(sim_node_t *node, uint32_t boot);
+
+double radio_rssi(const sim_node_t *from, const sim_node_t *to) {
+    double distance = std::max(1.0, hypot(from->x - to->x, from->y - to->y));
+    return RSSI_AT_1M - 10 * sim_radio_config.path_loss_exponent * log10(distance);
+}
+
+static bool in_range(double rssi, bool long_range) {
+    return rssi >= (long_range ? SENSITIVITY_LR : SENSITIVITY_FAST);
+}
+
+static uint32_t airtime_us(size_t len, bool long_range) {
+    uint32_t bits = (len + FRAME_OVERHEAD) * 8;
+    return PREAMBLE_US + (long_range ? 2 * bits : bits);
+}
+
+static uint32_t ack_airtime_us(bool long_range) {
+    return PREAMBLE_US + ACK_BYTES * 8 * (long_range ? 2 : 1);
+}
+
+static bool awake(const sim_node_t *node, sim_time_t time) {
+    const sim_radio_t *radio = &node->radio;
+    if (radio->wake_window_ms >= radio->wake_interval_ms) {
+        return true;
+    }
+    return (sim_local_time(node, time) / 1000) % radio->wake_interval_ms < radio->wake_window_ms;
+}
+
+static bool overlap(const transmission_t &a, const transmission_t &b) {
+    return a.start < b.end && b.start < a.end;
+}
+
+static void prune_on_air() {
+    sim_time_t horizon = sim_now() - 2 * airtime_us(250, true);
+    s_on_air.erase(std::remove_if(s_on_air.begin(), s_on_air.end(), [horizon](const transmission_t &t) { return t.end < horizon; }), s_on_air.end());
+}
+
+/* Until when the node senses the medium busy */
+static sim_time_t busy_until(const sim_node_t *node) {
+    sim_time_t until = 0;
+    for (const transmission_t &t : s_on_air) {
+        if (t.end > sim_now() && t.start + CCA_US <= sim_now() && t.channel == node->radio.channel &&
+            (t.src == node || in_range(radio_rssi(t.src, node), t.long_range))) {
+            until = std::max(until, t.end);
+        }
+    }
+    return until;
+}
+
+static transmission_t put_on_air(sim_node_t *src, uint32_t duration_us) {
+    prune_on_air();
+    s_on_air.push_back({ s_next_transmission_id++, src, sim_now(), sim_now() + duration_us, src->radio.channel, src->radio.long_range });
+    return s_on_air.back();
+}
+
+/* Whether the receiver gets the transmission (not counting the configured loss) */
+static bool receives(sim_node_t *receiver, const transmission_t &tx, double rssi) {
+    if (!receiver->running || receiver->radio.channel != tx.channel || !in_range(rssi, tx.long_range)) {
+        return false;
+    }
+    if (!awake(receiver, tx.start)) {
+        sim_radio_stats.lost_dozing++;
+        return false;
+    }
+
+    for (const transmission_t &other : s_on_air) {
+        if (other.id == tx.id || !overlap(other, tx) || other.channel != tx.channel) { continue; }
+
+        if (other.src == receiver) {
+            sim_radio_stats.lost_transmitting++;
+            return false;
+        }
+        if (sim_radio_config.collisions) {
+            double other_rssi = radio_rssi(other.src, receiver);
+            if (in_range(other_rssi, other.long_range) && rssi - other_rssi < CAPTURE_DB) {
+                sim_radio_stats.lost_collision++;
+                return false;
+            }
+        }
+    }
+
+    if (sim_uniform() < sim_radio_config.loss) {
+        sim_radio_stats.lost_random++;
+        return false;
+    }
+    return true;
+}
+
+static void deliver(sim_node_t *src, sim_node_t *receiver, const std::vector<uint8_t> &data, double rssi) {
+    sim_time_t at = sim_now() + sim_radio_config.latency_us + (sim_time_t)(sim_uniform() * sim_radio_config.jitter_us);
+    uint32_t boot = receiver->boot;
+    int8_t rssi_dbm = (int8_t)std::max(-127.0, round(rssi));
+    const uint8_t *src_mac = src->config.mac_addr;
+
+    sim_at(at, [receiver, boot, data, rssi_dbm, src_mac]() {
+        sim_call(receiver, boot, [&]() {
+            sim_radio_stats.receptions++;
+            receiver->api->receive(src_mac, data.data(), data.size(), rssi_dbm);
+        });
+    });
+}
+
+/* The first frame of the queue is done, report it and go on with the next one */
+static void frame_done(sim_node_t *node, uint32_t boot, bool success) {
+    sim_radio_frame_t frame = std::move(node->radio.queue.front());
+    node->radio.queue.pop_front();
+
+    sim_at(sim_now() + sim_radio_config.latency_us, [node, boot, frame, success]() {
+        sim_call(node, boot, [&]() { node->api->send_done(frame.dst, success); });
+    });
+
+    if (!node->radio.queue.empty()) {
+        sim_at(sim_now() + DIFS_US + sim_random(CONTENTION_WINDOW + 1) * SLOT_US, [node, boot]() { attempt(node, boot); });
+    }
+}
+
+/* End of a transmission of the first frame in the node's queue */
+static void transmitted(sim_node_t *node, uint32_t boot, const transmission_t &tx) {
+    if (node->boot != boot) { return; }
+
+    sim_radio_frame_t &frame = node->radio.queue.front();
+    bool broadcast           = memcmp(frame.dst, BROADCAST_MAC, SIM_MAC_LEN) == 0;
+    bool acked               = false;
+
+    for (sim_node_t *receiver : sim_nodes) {
+        if (receiver == node) { continue; }
+        if (!broadcast && memcmp(receiver->config.mac_addr, frame.dst, SIM_MAC_LEN) != 0) { continue; }
+
+        double rssi = radio_rssi(node, receiver) + sim_radio_config.fading_db * sim_normal();
+        if (receives(receiver, tx, rssi)) {
+            deliver(node, receiver, frame.data, rssi);
+            acked = !broadcast;
+        }
+    }
+
+    if (broadcast) {
+        frame_done(node, boot, true);
+        return;
+    }
+
+    if (acked) {
+        /* The receiver acknowledges after SIFS, its ACK occupies the medium around it */
+        sim_node_t *receiver = sim_find_node(frame.dst);
+        uint32_t ack_us      = ack_airtime_us(tx.long_range);
+        sim_at(sim_now() + SIFS_US, [receiver, ack_us]() { put_on_air(receiver, ack_us); });
+        sim_at(sim_now() + SIFS_US + ack_us, [node, boot]() {
+            if (node->boot == boot) { frame_done(node, boot, true); }
+        });
+        return;
+    }
+
+    if (frame.attempts <= sim_radio_config.retries) {
+        sim_radio_stats.retransmissions++;
+        sim_at(sim_now() + ACK_TIMEOUT_US + sim_random(CONTENTION_WINDOW + 1) * SLOT_US, [node, boot]() { attempt(node, boot); });
+    } else {
+        sim_radio_stats.unicasts_failed++;
+        sim_at(sim_now() + ACK_TIMEOUT_US, [node, boot]() {
+            if (node->boot == boot) { frame_done(node, boot, false); }
+        });
+    }
+}
+
+/* Tries to transmit the first frame of the node's queue */
+static void attempt(sim_node_t *node, uint32_t boot) {
+    if (node->boot != boot || node->radio.queue.empty()) { return; }
+
+    if (node->radio.channel == 0) {
+        sim_at(sim_now() + SCAN_RETRY_US, [node, boot]() { attempt(node, boot); });
+        return;
+    }
+
+    sim_time_t busy = busy_until(node);
+    if (busy > sim_now()) {
+        sim_at(busy + DIFS_US + sim_random(CONTENTION_WINDOW + 1) * SLOT_US, [node, boot]() { attempt(node, boot); });
+        return;
+    }
+
+    sim_radio_frame_t &frame = node->radio.queue.front();
+    frame.attempts++;
+    uint32_t duration = airtime_us(frame.data.size(), node->radio.long_range);
+    transmission_t tx = put_on_air(node, duration);
+
+    sim_radio_stats.frames++;
+    sim_radio_stats.frames_by_type[frame.data[0] & 0x0f]++;
+    sim_radio_stats.airtime_us += duration;
+
+    sim_at(tx.end, [node, boot, tx]() { transmitted(node, boot, tx); });
+}
+
+void radio_reset(sim_node_t *node) {
+    node->radio.channel          = 0;
+    node->radio.long_range       = false;
+    node->radio.wake_window_ms   = UINT16_MAX;
+    node->radio.wake_interval_ms = 100;
+    node->radio.queue.clear();
+}
+
+int radio_send(sim_node_t *node, const uint8_t *dst, const uint8_t *data, size_t len) {
+    sim_radio_t *radio = &node->radio;
+    if (radio->queue.size() >= sim_radio_config.tx_buffers) {
+        sim_radio_stats.no_mem++;
+        return ESP_ERR_ESPNOW_NO_MEM;
+    }
+
+    sim_radio_frame_t frame;
+    frame.data.assign(data, data + len);
+    memcpy(frame.dst, dst, SIM_MAC_LEN);
+    frame.attempts = 0;
+    radio->queue.push_back(std::move(frame));
+    sim_radio_stats.sends++;
+
+    if (radio->queue.size() == 1) {
+        uint32_t boot = node->boot;
+        sim_at(sim_now() + DIFS_US + sim_random(CONTENTION_WINDOW + 1) * SLOT_US, [node, boot]() { attempt(node, boot); });
+    }
+    return ESP_OK;
+}
+
+void radio_set_channel(sim_node_t *node, uint8_t channel) {
+    node->radio.channel = channel;
+}
+
+void radio_set_long_range(sim_node_t *node, bool long_range) {
+    node->radio.long_range = long_range;
+}
+
+void radio_set_wake_window(sim_node_t *node, uint16_t window_ms, uint16_t interval_ms) {
+    node->radio.wake_window_ms   = window_ms;
+    node->radio.wake_interval_ms = interval_ms;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "sim_api.h"
+#include <deque>
+#include <vector>
+
+/* The shared medium: every node hears the frames of the nodes in its range on its channel, as long as it is awake, not
+ * transmitting itself and no other frame it hears overlaps. Nodes sense the medium before transmitting (CSMA), unicasts
+ * are acknowledged and retried like the WiFi MAC does. */
+
+typedef struct {
+    double loss;               // Probability that a receiver loses a frame (on top of range, collisions and dozing)
+    int64_t latency_us;        // From the end of a frame to the receive callback
+    int64_t jitter_us;         // Uniformly distributed on top of latency_us
+    bool collisions;           // Whether overlapping frames destroy each other (otherwise only the range counts)
+    uint8_t tx_buffers;        // Frames a node's driver holds before esp_now_send() fails with ESP_ERR_ESPNOW_NO_MEM
+    uint8_t retries;           // Retransmissions of an unacknowledged unicast
+    double path_loss_exponent; // Of the log-distance path loss model
+    double fading_db;          // Standard deviation of the RSSI per frame
+} sim_radio_config_t;
+
+typedef struct {
+    uint64_t sends;                 // esp_now_send() calls accepted
+    uint64_t no_mem;                // esp_now_send() calls rejected because the node's buffers were full
+    uint64_t frames;                // Transmissions, including retransmissions
+    uint64_t frames_by_type[16];    // Transmissions by espnow_data_type_t
+    uint64_t retransmissions;       // Unicasts sent again because no acknowledgement came
+    uint64_t unicasts_failed;       // Unicasts never acknowledged
+    uint64_t receptions;            // Frames handed to receive callbacks
+    uint64_t lost_collision;        // Receptions lost to overlapping frames
+    uint64_t lost_random;           // Receptions lost to the configured loss
+    uint64_t lost_dozing;           // Receptions missed because the receiver was outside of its wake window
+    uint64_t lost_transmitting;     // Receptions missed because the receiver was transmitting
+    uint64_t airtime_us;
+} sim_radio_stats_t;
+
+typedef struct {
+    std::vector<uint8_t> data;
+    uint8_t dst[SIM_MAC_LEN];
+    uint8_t attempts;
+} sim_radio_frame_t;
+
+/* Radio state of a node */
+typedef struct {
+    uint8_t channel;         // 0: off or scanning
+    bool long_range;
+    uint16_t wake_window_ms; // 65535: always awake
+    uint16_t wake_interval_ms;
+    std::deque<sim_radio_frame_t> queue; // Frames handed to the driver, the first one is being transmitted
+} sim_radio_t;
+
+extern sim_radio_config_t sim_radio_config;
+extern sim_radio_stats_t sim_radio_stats;
+
+void radio_reset(sim_node_t *node); // On (re)boot and halt, drops all frames
+int radio_send(sim_node_t *node, const uint8_t *dst, const uint8_t *data, size_t len);
+void radio_set_channel(sim_node_t *node, uint8_t channel);
+void radio_set_long_range(sim_node_t *node, bool long_range);
+void radio_set_wake_window(sim_node_t *node, uint16_t window_ms, uint16_t interval_ms);
+
+/* Received signal strength of a frame from one node to another, without fading */
+double radio_rssi(const sim_node_t *from, const sim_node_t *to);
@@ -0,0 +1,418 @@
+#include "simulator.h"
+#include <dlfcn.h>
+#include <limits.h>
+#include <math.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <random>
+#include <string>
+
+#define TASK_STACK_SIZE (256 * 1024) // The firmware's stacks are tiny, but the host's libc needs more
+
+std::vector<sim_node_t *> sim_nodes;
+
+typedef struct {
+    sim_time_t time;
+    uint64_t seq; // Events at the same time run in the order they were scheduled
+    std::function<void()> fn;
+} sim_event_t;
+
+static bool event_after(const sim_event_t &a, const sim_event_t &b) {
+    return a.time != b.time ? a.time > b.time : a.seq > b.seq;
+}
+
+static std::vector<sim_event_t> s_events; // Heap, earliest first
+static uint64_t s_event_seq;
+static sim_time_t s_now;
+
+static std::mt19937_64 s_rng;
+static std::string s_module_image; // The module's file, copied for every boot of every node
+static char s_module_dir[] = "/tmp/buzzer_sim.XXXXXX";
+static sim_observer_t s_observer;
+static char s_log_level = 'W';
+static int s_log_node   = -1;
+
+static ucontext_t s_scheduler_context;
+static sim_task_t *s_current_task;
+static sim_task_t *s_starting_task;
+static bool s_in_call;
+static jmp_buf s_call_jmp;
+
+/* What a halted boot leaves behind, freed once the scheduler runs again */
+static std::vector<sim_task_t *> s_dead_tasks;
+static std::vector<void *> s_dead_modules;
+
+static const char *LOG_LEVELS = "EWIDV";
+
+static bool log_enabled(const sim_node_t *node, char level) {
+    const char *l = strchr(LOG_LEVELS, level);
+    return l != NULL && l <= strchr(LOG_LEVELS, s_log_level) && (s_log_node < 0 || s_log_node == node->index);
+}
+
+static void host_log_printf(const sim_node_t *node, char level, const char *format, ...) {
+    if (!log_enabled(node, level)) { return; }
+
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "%11.6f [%3d] %c ", s_now / 1e6, node->index, level);
+    vfprintf(stderr, format, args);
+    fputc('\n', stderr);
+    va_end(args);
+}
+
+/* Time and randomness */
+
+sim_time_t sim_now() {
+    return s_now;
+}
+
+int64_t sim_local_time(const sim_node_t *node, sim_time_t time) {
+    return (int64_t)((time - node->boot_at) * (1.0 + node->drift));
+}
+
+sim_time_t sim_duration(const sim_node_t *node, int64_t local_us) {
+    return std::max<sim_time_t>((sim_time_t)ceil(local_us / (1.0 + node->drift)), 1);
+}
+
+double sim_uniform() {
+    return std::uniform_real_distribution<double>(0, 1)(s_rng);
+}
+
+double sim_normal() {
+    return std::normal_distribution<double>(0, 1)(s_rng);
+}
+
+uint32_t sim_random(uint32_t max) {
+    return max == 0 ? 0 : std::uniform_int_distribution<uint32_t>(0, max - 1)(s_rng);
+}
+
+/* Events */
+
+void sim_at(sim_time_t time, std::function<void()> fn) {
+    s_events.push_back({ std::max(time, s_now), s_event_seq++, std::move(fn) });
+    std::push_heap(s_events.begin(), s_events.end(), event_after);
+}
+
+static void reap() {
+    for (sim_task_t *task : s_dead_tasks) {
+        free(task->stack);
+        delete task;
+    }
+    s_dead_tasks.clear();
+
+    for (void *module : s_dead_modules) {
+        dlclose(module);
+    }
+    s_dead_modules.clear();
+}
+
+bool sim_run_until(sim_time_t time, const std::function<bool()> &done) {
+    while (!s_events.empty() && s_events.front().time <= time) {
+        std::pop_heap(s_events.begin(), s_events.end(), event_after);
+        sim_event_t event = std::move(s_events.back());
+        s_events.pop_back();
+
+        s_now = event.time;
+        event.fn();
+        reap();
+
+        if (done && done()) { return true; }
+    }
+    s_now = std::max(s_now, time);
+    return false;
+}
+
+/* Observations */
+
+static void observe(sim_node_t *node) {
+    if (!node->running) { return; }
+
+    sim_node_observation_t observation;
+    node->api->observe(&observation);
+    if (memcmp(&observation, &node->observation, sizeof(sim_node_observation_t)) != 0) {
+        sim_node_observation_t previous = node->observation;
+        node->observation               = observation;
+        if (s_observer != NULL) {
+            s_observer(node, &previous);
+        }
+    }
+}
+
+/* Tasks */
+
+static void run_task(sim_task_t *task) {
+    s_current_task = task;
+    swapcontext(&s_scheduler_context, &task->context);
+    s_current_task = NULL;
+    observe(task->node);
+}
+
+/* Schedules a task to continue now, unless its node restarted meanwhile */
+static void resume_task(sim_task_t *task) {
+    sim_node_t *node = task->node;
+    uint32_t boot    = node->boot;
+    sim_at(s_now, [task, node, boot]() {
+        if (node->boot == boot) { run_task(task); }
+    });
+}
+
+static void task_entry() {
+    sim_task_t *task = s_starting_task;
+    task->fn(task->arg);
+
+    /* FreeRTOS tasks must not return, treat it like vTaskDelete() */
+    host_log_printf(task->node, 'W', "Task %s returned", task->name);
+    task->blocked    = true;
+    task->waiting_on = NULL;
+    swapcontext(&task->context, &s_scheduler_context);
+}
+
+static void *host_task_create(sim_node_t *node, void (*fn)(void *), void *arg, const char *name) {
+    sim_task_t *task = new sim_task_t();
+    task->node       = node;
+    task->fn         = fn;
+    task->arg        = arg;
+    task->stack      = malloc(TASK_STACK_SIZE);
+    snprintf(task->name, sizeof(task->name), "%s", name);
+
+    getcontext(&task->context);
+    task->context.uc_stack.ss_sp   = task->stack;
+    task->context.uc_stack.ss_size = TASK_STACK_SIZE;
+    task->context.uc_link          = NULL;
+    makecontext(&task->context, task_entry, 0);
+    node->tasks.push_back(task);
+
+    /* The task starts right away, but after the caller blocks (there is no preemption) */
+    uint32_t boot = node->boot;
+    sim_at(s_now, [task, node, boot]() {
+        if (node->boot != boot) { return; }
+        s_starting_task = task;
+        run_task(task);
+    });
+    return task;
+}
+
+static bool host_in_task(sim_node_t *node) {
+    return s_current_task != NULL && s_current_task->node == node;
+}
+
+static void *host_current_task(sim_node_t *node) {
+    return host_in_task(node) ? s_current_task : NULL;
+}
+
+static bool host_block(sim_node_t *node, const void *object, int64_t timeout_us) {
+    sim_task_t *task = s_current_task;
+    if (task == NULL || task->node != node || timeout_us == 0) {
+        return false;
+    }
+
+    task->waiting_on = object;
+    task->blocked    = true;
+    task->notified   = false;
+    uint32_t wake    = ++task->wake_seq;
+    if (timeout_us > 0) {
+        uint32_t boot = node->boot;
+        sim_at(s_now + sim_duration(node, timeout_us), [task, node, boot, wake]() {
+            if (node->boot == boot && task->blocked && task->wake_seq == wake) {
+                task->blocked = false;
+                run_task(task);
+            }
+        });
+    }
+
+    swapcontext(&task->context, &s_scheduler_context);
+    return task->notified;
+}
+
+static void host_notify(sim_node_t *node, const void *object) {
+    if (object == NULL) { return; }
+
+    for (sim_task_t *task : node->tasks) {
+        if (task->blocked && task->waiting_on == object) {
+            task->blocked  = false;
+            task->notified = true;
+            task->wake_seq++;
+            resume_task(task);
+        }
+    }
+}
+
+static void host_halt(sim_node_t *node, const char *reason, bool restart) {
+    host_log_printf(node, 'E', "Halted: %s%s", reason, restart ? ", restarting" : "");
+    node->halts++;
+    node->running = false;
+    node->boot++;
+    radio_reset(node);
+
+    s_dead_tasks.insert(s_dead_tasks.end(), node->tasks.begin(), node->tasks.end());
+    node->tasks.clear();
+    s_dead_modules.push_back(node->module);
+    node->module = NULL;
+    node->api    = NULL;
+
+    if (restart) {
+        sim_at(s_now + SIM_REBOOT_US, [node]() { sim_boot(node); });
+    }
+
+    /* Leave the node's code for good */
+    if (s_current_task != NULL && s_current_task->node == node) {
+        s_current_task = NULL;
+        setcontext(&s_scheduler_context);
+    }
+    if (s_in_call) {
+        longjmp(s_call_jmp, 1);
+    }
+}
+
+void sim_call(sim_node_t *node, uint32_t boot, const std::function<void()> &fn) {
+    if (!node->running || node->boot != boot) { return; }
+
+    s_in_call = true;
+    if (setjmp(s_call_jmp) == 0) {
+        fn();
+    }
+    s_in_call = false;
+    observe(node);
+}
+
+/* The rest of the host interface */
+
+static int64_t host_local_time_us(sim_node_t *node) {
+    return sim_local_time(node, s_now);
+}
+
+static uint32_t host_random(sim_node_t *node) {
+    /* splitmix64 */
+    uint64_t z = (node->rng += 0x9e3779b97f4a7c15);
+    z          = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z          = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return (uint32_t)(z ^ (z >> 31));
+}
+
+static void host_log(sim_node_t *node, char level, const char *message) {
+    host_log_printf(node, level, "%s", message);
+}
+
+static bool host_button_pressed(sim_node_t *node) {
+    return node->button;
+}
+
+static uint8_t *host_eeprom(sim_node_t *node, size_t size) {
+    if (node->eeprom.size() < size) {
+        node->eeprom.resize(size, 0xFF); // Erased flash
+    }
+    return node->eeprom.data();
+}
+
+static const sim_host_api_t s_host_api = {
+    .local_time_us   = host_local_time_us,
+    .random          = host_random,
+    .log             = host_log,
+    .task_create     = host_task_create,
+    .in_task         = host_in_task,
+    .current_task    = host_current_task,
+    .block           = host_block,
+    .notify          = host_notify,
+    .halt            = host_halt,
+    .send            = radio_send,
+    .set_channel     = radio_set_channel,
+    .set_long_range  = radio_set_long_range,
+    .set_wake_window = radio_set_wake_window,
+    .button_pressed  = host_button_pressed,
+    .eeprom          = host_eeprom,
+};
+
+/* Nodes */
+
+void sim_init(const char *module_path, uint64_t seed, sim_observer_t observer) {
+    s_rng.seed(seed);
+    s_observer = observer;
+
+    FILE *file = fopen(module_path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Cannot open %s\n", module_path);
+        exit(1);
+    }
+    char buffer[65536];
+    size_t len;
+    while ((len = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        s_module_image.append(buffer, len);
+    }
+    fclose(file);
+
+    if (mkdtemp(s_module_dir) == NULL) {
+        perror(s_module_dir);
+        exit(1);
+    }
+    atexit([]() { rmdir(s_module_dir); });
+}
+
+void sim_set_log(char level, int node) {
+    s_log_level = level;
+    s_log_node  = node;
+}
+
+sim_node_t *sim_add_node(const sim_node_config_t *config, double drift, double x, double y) {
+    sim_node_t *node = new sim_node_t();
+    node->index      = sim_nodes.size();
+    node->config     = *config;
+    node->drift      = drift;
+    node->x          = x;
+    node->y          = y;
+    node->rng        = s_rng();
+    sim_nodes.push_back(node);
+    return node;
+}
+
+sim_node_t *sim_find_node(const uint8_t *mac_addr) {
+    for (sim_node_t *node : sim_nodes) {
+        if (memcmp(node->config.mac_addr, mac_addr, SIM_MAC_LEN) == 0) {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+/* Every boot gets a fresh copy of the module. dlopen() loads a file only once (recognizing it by its name and inode), so
+ * each copy is a file of its own, removed again once loaded. */
+static void *load_module(const sim_node_t *node) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/node-%u-%u.so", s_module_dir, node->index, node->boot);
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL || fwrite(s_module_image.data(), 1, s_module_image.size(), file) != s_module_image.size() || fclose(file) != 0) {
+        perror(path);
+        exit(1);
+    }
+
+    void *module = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    unlink(path);
+    if (module == NULL) {
+        fprintf(stderr, "dlopen: %s\n", dlerror());
+        exit(1);
+    }
+    return module;
+}
+
+void sim_boot(sim_node_t *node) {
+    node->boot++;
+    node->boot_at = s_now;
+    node->running = true;
+    memset(&node->observation, 0, sizeof(sim_node_observation_t));
+    radio_reset(node);
+
+    node->module            = load_module(node);
+    sim_node_bind_fn_t bind = (sim_node_bind_fn_t)dlsym(node->module, SIM_NODE_BIND_SYMBOL);
+    if (bind == NULL) {
+        fprintf(stderr, "dlsym: %s\n", dlerror());
+        exit(1);
+    }
+    node->api = bind(&s_host_api, node, &node->config);
+
+    host_task_create(node, node->api->main, NULL, "main");
+}
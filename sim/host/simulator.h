@@ -0,0 +1,76 @@
+#pragma once
+
+#include "sim_api.h"
+#include "radio.h"
+#include <functional>
+#include <vector>
+#include <ucontext.h>
+
+/* Discrete-event core of the simulator: virtual time, the nodes with their module copies, and their tasks */
+
+typedef int64_t sim_time_t; // [us] Virtual time since the start of the simulation
+
+#define SIM_REBOOT_US 300000 // Time a restarting node takes until its setup() runs again
+
+struct sim_task_t {
+    sim_node_t *node;
+    ucontext_t context;
+    void *stack;
+    void (*fn)(void *);
+    void *arg;
+    char name[16];
+    const void *waiting_on; // Object passed to block(), NULL: only the timeout wakes the task
+    bool blocked;
+    bool notified;
+    uint32_t wake_seq;      // Invalidates pending timeouts once the task was woken otherwise
+};
+
+struct sim_node {
+    uint16_t index;
+    sim_node_config_t config;
+    double drift; // Of the node's clock (1e-6: 1 ppm fast)
+    double x, y;  // [m] Position
+    uint64_t rng;
+
+    /* Current boot */
+    bool running;
+    uint32_t boot; // Counts (re)starts, events of a previous boot are dropped
+    sim_time_t boot_at;
+    void *module;
+    const sim_node_api_t *api;
+    std::vector<sim_task_t *> tasks;
+
+    std::vector<uint8_t> eeprom; // Survives restarts
+    bool button;
+    sim_node_observation_t observation;
+    uint32_t halts;
+
+    sim_radio_t radio;
+};
+
+/* Called whenever the observation of a node changed, with the previous one */
+typedef void (*sim_observer_t)(sim_node_t *node, const sim_node_observation_t *previous);
+
+extern std::vector<sim_node_t *> sim_nodes;
+
+void sim_init(const char *module_path, uint64_t seed, sim_observer_t observer);
+void sim_set_log(char level, int node); // node < 0: all nodes
+
+sim_node_t *sim_add_node(const sim_node_config_t *config, double drift, double x, double y);
+void sim_boot(sim_node_t *node);
+sim_node_t *sim_find_node(const uint8_t *mac_addr);
+
+sim_time_t sim_now();
+void sim_at(sim_time_t time, std::function<void()> fn);
+/* Runs events until time (or until done() returns true after an event). Returns whether done() stopped it. */
+bool sim_run_until(sim_time_t time, const std::function<bool()> &done = nullptr);
+/* Calls into a node outside of its tasks (like the WiFi driver does), if it is still in the given boot */
+void sim_call(sim_node_t *node, uint32_t boot, const std::function<void()> &fn);
+
+int64_t sim_local_time(const sim_node_t *node, sim_time_t time);
+sim_time_t sim_duration(const sim_node_t *node, int64_t local_us); // Virtual time a duration of the node's clock takes
+
+/* Random numbers of the simulator (the nodes have their own) */
+double sim_uniform();  // [0, 1)
+double sim_normal();   // Standard normal
+uint32_t sim_random(uint32_t max); // [0, max)
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Backed by the simulator, the contents survive restarts of the node */
+class EEPROMClass {
+  public:
+    bool begin(size_t size);
+    size_t readBytes(int address, void *value, size_t len);
+    size_t writeBytes(int address, const void *value, size_t len);
+    bool commit();
+
+  private:
+    uint8_t *data = nullptr;
+    size_t size   = 0;
+};
+
+extern EEPROMClass EEPROM;
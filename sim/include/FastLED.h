@@ -0,0 +1,70 @@
+#pragma once
+
+/* Just enough of FastLED for the firmware to compile, nothing is displayed in the simulator */
+
+#include "Arduino.h"
+
+typedef uint8_t fract8;
+
+struct CRGB {
+    union {
+        struct {
+            uint8_t r, g, b;
+        };
+        uint8_t raw[3];
+    };
+
+    enum HTMLColorCode {
+        Red       = 0xFF0000,
+        Yellow    = 0xFFFF00,
+        OrangeRed = 0xFF4500,
+        Green     = 0x008000,
+        Teal      = 0x008080,
+        Blue      = 0x0000FF,
+        Navy      = 0x000080,
+        Purple    = 0x800080,
+        White     = 0xFFFFFF,
+    };
+
+    CRGB() : r(0), g(0), b(0) {}
+    CRGB(uint8_t r, uint8_t g, uint8_t b) : r(r), g(g), b(b) {}
+    CRGB(uint32_t c) : r(c >> 16), g(c >> 8), b(c) {}
+    CRGB(HTMLColorCode c) : CRGB((uint32_t)c) {}
+
+    CRGB &nscale8_video(uint8_t scale) { return *this; }
+    CRGB scale8(uint8_t scale) const { return *this; }
+    CRGB lerp8(const CRGB &other, fract8 frac) const { return *this; }
+};
+
+void fill_solid(CRGB *leds, int num, const CRGB &color);
+uint8_t sin8(uint8_t theta);
+
+class CFastLED {
+  public:
+    void setBrightness(uint8_t brightness) {}
+    void show() {}
+};
+extern CFastLED FastLED;
+
+class CEveryNMillis {
+  public:
+    unsigned long mPrevTrigger;
+    unsigned long mPeriod;
+
+    CEveryNMillis(unsigned long period) : mPrevTrigger(millis()), mPeriod(period) {}
+
+    bool ready() {
+        unsigned long time = millis();
+        if (time - mPrevTrigger < mPeriod) { return false; }
+        mPrevTrigger = time;
+        return true;
+    }
+    void reset() { mPrevTrigger = millis(); }
+    operator bool() { return ready(); }
+};
+
+#define EVERY_N_CONCAT_(x, y)     x##y
+#define EVERY_N_CONCAT(x, y)      EVERY_N_CONCAT_(x, y)
+#define EVERY_N_MILLIS(N)         EVERY_N_MILLIS_I(EVERY_N_CONCAT(every_n_, __COUNTER__), N)
+#define EVERY_N_MILLIS_I(NAME, N) static CEveryNMillis NAME(N); if (NAME)
+#define EVERY_N_SECONDS(N)        EVERY_N_MILLIS((N) * 1000)
@@ -0,0 +1,3 @@
+#pragma once
+
+/* The simulated nodes have no USB, CONFIG_TINYUSB_ENABLED is never set */
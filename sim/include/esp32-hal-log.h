@@ -0,0 +1,11 @@
+#pragma once
+
+/* Log output goes to the simulator, which prefixes it with the time and the node */
+
+void sim_log(char level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+#define log_e(format, ...) sim_log('E', format, ##__VA_ARGS__)
+#define log_w(format, ...) sim_log('W', format, ##__VA_ARGS__)
+#define log_i(format, ...) sim_log('I', format, ##__VA_ARGS__)
+#define log_d(format, ...) sim_log('D', format, ##__VA_ARGS__)
+#define log_v(format, ...) sim_log('V', format, ##__VA_ARGS__)
@@ -0,0 +1,5 @@
+#pragma once
+
+#include "esp_rom_crc.h"
+
+static inline uint32_t esp_crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len) { return esp_rom_crc32_le(crc, buf, len); }
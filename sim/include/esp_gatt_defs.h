@@ -0,0 +1,3 @@
+#pragma once
+
+#define ESP_GATT_MAX_ATTR_LEN 512
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_event.h"
+
+typedef enum { WIFI_IF_STA = 0, WIFI_IF_AP } wifi_interface_t;
+typedef enum { WIFI_MODE_NULL = 0, WIFI_MODE_STA, WIFI_MODE_AP, WIFI_MODE_APSTA } wifi_mode_t;
+typedef enum { WIFI_SECOND_CHAN_NONE = 0, WIFI_SECOND_CHAN_ABOVE, WIFI_SECOND_CHAN_BELOW } wifi_second_chan_t;
+typedef enum { WIFI_STORAGE_FLASH, WIFI_STORAGE_RAM } wifi_storage_t;
+typedef enum { WIFI_PKT_MGMT, WIFI_PKT_CTRL, WIFI_PKT_DATA, WIFI_PKT_MISC } wifi_promiscuous_pkt_type_t;
+typedef enum { WIFI_PHY_RATE_1M_L = 0x00, WIFI_PHY_RATE_LORA_250K = 0x29, WIFI_PHY_RATE_LORA_500K = 0x2A } wifi_phy_rate_t;
+
+#define WIFI_PROTOCOL_11B            1
+#define WIFI_PROTOCOL_11G            2
+#define WIFI_PROTOCOL_11N            4
+#define WIFI_PROTOCOL_LR             8
+#define WIFI_PROMIS_FILTER_MASK_MGMT 1
+
+typedef struct {
+    signed rssi : 8;
+    unsigned rate : 5;
+    unsigned : 19;
+    unsigned channel : 4;
+    unsigned : 28;
+    unsigned sig_len : 12;
+    unsigned : 20;
+} wifi_pkt_rx_ctrl_t;
+
+typedef struct {
+    wifi_pkt_rx_ctrl_t rx_ctrl;
+    uint8_t payload[0];
+} wifi_promiscuous_pkt_t;
+
+typedef struct {
+    uint32_t filter_mask;
+} wifi_promiscuous_filter_t;
+
+typedef struct {
+    uint8_t *ssid;
+    uint8_t *bssid;
+    uint8_t channel;
+    bool show_hidden;
+} wifi_scan_config_t;
+
+typedef struct {
+    uint8_t bssid[6];
+    uint8_t ssid[33];
+    uint8_t primary;
+    wifi_second_chan_t second;
+    int8_t rssi;
+} wifi_ap_record_t;
+
+extern const esp_event_base_t WIFI_EVENT;
+
+typedef enum {
+    WIFI_EVENT_WIFI_READY = 0,
+    WIFI_EVENT_SCAN_DONE,
+} wifi_event_t;
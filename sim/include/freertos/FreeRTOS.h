@@ -0,0 +1,30 @@
+#pragma once
+
+/* FreeRTOS on top of the simulator's tasks (see sim_api.h), or of threads in the Linux processes (sim/posix). Critical
+ * sections are global, as on a single core. The simulator never preempts its tasks, so there they are empty. */
+
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t; // As in the ESP-IDF ports
+typedef unsigned int UBaseType_t;
+
+#define pdTRUE             1
+#define pdFALSE            0
+#define pdPASS             pdTRUE
+#define portMAX_DELAY      (TickType_t)0xffffffffUL
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms)  ((TickType_t)(ms) / portTICK_PERIOD_MS)
+
+typedef struct {
+    int unused;
+} portMUX_TYPE;
+
+void sim_enter_critical(void);
+void sim_exit_critical(void);
+
+#define portMUX_INITIALIZER_UNLOCKED { 0 }
+#define portENTER_CRITICAL(mux)      ((void)(mux), sim_enter_critical())
+#define portEXIT_CRITICAL(mux)       ((void)(mux), sim_exit_critical())
+
+#define configUSE_TRACE_FACILITY     0
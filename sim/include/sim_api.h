@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Interface between the simulator (host) and a simulated node.
+ *
+ * The firmware of a node is built into a shared module together with the shims in sim/node, which implement the Arduino,
+ * FreeRTOS and ESP-NOW APIs on top of sim_host_api_t. The host loads a private copy of the module per node, so every node
+ * has its own globals, and binds it with sim_node_bind(). Everything the node does runs in the tasks the host creates for
+ * it, or in the callbacks of sim_node_api_t, one at a time and in virtual time. */
+
+#define SIM_MAC_LEN 6
+
+typedef struct sim_node sim_node_t; // Opaque for the module
+
+typedef struct {
+    uint8_t mac_addr[SIM_MAC_LEN];
+    bool controller;       // Externally powered, i.e. a controller
+    bool button_interrupt; // The host calls sim_node_api_t::button_changed, the button is not polled
+    uint32_t loop_ms;      // Longest the main loop blocks, i.e. the period the button is polled at
+} sim_node_config_t;
+
+typedef struct {
+    /* Time and randomness */
+    int64_t (*local_time_us)(sim_node_t *node); // The node's clock since its boot (with drift)
+    uint32_t (*random)(sim_node_t *node);
+    void (*log)(sim_node_t *node, char level, const char *message);
+
+    /* Tasks. block() suspends the calling task until notify() is called with the same object, or until the timeout
+     * (local time, < 0: none) passed. Returns true if notified. Outside of a task, it returns false right away. Tasks are
+     * identified by the handle task_create() returns. */
+    void *(*task_create)(sim_node_t *node, void (*fn)(void *), void *arg, const char *name);
+    bool (*in_task)(sim_node_t *node);
+    void *(*current_task)(sim_node_t *node); // NULL outside of a task
+    bool (*block)(sim_node_t *node, const void *object, int64_t timeout_us);
+    void (*notify)(sim_node_t *node, const void *object);
+    /* Stops the node (never returns to the caller), restarting it if restart is set */
+    void (*halt)(sim_node_t *node, const char *reason, bool restart);
+
+    /* Radio. send() returns an esp_err_t, the outcome is reported through sim_node_api_t::send_done. */
+    int (*send)(sim_node_t *node, const uint8_t *dst, const uint8_t *data, size_t len);
+    void (*set_channel)(sim_node_t *node, uint8_t channel); // 0: not listening (scanning)
+    void (*set_long_range)(sim_node_t *node, bool long_range);
+    void (*set_wake_window)(sim_node_t *node, uint16_t window_ms, uint16_t interval_ms);
+
+    /* Hardware */
+    bool (*button_pressed)(sim_node_t *node);
+    uint8_t *(*eeprom)(sim_node_t *node, size_t size); // Kept across restarts
+} sim_host_api_t;
+
+/* What the host observes of a node after every step */
+typedef struct {
+    uint8_t known_peers; // Peers with a valid version in the peer table (not counting ourselves)
+    bool time_synced;    // Whether the node shares the network time (see timesync.h)
+    uint8_t mode;        // node_mode_t
+    uint8_t mode_state;  // node_state_default_t in MODE_DEFAULT
+    bool round_decided;  // Whether the last buzz round has been decided
+    uint8_t winner[SIM_MAC_LEN];
+    uint8_t channel;
+} sim_node_observation_t;
+
+typedef struct {
+    /* Runs setup() and then loop() forever, in the node's main task */
+    void (*main)(void *arg);
+    /* Called by the WiFi "task" */
+    void (*receive)(const uint8_t *src, const uint8_t *data, int len, int8_t rssi);
+    void (*send_done)(const uint8_t *dst, bool success);
+    /* The GPIO interrupt of the button, after button_pressed() changed (with sim_node_config_t::button_interrupt) */
+    void (*button_changed)();
+
+    void (*observe)(sim_node_observation_t *observation);
+} sim_node_api_t;
+
+typedef const sim_node_api_t *(*sim_node_bind_fn_t)(const sim_host_api_t *host, sim_node_t *node, const sim_node_config_t *config);
+#define SIM_NODE_BIND_SYMBOL "sim_node_bind"
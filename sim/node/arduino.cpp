@@ -0,0 +1,125 @@
+#include "sim_node.h"
+#include "_config.h"
+#include <Arduino.h>
+#include <stdarg.h>
+#include "esp_mac.h"
+#include "esp_random.h"
+#include "esp_rom_crc.h"
+
+static int64_t local_time_us() {
+    /* Static initializers run before the module is bound, that is at boot */
+    return sim_host != NULL ? sim_host->local_time_us(sim_self) : 0;
+}
+
+/* Arduino core */
+
+unsigned long millis() {
+    return local_time_us() / 1000;
+}
+
+unsigned long micros() {
+    return local_time_us();
+}
+
+void delay(uint32_t ms) {
+    vTaskDelay(pdMS_TO_TICKS(ms));
+}
+
+long random(long max) {
+    return max <= 0 ? 0 : sim_host->random(sim_self) % max;
+}
+
+long random(long min, long max) {
+    return min >= max ? min : min + random(max - min);
+}
+
+int digitalRead(uint8_t pin) {
+    /* The buttons are active low */
+    return pin == BUZZER_BUTTON_PIN && sim_host->button_pressed(sim_self) ? LOW : HIGH;
+}
+
+void digitalWrite(uint8_t pin, uint8_t val) {}
+
+void pinMode(uint8_t pin, uint8_t mode) {}
+
+void sim_log(char level, const char *format, ...) {
+    char message[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    sim_host->log(sim_self, level, message);
+}
+
+/* ESP-IDF system functions */
+
+int64_t esp_timer_get_time(void) {
+    return local_time_us();
+}
+
+uint32_t esp_random(void) {
+    return sim_host->random(sim_self);
+}
+
+esp_err_t esp_base_mac_addr_get(uint8_t *mac) {
+    memcpy(mac, sim_config.mac_addr, SIM_MAC_LEN);
+    return ESP_OK;
+}
+
+void esp_restart(void) {
+    sim_host->halt(sim_self, "esp_restart()", true);
+}
+
+const char *esp_err_to_name(esp_err_t code) {
+    switch (code) {
+        case ESP_OK: return "ESP_OK";
+        case ESP_FAIL: return "ESP_FAIL";
+        case ESP_ERR_NO_MEM: return "ESP_ERR_NO_MEM";
+        case ESP_ERR_INVALID_ARG: return "ESP_ERR_INVALID_ARG";
+        case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+        case ESP_ERR_INVALID_SIZE: return "ESP_ERR_INVALID_SIZE";
+        case ESP_ERR_NOT_FOUND: return "ESP_ERR_NOT_FOUND";
+        case ESP_ERR_NOT_SUPPORTED: return "ESP_ERR_NOT_SUPPORTED";
+        case ESP_ERR_TIMEOUT: return "ESP_ERR_TIMEOUT";
+        case ESP_ERR_ESPNOW_NOT_INIT: return "ESP_ERR_ESPNOW_NOT_INIT";
+        case ESP_ERR_ESPNOW_ARG: return "ESP_ERR_ESPNOW_ARG";
+        case ESP_ERR_ESPNOW_NO_MEM: return "ESP_ERR_ESPNOW_NO_MEM";
+        case ESP_ERR_ESPNOW_FULL: return "ESP_ERR_ESPNOW_FULL";
+        case ESP_ERR_ESPNOW_NOT_FOUND: return "ESP_ERR_ESPNOW_NOT_FOUND";
+        case ESP_ERR_ESPNOW_INTERNAL: return "ESP_ERR_ESPNOW_INTERNAL";
+        case ESP_ERR_ESPNOW_EXIST: return "ESP_ERR_ESPNOW_EXIST";
+        case ESP_ERR_ESPNOW_IF: return "ESP_ERR_ESPNOW_IF";
+        default: return "UNKNOWN ERROR";
+    }
+}
+
+void _esp_error_check_failed(esp_err_t rc, const char *file, int line, const char *function, const char *expression) {
+    char reason[256];
+    snprintf(reason, sizeof(reason), "ESP_ERROR_CHECK failed: esp_err_t 0x%x (%s) at %s:%d (%s): %s", rc, esp_err_to_name(rc), file, line, function, expression);
+    /* The real node aborts and reboots */
+    sim_host->halt(sim_self, reason, true);
+}
+
+/* The ROM CRC functions, with their inversion of the initial value and the result */
+
+uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len) {
+    crc = ~crc;
+    while (len--) {
+        crc ^= *buf++;
+        for (uint8_t i = 0; i < 8; i++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+        }
+    }
+    return ~crc;
+}
+
+uint16_t esp_rom_crc16_be(uint16_t crc, const uint8_t *buf, uint32_t len) {
+    crc = ~crc;
+    while (len--) {
+        crc ^= (uint16_t)*buf++ << 8;
+        for (uint8_t i = 0; i < 8; i++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return ~crc;
+}
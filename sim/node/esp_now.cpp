@@ -0,0 +1,315 @@
+#include "sim_node.h"
+#include <string.h>
+#include "esp_now.h"
+#include "esp_wifi.h"
+#include "esp_event.h"
+#include "esp_netif.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+
+/* ESP-NOW and the bits of WiFi the firmware uses, on top of the host's radio */
+
+#define SCAN_DURATION_MS 1300 // All 13 channels, as the real driver does
+
+static const uint8_t BROADCAST_MAC[ESP_NOW_ETH_ALEN] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+
+static bool s_initialized;
+static esp_now_recv_cb_t s_recv_cb;
+static esp_now_send_cb_t s_send_cb;
+
+static esp_now_peer_info_t s_peers[ESP_NOW_MAX_TOTAL_PEER_NUM];
+static bool s_peer_used[ESP_NOW_MAX_TOTAL_PEER_NUM];
+static int s_fetch_index;
+
+static uint8_t s_channel = 1;
+static bool s_wifi_started;
+static bool s_promiscuous;
+static wifi_promiscuous_cb_t s_promiscuous_cb;
+static uint16_t s_wake_interval_ms = 100;
+static bool s_scanning;
+static QueueHandle_t s_scan_requests; // To the event loop task
+static esp_event_handler_t s_scan_done_handler;
+static void *s_scan_done_arg;
+
+const esp_event_base_t WIFI_EVENT = "WIFI_EVENT";
+
+static int find_peer(const uint8_t *peer_addr) {
+    for (int i = 0; i < ESP_NOW_MAX_TOTAL_PEER_NUM; i++) {
+        if (s_peer_used[i] && memcmp(s_peers[i].peer_addr, peer_addr, ESP_NOW_ETH_ALEN) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* A management frame as the promiscuous callback sees it: an action frame carrying the Espressif OUI */
+typedef struct {
+    wifi_pkt_rx_ctrl_t rx_ctrl;
+    uint8_t frame_ctrl[2];
+    uint8_t duration_id[2];
+    uint8_t addr1[6];
+    uint8_t addr2[6];
+    uint8_t addr3[6];
+    uint8_t sequence_ctrl[2];
+    uint8_t category_code;
+    uint8_t oui[3];
+} __attribute__((packed)) sim_action_frame_t;
+
+void sim_espnow_receive(const uint8_t *src, const uint8_t *data, int len, int8_t rssi) {
+    if (s_promiscuous && s_promiscuous_cb != NULL) {
+        sim_action_frame_t frame = {};
+        frame.rx_ctrl.rssi       = rssi;
+        frame.rx_ctrl.channel    = s_channel;
+        frame.rx_ctrl.sig_len    = sizeof(sim_action_frame_t) - sizeof(wifi_pkt_rx_ctrl_t) + len;
+        frame.frame_ctrl[0]      = 0xd0;
+        frame.category_code      = 127; // Vendor specific
+        frame.oui[0]             = 0x18;
+        frame.oui[1]             = 0xfe;
+        frame.oui[2]             = 0x34;
+        memcpy(frame.addr1, BROADCAST_MAC, ESP_NOW_ETH_ALEN);
+        memcpy(frame.addr2, src, ESP_NOW_ETH_ALEN);
+        memcpy(frame.addr3, BROADCAST_MAC, ESP_NOW_ETH_ALEN);
+        s_promiscuous_cb(&frame, WIFI_PKT_MGMT);
+    }
+
+    if (s_initialized && s_recv_cb != NULL) {
+        s_recv_cb(src, data, len);
+    }
+}
+
+void sim_espnow_send_done(const uint8_t *dst, bool success) {
+    if (s_initialized && s_send_cb != NULL) {
+        s_send_cb(dst, success ? ESP_NOW_SEND_SUCCESS : ESP_NOW_SEND_FAIL);
+    }
+}
+
+/* ESP-NOW */
+
+esp_err_t esp_now_init(void) {
+    if (!s_wifi_started) {
+        return ESP_ERR_ESPNOW_IF;
+    }
+    s_initialized = true;
+    return ESP_OK;
+}
+
+esp_err_t esp_now_deinit(void) {
+    s_initialized = false;
+    s_recv_cb     = NULL;
+    s_send_cb     = NULL;
+    memset(s_peer_used, 0, sizeof(s_peer_used));
+    return ESP_OK;
+}
+
+esp_err_t esp_now_register_recv_cb(esp_now_recv_cb_t cb) {
+    if (!s_initialized) { return ESP_ERR_ESPNOW_NOT_INIT; }
+    s_recv_cb = cb;
+    return ESP_OK;
+}
+
+esp_err_t esp_now_register_send_cb(esp_now_send_cb_t cb) {
+    if (!s_initialized) { return ESP_ERR_ESPNOW_NOT_INIT; }
+    s_send_cb = cb;
+    return ESP_OK;
+}
+
+esp_err_t esp_now_send(const uint8_t *peer_addr, const uint8_t *data, size_t len) {
+    if (!s_initialized) { return ESP_ERR_ESPNOW_NOT_INIT; }
+    if (peer_addr == NULL || data == NULL || len == 0 || len > ESP_NOW_MAX_DATA_LEN) { return ESP_ERR_ESPNOW_ARG; }
+    if (find_peer(peer_addr) < 0) { return ESP_ERR_ESPNOW_NOT_FOUND; }
+
+    return sim_host->send(sim_self, peer_addr, data, len);
+}
+
+esp_err_t esp_now_add_peer(const esp_now_peer_info_t *peer) {
+    if (!s_initialized) { return ESP_ERR_ESPNOW_NOT_INIT; }
+    if (peer == NULL) { return ESP_ERR_ESPNOW_ARG; }
+    if (find_peer(peer->peer_addr) >= 0) { return ESP_ERR_ESPNOW_EXIST; }
+
+    for (int i = 0; i < ESP_NOW_MAX_TOTAL_PEER_NUM; i++) {
+        if (!s_peer_used[i]) {
+            s_peers[i]     = *peer;
+            s_peer_used[i] = true;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_ESPNOW_FULL;
+}
+
+esp_err_t esp_now_del_peer(const uint8_t *peer_addr) {
+    if (!s_initialized) { return ESP_ERR_ESPNOW_NOT_INIT; }
+
+    int i = find_peer(peer_addr);
+    if (i < 0) { return ESP_ERR_ESPNOW_NOT_FOUND; }
+    s_peer_used[i] = false;
+    return ESP_OK;
+}
+
+/* Like the real driver, skips the broadcast peer */
+esp_err_t esp_now_fetch_peer(bool from_head, esp_now_peer_info_t *peer) {
+    if (!s_initialized) { return ESP_ERR_ESPNOW_NOT_INIT; }
+    if (from_head) {
+        s_fetch_index = 0;
+    }
+
+    for (; s_fetch_index < ESP_NOW_MAX_TOTAL_PEER_NUM; s_fetch_index++) {
+        if (s_peer_used[s_fetch_index] && memcmp(s_peers[s_fetch_index].peer_addr, BROADCAST_MAC, ESP_NOW_ETH_ALEN) != 0) {
+            *peer = s_peers[s_fetch_index++];
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_ESPNOW_NOT_FOUND;
+}
+
+bool esp_now_is_peer_exist(const uint8_t *peer_addr) {
+    return find_peer(peer_addr) >= 0;
+}
+
+esp_err_t esp_now_get_peer_num(esp_now_peer_num_t *num) {
+    if (!s_initialized) { return ESP_ERR_ESPNOW_NOT_INIT; }
+
+    num->total_num   = 0;
+    num->encrypt_num = 0;
+    for (int i = 0; i < ESP_NOW_MAX_TOTAL_PEER_NUM; i++) {
+        if (s_peer_used[i]) {
+            num->total_num++;
+            num->encrypt_num += s_peers[i].encrypt;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_now_set_pmk(const uint8_t *pmk) {
+    return s_initialized ? ESP_OK : ESP_ERR_ESPNOW_NOT_INIT;
+}
+
+esp_err_t esp_now_set_wake_window(uint16_t window) {
+    if (!s_initialized) { return ESP_ERR_ESPNOW_NOT_INIT; }
+    sim_host->set_wake_window(sim_self, window, s_wake_interval_ms);
+    return ESP_OK;
+}
+
+/* WiFi */
+
+esp_err_t esp_netif_init(void) {
+    return ESP_OK;
+}
+
+/* Only runs the scans that do not block */
+static void event_loop_task(void *arg) {
+    while (true) {
+        uint8_t request;
+        xQueueReceive(s_scan_requests, &request, portMAX_DELAY);
+        vTaskDelay(pdMS_TO_TICKS(SCAN_DURATION_MS));
+        if (!s_scanning) { continue; } // Stopped
+
+        s_scanning = false;
+        sim_host->set_channel(sim_self, s_channel);
+        if (s_scan_done_handler != NULL) {
+            s_scan_done_handler(s_scan_done_arg, WIFI_EVENT, WIFI_EVENT_SCAN_DONE, NULL);
+        }
+    }
+}
+
+esp_err_t esp_event_loop_create_default(void) {
+    s_scan_requests = xQueueCreate(1, sizeof(uint8_t));
+    xTaskCreate(event_loop_task, "sys_evt", 2048, NULL, 20, NULL);
+    return ESP_OK;
+}
+
+esp_err_t esp_event_handler_register(esp_event_base_t event_base, int32_t event_id, esp_event_handler_t event_handler, void *event_handler_arg) {
+    if (event_base != WIFI_EVENT || event_id != WIFI_EVENT_SCAN_DONE) { return ESP_ERR_NOT_SUPPORTED; }
+
+    s_scan_done_handler = event_handler;
+    s_scan_done_arg     = event_handler_arg;
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_init(const wifi_init_config_t *config) {
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_storage(wifi_storage_t storage) {
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_mode(wifi_mode_t mode) {
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_start(void) {
+    s_wifi_started = true;
+    sim_host->set_channel(sim_self, s_channel);
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_channel(uint8_t primary, wifi_second_chan_t second) {
+    if (primary < 1 || primary > 13) { return ESP_ERR_INVALID_ARG; }
+
+    s_channel = primary;
+    if (s_wifi_started) {
+        sim_host->set_channel(sim_self, s_channel);
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_promiscuous(bool enable) {
+    s_promiscuous = enable;
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_promiscuous_filter(const wifi_promiscuous_filter_t *filter) {
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_promiscuous_rx_cb(wifi_promiscuous_cb_t cb) {
+    s_promiscuous_cb = cb;
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_protocol(wifi_interface_t ifx, uint8_t protocol_bitmap) {
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_config_espnow_rate(wifi_interface_t ifx, wifi_phy_rate_t rate) {
+    sim_host->set_long_range(sim_self, rate == WIFI_PHY_RATE_LORA_250K || rate == WIFI_PHY_RATE_LORA_500K);
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_connectionless_module_set_wake_interval(uint16_t interval) {
+    s_wake_interval_ms = interval;
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_scan_start(const wifi_scan_config_t *config, bool block) {
+    if (!s_wifi_started || s_scanning) { return ESP_ERR_INVALID_STATE; }
+
+    /* The radio hops through the channels and hears none of the nodes meanwhile */
+    sim_host->set_channel(sim_self, 0);
+    if (!block) {
+        uint8_t request = 0;
+        s_scanning      = true;
+        xQueueSend(s_scan_requests, &request, 0);
+        return ESP_OK;
+    }
+    vTaskDelay(pdMS_TO_TICKS(SCAN_DURATION_MS));
+    sim_host->set_channel(sim_self, s_channel);
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_scan_stop(void) {
+    if (s_scanning) {
+        s_scanning = false;
+        sim_host->set_channel(sim_self, s_channel);
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_scan_get_ap_records(uint16_t *number, wifi_ap_record_t *ap_records) {
+    *number = 0;
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_clear_ap_list(void) {
+    return ESP_OK;
+}
@@ -0,0 +1,126 @@
+#include "sim_node.h"
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+
+/* Queues and semaphores on top of the host's block() and notify(). Tasks only switch when they block, so the state needs
+ * no locking. Semaphores are queues of items without data. */
+struct QueueDefinition {
+    UBaseType_t length;
+    UBaseType_t item_size;
+    UBaseType_t count;
+    UBaseType_t head;
+    uint8_t *items;
+};
+
+/* Waits for the object to be notified, at most until ticks after start_us. Returns false once the time is up, or if the
+ * caller cannot wait (i.e. is not a task). */
+static bool wait(const void *object, TickType_t ticks, int64_t start_us) {
+    if (ticks == 0 || !sim_host->in_task(sim_self)) {
+        return false;
+    }
+    if (ticks == portMAX_DELAY) {
+        sim_host->block(sim_self, object, -1);
+        return true;
+    }
+
+    int64_t remaining_us = start_us + (int64_t)ticks * portTICK_PERIOD_MS * 1000 - sim_host->local_time_us(sim_self);
+    if (remaining_us <= 0) {
+        return false;
+    }
+    sim_host->block(sim_self, object, remaining_us);
+    return true;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+    QueueHandle_t queue = (QueueHandle_t)calloc(1, sizeof(QueueDefinition));
+    queue->length       = length;
+    queue->item_size    = item_size;
+    queue->items        = item_size > 0 ? (uint8_t *)malloc(length * item_size) : NULL;
+    return queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks_to_wait) {
+    int64_t start_us = sim_host->local_time_us(sim_self);
+    while (queue->count >= queue->length) {
+        if (!wait(queue, ticks_to_wait, start_us)) { return pdFALSE; }
+    }
+
+    if (queue->item_size > 0) {
+        memcpy(&queue->items[((queue->head + queue->count) % queue->length) * queue->item_size], item, queue->item_size);
+    }
+    queue->count++;
+    sim_host->notify(sim_self, queue);
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks_to_wait) {
+    int64_t start_us = sim_host->local_time_us(sim_self);
+    while (queue->count == 0) {
+        if (!wait(queue, ticks_to_wait, start_us)) { return pdFALSE; }
+    }
+
+    if (queue->item_size > 0) {
+        memcpy(item, &queue->items[queue->head * queue->item_size], queue->item_size);
+    }
+    queue->head = (queue->head + 1) % queue->length;
+    queue->count--;
+    sim_host->notify(sim_self, queue);
+    return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+    return queue->count;
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max_count, UBaseType_t initial_count) {
+    SemaphoreHandle_t semaphore = xQueueCreate(max_count, 0);
+    semaphore->count            = initial_count;
+    return semaphore;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+    return xSemaphoreCreateCounting(1, 1);
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+    return xQueueSend(semaphore, NULL, 0);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks_to_wait) {
+    return xQueueReceive(semaphore, NULL, ticks_to_wait);
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack_depth, void *parameters, UBaseType_t priority, TaskHandle_t *created_task) {
+    void *task = sim_host->task_create(sim_self, fn, parameters, name);
+    if (created_task != NULL) {
+        *created_task = task;
+    }
+    return pdPASS;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) {
+    return sim_host->current_task(sim_self);
+}
+
+void vTaskDelete(TaskHandle_t task) {
+    /* Only used by tasks to end themselves */
+    sim_host->block(sim_self, NULL, -1);
+}
+
+void vTaskDelay(TickType_t ticks) {
+    if (ticks > 0) {
+        sim_host->block(sim_self, NULL, (int64_t)ticks * portTICK_PERIOD_MS * 1000);
+    }
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task) {
+    return UINT16_MAX; // The host's stacks are not the firmware's, nothing to measure
+}
+
+void sim_enter_critical(void) {}
+
+void sim_exit_critical(void) {}
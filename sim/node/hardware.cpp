@@ -0,0 +1,138 @@
+#include "sim_node.h"
+#include "battery.h"
+#include "button.h"
+#include "bluetooth.h"
+#include "led.h"
+#include "nvm.h"
+#include "EEPROM.h"
+#include "modes/IMode.h"
+
+/* Stand-ins for the peripherals of battery.cpp, button.cpp, led.cpp and bluetooth.cpp, which are not part of the simulation */
+
+uint32_t battery_voltage        = 0;
+float battery_percent           = 0;
+uint8_t battery_percent_rounded = 0;
+bool low_battery                = false;
+bool has_external_power         = false;
+
+CRGB leds[NUM_LEDS];
+color_t buzzer_color  = COLOR_ORANGE;
+CRGB buzzer_color_rgb = CRGB::OrangeRed;
+CRGB colors[]         = { CRGB::Red, CRGB::Yellow, CRGB::OrangeRed, CRGB::Green, CRGB::Teal, CRGB::Navy, CRGB::Purple, CRGB::White };
+CRGB baseColor;
+CFastLED FastLED;
+
+EEPROMClass EEPROM;
+
+static bool s_buzzer_pressed = false;
+static QueueHandle_t s_button_edges; // Times of the interrupts
+
+static void button_change(int64_t time_us) {
+    bool pressed = digitalRead(BUZZER_BUTTON_PIN) == LOW;
+    if (pressed != s_buzzer_pressed) {
+        s_buzzer_pressed = pressed;
+        get_current_mode()->onButtonEdge(BUTTON_BUZZER, pressed, time_us);
+        dispatcher_post_button(BUTTON_BUZZER, pressed, time_us, true);
+    }
+}
+
+/* The button task without debouncing, the simulated contacts do not bounce */
+static void button_task(void *arg) {
+    int64_t time_us;
+    while (true) {
+        if (xQueueReceive(s_button_edges, &time_us, portMAX_DELAY) == pdTRUE) {
+            button_change(time_us);
+        }
+    }
+}
+
+void sim_button_changed() {
+    if (s_button_edges == NULL) {
+        return; // Still booting, button_setup() reads the level
+    }
+    int64_t time_us = esp_timer_get_time();
+    xQueueSend(s_button_edges, &time_us, 0);
+}
+
+void sim_button_poll() {
+    button_change(esp_timer_get_time());
+}
+
+void sim_hardware_setup() {
+    /* Controllers run on USB power, buzzers on a charged battery */
+    has_external_power      = sim_config.controller;
+    battery_voltage         = sim_config.controller ? BAT_VOLTAGE_EXTERNAL_POWER + 100 : BAT_VOLTAGE_100_PCT;
+    battery_percent         = 1;
+    battery_percent_rounded = 100;
+
+    buzzer_color     = nvm_data.color;
+    buzzer_color_rgb = CRGB(nvm_data.rgb[0], nvm_data.rgb[1], nvm_data.rgb[2]);
+    baseColor        = buzzer_color == COLOR_RGB ? buzzer_color_rgb : colors[buzzer_color % COLOR_NUM];
+
+    if (sim_config.button_interrupt) {
+        s_button_edges = xQueueCreate(BUTTON_QUEUE_SIZE, sizeof(int64_t));
+        xTaskCreate(&button_task, "button_task", 3072, NULL, TASK_PRIO_BUTTON, NULL);
+    }
+}
+
+void button_loop() {}
+
+bool button_pressed(button_t button) {
+    return button == BUTTON_BUZZER && s_buzzer_pressed;
+}
+
+void battery_setup() {}
+
+void battery_loop() {}
+
+void shutdown(bool turnOffLEDs, bool allowWakeupWithBuzzer) {
+    sim_host->halt(sim_self, "shutdown()", false);
+}
+
+void led_setup() {}
+
+void fill_solid(CRGB *leds, int num, const CRGB &color) {
+    for (int i = 0; i < num; i++) {
+        leds[i] = color;
+    }
+}
+
+uint8_t sin8(uint8_t theta) {
+    return 128 + 127 * sin(theta * 2 * M_PI / 256);
+}
+
+void bluetooth_init() {}
+
+bool bluetooth_connected() {
+    return false;
+}
+
+void bluetooth_notify_peer_list_changed() {}
+
+void bluetooth_notify_command_delivery(const command_delivery_t *delivery) {}
+
+void bluetooth_set_state(bool state) {}
+
+void bluetooth_loop() {}
+
+bool EEPROMClass::begin(size_t size) {
+    this->data = sim_host->eeprom(sim_self, size);
+    this->size = size;
+    return true;
+}
+
+size_t EEPROMClass::readBytes(int address, void *value, size_t len) {
+    if (address < 0 || address + len > this->size) { return 0; }
+    memcpy(value, &this->data[address], len);
+    return len;
+}
+
+size_t EEPROMClass::writeBytes(int address, const void *value, size_t len) {
+    if (address < 0 || address + len > this->size) { return 0; }
+    memcpy(&this->data[address], value, len);
+    return len;
+}
+
+bool EEPROMClass::commit() {
+    return true;
+}
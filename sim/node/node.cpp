@@ -0,0 +1,69 @@
+#include "sim_node.h"
+#include "comm.h"
+#include "nvm.h"
+#include "channel.h"
+#include "timesync.h"
+#include "modes/IMode.h"
+#include "modes/ModeDefault.h"
+#include "dispatcher.h"
+
+const sim_host_api_t *sim_host;
+sim_node_t *sim_self;
+sim_node_config_t sim_config;
+
+/* setup() and loop() of main.cpp, without the peripherals the simulator has no use for (USB, bluetooth, LEDs) */
+static void node_main(void *arg) {
+    log_i("Starting application...");
+
+    nvm_setup();
+    sim_hardware_setup();
+    dispatcher_setup();
+    mode_setup();
+
+    comm_setup();
+
+    while (true) {
+        if (!sim_config.button_interrupt) {
+            /* There is no button interrupt, so the dispatcher wakes up to poll it */
+            sim_button_poll();
+        }
+        dispatcher_run(pdMS_TO_TICKS(sim_config.loop_ms));
+    }
+}
+
+static void node_observe(sim_node_observation_t *observation) {
+    memset(observation, 0, sizeof(sim_node_observation_t));
+
+    for (uint8_t i = 0; i < PEER_DATA_TABLE_ENTRIES; i++) {
+        const peer_data_t *peer_data = &peer_data_table[i];
+        if (peer_data->valid_version && memcmp(peer_data->mac_addr, my_mac_addr, ESP_NOW_ETH_ALEN) != 0) {
+            observation->known_peers++;
+        }
+    }
+
+    observation->time_synced = timesync_is_synced();
+
+    observation->mode       = nvm_data.mode;
+    observation->mode_state = get_current_mode()->getState().raw;
+    observation->channel    = channel_current();
+
+    if (modeDefault->round_decided && modeDefault->num_claims > 0) {
+        observation->round_decided = true;
+        memcpy(observation->winner, modeDefault->claims[0].mac_addr, ESP_NOW_ETH_ALEN);
+    }
+}
+
+static const sim_node_api_t s_node_api = {
+    .main           = node_main,
+    .receive        = sim_espnow_receive,
+    .send_done      = sim_espnow_send_done,
+    .button_changed = sim_button_changed,
+    .observe        = node_observe,
+};
+
+extern "C" __attribute__((visibility("default"))) const sim_node_api_t *sim_node_bind(const sim_host_api_t *host, sim_node_t *node, const sim_node_config_t *config) {
+    sim_host   = host;
+    sim_self   = node;
+    sim_config = *config;
+    return &s_node_api;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "sim_api.h"
+
+/* State of the node this copy of the module belongs to, set by sim_node_bind() */
+extern const sim_host_api_t *sim_host;
+extern sim_node_t *sim_self;
+extern sim_node_config_t sim_config;
+
+/* Entry points of the radio, called by the host (see esp_now.cpp) */
+void sim_espnow_receive(const uint8_t *src, const uint8_t *data, int len, int8_t rssi);
+void sim_espnow_send_done(const uint8_t *dst, bool success);
+
+/* Entry points of the hardware stubs (see hardware.cpp) */
+void sim_hardware_setup();
+/* Hands changes of the buzzer button to the mode, as the button task does: sim_button_changed() is the interrupt, without
+ * sim_node_config_t::button_interrupt the main loop calls sim_button_poll() instead */
+void sim_button_changed();
+void sim_button_poll();
@@ -0,0 +1,148 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+
+/* Queues and semaphores for tasks running as threads. Semaphores are queues of items without data. */
+struct QueueDefinition {
+    UBaseType_t length;
+    UBaseType_t item_size;
+    UBaseType_t count;
+    UBaseType_t head;
+    uint8_t *items;
+    std::mutex mutex;
+    std::condition_variable changed;
+};
+
+static std::recursive_mutex s_critical;
+
+/* Waits until ready() holds, at most ticks. Returns whether it does. */
+template <typename Predicate>
+static bool wait(QueueHandle_t queue, std::unique_lock<std::mutex> &lock, TickType_t ticks, Predicate ready) {
+    if (ticks == portMAX_DELAY) {
+        queue->changed.wait(lock, ready);
+        return true;
+    }
+    return queue->changed.wait_for(lock, std::chrono::milliseconds((uint64_t)ticks * portTICK_PERIOD_MS), ready);
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+    QueueHandle_t queue = new QueueDefinition();
+    queue->length       = length;
+    queue->item_size    = item_size;
+    queue->items        = item_size > 0 ? (uint8_t *)malloc(length * item_size) : NULL;
+    return queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks_to_wait) {
+    std::unique_lock<std::mutex> lock(queue->mutex);
+    if (!wait(queue, lock, ticks_to_wait, [queue]() { return queue->count < queue->length; })) {
+        return pdFALSE;
+    }
+
+    if (queue->item_size > 0) {
+        memcpy(&queue->items[((queue->head + queue->count) % queue->length) * queue->item_size], item, queue->item_size);
+    }
+    queue->count++;
+    queue->changed.notify_all();
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks_to_wait) {
+    std::unique_lock<std::mutex> lock(queue->mutex);
+    if (!wait(queue, lock, ticks_to_wait, [queue]() { return queue->count > 0; })) {
+        return pdFALSE;
+    }
+
+    if (queue->item_size > 0) {
+        memcpy(item, &queue->items[queue->head * queue->item_size], queue->item_size);
+    }
+    queue->head = (queue->head + 1) % queue->length;
+    queue->count--;
+    queue->changed.notify_all();
+    return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+    std::lock_guard<std::mutex> lock(queue->mutex);
+    return queue->count;
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max_count, UBaseType_t initial_count) {
+    SemaphoreHandle_t semaphore = xQueueCreate(max_count, 0);
+    semaphore->count            = initial_count;
+    return semaphore;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+    return xSemaphoreCreateCounting(1, 1);
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+    return xQueueSend(semaphore, NULL, 0);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks_to_wait) {
+    return xQueueReceive(semaphore, NULL, ticks_to_wait);
+}
+
+typedef struct {
+    TaskFunction_t fn;
+    void *parameters;
+    TaskHandle_t *created_task;
+} task_start_t;
+
+static void *task_main(void *arg) {
+    task_start_t start = *(task_start_t *)arg;
+    delete (task_start_t *)arg;
+    if (start.created_task != NULL) {
+        *start.created_task = xTaskGetCurrentTaskHandle(); // Like FreeRTOS, before the task runs
+    }
+    start.fn(start.parameters);
+    return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack_depth, void *parameters, UBaseType_t priority, TaskHandle_t *created_task) {
+    pthread_t thread;
+    task_start_t *start = new task_start_t{ fn, parameters, created_task };
+    if (pthread_create(&thread, NULL, task_main, start) != 0) {
+        delete start;
+        return pdFALSE;
+    }
+    pthread_setname_np(thread, name);
+    pthread_detach(thread);
+    return pdPASS;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) {
+    return (TaskHandle_t)pthread_self();
+}
+
+void vTaskDelete(TaskHandle_t task) {
+    /* Only used by tasks to end themselves */
+    pthread_exit(NULL);
+}
+
+void vTaskDelay(TickType_t ticks) {
+    struct timespec duration = { (time_t)(ticks * portTICK_PERIOD_MS / 1000), (long)(ticks * portTICK_PERIOD_MS % 1000) * 1000000 };
+    while (nanosleep(&duration, &duration) != 0) {}
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task) {
+    return UINT16_MAX; // The host's stacks are not the firmware's, nothing to measure
+}
+
+void sim_enter_critical(void) {
+    s_critical.lock();
+}
+
+void sim_exit_critical(void) {
+    s_critical.unlock();
+}
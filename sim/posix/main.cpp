@@ -0,0 +1,315 @@
+/* Runs the firmware of a number of nodes as Linux processes on this host, talking to each other by UDP multicast (see
+ * TransportUdp.h). Time is real: the processes can be load tested and profiled with ordinary tools. See README.md. */
+
+#include "sim_api.h"
+#include "esp_err.h"
+#include "esp_now.h"
+#include "esp_wifi.h"
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <mutex>
+#include <random>
+#include <vector>
+
+#define EXIT_RESTART   3   // Exit status of a node that wants to be restarted
+#define REBOOT_MS      300 // From a restart until the node boots again
+#define EEPROM_SIZE    4096
+#define PRESS_DURATION 200 // [ms]
+
+extern "C" const sim_node_api_t *sim_node_bind(const sim_host_api_t *host, sim_node_t *node, const sim_node_config_t *config);
+
+typedef struct {
+    int nodes                  = 1;
+    int controllers            = 1;
+    int first                  = 0;
+    uint64_t seed              = 1;
+    uint32_t loop_ms           = 5;
+    uint32_t boot_spread_ms    = 2000;
+    uint32_t press_interval_ms = 0;
+    uint32_t duration_s        = 0;
+    char log_level             = 'W';
+    int log_node               = -1;
+} options_t;
+
+static options_t s_options;
+
+/* The node this process runs */
+static int s_index;
+static int64_t s_boot_us;
+static uint8_t *s_eeprom; // Shared with the parent, so that it survives restarts
+static std::mt19937 s_rng;
+static std::mutex s_rng_mutex;
+static int64_t s_press_at = -1; // Local time of the next press
+
+static const char LOG_LEVELS[] = "EWIDV";
+
+static int64_t monotonic_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static uint32_t random_below(uint32_t limit) {
+    std::lock_guard<std::mutex> lock(s_rng_mutex);
+    return limit > 0 ? s_rng() % limit : 0;
+}
+
+/* The first nodes started are the controllers */
+static bool is_controller(int index) {
+    return index - s_options.first < s_options.controllers;
+}
+
+/* The host API, for the one node of this process */
+
+static int64_t host_local_time_us(sim_node_t *node) {
+    return monotonic_us() - s_boot_us;
+}
+
+static uint32_t host_random(sim_node_t *node) {
+    std::lock_guard<std::mutex> lock(s_rng_mutex);
+    return s_rng();
+}
+
+static void host_log(sim_node_t *node, char level, const char *message) {
+    const char *l = strchr(LOG_LEVELS, level);
+    if (l == NULL || l > strchr(LOG_LEVELS, s_options.log_level) || (s_options.log_node >= 0 && s_options.log_node != s_index)) {
+        return;
+    }
+    fprintf(stderr, "%10.3f [%3d] %c %s\n", host_local_time_us(node) / 1e6, s_index, level, message);
+}
+
+static void host_halt(sim_node_t *node, const char *reason, bool restart) {
+    fprintf(stderr, "%10.3f [%3d] E Halted: %s\n", host_local_time_us(node) / 1e6, s_index, reason);
+    fflush(stderr);
+    _exit(restart ? EXIT_RESTART : EXIT_SUCCESS);
+}
+
+static int host_send(sim_node_t *node, const uint8_t *dst, const uint8_t *data, size_t len) {
+    /* Frames go through TransportUdp, not ESP-NOW */
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+static void host_set_channel(sim_node_t *node, uint8_t channel) {}
+
+static void host_set_long_range(sim_node_t *node, bool long_range) {}
+
+static void host_set_wake_window(sim_node_t *node, uint16_t window_ms, uint16_t interval_ms) {}
+
+/* Buzzers press their button every press_interval_ms on average */
+static bool host_button_pressed(sim_node_t *node) {
+    if (s_options.press_interval_ms == 0 || is_controller(s_index)) {
+        return false;
+    }
+
+    int64_t now = host_local_time_us(node);
+    if (s_press_at < 0 || now >= s_press_at + PRESS_DURATION * 1000) {
+        std::exponential_distribution<double> interval(1.0 / s_options.press_interval_ms);
+        std::lock_guard<std::mutex> lock(s_rng_mutex);
+        s_press_at = now + (int64_t)(interval(s_rng) * 1000);
+    }
+    return now >= s_press_at;
+}
+
+static uint8_t *host_eeprom(sim_node_t *node, size_t size) {
+    if (size > EEPROM_SIZE) {
+        host_halt(node, "EEPROM too large", false);
+    }
+    return s_eeprom;
+}
+
+/* Tasks are threads (see freertos.cpp), they need none of the simulator's scheduling */
+static const sim_host_api_t s_host = {
+    .local_time_us   = host_local_time_us,
+    .random          = host_random,
+    .log             = host_log,
+    .task_create     = NULL,
+    .in_task         = NULL,
+    .current_task    = NULL,
+    .block           = NULL,
+    .notify          = NULL,
+    .halt            = host_halt,
+    .send            = host_send,
+    .set_channel     = host_set_channel,
+    .set_long_range  = host_set_long_range,
+    .set_wake_window = host_set_wake_window,
+    .button_pressed  = host_button_pressed,
+    .eeprom          = host_eeprom,
+};
+
+static void run_node(int index, uint8_t *eeprom, bool boot_delay) {
+    s_index  = index;
+    s_eeprom = eeprom;
+    s_rng.seed(s_options.seed * 0x9E3779B97F4A7C15ULL + index);
+    if (boot_delay) {
+        usleep(random_below(s_options.boot_spread_ms + 1) * 1000);
+    }
+    s_boot_us = monotonic_us();
+
+    sim_node_config_t config      = {};
+    uint8_t mac_addr[SIM_MAC_LEN] = { 0x02, 0x00, 0x00, 0x00, (uint8_t)(index >> 8), (uint8_t)index }; // Locally administered
+    memcpy(config.mac_addr, mac_addr, SIM_MAC_LEN);
+    config.controller = is_controller(index);
+    config.loop_ms    = s_options.loop_ms;
+
+    const sim_node_api_t *api = sim_node_bind(&s_host, NULL, &config);
+
+    /* channel.cpp, phy.cpp and power_save.cpp still talk to the radio. Its shim (node/esp_now.cpp) does nothing in this
+     * build, but wants to be started like the real driver. */
+    esp_wifi_start();
+    esp_now_init();
+
+    pthread_t main_task;
+    pthread_create(&main_task, NULL, [](void *arg) -> void * { ((const sim_node_api_t *)arg)->main(NULL); return NULL; }, (void *)api);
+
+    if (s_options.duration_s == 0) {
+        pthread_join(main_task, NULL);
+    }
+    sleep(s_options.duration_s);
+
+    sim_node_observation_t observation;
+    api->observe(&observation);
+    printf("Node %3d %02x:%02x:%02x:%02x:%02x:%02x: %s, %u peers, %s, channel %u\n", index, mac_addr[0], mac_addr[1], mac_addr[2],
+           mac_addr[3], mac_addr[4], mac_addr[5], config.controller ? "controller" : "buzzer", observation.known_peers,
+           observation.time_synced ? "synced" : "not synced", observation.channel);
+    fflush(stdout);
+    _exit(EXIT_SUCCESS);
+}
+
+/* The parent: starts a process per node and restarts those that ask for it */
+
+static volatile sig_atomic_t s_stop;
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --nodes N               Nodes to run, a process each (%d)\n"
+            "  --controllers N         The first of these are externally powered controllers (%d)\n"
+            "  --first N               Index of the first node, to run more nodes from another shell (%d)\n"
+            "  --seed N                Seed of all random numbers (%llu)\n"
+            "  --loop-ms MS            Period the nodes poll their button at (%u)\n"
+            "  --boot-spread-ms MS     The nodes are switched on within this time (%u)\n"
+            "  --press-interval-ms MS  Buzzers press their button this often on average, 0: never (%u)\n"
+            "  --duration-s S          Stop after this long and print what the nodes know, 0: run until interrupted (%u)\n"
+            "  --log-level L           Log level of the nodes: E, W, I, D or V (%c)\n"
+            "  --log-node N            Only log this node\n",
+            name, s_options.nodes, s_options.controllers, s_options.first, (unsigned long long)s_options.seed, s_options.loop_ms,
+            s_options.boot_spread_ms, s_options.press_interval_ms, s_options.duration_s, s_options.log_level);
+    exit(2);
+}
+
+static void parse_options(int argc, char **argv) {
+    enum {
+        OPT_NODES = 256, OPT_CONTROLLERS, OPT_FIRST, OPT_SEED, OPT_LOOP, OPT_BOOT_SPREAD, OPT_PRESS_INTERVAL, OPT_DURATION, OPT_LOG_LEVEL,
+        OPT_LOG_NODE, OPT_HELP
+    };
+    static const struct option long_options[] = {
+        { "nodes", required_argument, NULL, OPT_NODES },
+        { "controllers", required_argument, NULL, OPT_CONTROLLERS },
+        { "first", required_argument, NULL, OPT_FIRST },
+        { "seed", required_argument, NULL, OPT_SEED },
+        { "loop-ms", required_argument, NULL, OPT_LOOP },
+        { "boot-spread-ms", required_argument, NULL, OPT_BOOT_SPREAD },
+        { "press-interval-ms", required_argument, NULL, OPT_PRESS_INTERVAL },
+        { "duration-s", required_argument, NULL, OPT_DURATION },
+        { "log-level", required_argument, NULL, OPT_LOG_LEVEL },
+        { "log-node", required_argument, NULL, OPT_LOG_NODE },
+        { "help", no_argument, NULL, OPT_HELP },
+        { NULL, 0, NULL, 0 },
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+            case OPT_NODES: s_options.nodes = atoi(optarg); break;
+            case OPT_CONTROLLERS: s_options.controllers = atoi(optarg); break;
+            case OPT_FIRST: s_options.first = atoi(optarg); break;
+            case OPT_SEED: s_options.seed = strtoull(optarg, NULL, 0); break;
+            case OPT_LOOP: s_options.loop_ms = atoi(optarg); break;
+            case OPT_BOOT_SPREAD: s_options.boot_spread_ms = atoi(optarg); break;
+            case OPT_PRESS_INTERVAL: s_options.press_interval_ms = atoi(optarg); break;
+            case OPT_DURATION: s_options.duration_s = atoi(optarg); break;
+            case OPT_LOG_LEVEL: s_options.log_level = optarg[0]; break;
+            case OPT_LOG_NODE: s_options.log_node = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if (optind < argc || s_options.nodes < 1 || s_options.first < 0 || s_options.first + s_options.nodes > 0xFFFF ||
+        s_options.controllers < 0 || s_options.controllers > s_options.nodes || s_options.loop_ms == 0) {
+        usage(argv[0]);
+    }
+}
+
+static pid_t start_node(int index, uint8_t *eeprom, bool boot_delay) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        run_node(index, eeprom, boot_delay);
+    }
+    return pid;
+}
+
+static void on_signal(int signal) {
+    s_stop = 1;
+}
+
+int main(int argc, char **argv) {
+    parse_options(argc, argv);
+
+    size_t eeprom_size = (size_t)s_options.nodes * EEPROM_SIZE;
+    uint8_t *eeproms   = (uint8_t *)mmap(NULL, eeprom_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (eeproms == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    memset(eeproms, 0xFF, eeprom_size); // Erased flash
+
+    struct sigaction action = {};
+    action.sa_handler       = on_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    std::vector<pid_t> pids(s_options.nodes);
+    for (int i = 0; i < s_options.nodes; i++) {
+        pids[i] = start_node(s_options.first + i, &eeproms[i * EEPROM_SIZE], true);
+    }
+
+    int running = s_options.nodes;
+    bool killed = false;
+    while (running > 0) {
+        if (s_stop && !killed) {
+            for (pid_t pid : pids) {
+                if (pid > 0) { kill(pid, SIGTERM); }
+            }
+            killed = true;
+        }
+
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0) { continue; }
+
+        for (int i = 0; i < s_options.nodes; i++) {
+            if (pids[i] != pid) { continue; }
+
+            if (!s_stop && WIFEXITED(status) && WEXITSTATUS(status) == EXIT_RESTART) {
+                usleep(REBOOT_MS * 1000);
+                pids[i] = start_node(s_options.first + i, &eeproms[i * EEPROM_SIZE], false);
+            } else {
+                pids[i] = 0;
+                running--;
+            }
+        }
+    }
+    return 0;
+}
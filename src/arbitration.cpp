@@ -0,0 +1,262 @@
+#include "arbitration.h"
+#include "comm_scheduler.h"
+#include "dispatcher.h"
+#include "power_save.h"
+#include "relay.h"
+#include "timesync.h"
+#include "battery.h"
+#include "tx.h"
+#include "esp_mac.h"
+#include "esp_random.h"
+#include "esp32-hal-log.h"
+#include <nvm.h>
+#include <sys/param.h>
+
+static_assert(BUZZ_DECISION_SIZE(BUZZ_MAX_CLAIMS) <= RELAY_MAX_FRAME_LEN, "Relays must be able to forward every decision");
+static_assert(BUZZ_CLAIM_COPIES * BUZZ_CLAIM_COPY_MAX_DELAY_MS < BUZZ_DECISION_DELAY_MS, "The copies of a claim must arrive before the decision");
+static_assert(BUZZ_DECISION_TIMEOUT_MS > COMMAND_RETRY_INITIAL_MS * (1 << (COMMAND_MAX_ATTEMPTS - 1)), "Claimants must have given up on the arbiter before the nodes decide on their own");
+
+#define ARBITRATION_SEEN_CLAIMS (2 * BUZZ_MAX_CLAIMS)
+
+typedef struct {
+    uint8_t mac_addr[ESP_NOW_ETH_ALEN];
+    int64_t press_time_us;  // As sent
+    int64_t ranked_time_us; // Network time the claim is ranked by
+} seen_claim_t;
+
+/* Shared with the main loop and the USB task */
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint8_t s_arbiter[ESP_NOW_ETH_ALEN]; // The controller with the lowest MAC heard of, besides us
+static bool s_has_arbiter;
+static unsigned long s_arbiter_seen_at;
+static payload_buzz_decision_t s_decision_set; // Left by arbitration_set_decision
+static bool s_has_decision_set;
+
+/* Only used by comm_task */
+static seen_claim_t s_seen[ARBITRATION_SEEN_CLAIMS];
+static uint8_t s_seen_next;
+static espnow_data_t s_claim;   // Our last claim
+static uint8_t s_claim_copies;  // Copies left to send right away
+static uint8_t s_claim_repeats; // Repetitions left for the dozing buzzers
+static uint8_t s_claim_retries; // Retransmissions for the arbiter so far
+static unsigned long s_claim_retry_ms;
+static espnow_data_t s_decision; // Our last decision
+static bool s_has_decision;
+static uint8_t s_decision_repeats; // Transmissions left
+static uint8_t s_received_from[ESP_NOW_ETH_ALEN];
+static uint16_t s_received_round;
+static uint8_t s_received_ranked; // 0 before the first decision received
+
+/* Dozing buzzers only hear a fraction of the announcements */
+static unsigned long remember_ms() {
+    unsigned long remember_ms = SECONDS_TO_REMEMBER_PEERS * 1000UL;
+    if (!has_external_power && nvm_data.power_save == POWER_SAVE_ON) {
+        remember_ms *= POWER_SAVE_REMEMBER_FACTOR;
+    }
+    return remember_ms;
+}
+
+/* Must be called with s_lock held */
+static bool other_arbiter(unsigned long time) {
+    return s_has_arbiter && time - s_arbiter_seen_at <= remember_ms();
+}
+
+bool arbitration_is_arbiter() {
+    if (!has_external_power) {
+        return false;
+    }
+    portENTER_CRITICAL(&s_lock);
+    bool lower = other_arbiter(millis()) && memcmp(s_arbiter, my_mac_addr, ESP_NOW_ETH_ALEN) < 0;
+    portEXIT_CRITICAL(&s_lock);
+    return !lower;
+}
+
+bool arbitration_has_arbiter() {
+    if (has_external_power) {
+        return true;
+    }
+    portENTER_CRITICAL(&s_lock);
+    bool known = other_arbiter(millis());
+    portEXIT_CRITICAL(&s_lock);
+    return known;
+}
+
+void arbitration_node_info(const uint8_t *mac_addr, const payload_node_info_t *node_info, unsigned long time) {
+    if (node_info->node_type != NODE_TYPE_CONTROLLER || node_info->version != VERSION_CODE) {
+        return;
+    }
+
+    portENTER_CRITICAL(&s_lock);
+    if (!other_arbiter(time) || memcmp(mac_addr, s_arbiter, ESP_NOW_ETH_ALEN) <= 0) {
+        memcpy(s_arbiter, mac_addr, ESP_NOW_ETH_ALEN);
+        s_has_arbiter     = true;
+        s_arbiter_seen_at = time;
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
+
+/* A press time of INT64_MIN matches any claim of the node */
+static bool is_ranked(const payload_buzz_decision_t *decision, const uint8_t *mac_addr, int64_t press_time_us) {
+    for (uint8_t i = 0; i < decision->num_ranked; i++) {
+        if (memcmp(decision->ranking[i].mac_addr, mac_addr, ESP_NOW_ETH_ALEN) == 0) {
+            return press_time_us == INT64_MIN || decision->press_time_us + decision->ranking[i].delay_us == press_time_us;
+        }
+    }
+    return false;
+}
+
+static unsigned long decision_job(unsigned long time) {
+    esp_err_t ret = tx_send(s_broadcast_mac, &s_decision, BUZZ_DECISION_SIZE(s_decision.payload.buzz_decision.num_ranked), TX_PRIO_HIGH);
+    if (ret != ESP_OK) {
+        log_e("Send error: %s", esp_err_to_name(ret));
+    }
+    s_decision.payload.buzz_decision.attempt++;
+
+    if (--s_decision_repeats == 0) {
+        return COMM_JOB_STOP;
+    }
+    return COMMAND_RETRY_INITIAL_MS;
+}
+
+static comm_job_t s_decision_job = COMM_JOB("arbitration_decision", decision_job);
+
+bool arbitration_claim_received(const uint8_t *mac_addr, const payload_buzz_t *buzz, int64_t rx_local_us, int64_t *press_time_us) {
+    for (uint8_t i = 0; i < ARBITRATION_SEEN_CLAIMS; i++) {
+        if (s_seen[i].press_time_us == buzz->press_time_us && memcmp(s_seen[i].mac_addr, mac_addr, ESP_NOW_ETH_ALEN) == 0) {
+            /* Repeated for the dozing buzzers, or retransmitted because the claimant missed our decision */
+            if (s_has_decision && is_ranked(&s_decision.payload.buzz_decision, mac_addr, s_seen[i].ranked_time_us) && arbitration_is_arbiter()) {
+                s_decision_repeats = MAX(s_decision_repeats, 1);
+                comm_schedule(&s_decision_job, 0);
+            }
+            return false;
+        }
+    }
+
+    *press_time_us = buzz->press_time_us;
+    if (buzz->stratum == TIMESYNC_STRATUM_UNSYNCED && (timesync_is_synced() || timesync_is_master())) {
+        /* Just the claimant's own clock (a node out of reach of every time source), our receive time is closer */
+        *press_time_us = timesync_local_to_network_us(rx_local_us) - buzz->send_delay_us;
+    }
+
+    memcpy(s_seen[s_seen_next].mac_addr, mac_addr, ESP_NOW_ETH_ALEN);
+    s_seen[s_seen_next].press_time_us  = buzz->press_time_us;
+    s_seen[s_seen_next].ranked_time_us = *press_time_us;
+    s_seen_next                        = (s_seen_next + 1) % ARBITRATION_SEEN_CLAIMS;
+    return true;
+}
+
+/* The arbiter decides BUZZ_DECISION_DELAY_MS after the window */
+static unsigned long decision_wait_ms() {
+    return (BUZZ_ARBITRATION_WINDOW_US + power_save_extra_latency_us()) / 1000 + BUZZ_DECISION_DELAY_MS + COMMAND_RETRY_INITIAL_MS;
+}
+
+/* Random, so the copies of claims sent at the same time do not collide again */
+static unsigned long copy_delay_ms() {
+    return 1 + esp_random() % BUZZ_CLAIM_COPY_MAX_DELAY_MS;
+}
+
+static unsigned long claim_job(unsigned long time) {
+    if (s_claim_copies > 0) {
+        s_claim_copies--;
+    } else if (s_claim_repeats == 0) {
+        /* Only the arbiter answers, and it does not need our claim to decide */
+        if (!arbitration_has_arbiter() || arbitration_is_arbiter() || s_claim_retries == COMMAND_MAX_ATTEMPTS - 1) {
+            return COMM_JOB_STOP;
+        }
+        s_claim_retries++;
+    } else {
+        s_claim_repeats--;
+    }
+
+    s_claim.payload.buzz.attempt++;
+    esp_err_t ret = tx_send(s_broadcast_mac, &s_claim, ESPNOW_DATA_SIZE(buzz), TX_PRIO_HIGH);
+    if (ret != ESP_OK) {
+        log_e("Send error: %s", esp_err_to_name(ret));
+    }
+
+    if (s_claim_copies > 0) {
+        return copy_delay_ms();
+    }
+    if (s_claim_repeats > 0) {
+        return COMMAND_RETRY_INITIAL_MS;
+    }
+    if (s_claim_retries == 0) {
+        return decision_wait_ms();
+    }
+    unsigned long delay_ms = s_claim_retry_ms;
+    s_claim_retry_ms *= 2;
+    return delay_ms;
+}
+
+static comm_job_t s_claim_job = COMM_JOB("arbitration_claim", claim_job);
+
+void arbitration_claim_sent(const payload_buzz_t *buzz, unsigned long time) {
+    s_claim.type         = ESP_DATA_TYPE_BUZZ;
+    s_claim.payload.buzz = *buzz;
+    s_claim_retries      = 0;
+    s_claim_retry_ms     = COMMAND_RETRY_INITIAL_MS;
+
+    /* A frame only reaches a dozing buzzer in its wake window. The claim itself has just been sent. */
+    s_claim_repeats = power_save_broadcast_repeats(time) - 1;
+    if (s_claim_repeats > 0) {
+        s_claim_copies = 0;
+        comm_schedule(&s_claim_job, COMMAND_RETRY_INITIAL_MS);
+        return;
+    }
+    /* Claims of a close race are sent at nearly the same time and may collide. Copies still reach the arbiter before it
+     * decides, a retransmission would only be ranked behind the winner. */
+    s_claim_copies = BUZZ_CLAIM_COPIES;
+    comm_schedule(&s_claim_job, copy_delay_ms());
+}
+
+void arbitration_set_decision(const payload_buzz_decision_t *decision) {
+    portENTER_CRITICAL(&s_lock);
+    s_decision_set     = *decision;
+    s_has_decision_set = true;
+    portEXIT_CRITICAL(&s_lock);
+}
+
+void arbitration_send_decision(unsigned long time) {
+    payload_buzz_decision_t decision_set;
+    portENTER_CRITICAL(&s_lock);
+    bool has_decision_set = s_has_decision_set;
+    decision_set          = s_decision_set;
+    s_has_decision_set    = false;
+    portEXIT_CRITICAL(&s_lock);
+    if (!has_decision_set) {
+        return; // Sent with an earlier event
+    }
+
+    payload_buzz_decision_t *decision = &s_decision.payload.buzz_decision;
+    /* An update of the ranking must not be taken for a copy of the previous one (see relay.h) */
+    uint8_t attempt    = s_has_decision && decision->round == decision_set.round ? decision->attempt : 0;
+    s_decision.type    = ESP_DATA_TYPE_BUZZ_DECISION;
+    *decision          = decision_set;
+    decision->attempt  = attempt;
+    s_has_decision     = true;
+    s_decision_repeats = MAX(COMMAND_BROADCAST_REPEATS, power_save_broadcast_repeats(time));
+    comm_schedule(&s_decision_job, 0);
+}
+
+void arbitration_decision_received(const uint8_t *mac_addr, const payload_buzz_decision_t *decision, int len) {
+    if (len < (int)BUZZ_DECISION_SIZE(0) || decision->num_ranked == 0 || decision->num_ranked > BUZZ_MAX_CLAIMS ||
+        len < (int)BUZZ_DECISION_SIZE(decision->num_ranked)) {
+        log_e("Received malformed buzz decision from " MACSTR, MAC2STR(mac_addr));
+        return;
+    }
+
+    /* The arbiter ranks an unsynced claim by its own receive time */
+    int64_t my_press_us = s_claim.payload.buzz.stratum == TIMESYNC_STRATUM_UNSYNCED ? INT64_MIN : s_claim.payload.buzz.press_time_us;
+    if (comm_is_scheduled(&s_claim_job) && is_ranked(decision, my_mac_addr, my_press_us)) {
+        comm_unschedule(&s_claim_job);
+    }
+
+    /* Decisions are repeated, the main loop only needs to hear of new rankings */
+    if (s_received_ranked == decision->num_ranked && s_received_round == decision->round && memcmp(s_received_from, mac_addr, ESP_NOW_ETH_ALEN) == 0) {
+        return;
+    }
+    memcpy(s_received_from, mac_addr, ESP_NOW_ETH_ALEN);
+    s_received_round  = decision->round;
+    s_received_ranked = decision->num_ranked;
+    dispatcher_post_decision(mac_addr, decision);
+}
@@ -2,6 +2,8 @@
 #include "_config.h"
 #include "battery.h"
 #include "comm.h"
+#include "command_delivery.h"
+#include "peer_table.h"
 #include "esp32-hal-log.h"
 #include <BLEDevice.h>
 #include <BLEUtils.h>
@@ -12,13 +14,16 @@
 #include <FastLED.h>
 
 // Generated using https://www.uuidgenerator.net/
-#define UUID_SERVICE                     "20d86bb5-f515-4671-8a88-32fddb20920c"
-#define UUID_CHARACTERISTIC_VERSION      "4d3c98dc-2970-496a-bc20-c1295abc9730"
-#define UUID_CHARACTERISTIC_EXEC_COMMAND "d384392d-e53e-4c21-a598-f7bf8ccfcb66"
-#define UUID_CHARACTERISTIC_PEER_LIST    "f7551fb0-05c3-4dff-a944-4980f40779e1"
+#define UUID_SERVICE                       "20d86bb5-f515-4671-8a88-32fddb20920c"
+#define UUID_CHARACTERISTIC_VERSION        "4d3c98dc-2970-496a-bc20-c1295abc9730"
+#define UUID_CHARACTERISTIC_EXEC_COMMAND   "d384392d-e53e-4c21-a598-f7bf8ccfcb66"
+#define UUID_CHARACTERISTIC_PEER_LIST      "f7551fb0-05c3-4dff-a944-4980f40779e1"
+#define UUID_CHARACTERISTIC_EXEC_MULTICAST "0b8f6a7e-3f0c-4f2e-9d55-6f1f3c2a9b41"
 
-#define UUID_SERVICE_BATTERY             "180f"
-#define UUID_CHARACTERISTIC_BATTERY      "2a19"
+#define UUID_SERVICE_BATTERY               "180f"
+#define UUID_CHARACTERISTIC_BATTERY        "2a19"
+
+#define BLE_SERVICE_NUM_HANDLES            30 // The default of 15 is not enough for all characteristics and their descriptors
 
 BLEServer *btServer;
 BLEService *pService;
@@ -27,6 +32,7 @@ BLEAdvertising *pAdvertising;
 BLECharacteristic *characteristicVersion;
 BLECharacteristic *characteristicExecCommand;
 BLECharacteristic *characteristicPeerList;
+BLECharacteristic *characteristicExecMulticast;
 BLECharacteristic *characteristicBattery;
 
 void bluetooth_notify_peer_list_changed() {
@@ -35,6 +41,14 @@ void bluetooth_notify_peer_list_changed() {
     }
 }
 
+/* Notifies the outcome of a relayed command. Reading the characteristic returns the recent ones (newest first). */
+void bluetooth_notify_command_delivery(const command_delivery_t *delivery) {
+    if (characteristicExecCommand != nullptr) {
+        characteristicExecCommand->setValue((uint8_t *)delivery, sizeof(command_delivery_t));
+        characteristicExecCommand->notify();
+    }
+}
+
 static uint8_t connected_clients = 0;
 
 class BTServerCallbacks : public BLEServerCallbacks {
@@ -64,11 +78,43 @@ class BTExecCommandCallbacks : public BLECharacteristicCallbacks {
             executeCommand(value->dst_mac_addr, &value->command, param->write.len - sizeof(value->dst_mac_addr));
         }
     }
+
+    void onRead(BLECharacteristic *pCharacteristic, esp_ble_gatts_cb_param_t *param) {
+        command_delivery_t deliveries[COMMAND_DELIVERY_HISTORY];
+        uint8_t count = get_command_deliveries(deliveries, COMMAND_DELIVERY_HISTORY);
+        pCharacteristic->setValue((uint8_t *)deliveries, count * sizeof(command_delivery_t));
+    }
+};
+class BTExecMulticastCallbacks : public BLECharacteristicCallbacks {
+    void onWrite(BLECharacteristic *pCharacteristic, esp_ble_gatts_cb_param_t *param) {
+        log_d("Received multicast command via bluetooth (%d bytes)...", param->write.len);
+        executeMulticastCommand(param->write.value, param->write.len);
+    }
 };
+/* Every read returns the page at the cursor and advances it (wrapping around at the end of the table), a write sets it.
+ * Clients read until they have seen every page, so interleaved reads of other clients only cost them another read. */
 class BTPeerListCallbacks : public BLECharacteristicCallbacks {
+    uint8_t cursor = 0;
+
+    void onWrite(BLECharacteristic *pCharacteristic, esp_ble_gatts_cb_param_t *param) {
+        if (param->write.len >= 1 && param->write.value[0] < PEER_DATA_TABLE_ENTRIES) {
+            cursor = param->write.value[0];
+        }
+    }
+
     void onRead(BLECharacteristic *pCharacteristic, esp_ble_gatts_cb_param_t *param) {
-        update_my_info();
-        pCharacteristic->setValue((uint8_t *)peer_data_table, sizeof(peer_data_table));
+        static struct {
+            peer_list_page_header_t header;
+            peer_data_t entries[PEER_LIST_PAGE_ENTRIES];
+        } __attribute__((packed)) page;
+
+        uint8_t count     = MIN((int)PEER_LIST_PAGE_ENTRIES, PEER_DATA_TABLE_ENTRIES - cursor);
+        page.header.first  = cursor;
+        page.header.total  = PEER_DATA_TABLE_ENTRIES;
+        peer_table_read_snapshot(page.entries, cursor, count);
+        pCharacteristic->setValue((uint8_t *)&page, sizeof(page.header) + count * sizeof(peer_data_t));
+
+        cursor = (cursor + count) % PEER_DATA_TABLE_ENTRIES;
     }
 };
 
@@ -94,6 +140,7 @@ unsigned long bluetooth_last_connected = 0;
 BTServerCallbacks btServerCallbacks;
 BTPeerListCallbacks btPeerListCallbacks;
 BTExecCommandCallbacks btExecCommandCallbacks;
+BTExecMulticastCallbacks btExecMulticastCallbacks;
 
 void bluetooth_start() {
     if (BLEDevice::getInitialized()) {
@@ -107,19 +154,24 @@ void bluetooth_start() {
     btServer = BLEDevice::createServer();
     btServer->setCallbacks(&btServerCallbacks);
 
-    pService = btServer->createService(UUID_SERVICE);
+    pService = btServer->createService(BLEUUID(UUID_SERVICE), BLE_SERVICE_NUM_HANDLES);
 
     characteristicVersion = pService->createCharacteristic(UUID_CHARACTERISTIC_VERSION, BLECharacteristic::PROPERTY_READ);
     characteristicVersion->addDescriptor(userDescription("Communication Version"));
     characteristicVersion->addDescriptor(formatDescriptor(BLE2904::FORMAT_UINT8));
     characteristicVersion->setValue((uint8_t *)&_VERSION_CODE, 1);
 
-    characteristicExecCommand = pService->createCharacteristic(UUID_CHARACTERISTIC_EXEC_COMMAND, BLECharacteristic::PROPERTY_WRITE);
+    characteristicExecCommand = pService->createCharacteristic(UUID_CHARACTERISTIC_EXEC_COMMAND, BLECharacteristic::PROPERTY_WRITE | BLECharacteristic::PROPERTY_READ | BLECharacteristic::PROPERTY_NOTIFY);
     characteristicExecCommand->addDescriptor(userDescription("Execute Command"));
     characteristicExecCommand->addDescriptor(formatDescriptor(BLE2904::FORMAT_OPAQUE));
     characteristicExecCommand->setCallbacks(&btExecCommandCallbacks);
 
-    characteristicPeerList = pService->createCharacteristic(UUID_CHARACTERISTIC_PEER_LIST, BLECharacteristic::PROPERTY_READ | BLECharacteristic::PROPERTY_NOTIFY);
+    characteristicExecMulticast = pService->createCharacteristic(UUID_CHARACTERISTIC_EXEC_MULTICAST, BLECharacteristic::PROPERTY_WRITE);
+    characteristicExecMulticast->addDescriptor(userDescription("Execute Multicast Command"));
+    characteristicExecMulticast->addDescriptor(formatDescriptor(BLE2904::FORMAT_OPAQUE));
+    characteristicExecMulticast->setCallbacks(&btExecMulticastCallbacks);
+
+    characteristicPeerList = pService->createCharacteristic(UUID_CHARACTERISTIC_PEER_LIST, BLECharacteristic::PROPERTY_READ | BLECharacteristic::PROPERTY_WRITE | BLECharacteristic::PROPERTY_NOTIFY);
     characteristicPeerList->addDescriptor(userDescription("Peer List"));
     characteristicPeerList->addDescriptor(formatDescriptor(BLE2904::FORMAT_OPAQUE));
     characteristicPeerList->setCallbacks(&btPeerListCallbacks);
@@ -5,6 +5,26 @@
 #include "battery.h"
 #include "nvm.h"
 #include "bluetooth.h"
+#include "mode.h"
+#include "modes/IMode.h"
+#include "dispatcher.h"
+#include "esp_timer.h"
+#include "esp_sleep.h"
+#include "driver/gpio.h"
+#include "hal/gpio_ll.h"
+#include <sys/param.h>
+
+typedef struct {
+    button_t button;
+    bool pressed;    // Level right after the edge
+    int64_t time_us; // esp_timer_get_time() of the edge
+} button_edge_t;
+
+typedef struct {
+    bool pressed;          // Debounced state
+    bool settling;         // Whether the contacts may still be bouncing from the last change
+    int64_t changed_at_us; // Time of the last change
+} button_state_t;
 
 unsigned long back_button_pressed_since = 0;
 uint16_t both_buttons_pressed_for       = 0;
@@ -12,11 +32,106 @@ uint16_t both_buttons_pressed_for       = 0;
 bool lastPushedBackButton       = false; /* Whether or not the back button was pushed last loop iteration */
 bool pressedBackButtonSinceBoot = false;
 
+static uint8_t s_pins[BUTTON_NUM] = { BUZZER_BUTTON_PIN, BACK_BUTTON_PIN }; // Not const, the ISR must not read from flash
+static QueueHandle_t s_edges;
+static button_state_t s_states[BUTTON_NUM];
+
+static void IRAM_ATTR button_isr(void *arg) {
+    button_edge_t edge;
+    edge.time_us     = esp_timer_get_time();
+    edge.button      = (button_t)(uintptr_t)arg;
+    edge.pressed     = digitalRead(s_pins[edge.button]) == LOW;
+    /* Wait for the opposite level next. gpio_set_intr_type is not in IRAM. */
+    gpio_ll_set_intr_type(&GPIO, (gpio_num_t)s_pins[edge.button], edge.pressed ? GPIO_INTR_HIGH_LEVEL : GPIO_INTR_LOW_LEVEL);
+    BaseType_t woken = pdFALSE;
+    xQueueSendFromISR(s_edges, &edge, &woken);
+    if (woken) {
+        portYIELD_FROM_ISR();
+    }
+}
+
+static void change(button_t button, bool pressed, int64_t time_us) {
+    button_state_t *state = &s_states[button];
+    __atomic_store_n(&state->pressed, pressed, __ATOMIC_RELAXED);
+    state->settling      = true;
+    state->changed_at_us = time_us;
+
+    /* The config menu reads the buttons itself */
+    bool to_mode = current_state != STATE_CONFIG;
+    if (to_mode) {
+        /* Only what must not wait for the main loop, the mode handles the change in onButton */
+        get_current_mode()->onButtonEdge(button, pressed, time_us);
+    }
+    dispatcher_post_button(button, pressed, time_us, to_mode);
+}
+
+static void button_task(void *arg) {
+    button_edge_t edge;
+    while (true) {
+        /* Wake up when the first button is done bouncing */
+        TickType_t ticks = portMAX_DELAY;
+        int64_t now_us   = esp_timer_get_time();
+        for (uint8_t i = 0; i < BUTTON_NUM; i++) {
+            if (s_states[i].settling) {
+                int64_t remaining_us = MAX(s_states[i].changed_at_us + BUTTON_DEBOUNCE_US - now_us, (int64_t)0);
+                ticks                = MIN(ticks, pdMS_TO_TICKS(remaining_us / 1000 + 1));
+            }
+        }
+
+        if (xQueueReceive(s_edges, &edge, ticks) == pdTRUE) {
+            button_state_t *state = &s_states[edge.button];
+            if (state->settling && edge.time_us - state->changed_at_us < BUTTON_DEBOUNCE_US) {
+                continue; // Bouncing
+            }
+            state->settling = false;
+            if (edge.pressed != state->pressed) {
+                change(edge.button, edge.pressed, edge.time_us);
+            }
+            continue;
+        }
+
+        /* The level after bouncing, in case it differs from the last edge we took */
+        now_us = esp_timer_get_time();
+        for (uint8_t i = 0; i < BUTTON_NUM; i++) {
+            button_state_t *state = &s_states[i];
+            if (state->settling && now_us - state->changed_at_us >= BUTTON_DEBOUNCE_US) {
+                state->settling = false;
+                bool pressed    = digitalRead(s_pins[i]) == LOW;
+                if (pressed != state->pressed) {
+                    change((button_t)i, pressed, now_us);
+                }
+            }
+        }
+    }
+}
+
 void button_setup() {
     pinMode(BACK_BUTTON_PIN, INPUT_PULLUP);
     pinMode(BUZZER_BUTTON_PIN, INPUT_PULLUP);
 
     pressedBackButtonSinceBoot = (digitalRead(BACK_BUTTON_PIN) == LOW);
+
+    s_edges = xQueueCreate(BUTTON_QUEUE_SIZE, sizeof(button_edge_t));
+    if (s_edges == NULL) {
+        log_e("Create button queue fail");
+        return;
+    }
+    for (uint8_t i = 0; i < BUTTON_NUM; i++) {
+        s_states[i].pressed = digitalRead(s_pins[i]) == LOW;
+        attachInterruptArg(digitalPinToInterrupt(s_pins[i]), button_isr, (void *)(uintptr_t)i, s_states[i].pressed ? ONHIGH : ONLOW);
+#ifdef CONFIG_PM_ENABLE
+        /* Wakes from automatic light sleep on the level the interrupt waits for */
+        ESP_ERROR_CHECK(gpio_wakeup_enable((gpio_num_t)s_pins[i], s_states[i].pressed ? GPIO_INTR_HIGH_LEVEL : GPIO_INTR_LOW_LEVEL));
+#endif
+    }
+#ifdef CONFIG_PM_ENABLE
+    ESP_ERROR_CHECK(esp_sleep_enable_gpio_wakeup());
+#endif
+    xTaskCreate(&button_task, "button_task", 3072, NULL, TASK_PRIO_BUTTON, NULL);
+}
+
+bool button_pressed(button_t button) {
+    return __atomic_load_n(&s_states[button].pressed, __ATOMIC_RELAXED);
 }
 
 inline static void next_color() {
@@ -76,16 +191,14 @@ void config_loop() {
 void button_loop() {
     unsigned long time = millis();
 
-    static CEveryNMillis debounceBackButtonRelease(50);
-    if (digitalRead(BACK_BUTTON_PIN) == LOW) {
+    if (button_pressed(BUTTON_BACK)) {
         if (!lastPushedBackButton) {
             back_button_pressed_since = time;
             send_state_update();
         }
         lastPushedBackButton = true;
-        debounceBackButtonRelease.reset();
 
-        if (digitalRead(BUZZER_BUTTON_PIN) == LOW) {
+        if (button_pressed(BUTTON_BUZZER)) {
             EVERY_N_MILLIS(100) { both_buttons_pressed_for += 100; }
 
             if (both_buttons_pressed_for > 2000) {
@@ -104,14 +217,12 @@ void button_loop() {
             shutdown(true, false);
         }
     } else {
-        if (debounceBackButtonRelease) {
-            if (!pressedBackButtonSinceBoot && lastPushedBackButton && (time - back_button_pressed_since) < 1000) {
-                set_state(STATE_SHOW_BATTERY);
-                bluetooth_set_state(true);
-            }
-            both_buttons_pressed_for   = 0;
-            lastPushedBackButton       = false;
-            pressedBackButtonSinceBoot = false;
+        if (!pressedBackButtonSinceBoot && lastPushedBackButton && (time - back_button_pressed_since) < 1000) {
+            set_state(STATE_SHOW_BATTERY);
+            bluetooth_set_state(true);
         }
+        both_buttons_pressed_for   = 0;
+        lastPushedBackButton       = false;
+        pressedBackButtonSinceBoot = false;
     }
 }
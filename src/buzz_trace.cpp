@@ -0,0 +1,125 @@
+#include "buzz_trace.h"
+#include "timesync.h"
+#include "esp_timer.h"
+#include "esp_mac.h"
+#include <sys/param.h>
+
+#define BUZZ_TRACE_SUB_BITS     2 // log2(BUZZ_TRACE_SUB_BUCKETS)
+#define BUZZ_TRACE_MAX_EXPONENT 23
+
+static_assert(BUZZ_TRACE_SUB_BUCKETS == 1 << BUZZ_TRACE_SUB_BITS, "BUZZ_TRACE_SUB_BITS does not match BUZZ_TRACE_SUB_BUCKETS");
+static_assert(BUZZ_TRACE_BUCKETS == (BUZZ_TRACE_MAX_EXPONENT - BUZZ_TRACE_SUB_BITS + 2) * BUZZ_TRACE_SUB_BUCKETS, "BUZZ_TRACE_BUCKETS does not cover 2^24us");
+
+/* A claim waiting for its key press */
+typedef struct {
+    bool used;
+    uint8_t mac_addr[ESP_NOW_ETH_ALEN];
+    uint16_t trace_id;
+    bool synced;              // Whether press_time_us is comparable to our network time
+    int64_t press_time_us;    // Network time
+    int64_t dispatched_at_us; // Local time
+} buzz_trace_pending_t;
+
+static portMUX_TYPE s_trace_lock = portMUX_INITIALIZER_UNLOCKED;
+static buzz_trace_stats_t s_stats;
+static buzz_trace_pending_t s_pending[BUZZ_TRACE_PENDING];
+static uint16_t s_next_id = 0;
+
+uint8_t buzz_trace_bucket(uint32_t latency_us) {
+    if (latency_us < BUZZ_TRACE_SUB_BUCKETS) {
+        return latency_us;
+    }
+    uint8_t exponent = 31 - __builtin_clz(latency_us);
+    if (exponent > BUZZ_TRACE_MAX_EXPONENT) {
+        return BUZZ_TRACE_BUCKETS - 1;
+    }
+    uint8_t sub = (latency_us >> (exponent - BUZZ_TRACE_SUB_BITS)) & (BUZZ_TRACE_SUB_BUCKETS - 1);
+    return (exponent - BUZZ_TRACE_SUB_BITS + 1) * BUZZ_TRACE_SUB_BUCKETS + sub;
+}
+
+/* Only with s_trace_lock held */
+static void record(buzz_trace_stage_t stage, int64_t latency_us) {
+    /* Network time stages can come out slightly negative within the sync error */
+    uint32_t clamped                  = (uint32_t)MIN(MAX(latency_us, (int64_t)0), (int64_t)UINT32_MAX);
+    buzz_trace_histogram_t *histogram = &s_stats.histograms[stage];
+    histogram->count++;
+    histogram->max_us  = MAX(histogram->max_us, clamped);
+    histogram->sum_us += clamped;
+    histogram->buckets[buzz_trace_bucket(clamped)]++;
+}
+
+uint16_t buzz_trace_next_id() {
+    return __atomic_fetch_add(&s_next_id, 1, __ATOMIC_RELAXED);
+}
+
+void buzz_trace_received(const uint8_t *mac_addr, const payload_buzz_t *buzz, int64_t rx_local_us) {
+    int64_t dispatched_at_us = esp_timer_get_time();
+    bool synced              = buzz->stratum != TIMESYNC_STRATUM_UNSYNCED && (timesync_is_synced() || timesync_is_master());
+    int64_t rx_network_us    = timesync_local_to_network_us(rx_local_us);
+
+    portENTER_CRITICAL(&s_trace_lock);
+    s_stats.traces_started++;
+    record(BUZZ_TRACE_PRESS_TO_SEND, buzz->send_delay_us);
+    if (synced) {
+        record(BUZZ_TRACE_SEND_TO_RECEIVE, rx_network_us - (buzz->press_time_us + buzz->send_delay_us));
+    } else {
+        s_stats.traces_unsynced++;
+    }
+    record(BUZZ_TRACE_RECEIVE_TO_DISPATCH, dispatched_at_us - rx_local_us);
+
+    /* One claim per node and round, so a node's previous trace is over. Otherwise, replace the oldest one. */
+    buzz_trace_pending_t *pending = &s_pending[0];
+    for (uint8_t i = 0; i < BUZZ_TRACE_PENDING; i++) {
+        if (s_pending[i].used && memcmp(s_pending[i].mac_addr, mac_addr, ESP_NOW_ETH_ALEN) == 0) {
+            pending = &s_pending[i];
+            break;
+        }
+        if (!s_pending[i].used || (pending->used && s_pending[i].dispatched_at_us < pending->dispatched_at_us)) {
+            pending = &s_pending[i];
+        }
+    }
+    pending->used = true;
+    memcpy(pending->mac_addr, mac_addr, ESP_NOW_ETH_ALEN);
+    pending->trace_id         = buzz->trace_id;
+    pending->synced           = synced;
+    pending->press_time_us    = buzz->press_time_us;
+    pending->dispatched_at_us = dispatched_at_us;
+    portEXIT_CRITICAL(&s_trace_lock);
+
+    log_v("Buzz trace %04x of " MACSTR ": press->send %uus", buzz->trace_id, MAC2STR(mac_addr), buzz->send_delay_us);
+}
+
+void buzz_trace_key_pressed(const uint8_t *mac_addr) {
+    int64_t now_us         = esp_timer_get_time();
+    int64_t now_network_us = timesync_local_to_network_us(now_us);
+    int32_t trace_id       = -1;
+
+    portENTER_CRITICAL(&s_trace_lock);
+    for (uint8_t i = 0; i < BUZZ_TRACE_PENDING; i++) {
+        buzz_trace_pending_t *pending = &s_pending[i];
+        if (pending->used && memcmp(pending->mac_addr, mac_addr, ESP_NOW_ETH_ALEN) == 0) {
+            s_stats.traces_keyed++;
+            record(BUZZ_TRACE_DISPATCH_TO_KEY, now_us - pending->dispatched_at_us);
+            if (pending->synced) {
+                record(BUZZ_TRACE_PRESS_TO_KEY, now_network_us - pending->press_time_us);
+            }
+            pending->used = false;
+            trace_id      = pending->trace_id;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&s_trace_lock);
+
+    if (trace_id >= 0) {
+        log_v("Buzz trace %04x of " MACSTR ": key pressed", trace_id, MAC2STR(mac_addr));
+    }
+}
+
+void buzz_trace_read(buzz_trace_stats_t *stats) {
+    portENTER_CRITICAL(&s_trace_lock);
+    *stats = s_stats;
+    portEXIT_CRITICAL(&s_trace_lock);
+    stats->stages      = BUZZ_TRACE_STAGES;
+    stats->buckets     = BUZZ_TRACE_BUCKETS;
+    stats->sub_buckets = BUZZ_TRACE_SUB_BUCKETS;
+}
@@ -0,0 +1,300 @@
+#include "channel.h"
+#include "comm_scheduler.h"
+#include "timesync.h"
+#include "battery.h"
+#include "power_save.h"
+#include "esp_wifi.h"
+#include "esp32-hal-log.h"
+#include <nvm.h>
+#include <sys/param.h>
+#include <inttypes.h>
+
+static uint8_t s_channel = CONFIG_ESPNOW_CHANNEL;
+
+/* Only used by comm_task */
+static uint8_t s_pending_channel;
+static unsigned long s_last_heard;
+static bool s_searching;
+static uint8_t s_search_steps;
+static bool s_scanning;
+static bool s_round_open;
+static unsigned long s_round_opened_at;
+static uint8_t s_deferred_channel; // Migration waiting for the round to end (0: to the quietest channel)
+
+static inline bool is_valid_channel(uint8_t channel) {
+    return channel >= CHANNEL_MIN && channel <= CHANNEL_MAX;
+}
+
+static void set_channel(uint8_t channel) {
+    esp_err_t ret = esp_wifi_set_channel(channel, WIFI_SECOND_CHAN_NONE);
+    if (ret != ESP_OK) {
+        log_e("Cannot switch to channel %d: %s", channel, esp_err_to_name(ret));
+        return;
+    }
+    s_channel = channel;
+}
+
+static void save_channel() {
+    if (nvm_data.channel != s_channel) {
+        nvm_data.channel = s_channel;
+        nvm_save();
+    }
+}
+
+/* The radio is off our channel until channel_scan_done(), nothing is received meanwhile */
+static bool start_scan() {
+    wifi_scan_config_t config = {};
+    config.show_hidden        = true;
+
+    /* Promiscuous mode would keep the radio on our channel */
+    ESP_ERROR_CHECK(esp_wifi_set_promiscuous(false));
+    esp_err_t ret = esp_wifi_scan_start(&config, false);
+    if (ret != ESP_OK) {
+        log_e("Cannot start the channel scan: %s", esp_err_to_name(ret));
+        ESP_ERROR_CHECK(esp_wifi_set_promiscuous(true));
+        return false;
+    }
+    s_scanning = true;
+    return true;
+}
+
+/* Back to our channel, after the scan is done or given up */
+static void end_scan() {
+    ESP_ERROR_CHECK(esp_wifi_set_promiscuous(true));
+    set_channel(s_channel); // The scan leaves us on some other channel
+    s_scanning = false;
+}
+
+static uint8_t quietest_channel(const wifi_ap_record_t *records, uint16_t num) {
+    uint32_t load[CHANNEL_MAX + 1] = {};
+
+    /* 2.4 GHz channels are 5 MHz apart, but 20 MHz wide: an access point disturbs the four channels around it as well */
+    for (uint16_t i = 0; i < num; i++) {
+        uint32_t strength = constrain(records[i].rssi + 100, 0, 100);
+        for (uint8_t channel = CHANNEL_MIN; channel <= CHANNEL_MAX; channel++) {
+            int distance = abs((int)channel - (int)records[i].primary);
+            if (distance < 5) {
+                load[channel] += (5 - distance) * strength;
+            }
+        }
+    }
+
+    uint8_t quietest = s_channel;
+    for (uint8_t channel = CHANNEL_MIN; channel <= CHANNEL_MAX; channel++) {
+        log_v("Channel %2d: load %" PRIu32, channel, load[channel]);
+        if (load[channel] < load[quietest]) {
+            quietest = channel;
+        }
+    }
+
+    /* Stay unless another channel is really better, moving the network costs the buzzers that miss the switch a search */
+    uint32_t gain     = load[s_channel] - load[quietest];
+    uint32_t min_gain = MAX(CHANNEL_SWITCH_MIN_GAIN, load[s_channel] * CHANNEL_SWITCH_MIN_GAIN_PERCENT / 100);
+    if (quietest != s_channel && gain < min_gain) {
+        log_i("Scanned %d access points, channel %d is quieter, but not enough to leave channel %d (load %" PRIu32 " vs. %" PRIu32 ").", num, quietest,
+              s_channel, load[quietest], load[s_channel]);
+        return s_channel;
+    }
+
+    log_i("Scanned %d access points, channel %d is the quietest.", num, quietest);
+    return quietest;
+}
+
+static unsigned long switch_job(unsigned long time) {
+    log_i("Switching to channel %d.", s_pending_channel);
+    set_channel(s_pending_channel);
+    save_channel();
+
+    /* Give the others time to follow */
+    s_last_heard = time;
+    s_searching  = false;
+    return COMM_JOB_STOP;
+}
+
+/* Buzzers only: searches the channels for the network once nobody has been heard for a while */
+static unsigned long watch_job(unsigned long time);
+
+/* Runs a deferred migration once the round is over */
+static unsigned long deferred_job(unsigned long time);
+
+/* In case WIFI_EVENT_SCAN_DONE never makes it to us */
+static unsigned long scan_timeout_job(unsigned long time) {
+    if (s_scanning) {
+        log_w("Channel scan timed out.");
+        esp_wifi_scan_stop();
+        end_scan();
+    }
+    return COMM_JOB_STOP;
+}
+
+static comm_job_t s_switch_job       = COMM_JOB("channel_switch", switch_job);
+static comm_job_t s_watch_job        = COMM_JOB("channel_watch", watch_job);
+static comm_job_t s_deferred_job     = COMM_JOB("channel_deferred", deferred_job);
+static comm_job_t s_scan_timeout_job = COMM_JOB("channel_scan_timeout", scan_timeout_job);
+
+static inline bool round_open(unsigned long time) {
+    /* Like power save, a round without COMMAND_ROUND_END counts as ended after a while */
+    return s_round_open && time - s_round_opened_at < POWER_SAVE_ROUND_TIMEOUT_MS;
+}
+
+static unsigned long deferred_job(unsigned long time) {
+    if (round_open(time)) {
+        return POWER_SAVE_ROUND_TIMEOUT_MS - (time - s_round_opened_at);
+    }
+    channel_migrate(s_deferred_channel);
+    return COMM_JOB_STOP;
+}
+
+/* Moving the network, or being deaf for a scan, would cost the buzzers of an open round their buzzes */
+static bool defer_in_round(uint8_t channel) {
+    unsigned long time = millis();
+    if (!round_open(time)) {
+        return false;
+    }
+    log_i("A round is open, moving the network once it is over.");
+    s_deferred_channel = channel;
+    comm_schedule(&s_deferred_job, POWER_SAVE_ROUND_TIMEOUT_MS - (time - s_round_opened_at));
+    return true;
+}
+
+static unsigned long watch_job(unsigned long time) {
+    if (comm_is_scheduled(&s_switch_job)) {
+        return CHANNEL_SEARCH_DWELL_MS;
+    }
+
+    if (!s_searching) {
+        if (power_save_dozing()) {
+            /* We hear only a fraction of the frames, a channel switch is repeated until we get it */
+            s_last_heard = time;
+        }
+        if (time - s_last_heard < CHANNEL_LOST_TIMEOUT_MS) {
+            return CHANNEL_LOST_TIMEOUT_MS - (time - s_last_heard);
+        }
+        log_i("Lost the network on channel %d, searching...", s_channel);
+        s_searching    = true;
+        s_search_steps = 0;
+    } else if (time - s_last_heard < CHANNEL_SEARCH_DWELL_MS) {
+        log_i("Found the network on channel %d.", s_channel);
+        s_searching = false;
+        save_channel();
+        return CHANNEL_LOST_TIMEOUT_MS;
+    }
+
+    if (s_search_steps == CHANNEL_MAX - CHANNEL_MIN + 1) {
+        /* Back on our original channel, nobody is around. Try again later. */
+        s_searching  = false;
+        s_last_heard = time;
+        return CHANNEL_LOST_TIMEOUT_MS;
+    }
+
+    s_search_steps++;
+    set_channel((s_channel - CHANNEL_MIN + 1) % (CHANNEL_MAX - CHANNEL_MIN + 1) + CHANNEL_MIN);
+    send_join_announcement(); // Anyone hearing this replies
+    return CHANNEL_SEARCH_DWELL_MS;
+}
+
+void channel_init() {
+    if (is_valid_channel(nvm_data.channel)) {
+        s_channel = nvm_data.channel;
+    }
+    ESP_ERROR_CHECK(esp_wifi_set_channel(s_channel, WIFI_SECOND_CHAN_NONE));
+}
+
+uint8_t channel_current() {
+    return s_channel;
+}
+
+void channel_start() {
+    s_last_heard = millis();
+    if (has_external_power) {
+#if CHANNEL_SELECT_ON_BOOT
+        channel_migrate(0);
+#endif
+    } else {
+        comm_schedule(&s_watch_job, CHANNEL_LOST_TIMEOUT_MS);
+    }
+}
+
+void channel_heard_peer(unsigned long time) {
+    s_last_heard = time;
+}
+
+void channel_migrate(uint8_t channel) {
+    if (defer_in_round(channel)) {
+        return;
+    }
+    comm_unschedule(&s_deferred_job); // Superseded
+    if (channel == 0) {
+        if (!s_scanning && start_scan()) {
+            comm_schedule(&s_scan_timeout_job, CHANNEL_SCAN_TIMEOUT_MS);
+        }
+        return; // Continued in channel_scan_done()
+    }
+    if (!is_valid_channel(channel)) {
+        log_e("Invalid channel %d", channel);
+        return;
+    }
+    if (channel == s_channel) {
+        log_d("Staying on channel %d.", channel);
+        return;
+    }
+
+    payload_command_t command = {
+        .command = COMMAND_SWITCH_CHANNEL,
+        .args    = {},
+    };
+    command.args.switch_channel.channel = channel;
+    command.args.switch_channel.at_us   = timesync_now_us() + CHANNEL_SWITCH_DELAY_MS * 1000LL;
+
+    log_i("Moving the network to channel %d.", channel);
+    executeCommand(s_broadcast_mac, &command, sizeof(payload_command_t)); // Switches us as well
+}
+
+void channel_scan_done() {
+    static wifi_ap_record_t records[CHANNEL_SCAN_MAX_APS];
+
+    if (!s_scanning) {
+        esp_wifi_clear_ap_list(); // Given up on, or stopped for a round
+        return;
+    }
+    comm_unschedule(&s_scan_timeout_job);
+
+    uint16_t num  = CHANNEL_SCAN_MAX_APS;
+    esp_err_t ret = esp_wifi_scan_get_ap_records(&num, records);
+    end_scan();
+    if (ret != ESP_OK) {
+        log_e("Channel scan failed: %s", esp_err_to_name(ret));
+        return;
+    }
+    channel_migrate(quietest_channel(records, num));
+}
+
+void channel_set_round(bool open, unsigned long time) {
+    s_round_open      = open;
+    s_round_opened_at = time;
+
+    if (open && s_scanning) {
+        /* Listen to the round instead, and scan again after it */
+        log_i("A round started, stopping the channel scan.");
+        comm_unschedule(&s_scan_timeout_job);
+        esp_wifi_scan_stop();
+        end_scan();
+        defer_in_round(0);
+    } else if (!open && comm_is_scheduled(&s_deferred_job)) {
+        comm_schedule(&s_deferred_job, 0);
+    }
+}
+
+void channel_schedule_switch(uint8_t channel, int64_t at_us) {
+    if (!is_valid_channel(channel)) {
+        log_e("Invalid channel %d", channel);
+        return;
+    }
+
+    /* Without a synced clock, at_us means nothing to us. The command went out well before the switch, so we are
+     * still on time by waiting for less than the full delay. */
+    int64_t delay_us = (timesync_is_synced() || timesync_is_master()) ? at_us - timesync_now_us() : CHANNEL_SWITCH_DELAY_MS * 1000LL / 2;
+
+    s_pending_channel = channel;
+    comm_schedule(&s_switch_job, delay_us > 0 ? delay_us / 1000 : 0);
+}
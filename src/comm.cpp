@@ -7,15 +7,30 @@
 #include "freertos/timers.h"
 #include "nvs_flash.h"
 #include "esp_random.h"
-#include "esp_event.h"
-#include "esp_netif.h"
-#include "esp_wifi.h"
 #include "esp_log.h"
 #include "esp_mac.h"
 #include "esp_now.h"
 #include "esp_crc.h"
+#include "esp_event.h"
 #include "esp32-hal-log.h"
 #include "comm.h"
+#include "peer_table.h"
+#include "comm_scheduler.h"
+#include "timesync.h"
+#include "command_delivery.h"
+#include "link_stats.h"
+#include "rssi_filter.h"
+#include "relay.h"
+#include "channel.h"
+#include "phy.h"
+#include "power_save.h"
+#include "arbitration.h"
+#include "tx.h"
+#include "journal.h"
+#include "buzz_trace.h"
+#include "dispatcher.h"
+#include "transports/ITransport.h"
+#include "esp_timer.h"
 #include <WiFi.h>
 #include "battery.h"
 #include <map>
@@ -27,11 +42,37 @@
 #define FASTLED_INTERNAL
 #include <FastLED.h>
 
-#define ESPNOW_MAXDELAY         512
-#define ESPNOW_QUEUE_SIZE       10
-#define IS_BROADCAST_ADDR(addr) (memcmp(addr, s_broadcast_mac, ESP_NOW_ETH_ALEN) == 0)
+#define ESPNOW_MAXDELAY              512
+#define ESPNOW_QUEUE_SIZE            10
+#define ESPNOW_HIGH_QUEUE_SIZE       6
+#define ESPNOW_POOL_RESERVED         3 // Packet slots only received frames of the high priority lane may use
+#define ESPNOW_POOL_COMMAND_RESERVED 2 // Packet slots only the commands we send may use
+#define ESPNOW_PACKET_POOL_SIZE      (ESPNOW_QUEUE_SIZE + ESPNOW_HIGH_QUEUE_SIZE + 2 + ESPNOW_POOL_COMMAND_RESERVED) // Every queue entry plus the one being processed and one being received
+#define IS_BROADCAST_ADDR(addr)      (memcmp(addr, s_broadcast_mac, ESP_NOW_ETH_ALEN) == 0)
+
+#define CLEANUP_INTERVAL_MS             5000
+#define SHUTDOWN_CHECK_INTERVAL_MS      5000 // Upper bound, so that unplugging external power is noticed
+#define PING_DISABLED_CHECK_INTERVAL_MS 1000
+
+/* comm_task is fed by two lanes: buzzes, lockouts (state updates and commands) and their acknowledgements go through
+ * s_comm_queue_high, so they never wait behind (or get dropped because of) pings, join announcements and send callbacks
+ * in s_comm_queue. Every posted event is counted in s_comm_events, which is what comm_task actually waits on. */
+typedef enum {
+    COMM_LANE_LOW,
+    COMM_LANE_HIGH,
+} comm_lane_t;
 
 static QueueHandle_t s_comm_queue;
+static QueueHandle_t s_comm_queue_high;
+static SemaphoreHandle_t s_comm_events;
+static TaskHandle_t s_comm_task;
+
+/* Received frames are copied into one of these preallocated slots in the WiFi task and handed to comm_task by index.
+ * The indices of all free slots are kept in s_packet_pool_free, so neither side ever touches the heap. */
+static espnow_data_t s_packet_pool[ESPNOW_PACKET_POOL_SIZE];
+static QueueHandle_t s_packet_pool_free;
+
+comm_stats_t comm_stats = {};
 
 uint8_t comm_task_started                 = false;
 uint8_t s_broadcast_mac[ESP_NOW_ETH_ALEN] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
@@ -39,53 +80,43 @@ uint8_t my_mac_addr[ESP_NOW_ETH_ALEN]     = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
 
 uint16_t pingInterval = DEFAULT_PING_INTERVAL;
 
-peer_data_t peer_data_table[PEER_DATA_TABLE_ENTRIES];
-
 static espnow_data_t s_my_broadcast_info = {
     .type    = ESP_DATA_TYPE_JOIN_ANNOUNCEMENT,
     .payload = {
         .node_info = {
-            .version            = VERSION_CODE,
-            .color              = COLOR_RED,
-            .rgb                = { 255, 0, 0 },
-            .current_state      = STATE_DEFAULT,
-            .current_mode       = MODE_DEFAULT,
-            .current_mode_state = { .node_state_default = MODE_DEFAULT_STATE_IDLE },
+            .version                    = VERSION_CODE,
+            .node_type                  = NODE_TYPE_BUZZER,
+            .battery_percent            = 0,
+            .battery_voltage            = 0,
+            .color                      = COLOR_RED,
+            .rgb                        = { 255, 0, 0 },
+            .key_config                 = { .modifiers = 0, .scan_code = 0 },
+            .current_state              = STATE_DEFAULT,
+            .current_mode               = MODE_DEFAULT,
+            .current_mode_state         = { .node_state_default = MODE_DEFAULT_STATE_IDLE },
+            .buzzer_active_remaining_ms = 0,
         } }
 };
 
 unsigned long time_of_last_keep_alive_communication = 0;
 unsigned long time_of_last_seen_peer                = 0;
 
-static esp_now_peer_info_t *malloc_peer_info(const uint8_t *mac) {
-    esp_now_peer_info_t *peer = (esp_now_peer_info_t *)malloc(sizeof(esp_now_peer_info_t));
-    if (peer == NULL) {
-        log_e("Malloc peer information fail");
-        // vSemaphoreDelete(s_espnow_queue);
-        // esp_now_deinit();
-        // return ESP_FAIL;
-    }
-    memset(peer, 0, sizeof(esp_now_peer_info_t));
-    peer->channel = CONFIG_ESPNOW_CHANNEL;
-    peer->ifidx   = ESPNOW_WIFI_IF;
-
-    peer->encrypt = false;
-#ifdef CONFIG_ESPNOW_ENCRYPT
-    if (!IS_BROADCAST_ADDR(mac)) {
-        peer->encrypt = true;
-        memcpy(peer->lmk, CONFIG_ESPNOW_LMK, ESP_NOW_KEY_LEN);
-    }
-#else
-#endif
-
-    memcpy(peer->peer_addr, mac, ESP_NOW_ETH_ALEN);
-
-    return peer;
-}
+static unsigned long time_of_last_keyframe = 0; // millis() at which we last broadcast our full state
+static unsigned long time_of_last_join     = 0; // millis() at which we received the latest join announcement
 
 typedef enum {
     ESPNOW_SEND_CB,
     ESPNOW_RECV_CB,
+    ESPNOW_SEND_COMMAND,
+    ESPNOW_CHANNEL_MIGRATE,
+    ESPNOW_CHANNEL_SCAN_DONE,
+    ESPNOW_CHANNEL_SWITCH,
+    ESPNOW_PHY_SWITCH,
+    ESPNOW_ROUND_START,
+    ESPNOW_ROUND_END,
+    ESPNOW_POWER_SAVE_UPDATE,
+    ESPNOW_BUZZ_CLAIMED,
+    ESPNOW_BUZZ_DECIDED,
 } espnow_event_id_t;
 
 typedef struct {
@@ -95,13 +126,44 @@ typedef struct {
 
 typedef struct {
     uint8_t mac_addr[ESP_NOW_ETH_ALEN];
-    uint8_t *data;
+    uint8_t slot; /* Index into s_packet_pool */
     int data_len;
+    int64_t rx_time_us; /* esp_timer_get_time() when the frame was handed to us */
 } espnow_event_recv_cb_t;
 
+/* A command frame to relay, handed from the USB/bluetooth tasks to comm_task */
+typedef struct {
+    uint8_t mac_addr[ESP_NOW_ETH_ALEN];
+    uint8_t slot; /* Index into s_packet_pool */
+    int data_len;
+    uint16_t seq;
+    command_t command;
+} espnow_event_send_command_t;
+
+/* A channel change requested by a host (migrate) or announced by the controller (switch) */
+typedef struct {
+    uint8_t channel;
+    int64_t at_us;
+} espnow_event_channel_t;
+
+/* A PHY switch announced by the controller */
+typedef struct {
+    phy_mode_t mode;
+    int64_t at_us;
+} espnow_event_phy_t;
+
+/* Our own buzz claim, sent from the button task */
+typedef struct {
+    payload_buzz_t buzz;
+} espnow_event_buzz_t;
+
 typedef union {
     espnow_event_send_cb_t send_cb;
     espnow_event_recv_cb_t recv_cb;
+    espnow_event_send_command_t send_command;
+    espnow_event_channel_t channel;
+    espnow_event_phy_t phy;
+    espnow_event_buzz_t buzz;
 } espnow_event_info_t;
 
 /* When ESPNOW sending or receiving callback function is called, post event to ESPNOW task. */
@@ -110,6 +172,91 @@ typedef struct {
     espnow_event_info_t info;
 } espnow_event_t;
 
+/* Who a packet slot is for. Each leaves the others' reserved slots alone. */
+typedef enum {
+    POOL_RX_LOW,  // A received frame of the low priority lane
+    POOL_RX_HIGH, // A received frame of the high priority lane
+    POOL_COMMAND, // A command we send (from any task), so a burst of received frames cannot starve the host's commands
+} pool_user_t;
+
+static espnow_data_t *packet_pool_alloc(uint8_t *slot, pool_user_t user) {
+    UBaseType_t keep_free = 0;
+    switch (user) {
+        case POOL_RX_LOW:
+            keep_free = ESPNOW_POOL_RESERVED + ESPNOW_POOL_COMMAND_RESERVED;
+            break;
+        case POOL_RX_HIGH:
+            keep_free = ESPNOW_POOL_COMMAND_RESERVED;
+            break;
+        case POOL_COMMAND:
+            keep_free = ESPNOW_POOL_RESERVED;
+            break;
+    }
+    if (uxQueueMessagesWaiting(s_packet_pool_free) <= keep_free) {
+        return NULL;
+    }
+    if (xQueueReceive(s_packet_pool_free, slot, 0) != pdTRUE) {
+        return NULL;
+    }
+
+    uint8_t in_use = ESPNOW_PACKET_POOL_SIZE - uxQueueMessagesWaiting(s_packet_pool_free);
+    if (in_use > comm_stats.rx_pool_peak_in_use) {
+        comm_stats.rx_pool_peak_in_use = in_use;
+    }
+    return &s_packet_pool[*slot];
+}
+
+static void packet_pool_free(uint8_t slot) {
+    xQueueSend(s_packet_pool_free, &slot, 0);
+}
+
+static bool post_event(const espnow_event_t *evt, comm_lane_t lane, TickType_t ticks_to_wait) {
+    if (xQueueSend(lane == COMM_LANE_HIGH ? s_comm_queue_high : s_comm_queue, evt, ticks_to_wait) != pdTRUE) {
+        return false;
+    }
+    xSemaphoreGive(s_comm_events);
+    return true;
+}
+
+static void handle_own_event(const espnow_event_t *evt, unsigned long time);
+
+/* For the events that the command handlers post. comm_task runs them itself right away: waiting for room in its own
+ * queue would never end, and they are due before anything else it has queued. */
+static bool post_own_event(const espnow_event_t *evt, comm_lane_t lane) {
+    if (xTaskGetCurrentTaskHandle() == s_comm_task) {
+        handle_own_event(evt, millis());
+        return true;
+    }
+    return post_event(evt, lane, ESPNOW_MAXDELAY);
+}
+
+/* Waits for the next event, high priority lane first */
+static bool receive_event(espnow_event_t *evt, TickType_t ticks_to_wait) {
+    if (xSemaphoreTake(s_comm_events, ticks_to_wait) != pdTRUE) {
+        return false;
+    }
+    return xQueueReceive(s_comm_queue_high, evt, 0) == pdTRUE || xQueueReceive(s_comm_queue, evt, 0) == pdTRUE;
+}
+
+/* Only needs to look at the type, this runs in the WiFi task */
+static inline comm_lane_t classify_frame(const uint8_t *data, int len) {
+    switch ((espnow_data_type_t)data[0]) {
+        case ESP_DATA_TYPE_RELAY:
+            /* By what they carry */
+            return len > (int)RELAY_FRAME_OFFSET ? classify_frame(data + RELAY_FRAME_OFFSET, len - RELAY_FRAME_OFFSET) : COMM_LANE_LOW;
+        case ESP_DATA_TYPE_BUZZ:
+        case ESP_DATA_TYPE_BUZZ_DECISION:
+        case ESP_DATA_TYPE_STATE_UPDATE:
+        case ESP_DATA_TYPE_STATE_DELTA:
+        case ESP_DATA_TYPE_COMMAND:
+        case ESP_DATA_TYPE_COMMAND_ACK:
+        case ESP_DATA_TYPE_MULTICAST_COMMAND:
+            return COMM_LANE_HIGH;
+        default:
+            return COMM_LANE_LOW;
+    }
+}
+
 /* ESPNOW sending or receiving callback function is called in WiFi task.
  * Users should not do lengthy operations from this task. Instead, post
  * necessary data to a queue and handle it from a lower priority task. */
@@ -122,17 +269,32 @@ static void espnow_send_cb(const uint8_t *mac_addr, esp_now_send_status_t status
         return;
     }
 
+    /* Account for it right here, the event may not make it into the queue */
+    tx_send_done(mac_addr, status);
+
     evt.id = ESPNOW_SEND_CB;
     memcpy(send_cb->mac_addr, mac_addr, ESP_NOW_ETH_ALEN);
     send_cb->status = status;
-    if (xQueueSend(s_comm_queue, &evt, ESPNOW_MAXDELAY) != pdTRUE) {
+    /* Don't block the WiFi task, it is delivering the frames of the high priority lane, too */
+    if (!post_event(&evt, COMM_LANE_LOW, 0)) {
+        comm_stats.tx_cb_queue_full++;
         log_w("Send send queue fail");
     }
 }
 
+/* Runs in the event loop task, the scan result is picked up by comm_task */
+static void wifi_scan_done_cb(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data) {
+    espnow_event_t evt;
+    evt.id = ESPNOW_CHANNEL_SCAN_DONE;
+    if (!post_event(&evt, COMM_LANE_LOW, 0)) {
+        log_w("Send queue full. Channel scan result lost.");
+    }
+}
+
 // static void espnow_recv_cb(const esp_now_recv_info_t * esp_now_info, const uint8_t *data, int len)
 static void espnow_recv_cb(const uint8_t *src_addr, const uint8_t *data, int len) {
     // const uint8_t *src_addr = esp_now_info->src_addr;
+    int64_t rx_time_us = esp_timer_get_time(); // As early as possible, this is a time sync sample
     espnow_event_t evt;
     espnow_event_recv_cb_t *recv_cb = &evt.info.recv_cb;
     const uint8_t *mac_addr         = src_addr;
@@ -143,18 +305,54 @@ static void espnow_recv_cb(const uint8_t *src_addr, const uint8_t *data, int len
         return;
     }
 
+    if ((size_t)len > sizeof(espnow_data_t)) {
+        comm_stats.rx_oversized++;
+        log_w("Received oversized frame (%d bytes). Dropping message.", len);
+        return;
+    }
+
+    comm_lane_t lane = classify_frame(data, len);
+
     evt.id = ESPNOW_RECV_CB;
     memcpy(recv_cb->mac_addr, mac_addr, ESP_NOW_ETH_ALEN);
-    recv_cb->data = (uint8_t *)malloc(len);
-    if (recv_cb->data == NULL) {
-        log_e("Malloc receive data fail");
+    espnow_data_t *packet = packet_pool_alloc(&recv_cb->slot, lane == COMM_LANE_HIGH ? POOL_RX_HIGH : POOL_RX_LOW);
+    if (packet == NULL) {
+        if (lane == COMM_LANE_HIGH) {
+            comm_stats.rx_high_dropped++;
+        } else {
+            comm_stats.rx_pool_exhausted++;
+        }
+        log_w("Packet pool exhausted. Dropping message.");
         return;
     }
-    memcpy(recv_cb->data, data, len);
-    recv_cb->data_len = len;
-    if (xQueueSend(s_comm_queue, &evt, ESPNOW_MAXDELAY) != pdTRUE) {
+    memcpy(packet, data, len);
+    /* Zero the tail, so short frames never expose a previous packet's data */
+    memset((uint8_t *)packet + len, 0, sizeof(espnow_data_t) - len);
+    recv_cb->data_len   = len;
+    recv_cb->rx_time_us = rx_time_us;
+    if (!post_event(&evt, lane, 0)) {
+        if (lane == COMM_LANE_HIGH) {
+            comm_stats.rx_high_dropped++;
+        } else {
+            comm_stats.rx_queue_full++;
+        }
         log_w("Receive queue full. Dropping message.");
-        free(recv_cb->data);
+        packet_pool_free(recv_cb->slot);
+        return;
+    }
+    comm_stats.rx_frames++;
+    if (lane == COMM_LANE_HIGH) {
+        comm_stats.rx_high_frames++;
+    }
+}
+
+/* Also called in the WiFi task, for every frame heard (even if it was meant for another node) */
+static void espnow_rssi_cb(const uint8_t *mac_addr, int8_t rssi) {
+    peer_data_t *peer_data;
+    /* Runs in the WiFi task, the sample is lost if comm_task is just changing the peer table */
+    if (get_peer_info_concurrent(mac_addr, &peer_data) == ESP_OK) {
+        rssi_filter_update(peer_data, rssi);
+        log_v("Packet from " MACSTR ": RSSI = %ddBm", MAC2STR(mac_addr), rssi);
     }
 }
 
@@ -189,118 +387,247 @@ void update_my_info() {
     peer_data_table[0].node_info         = s_my_broadcast_info.payload.node_info;
 }
 
-void send_state_update() {
-    update_my_info();
+#define NODE_INFO_FIELD(field) { offsetof(payload_node_info_t, field), sizeof(((payload_node_info_t *)0)->field) }
+
+/* The fields of payload_node_info_t, in the bit order of payload_node_info_delta_t::changed_fields */
+static const struct {
+    uint8_t offset;
+    uint8_t size;
+} node_info_fields[] = {
+    NODE_INFO_FIELD(version),
+    NODE_INFO_FIELD(node_type),
+    NODE_INFO_FIELD(battery_percent),
+    NODE_INFO_FIELD(battery_voltage),
+    NODE_INFO_FIELD(color),
+    NODE_INFO_FIELD(rgb),
+    NODE_INFO_FIELD(key_config),
+    NODE_INFO_FIELD(current_state),
+    NODE_INFO_FIELD(current_mode),
+    NODE_INFO_FIELD(current_mode_state),
+    NODE_INFO_FIELD(buzzer_active_remaining_ms),
+};
+#define NUM_NODE_INFO_FIELDS (sizeof(node_info_fields) / sizeof(node_info_fields[0]))
+static_assert(NUM_NODE_INFO_FIELDS <= 16, "changed_fields has too few bits");
 
-    esp_err_t ret = esp_now_send(s_broadcast_mac, (const uint8_t *)&s_my_broadcast_info, sizeof(s_my_broadcast_info));
-    if (ret == ESP_OK) {
-        log_d("Broadcasting node information.");
-    } else {
-        log_e("Send error: %s", esp_err_to_name(ret));
-    }
+/* Changes to these fields are always sent as keyframe, so peers that missed a keyframe never miss a state transition (e.g. a buzz) */
+#define NODE_INFO_KEYFRAME_FIELDS ((1 << 0) | (1 << 1) | (1 << 7) | (1 << 8) | (1 << 9)) /* version, node_type, current_state, current_mode, current_mode_state */
+
+static SemaphoreHandle_t s_state_update_mutex;
+static payload_node_info_t s_keyframe;                            /* The last full node info we broadcast */
+static uint16_t s_keyframe_crc;                                   /* CRC of s_keyframe */
+static uint8_t s_deltas_since_keyframe = STATE_KEYFRAME_INTERVAL; /* Forces the first update to be a keyframe */
+
+static uint16_t node_info_crc(const payload_node_info_t *node_info) {
+    return esp_rom_crc16_be(0, (const uint8_t *)node_info, sizeof(payload_node_info_t));
 }
 
-static esp_err_t get_peer_info(const uint8_t *mac_addr, peer_data_t **data) {
-    if (mac_addr == NULL || data == NULL) {
-        return ESP_ERR_ESPNOW_ARG;
+/* Stores all fields of node_info that differ from keyframe in delta, returns the number of data bytes used */
+static uint8_t encode_node_info_delta(const payload_node_info_t *keyframe, const payload_node_info_t *node_info, payload_node_info_delta_t *delta) {
+    uint8_t len           = 0;
+    delta->changed_fields = 0;
+    for (uint8_t i = 0; i < NUM_NODE_INFO_FIELDS; i++) {
+        const uint8_t *field = (const uint8_t *)node_info + node_info_fields[i].offset;
+        if (memcmp(field, (const uint8_t *)keyframe + node_info_fields[i].offset, node_info_fields[i].size) != 0) {
+            delta->changed_fields |= (1 << i);
+            memcpy(&delta->data[len], field, node_info_fields[i].size);
+            len += node_info_fields[i].size;
+        }
     }
+    return len;
+}
+
+/* Applies delta on top of node_info (which must hold the keyframe), returns false if the delta is malformed */
+static bool apply_node_info_delta(payload_node_info_t *node_info, const payload_node_info_delta_t *delta, int data_len) {
+    int offset = 0;
+    for (uint8_t i = 0; i < NUM_NODE_INFO_FIELDS; i++) {
+        if ((delta->changed_fields & (1 << i)) == 0) { continue; }
 
-    for (uint8_t i = 0; i < PEER_DATA_TABLE_ENTRIES; i++) {
-        if (memcmp(peer_data_table[i].mac_addr, mac_addr, ESP_NOW_ETH_ALEN) == 0) {
-            *data = &peer_data_table[i];
-            return ESP_OK;
+        if (offset + node_info_fields[i].size > data_len) {
+            return false;
         }
+        memcpy((uint8_t *)node_info + node_info_fields[i].offset, &delta->data[offset], node_info_fields[i].size);
+        offset += node_info_fields[i].size;
     }
-
-    return ESP_ERR_ESPNOW_NOT_FOUND;
+    return true;
 }
 
-static esp_err_t get_or_create_peer_info(const uint8_t *mac_addr, peer_data_t **data) {
-    if (mac_addr == NULL || data == NULL) {
-        return ESP_ERR_ESPNOW_ARG;
+/* Broadcasts our node info, either in full (keyframe) or as delta to the last keyframe if that is shorter.
+ * Returns ESP_ERR_ESPNOW_NO_MEM if a low priority update was deferred (see tx.h). */
+static esp_err_t broadcast_state(bool keyframe, tx_prio_t prio) {
+    xSemaphoreTake(s_state_update_mutex, portMAX_DELAY);
+    update_my_info();
+    peer_table_changed(); // Our own entry
+
+    const payload_node_info_t *node_info = &s_my_broadcast_info.payload.node_info;
+
+    espnow_data_t delta_frame;
+    size_t delta_size = 0;
+    if (!keyframe && s_deltas_since_keyframe < STATE_KEYFRAME_INTERVAL) {
+        delta_frame.type                             = ESP_DATA_TYPE_STATE_DELTA;
+        delta_frame.payload.node_info_delta.base_crc = s_keyframe_crc;
+        delta_size                                   = offsetof(espnow_data_t, payload.node_info_delta.data) + encode_node_info_delta(&s_keyframe, node_info, &delta_frame.payload.node_info_delta);
+        if ((delta_frame.payload.node_info_delta.changed_fields & NODE_INFO_KEYFRAME_FIELDS) != 0) {
+            delta_size = 0;
+        }
     }
 
-    for (uint8_t i = 0; i < PEER_DATA_TABLE_ENTRIES; i++) {
-        if (memcmp(peer_data_table[i].mac_addr, mac_addr, ESP_NOW_ETH_ALEN) == 0) {
-            *data = &peer_data_table[i];
-            return ESP_OK;
+    esp_err_t ret;
+    if (delta_size > 0 && delta_size < ESPNOW_DATA_SIZE(node_info)) {
+        ret = tx_send(s_broadcast_mac, &delta_frame, delta_size, prio);
+        if (ret == ESP_OK) {
+            s_deltas_since_keyframe++;
+            comm_stats.tx_deltas++;
+        }
+    } else {
+        ret = tx_send(s_broadcast_mac, &s_my_broadcast_info, ESPNOW_DATA_SIZE(node_info), prio);
+        if (ret == ESP_OK) {
+            s_keyframe              = *node_info;
+            s_keyframe_crc          = node_info_crc(node_info);
+            s_deltas_since_keyframe = 0;
+            time_of_last_keyframe   = millis();
+            comm_stats.tx_keyframes++;
         }
     }
+    xSemaphoreGive(s_state_update_mutex);
 
-    for (uint8_t i = 0; i < PEER_DATA_TABLE_ENTRIES; i++) {
-        if (memcmp(peer_data_table[i].mac_addr, s_broadcast_mac, ESP_NOW_ETH_ALEN) == 0) {
-            memset(&peer_data_table[i], 0, sizeof(peer_data_t));
-            memcpy(&peer_data_table[i].mac_addr, mac_addr, ESP_NOW_ETH_ALEN);
-
-            *data = &(peer_data_table[i]);
-            return ESP_OK;
-        }
+    if (ret == ESP_OK) {
+        log_d("Broadcasting node information.");
+    } else if (ret != ESP_ERR_ESPNOW_NO_MEM || prio == TX_PRIO_HIGH) {
+        log_e("Send error: %s", esp_err_to_name(ret));
     }
+    return ret;
+}
 
-    return ESP_ERR_ESPNOW_FULL;
+void send_state_update() {
+    broadcast_state(false, TX_PRIO_HIGH);
 }
 
-static esp_err_t remove_peer_info(const uint8_t *mac_addr) {
-    if (mac_addr == NULL) {
-        return ESP_ERR_ESPNOW_ARG;
+void send_buzz_claim(int64_t press_time_us, int64_t press_local_us) {
+    espnow_data_t claim = {
+        .type    = ESP_DATA_TYPE_BUZZ,
+        .payload = {
+            .buzz = {
+                .press_time_us = press_time_us,
+                .stratum       = timesync_stratum(),
+                .trace_id      = buzz_trace_next_id(),
+                .send_delay_us = 0, // Set right before sending
+                .attempt       = 0,
+            },
+        },
+    };
+
+    /* As late as possible, tx_send hands the frame to the transport right away */
+    claim.payload.buzz.send_delay_us = (uint32_t)MIN(esp_timer_get_time() - press_local_us, (int64_t)UINT32_MAX);
+    esp_err_t ret = tx_send(s_broadcast_mac, &claim, ESPNOW_DATA_SIZE(buzz), TX_PRIO_HIGH);
+    if (ret != ESP_OK) {
+        log_e("Send error: %s", esp_err_to_name(ret));
     }
-    for (uint8_t i = 0; i < PEER_DATA_TABLE_ENTRIES; i++) {
-        if (memcmp(peer_data_table[i].mac_addr, mac_addr, ESP_NOW_ETH_ALEN) == 0) {
-            memset(peer_data_table[i].mac_addr, 0xFF, ESP_NOW_ETH_ALEN);
-            return ESP_OK;
-        }
+
+    /* Retransmitted until the arbiter decides, see arbitration.h */
+    espnow_event_t evt;
+    evt.id             = ESPNOW_BUZZ_CLAIMED;
+    evt.info.buzz.buzz = claim.payload.buzz;
+    /* Called from the button task, which must not wait for comm_task */
+    if (!post_event(&evt, COMM_LANE_HIGH, 0)) {
+        log_w("Send queue full. Not repeating the buzz claim.");
     }
+}
+
+void send_buzz_decision(const payload_buzz_decision_t *decision) {
+    arbitration_set_decision(decision);
 
-    return ESP_ERR_ESPNOW_NOT_FOUND;
+    espnow_event_t evt;
+    evt.id = ESPNOW_BUZZ_DECIDED;
+    if (!post_event(&evt, COMM_LANE_HIGH, 0)) {
+        log_e("Send queue full. Cannot send the buzz decision.");
+    }
 }
 
-void send_ping(const uint8_t *mac_addr) {
+static void send_command_ack(const uint8_t *mac_addr, const payload_command_frame_t *frame, command_result_t result) {
+    espnow_data_t ack = {
+        .type    = ESP_DATA_TYPE_COMMAND_ACK,
+        .payload = {
+            .command_ack = {
+                .seq     = frame->seq,
+                .attempt = frame->attempt,
+                .result  = result,
+            },
+        },
+    };
+
+    esp_err_t ret = relay_send(mac_addr, &ack, ESPNOW_DATA_SIZE(command_ack));
+    if (ret != ESP_OK) {
+        log_e("Send error: %s", esp_err_to_name(ret));
+    }
+}
+
+/* Returns ESP_ERR_ESPNOW_NO_MEM if the ping was deferred (see tx.h) */
+static esp_err_t send_ping(const uint8_t *mac_addr) {
     espnow_data_t ping = {
         .type    = ESP_DATA_TYPE_PING_PONG,
         .payload = {
             .ping_pong = {
-                .stage      = PING_PONG_STAGE_PING,
-                .latency_us = 0,
-                .rssi       = 0,
+                .stage         = PING_PONG_STAGE_PING,
+                .latency_us    = 0,
+                .rssi          = 0,
+                .stratum       = 0, // The time sample is up to timesync_prepare_ping
+                .tx_local_us   = 0,
+                .echo_us       = 0,
+                .hold_us       = 0,
+                .tx_network_us = 0,
             },
         },
     };
 
     peer_data_t *peer_data;
     ESP_ERROR_CHECK(get_or_create_peer_info(mac_addr, &peer_data));
+    if (relay_is_indirect(get_peer_state(peer_data))) {
+        /* Pings measure the direct link, there is none */
+        return ESP_OK;
+    }
     peer_data->last_sent_ping_us = micros();
 
-    esp_err_t ret = esp_now_send(mac_addr, (const uint8_t *)&ping, sizeof(ping));
+    timesync_prepare_ping(get_peer_state(peer_data), &ping.payload.ping_pong);
+    esp_err_t ret = tx_send(mac_addr, &ping, ESPNOW_DATA_SIZE(ping_pong), TX_PRIO_LOW);
     if (ret == ESP_OK) {
+        link_stats_ping_sent(&get_peer_state(peer_data)->link, millis());
+        peer_table_changed();
         log_v("Pinging %2x:%2x:%2x:%2x:%2x:%2x", mac_addr[0], mac_addr[1], mac_addr[2], mac_addr[3], mac_addr[4], mac_addr[5]);
-    } else {
+    } else if (ret != ESP_ERR_ESPNOW_NO_MEM) {
         log_e("Send error: %s", esp_err_to_name(ret));
     }
+    return ret;
 }
 
-void cleanup_peer_list() {
+static void cleanup_peer_list() {
     if (!comm_task_started) { return; }
 
     bool peer_list_updated = false;
 
     unsigned long time = millis();
     {
+        /* Dozing buzzers only hear a fraction of the announcements */
+        unsigned long remember_ms = SECONDS_TO_REMEMBER_PEERS * 1000UL;
+        if (!has_external_power && nvm_data.power_save == POWER_SAVE_ON) {
+            remember_ms *= POWER_SAVE_REMEMBER_FACTOR;
+        }
+
         bool head = true;
 
-        esp_now_peer_info_t peer;
+        uint8_t peer_addr[ESP_NOW_ETH_ALEN];
         peer_data_t *peer_data;
-        while (esp_now_fetch_peer(head, &peer) == ESP_OK) {
+        while (transport->fetchPeer(head, peer_addr) == ESP_OK) {
             head = false;
 
-            if (get_peer_info(peer.peer_addr, &peer_data) == ESP_OK) {
+            if (get_peer_info(peer_addr, &peer_data) == ESP_OK) {
                 unsigned long timeSinceLastSeen = time - peer_data->last_seen;
-                if (timeSinceLastSeen > SECONDS_TO_REMEMBER_PEERS * 1000) {
-                    log_d("Removing peer " MACSTR ", last seen %.1fs ago.", MAC2STR(peer.peer_addr), timeSinceLastSeen / 1000.0f);
-                    ESP_ERROR_CHECK(esp_now_del_peer(peer.peer_addr));
-                    remove_peer_info(peer.peer_addr);
+                if (timeSinceLastSeen > remember_ms) {
+                    log_d("Removing peer " MACSTR ", last seen %.1fs ago.", MAC2STR(peer_addr), timeSinceLastSeen / 1000.0f);
+                    ESP_ERROR_CHECK(transport->delPeer(peer_addr));
+                    remove_peer_info(peer_addr);
                     peer_list_updated = true;
                 } else {
-                    // log_d("Peer: " MACSTR " last seen %.1fs ago, keeping.", MAC2STR(peer.peer_addr), timeSinceLastSeen / 1000.0f);
+                    // log_d("Peer: " MACSTR " last seen %.1fs ago, keeping.", MAC2STR(peer_addr), timeSinceLastSeen / 1000.0f);
                 }
             }
         }
@@ -316,18 +643,108 @@ void cleanup_peer_list() {
         }
     }
 
-    {
-        esp_now_peer_num_t peer_num;
-        ESP_ERROR_CHECK(esp_now_get_peer_num(&peer_num));
-        log_v("Number of known peers is now: %d", peer_num.total_num - 1);
-    }
+    log_v("Number of known peers is now: %d", transport->peerCount());
 
     if (peer_list_updated) {
         bluetooth_notify_peer_list_changed();
     }
 }
 
-boolean executeCommand(uint8_t mac_addr[6], payload_command_t *command, uint32_t len) {
+static bool post_command(espnow_event_t *evt) {
+    if (!post_own_event(evt, COMM_LANE_HIGH)) {
+        log_e("Send queue full. Cannot relay command.");
+        packet_pool_free(evt->info.send_command.slot);
+        return false;
+    }
+    return true;
+}
+
+/* Moves the network to another channel (0: the quietest one), see channel.h */
+boolean requestChannelMigration(uint8_t channel) {
+    espnow_event_t evt;
+    evt.id                   = ESPNOW_CHANNEL_MIGRATE;
+    evt.info.channel.channel = channel;
+    evt.info.channel.at_us   = 0;
+    return post_event(&evt, COMM_LANE_LOW, ESPNOW_MAXDELAY);
+}
+
+/* Returns whether a multicast command addresses the node with the given MAC */
+static bool is_multicast_target(const payload_multicast_command_t *multicast, const uint8_t *mac_addr) {
+    bool listed = false;
+    for (uint8_t i = 0; i < multicast->num_targets && !listed; i++) {
+        listed = memcmp(multicast->targets[i], mac_addr, ESP_NOW_ETH_ALEN) == 0;
+    }
+    return listed != ((multicast->flags & MULTICAST_FLAG_EXCLUDE) != 0);
+}
+
+/* request: flags (MULTICAST_FLAG_*), num_targets, num_targets MAC addresses, command */
+boolean executeMulticastCommand(const uint8_t *request, uint32_t len, int32_t *seq) {
+    if (seq != NULL) { *seq = -1; }
+    if (len < 2) { return false; }
+
+    uint8_t flags       = request[0];
+    uint8_t num_targets = request[1];
+    uint32_t header_len = 2 + num_targets * ESP_NOW_ETH_ALEN;
+    if (num_targets > MULTICAST_MAX_TARGETS || len < header_len + sizeof(command_t)) {
+        log_e("Invalid multicast command (%d targets, %d bytes).", num_targets, len);
+        return false;
+    }
+
+    espnow_event_t evt;
+    espnow_event_send_command_t *send_command = &evt.info.send_command;
+    evt.id                                    = ESPNOW_SEND_COMMAND;
+    memcpy(send_command->mac_addr, s_broadcast_mac, ESP_NOW_ETH_ALEN);
+
+    espnow_data_t *frame = packet_pool_alloc(&send_command->slot, POOL_COMMAND);
+    if (frame == NULL) {
+        log_e("Packet pool exhausted. Cannot relay command.");
+        return false;
+    }
+
+    payload_multicast_command_t *multicast = &frame->payload.multicast_command;
+    frame->type                            = ESP_DATA_TYPE_MULTICAST_COMMAND;
+    multicast->seq                         = command_delivery_next_seq();
+    multicast->flags                       = flags;
+    multicast->num_targets                 = num_targets;
+    memset(&multicast->command, 0, sizeof(payload_command_t));
+    memcpy(&multicast->command, request + header_len, MIN(len - header_len, sizeof(payload_command_t)));
+    memcpy(multicast->targets, request + 2, num_targets * ESP_NOW_ETH_ALEN);
+
+    send_command->data_len = offsetof(espnow_data_t, payload.multicast_command.targets) + num_targets * ESP_NOW_ETH_ALEN;
+    send_command->seq      = multicast->seq;
+    send_command->command  = multicast->command.command;
+
+    /* We may be addressed ourselves */
+    if (is_multicast_target(multicast, my_mac_addr)) {
+        executeCommand(NULL, &multicast->command, sizeof(payload_command_t));
+    }
+
+    command_delivery_record(s_broadcast_mac, send_command->seq, send_command->command, COMMAND_STATUS_SENT);
+    if (!post_command(&evt)) {
+        return false;
+    }
+    if (seq != NULL) { *seq = send_command->seq; }
+
+    log_d("Relaying multicast command to %s%d nodes...", (flags & MULTICAST_FLAG_EXCLUDE) ? "all but " : "", num_targets);
+    return true;
+}
+
+/* Commands that change the state of the whole network, a broadcast of them applies to us as well */
+static bool is_network_command(command_t command) {
+    switch (command) {
+        case COMMAND_SWITCH_CHANNEL:
+        case COMMAND_SET_PHY:
+        case COMMAND_SET_POWER_SAVE:
+        case COMMAND_ROUND_START:
+        case COMMAND_ROUND_END:
+            return true;
+        default:
+            return false;
+    }
+}
+
+boolean executeCommand(uint8_t mac_addr[6], payload_command_t *command, uint32_t len, int32_t *seq) {
+    if (seq != NULL) { *seq = -1; }
     if (mac_addr != NULL &&
         (mac_addr[0] != 0 ||
          mac_addr[0] != 0 ||
@@ -339,18 +756,39 @@ boolean executeCommand(uint8_t mac_addr[6], payload_command_t *command, uint32_t
         /* Don't execute here, but on peer node */
         log_v("Received a command for another peer.");
 
-        espnow_data_t relayed_command;
-        relayed_command.type = ESP_DATA_TYPE_COMMAND;
+        /* Delivery (and retransmission) is up to comm_task */
+        espnow_event_t evt;
+        espnow_event_send_command_t *send_command = &evt.info.send_command;
+        evt.id                                    = ESPNOW_SEND_COMMAND;
+        memcpy(send_command->mac_addr, mac_addr, ESP_NOW_ETH_ALEN);
 
-        memcpy(&relayed_command.payload.command, command, len);
+        espnow_data_t *relayed_command = packet_pool_alloc(&send_command->slot, POOL_COMMAND);
+        if (relayed_command == NULL) {
+            log_e("Packet pool exhausted. Cannot relay command.");
+            return false;
+        }
 
-        esp_err_t ret = esp_now_send(mac_addr, (uint8_t *)&relayed_command, sizeof(relayed_command));
-        if (ret == ESP_OK) {
-            log_d("Relaying command...");
-        } else {
-            log_e("Send error: %s", esp_err_to_name(ret));
+        bool broadcast                               = IS_BROADCAST_ADDR(mac_addr);
+        len                                          = MIN(len, sizeof(payload_command_t));
+        relayed_command->type                        = ESP_DATA_TYPE_COMMAND;
+        relayed_command->payload.command_frame.seq   = command_delivery_next_seq();
+        relayed_command->payload.command_frame.flags = broadcast ? 0 : COMMAND_FLAG_ACK_REQUESTED;
+        memcpy(&relayed_command->payload.command_frame.command, command, len);
+        send_command->data_len = offsetof(espnow_data_t, payload.command_frame.command) + len;
+        send_command->seq      = relayed_command->payload.command_frame.seq;
+        send_command->command  = command->command;
+
+        command_delivery_record(mac_addr, send_command->seq, command->command, broadcast ? COMMAND_STATUS_SENT : COMMAND_STATUS_PENDING);
+        if (!post_command(&evt)) {
+            return false;
         }
+        if (seq != NULL) { *seq = send_command->seq; }
 
+        log_d("Relaying command...");
+        if (broadcast && is_network_command(command->command)) {
+            /* We are part of the network, too */
+            return executeCommand(NULL, command, len);
+        }
         return true;
     }
 
@@ -406,6 +844,73 @@ boolean executeCommand(uint8_t mac_addr[6], payload_command_t *command, uint32_t
                 return true;
             }
             break;
+        case COMMAND_SET_RELAY_MODE:
+            {
+                relay_mode_t relay_mode = command->args.relay_mode;
+                if (relay_mode != RELAY_MODE_OFF && relay_mode != RELAY_MODE_ON) {
+                    log_e("Received invalid relay mode %d", relay_mode);
+                    return false;
+                }
+                relay_set_mode(relay_mode);
+                return true;
+            }
+            break;
+        case COMMAND_SWITCH_CHANNEL:
+            {
+                /* Switching is up to comm_task */
+                espnow_event_t evt;
+                evt.id                   = ESPNOW_CHANNEL_SWITCH;
+                evt.info.channel.channel = command->args.switch_channel.channel;
+                evt.info.channel.at_us   = command->args.switch_channel.at_us;
+                return post_own_event(&evt, COMM_LANE_HIGH);
+            }
+            break;
+        case COMMAND_SET_PHY:
+            {
+                phy_mode_t mode = command->args.set_phy.mode;
+                if (mode != PHY_MODE_FAST && mode != PHY_MODE_LONG_RANGE) {
+                    log_e("Received invalid PHY mode %d", mode);
+                    return false;
+                }
+                espnow_event_t evt;
+                evt.id             = ESPNOW_PHY_SWITCH;
+                evt.info.phy.mode  = mode;
+                evt.info.phy.at_us = command->args.set_phy.at_us;
+                return post_own_event(&evt, COMM_LANE_HIGH);
+            }
+            break;
+        case COMMAND_SET_POWER_SAVE:
+            {
+                power_save_mode_t power_save = command->args.power_save.mode;
+                /* Hosts that predate the latency send the mode only */
+                uint16_t latency_ms = len >= offsetof(payload_command_t, args.power_save.max_buzz_latency_ms) + sizeof(uint16_t) ? command->args.power_save.max_buzz_latency_ms : 0;
+                if (power_save != POWER_SAVE_OFF && power_save != POWER_SAVE_ON) {
+                    log_e("Received invalid power save mode %d", power_save);
+                    return false;
+                }
+                if (latency_ms != 0 && (latency_ms < POWER_SAVE_MIN_BUZZ_LATENCY_MS || latency_ms > POWER_SAVE_MAX_BUZZ_LATENCY_MS)) {
+                    log_e("Received invalid power save buzz latency %dms", latency_ms);
+                    return false;
+                }
+                bool changed = false;
+                if (nvm_data.power_save != power_save) {
+                    log_d("Power save %s.", power_save == POWER_SAVE_ON ? "enabled" : "disabled");
+                    nvm_data.power_save = power_save;
+                    changed             = true;
+                }
+                if (latency_ms != 0 && nvm_data.power_save_latency_ms != latency_ms) {
+                    log_d("Power save buzz latency %dms.", latency_ms);
+                    nvm_data.power_save_latency_ms = latency_ms;
+                    changed                        = true;
+                }
+                if (changed) {
+                    nvm_save();
+                }
+                espnow_event_t evt;
+                evt.id = ESPNOW_POWER_SAVE_UPDATE;
+                return post_own_event(&evt, COMM_LANE_HIGH);
+            }
+            break;
         case COMMAND_SET_MODE:
             {
                 node_mode_t mode = command->args.mode;
@@ -422,16 +927,17 @@ boolean executeCommand(uint8_t mac_addr[6], payload_command_t *command, uint32_t
             }
             break;
         case COMMAND_BUZZ:
-            modeDefault->buzz();
-            return true;
         case COMMAND_SET_INACTIVE:
-            modeDefault->setActive(true);
-            send_state_update();
-            return true;
         case COMMAND_SET_ACTIVE:
-            modeDefault->setActive(false);
-            send_state_update();
-            return true;
+            /* They change the mode's state, which is up to the main loop */
+            return dispatcher_post_command(command->command);
+        case COMMAND_ROUND_START:
+        case COMMAND_ROUND_END:
+            {
+                espnow_event_t evt;
+                evt.id = command->command == COMMAND_ROUND_START ? ESPNOW_ROUND_START : ESPNOW_ROUND_END;
+                return post_own_event(&evt, COMM_LANE_HIGH);
+            }
         case COMMAND_RESET:
             log_d("Received restart command.");
             esp_restart();
@@ -447,22 +953,310 @@ boolean executeCommand(uint8_t mac_addr[6], payload_command_t *command, uint32_t
     return false;
 }
 
+/* Records what changed about a peer whose previous state we know */
+static void journal_peer_state(const uint8_t *mac_addr, const payload_node_info_t *previous, const payload_node_info_t *received) {
+    if (received->current_mode != previous->current_mode) {
+        journal_record(JOURNAL_MODE_CHANGE, mac_addr, received->current_mode, 0);
+        return;
+    }
+    if (received->current_mode != MODE_DEFAULT || received->current_mode_state.raw == previous->current_mode_state.raw) {
+        return;
+    }
+
+    switch (received->current_mode_state.node_state_default) {
+        case MODE_DEFAULT_STATE_BUZZER_ACTIVE:
+            journal_record(JOURNAL_BUZZER_ACTIVE, mac_addr, 0, received->buzzer_active_remaining_ms);
+            break;
+        case MODE_DEFAULT_STATE_DISABLED:
+            journal_record(JOURNAL_LOCKOUT, mac_addr, 0, 0);
+            break;
+        case MODE_DEFAULT_STATE_IDLE:
+            journal_record(JOURNAL_RELEASED, mac_addr, 0, 0);
+            break;
+    }
+}
+
+static void handle_node_info(const uint8_t *mac_addr, payload_node_info_t *node_info, bool keyframe, unsigned long time) {
+    time_of_last_seen_peer = time;
+    arbitration_node_info(mac_addr, node_info, time); // Even if the peer table is full
+    if (node_info->buzzer_active_remaining_ms > 0) {
+        /* Someone buzzed, wake up for what follows */
+        power_save_activity(time);
+    }
+
+    log_d("Received node state from " MACSTR ": type=%d, color=%d, currentState=%d, battery=%dmV (%d%%)", MAC2STR(mac_addr), node_info->node_type, node_info->color, node_info->current_state, node_info->battery_voltage, node_info->battery_percent);
+
+    boolean notSeenBefore = false;
+    if (transport->hasPeer(mac_addr) == false) {
+        notSeenBefore = true;
+        /* If MAC address does not exist in peer list, add it to peer list. */
+        log_v("Adding peer to list (" MACSTR ").", MAC2STR(mac_addr));
+        esp_err_t ret = transport->addPeer(mac_addr);
+        if (ret == ESP_ERR_ESPNOW_FULL) {
+            log_w("Peer list full, ignoring " MACSTR ".", MAC2STR(mac_addr));
+            comm_stats.rx_peer_table_full++;
+            return;
+        }
+        ESP_ERROR_CHECK(ret);
+    }
+
+    peer_data_t *peer_data;
+    esp_err_t ret = get_or_create_peer_info(mac_addr, &peer_data);
+    if (ret == ESP_ERR_ESPNOW_FULL) {
+        /* More nodes around than we can track, the entries are freed when peers time out */
+        log_w("Peer table full, ignoring " MACSTR ".", MAC2STR(mac_addr));
+        comm_stats.rx_peer_table_full++;
+        if (notSeenBefore) {
+            transport->delPeer(mac_addr);
+        }
+        return;
+    }
+    ESP_ERROR_CHECK(ret);
+
+    if (keyframe) {
+        peer_state_t *peer_state = get_peer_state(peer_data);
+        peer_state->keyframe     = *node_info;
+        peer_state->keyframe_crc = node_info_crc(node_info);
+        peer_state->has_keyframe = true;
+    }
+
+    peer_table_changed();
+    bool known_state         = peer_data->valid_version;
+    peer_data->last_seen     = time;
+    peer_data->valid_version = (node_info->version == VERSION_CODE);
+    if (peer_data->valid_version) {
+        if (known_state) {
+            journal_peer_state(mac_addr, &peer_data->node_info, node_info);
+        }
+        /* The main loop only hears of what the modes care about */
+        bool mode_state_changed = !known_state || peer_data->node_info.current_mode != node_info->current_mode ||
+                                  peer_data->node_info.current_mode_state.raw != node_info->current_mode_state.raw ||
+                                  peer_data->node_info.buzzer_active_remaining_ms != node_info->buzzer_active_remaining_ms;
+        get_current_mode()->onReceiveState(peer_data, node_info);
+        memcpy(&peer_data->node_info, node_info, sizeof(payload_node_info_t));
+        if (mode_state_changed) {
+            dispatcher_post_peer_state(mac_addr);
+        }
+    } else {
+        log_d("Received message from peer with invalid version (%d)", node_info->version);
+    }
+
+    if (notSeenBefore) {
+        /* Ping when we first see them */
+        send_ping(mac_addr);
+    }
+
+    if (node_info->node_type == NODE_TYPE_CONTROLLER) {
+        time_of_last_keep_alive_communication = time; // When a controller is present -> prevent sleeping
+    }
+
+    bluetooth_notify_peer_list_changed();
+}
+
+/* Makes the current peer table (including our own, fresh entry) visible to USB and bluetooth, if anything changed */
+static void publish_peer_snapshot() {
+    if (!peer_table_snapshot_due()) {
+        return;
+    }
+
+    xSemaphoreTake(s_state_update_mutex, portMAX_DELAY);
+    update_my_info();
+    xSemaphoreGive(s_state_update_mutex);
+
+    peer_table_publish_snapshot();
+}
+
+static unsigned long cleanup_job(unsigned long time) {
+    cleanup_peer_list();
+    peer_table_changed(); // Our own entry changes without a broadcast too (battery)
+
+    static UBaseType_t s_stack_warned_at = COMM_TASK_STACK_MARGIN;
+    UBaseType_t stack_unused             = uxTaskGetStackHighWaterMark(NULL);
+    if (stack_unused < s_stack_warned_at) {
+        s_stack_warned_at = stack_unused;
+        log_w("comm_task stack: only %u of %u bytes never used", stack_unused, COMM_TASK_STACK_SIZE);
+    }
+    log_v("comm_task stack: %u of %u bytes never used", stack_unused, COMM_TASK_STACK_SIZE);
+
+    return CLEANUP_INTERVAL_MS;
+}
+
+static unsigned long announcement_job(unsigned long time) {
+    if (broadcast_state(true, TX_PRIO_LOW) == ESP_ERR_ESPNOW_NO_MEM) {
+        return TX_DEFER_RETRY_MS;
+    }
+    return ACCOUNCEMENT_INTERVAL_SECONDS * 1000;
+}
+
+static unsigned long shutdown_job(unsigned long time) {
+    if (has_external_power) {
+        /* Power may be unplugged at any time */
+        return SHUTDOWN_CHECK_INTERVAL_MS;
+    }
+
+    /* The timestamps are reset from other tasks too and may be slightly ahead of time, so compare signed */
+    long idle_no_buzzing = (long)(time - time_of_last_keep_alive_communication);
+    long idle_no_comms   = (long)(time - time_of_last_seen_peer);
+
+    if (idle_no_buzzing > SHUTDOWN_TIME_NO_BUZZING_SECONDS * 1000L) {
+        log_i("Nobody pushing any buttons. Shutting down...");
+        FastLED.setBrightness(10);
+        shutdown(false, true);
+        return COMM_JOB_STOP;
+    } else if (idle_no_comms > SHUTDOWN_TIME_NO_COMMS_SECONDS * 1000L) {
+        log_i("No other buzzer near me. Shutting down...");
+        FastLED.setBrightness(10);
+        shutdown(false, true);
+        return COMM_JOB_STOP;
+    }
+
+    /* Come back when the earlier of both deadlines passes (or power is removed). Resetting a timer only moves the deadline
+     * back, in which case we simply recompute it then. */
+    long remaining = MIN(SHUTDOWN_TIME_NO_BUZZING_SECONDS * 1000L - idle_no_buzzing, SHUTDOWN_TIME_NO_COMMS_SECONDS * 1000L - idle_no_comms) + 1;
+    return MIN(remaining, (long)SHUTDOWN_CHECK_INTERVAL_MS);
+}
+
+static unsigned long ping_job(unsigned long time) {
+    if (pingInterval == 0) {
+        /* Pinging is disabled, check whether it has been re-enabled every now and then */
+        return PING_DISABLED_CHECK_INTERVAL_MS;
+    }
+    if (power_save_network_dozing(time)) {
+        /* Dozing buzzers would miss most pings (or their pongs), which is not what the link stats are about */
+        return pingInterval;
+    }
+
+    /* At most one ping per interval, to the peer that is the most overdue according to its link stability.
+     * If no link is due, the slot is left unused. */
+    bool head = true;
+    uint8_t peer_addr[ESP_NOW_ETH_ALEN];
+    peer_data_t *peer_data;
+    const uint8_t *most_urgent = NULL;
+    uint32_t max_urgency       = 0;
+    while (transport->fetchPeer(head, peer_addr) == ESP_OK) {
+        head = false;
+        if (get_peer_info(peer_addr, &peer_data) != ESP_OK || !peer_data->valid_version || relay_is_indirect(get_peer_state(peer_data))) {
+            continue;
+        }
+
+        uint32_t urgency = link_stats_ping_urgency(&get_peer_state(peer_data)->link, time);
+        if (urgency >= 256 && urgency > max_urgency) {
+            max_urgency = urgency;
+            most_urgent = peer_data->mac_addr;
+        }
+    }
+
+    if (most_urgent != NULL && send_ping(most_urgent) == ESP_ERR_ESPNOW_NO_MEM) {
+        return TX_DEFER_RETRY_MS;
+    }
+
+    return pingInterval;
+}
+
+static unsigned long timesync_job(unsigned long time) {
+    timesync_select_source();
+
+    /* Exchange a time sample with our source, independent of (and more often than) the regular pings */
+    const uint8_t *source = timesync_source();
+    if (source != NULL && send_ping(source) == ESP_ERR_ESPNOW_NO_MEM) {
+        return TX_DEFER_RETRY_MS;
+    }
+    return TIMESYNC_INTERVAL_MS;
+}
+
+esp_err_t send_join_announcement() {
+    s_my_broadcast_info.type = ESP_DATA_TYPE_JOIN_ANNOUNCEMENT;
+    esp_err_t ret            = broadcast_state(true, TX_PRIO_LOW);
+    s_my_broadcast_info.type = ESP_DATA_TYPE_STATE_UPDATE;
+    return ret;
+}
+
+static unsigned long join_job(unsigned long time) {
+    if (send_join_announcement() == ESP_ERR_ESPNOW_NO_MEM) {
+        return TX_DEFER_RETRY_MS;
+    }
+    return COMM_JOB_STOP;
+}
+
+static unsigned long join_reply_job(unsigned long time) {
+    /* Our full state is broadcast, so anything sent since the (latest) join already answered it */
+    if ((long)(time_of_last_keyframe - time_of_last_join) >= 0) {
+        comm_stats.join_replies_saved++;
+        log_v("Join announcement already answered.");
+        return COMM_JOB_STOP;
+    }
+
+    if (broadcast_state(true, TX_PRIO_LOW) == ESP_ERR_ESPNOW_NO_MEM) {
+        return TX_DEFER_RETRY_MS;
+    }
+    comm_stats.tx_join_replies++;
+    return COMM_JOB_STOP;
+}
+
+static comm_job_t s_cleanup_job      = COMM_JOB("cleanup", cleanup_job);
+static comm_job_t s_announcement_job = COMM_JOB("announcement", announcement_job);
+static comm_job_t s_shutdown_job     = COMM_JOB("shutdown", shutdown_job);
+static comm_job_t s_ping_job         = COMM_JOB("ping", ping_job);
+static comm_job_t s_timesync_job     = COMM_JOB("timesync", timesync_job);
+static comm_job_t s_join_job         = COMM_JOB("join", join_job);
+static comm_job_t s_join_reply_job   = COMM_JOB("join_reply", join_reply_job);
+
+/* The events of post_own_event() */
+static void handle_own_event(const espnow_event_t *evt, unsigned long time) {
+    switch (evt->id) {
+        case ESPNOW_SEND_COMMAND:
+            {
+                const espnow_event_send_command_t *send_command = &evt->info.send_command;
+                command_delivery_start(send_command->mac_addr, send_command->seq, send_command->command, &s_packet_pool[send_command->slot], send_command->data_len);
+                packet_pool_free(send_command->slot);
+                break;
+            }
+        case ESPNOW_CHANNEL_SWITCH:
+            channel_schedule_switch(evt->info.channel.channel, evt->info.channel.at_us);
+            break;
+        case ESPNOW_PHY_SWITCH:
+            phy_schedule_switch(evt->info.phy.mode, evt->info.phy.at_us);
+            break;
+        case ESPNOW_ROUND_START:
+        case ESPNOW_ROUND_END:
+            journal_record(evt->id == ESPNOW_ROUND_START ? JOURNAL_ROUND_START : JOURNAL_ROUND_END, my_mac_addr, 0, 0);
+            power_save_set_round(evt->id == ESPNOW_ROUND_START, time);
+            channel_set_round(evt->id == ESPNOW_ROUND_START, time);
+            break;
+        case ESPNOW_POWER_SAVE_UPDATE:
+            power_save_update();
+            break;
+        default:
+            log_e("Not an event of comm_task's own: %d", evt->id);
+            break;
+    }
+}
+
 static void comm_task(void *pvParameter) {
     espnow_event_t evt;
-    BaseType_t newQueueEntry;
+    bool newQueueEntry;
 
     log_i("Connecting to the node network...");
 
-    s_my_broadcast_info.type = ESP_DATA_TYPE_JOIN_ANNOUNCEMENT;
-    send_state_update();
+    /* When many nodes are switched on at once, spread their announcements (and the replies to them) */
     s_my_broadcast_info.type = ESP_DATA_TYPE_STATE_UPDATE;
+    comm_schedule(&s_join_job, esp_random() % JOIN_JITTER_MS);
+
+    comm_schedule(&s_cleanup_job, CLEANUP_INTERVAL_MS);
+    comm_schedule(&s_announcement_job, ACCOUNCEMENT_INTERVAL_SECONDS * 1000);
+    comm_schedule(&s_shutdown_job, 0);
+    comm_schedule(&s_ping_job, pingInterval);
+    comm_schedule(&s_timesync_job, TIMESYNC_INTERVAL_MS);
+    channel_start();
+    phy_start();
+    power_save_start();
 
     comm_task_started = true;
 
     while (true) {
-        newQueueEntry      = xQueueReceive(s_comm_queue, &evt, 500 / portTICK_RATE_MS);
+        newQueueEntry      = receive_event(&evt, comm_scheduler_ticks_until_next(millis()));
         unsigned long time = millis();
-        if (newQueueEntry == pdTRUE) {
+        if (newQueueEntry) {
             switch (evt.id) {
                 case ESPNOW_SEND_CB:
                     {
@@ -477,62 +1271,72 @@ static void comm_task(void *pvParameter) {
                 case ESPNOW_RECV_CB:
                     {
                         espnow_event_recv_cb_t *recv_cb = &evt.info.recv_cb;
-                        espnow_data_t *data             = (espnow_data_t *)recv_cb->data;
+                        espnow_data_t *data             = &s_packet_pool[recv_cb->slot];
+                        channel_heard_peer(time);
+                        phy_heard_peer(time);
+
+                        /* The promiscuous callback only feeds the filter, the exported RSSI is published from here */
+                        peer_data_t *sender;
+                        rssi_stats_t rssi;
+                        if (get_peer_info(recv_cb->mac_addr, &sender) == ESP_OK && rssi_filter_read(sender, &rssi) && sender->rssi != rssi.avg) {
+                            sender->rssi = rssi.avg;
+                            peer_table_changed();
+                        }
+
+                        if (data->type == ESP_DATA_TYPE_RELAY) {
+                            /* From here on, the inner frame is handled as if it came from its origin */
+                            if (!relay_handle_envelope(data, &recv_cb->data_len, recv_cb->mac_addr, recv_cb->rx_time_us, time)) {
+                                packet_pool_free(recv_cb->slot);
+                                break;
+                            }
+                        } else {
+                            relay_handle_direct(recv_cb->mac_addr, data, recv_cb->data_len, recv_cb->rx_time_us, time);
+                        }
+
                         switch (data->type) {
                             case ESP_DATA_TYPE_JOIN_ANNOUNCEMENT:
-                                /* Give them my info */
-                                send_state_update();
+                                /* Give them my info (they have no keyframe of ours yet). Replying right away would make every
+                                 * node answer every join of a mass power-on, so wait a random bit and answer all joins that
+                                 * came in until then at once, or not at all if a full state update went out anyway. */
+                                comm_stats.rx_joins++;
+                                time_of_last_join = time;
+                                if (!comm_is_scheduled(&s_join_reply_job) && !comm_is_scheduled(&s_join_job)) { // Our own join answers, too
+                                    comm_schedule(&s_join_reply_job, JOIN_REPLY_MIN_DELAY_MS + esp_random() % (JOIN_REPLY_MAX_DELAY_MS - JOIN_REPLY_MIN_DELAY_MS));
+                                }
 
                                 time_of_last_keep_alive_communication = time; // This is a notable event -> reset shutdown timer
 
                                 /* Intentional fallthrough */
                             case ESP_DATA_TYPE_STATE_UPDATE:
-                                {
-                                    time_of_last_seen_peer = time;
-
-                                    payload_node_info_t *node_info = &data->payload.node_info;
-                                    log_v("Task Stack High Water Mark: %d", uxTaskGetStackHighWaterMark(NULL));
-
-                                    log_d("Received node state from " MACSTR ": type=%d, color=%d, currentState=%d, battery=%dmV (%d%%)", MAC2STR(recv_cb->mac_addr), node_info->node_type, node_info->color, node_info->current_state, node_info->battery_voltage, node_info->battery_percent);
-
-                                    boolean notSeenBefore = false;
-                                    if (esp_now_is_peer_exist(recv_cb->mac_addr) == false) {
-                                        notSeenBefore = true;
-                                        /* If MAC address does not exist in peer list, add it to peer list. */
-                                        esp_now_peer_info_t *peer = malloc_peer_info(recv_cb->mac_addr);
-                                        log_v("Adding peer to list (" MACSTR ").", MAC2STR(peer->peer_addr));
-                                        ESP_ERROR_CHECK(esp_now_add_peer(peer));
-                                        free(peer);
-                                    }
+                                handle_node_info(recv_cb->mac_addr, &data->payload.node_info, true, time);
+                                break;
 
+                            case ESP_DATA_TYPE_STATE_DELTA:
+                                {
                                     peer_data_t *peer_data;
-                                    ESP_ERROR_CHECK(get_or_create_peer_info(recv_cb->mac_addr, &peer_data));
-
-                                    peer_data->last_seen     = time;
-                                    peer_data->valid_version = (node_info->version == VERSION_CODE);
-                                    if (peer_data->valid_version) {
-                                        get_current_mode()->onReceiveState(peer_data, node_info);
-                                        memcpy(&peer_data->node_info, node_info, sizeof(payload_node_info_t));
-                                    } else {
-                                        log_d("Received message from peer with invalid version (%d)", node_info->version);
+                                    peer_state_t *peer_state = NULL;
+                                    if (get_peer_info(recv_cb->mac_addr, &peer_data) == ESP_OK) {
+                                        peer_state = get_peer_state(peer_data);
                                     }
 
-                                    if (notSeenBefore) {
-                                        /* Ping when we first see them */
-                                        send_ping(recv_cb->mac_addr);
+                                    if (peer_state == NULL || !peer_state->has_keyframe || peer_state->keyframe_crc != data->payload.node_info_delta.base_crc) {
+                                        comm_stats.rx_deltas_dropped++;
+                                        log_v("Dropping state delta from " MACSTR ", keyframe is missing.", MAC2STR(recv_cb->mac_addr));
+                                        break;
                                     }
 
-                                    if (node_info->node_type == NODE_TYPE_CONTROLLER) {
-                                        time_of_last_keep_alive_communication = time; // When a controller is present -> prevent sleeping
+                                    payload_node_info_t node_info = peer_state->keyframe;
+                                    if (!apply_node_info_delta(&node_info, &data->payload.node_info_delta, recv_cb->data_len - (int)offsetof(espnow_data_t, payload.node_info_delta.data))) {
+                                        log_e("Received malformed state delta from " MACSTR, MAC2STR(recv_cb->mac_addr));
+                                        break;
                                     }
-
-                                    bluetooth_notify_peer_list_changed();
+                                    handle_node_info(recv_cb->mac_addr, &node_info, false, time);
                                 }
                                 break;
 
                             case ESP_DATA_TYPE_PING_PONG:
                                 {
-                                    if (esp_now_is_peer_exist(recv_cb->mac_addr) == false) {
+                                    if (transport->hasPeer(recv_cb->mac_addr) == false) {
                                         log_v("Ignoring ping from unknown peer %2x:%2x:%2x:%2x:%2x:%2x", recv_cb->mac_addr[0], recv_cb->mac_addr[1], recv_cb->mac_addr[2], recv_cb->mac_addr[3], recv_cb->mac_addr[4], recv_cb->mac_addr[5]);
                                         break;
                                     }
@@ -540,24 +1344,38 @@ static void comm_task(void *pvParameter) {
                                     ping_pong_stage_t stage = data->payload.ping_pong.stage;
                                     peer_data_t *peer_data;
                                     if (get_peer_info(recv_cb->mac_addr, &peer_data) == ESP_OK && peer_data->valid_version) {
+                                        peer_state_t *peer_state = get_peer_state(peer_data);
+                                        timesync_receive_ping(peer_data, peer_state, &data->payload.ping_pong, recv_cb->rx_time_us);
+                                        peer_table_changed(); // Latency and link stats
+
                                         unsigned long time_us = micros();
                                         if (stage > PING_PONG_STAGE_PING) {
                                             peer_data->latency_us = min(65535UL, time_us - peer_data->last_sent_ping_us);
+                                            link_stats_latency_sample(&peer_state->link, peer_data->latency_us);
+                                        }
+                                        if (stage == PING_PONG_STAGE_PONG) {
+                                            link_stats_pong_received(&peer_state->link);
                                         }
                                         if (stage < PING_PONG_STAGE_DATA2) {
                                             espnow_data_t pong = {
                                                 .type    = ESP_DATA_TYPE_PING_PONG,
                                                 .payload = {
                                                     .ping_pong = {
-                                                        .stage      = (ping_pong_stage_t)(stage + 1),
-                                                        .latency_us = peer_data->latency_us,
-                                                        .rssi       = peer_data->rssi,
+                                                        .stage         = (ping_pong_stage_t)(stage + 1),
+                                                        .latency_us    = peer_data->latency_us,
+                                                        .rssi          = peer_data->rssi,
+                                                        .stratum       = 0, // The time sample is up to timesync_prepare_ping
+                                                        .tx_local_us   = 0,
+                                                        .echo_us       = 0,
+                                                        .hold_us       = 0,
+                                                        .tx_network_us = 0,
                                                     },
                                                 },
                                             };
 
-                                            esp_err_t ret = esp_now_send(recv_cb->mac_addr, (const uint8_t *)&pong, sizeof(pong));
-                                            if (ret != ESP_OK) {
+                                            timesync_prepare_ping(peer_state, &pong.payload.ping_pong);
+                                            esp_err_t ret = tx_send(recv_cb->mac_addr, &pong, ESPNOW_DATA_SIZE(ping_pong), TX_PRIO_LOW);
+                                            if (ret != ESP_OK && ret != ESP_ERR_ESPNOW_NO_MEM) {
                                                 log_e("Send error: %s", esp_err_to_name(ret));
                                             }
                                         }
@@ -571,66 +1389,127 @@ static void comm_task(void *pvParameter) {
                                     }
                                 }
                                 break;
+                            case ESP_DATA_TYPE_BUZZ:
+                                {
+                                    /* From anyone, a claimant our peer table has no room for still takes part in the round */
+                                    if (recv_cb->data_len < (int)ESPNOW_DATA_SIZE(buzz)) {
+                                        log_e("Received malformed buzz claim from " MACSTR, MAC2STR(recv_cb->mac_addr));
+                                        break;
+                                    }
+                                    /* Claims are repeated and retransmitted, only the first copy counts */
+                                    int64_t press_time_us;
+                                    if (!arbitration_claim_received(recv_cb->mac_addr, &data->payload.buzz, recv_cb->rx_time_us, &press_time_us)) {
+                                        break;
+                                    }
+                                    payload_buzz_t buzz = data->payload.buzz;
+                                    buzz.press_time_us  = press_time_us;
+                                    uint32_t latency_us = power_save_claim_received(&data->payload.buzz, recv_cb->rx_time_us);
+                                    journal_record_at(JOURNAL_BUZZ_CLAIM, buzz.press_time_us, recv_cb->mac_addr, 0, latency_us);
+                                    buzz_trace_received(recv_cb->mac_addr, &data->payload.buzz, recv_cb->rx_time_us);
+                                    power_save_activity(time);
+
+                                    time_of_last_keep_alive_communication = time; // This is a notable event -> reset shutdown timer
+                                    dispatcher_post_buzz(recv_cb->mac_addr, &buzz);
+                                }
+                                break;
+                            case ESP_DATA_TYPE_BUZZ_DECISION:
+                                arbitration_decision_received(recv_cb->mac_addr, &data->payload.buzz_decision, recv_cb->data_len);
+                                break;
                             case ESP_DATA_TYPE_COMMAND:
-                                executeCommand(NULL, &data->payload.command, recv_cb->data_len - sizeof(espnow_data_type_t));
+                                {
+                                    payload_command_frame_t *frame = &data->payload.command_frame;
+                                    int command_len                = recv_cb->data_len - (int)offsetof(espnow_data_t, payload.command_frame.command);
+                                    if (command_len < (int)sizeof(command_t)) {
+                                        log_e("Received malformed command from " MACSTR, MAC2STR(recv_cb->mac_addr));
+                                        break;
+                                    }
+
+                                    peer_data_t *peer_data;
+                                    if (get_peer_info(recv_cb->mac_addr, &peer_data) == ESP_OK && command_delivery_is_duplicate(get_peer_state(peer_data), frame->seq)) {
+                                        /* Our acknowledgement got lost, just repeat it */
+                                        comm_stats.rx_command_dups++;
+                                        log_d("Received command %d again, not executing it twice.", frame->seq);
+                                        if (frame->flags & COMMAND_FLAG_ACK_REQUESTED) {
+                                            send_command_ack(recv_cb->mac_addr, frame, COMMAND_RESULT_DUPLICATE);
+                                        }
+                                        break;
+                                    }
+
+                                    bool returns = frame->command.command != COMMAND_RESET && frame->command.command != COMMAND_SHUTDOWN;
+                                    if (!returns && (frame->flags & COMMAND_FLAG_ACK_REQUESTED)) {
+                                        /* Acknowledge up front, otherwise the sender would retry (and restart us again) */
+                                        send_command_ack(recv_cb->mac_addr, frame, COMMAND_RESULT_OK);
+                                    }
+
+                                    bool executed = executeCommand(NULL, &frame->command, command_len);
+                                    if (returns && (frame->flags & COMMAND_FLAG_ACK_REQUESTED)) {
+                                        send_command_ack(recv_cb->mac_addr, frame, executed ? COMMAND_RESULT_OK : COMMAND_RESULT_REJECTED);
+                                    }
+                                }
+                                break;
+                            case ESP_DATA_TYPE_COMMAND_ACK:
+                                command_delivery_receive_ack(recv_cb->mac_addr, &data->payload.command_ack);
+                                break;
+                            case ESP_DATA_TYPE_MULTICAST_COMMAND:
+                                {
+                                    payload_multicast_command_t *multicast = &data->payload.multicast_command;
+                                    if (recv_cb->data_len < (int)offsetof(espnow_data_t, payload.multicast_command.targets) ||
+                                        multicast->num_targets > MULTICAST_MAX_TARGETS ||
+                                        recv_cb->data_len < (int)(offsetof(espnow_data_t, payload.multicast_command.targets) + multicast->num_targets * ESP_NOW_ETH_ALEN)) {
+                                        log_e("Received malformed multicast command from " MACSTR, MAC2STR(recv_cb->mac_addr));
+                                        break;
+                                    }
+
+                                    peer_data_t *peer_data;
+                                    if (get_peer_info(recv_cb->mac_addr, &peer_data) == ESP_OK && command_delivery_is_duplicate(get_peer_state(peer_data), multicast->seq)) {
+                                        /* Broadcasts are repeated */
+                                        break;
+                                    }
+
+                                    if (is_multicast_target(multicast, my_mac_addr)) {
+                                        executeCommand(NULL, &multicast->command, sizeof(payload_command_t));
+                                    }
+                                }
                                 break;
                             default:
                                 log_e("Unknown data packet received (type=%d)", data->type);
                                 break;
                         }
 
-                        free(recv_cb->data);
+                        packet_pool_free(recv_cb->slot);
                         break;
                     }
+                case ESPNOW_SEND_COMMAND:
+                case ESPNOW_CHANNEL_SWITCH:
+                case ESPNOW_PHY_SWITCH:
+                case ESPNOW_ROUND_START:
+                case ESPNOW_ROUND_END:
+                case ESPNOW_POWER_SAVE_UPDATE:
+                    handle_own_event(&evt, time);
+                    break;
+                case ESPNOW_CHANNEL_MIGRATE:
+                    channel_migrate(evt.info.channel.channel);
+                    break;
+                case ESPNOW_CHANNEL_SCAN_DONE:
+                    channel_scan_done();
+                    break;
+                case ESPNOW_BUZZ_CLAIMED:
+                    arbitration_claim_sent(&evt.info.buzz.buzz, time);
+                    power_save_activity(time); // We stay awake for the rest of the round
+                    break;
+                case ESPNOW_BUZZ_DECIDED:
+                    arbitration_send_decision(time);
+                    break;
                 default:
                     log_e("Callback type error: %d", evt.id);
                     break;
             }
-        } else {
-            /* No queue entry this time -> timeout */
-            EVERY_N_SECONDS(5) { cleanup_peer_list(); }
-
-            EVERY_N_SECONDS(ACCOUNCEMENT_INTERVAL_SECONDS) { send_state_update(); }
-
-            if (!has_external_power) {
-                /* Check for ">" in both of these time delta checks, otherwise an integer underflow will occur */
-                if ((time > time_of_last_keep_alive_communication) && (time - time_of_last_keep_alive_communication > (SHUTDOWN_TIME_NO_BUZZING_SECONDS * 1000))) {
-                    log_i("Nobody pushing any buttons. Shutting down...");
-                    FastLED.setBrightness(10);
-                    shutdown(false, true);
-                } else if ((time > time_of_last_seen_peer) && (time - time_of_last_seen_peer > (SHUTDOWN_TIME_NO_COMMS_SECONDS * 1000))) {
-                    log_i("No other buzzer near me. Shutting down...");
-                    FastLED.setBrightness(10);
-                    shutdown(false, true);
-                }
-            }
+        }
 
-            EVERY_N_MILLIS_I(peerPing, pingInterval) {
-                if (pingInterval != 0) {
-                    static uint8_t peerToPing = 0;
-                    bool head                 = true;
-                    esp_now_peer_info_t peer;
-                    peer_data_t *peer_data;
-                    uint8_t i = 0;
-                    while (esp_now_fetch_peer(head, &peer) == ESP_OK) {
-                        head = false;
-                        if (i++ < peerToPing) {
-                            continue;
-                        }
+        /* Run everything that became due while we were busy or waiting */
+        comm_scheduler_run_due(millis());
 
-                        if (get_peer_info(peer.peer_addr, &peer_data) == ESP_OK && peer_data->valid_version) {
-                            send_ping(peer.peer_addr);
-                            break;
-                        }
-                    }
-                    peerToPing++;
-                    if (esp_now_fetch_peer(head, &peer) != ESP_OK) {
-                        peerToPing = 0;
-                    }
-                }
-            }
-            peerPing.setPeriod(pingInterval);
-        }
+        publish_peer_snapshot();
     }
 
     vTaskDelete(NULL);
@@ -639,115 +1518,67 @@ static void comm_task(void *pvParameter) {
 static esp_err_t espnow_init(void) {
     esp_base_mac_addr_get(my_mac_addr);
 
-    s_comm_queue = xQueueCreate(ESPNOW_QUEUE_SIZE, sizeof(espnow_event_t));
-    if (s_comm_queue == NULL) {
+    s_comm_queue      = xQueueCreate(ESPNOW_QUEUE_SIZE, sizeof(espnow_event_t));
+    s_comm_queue_high = xQueueCreate(ESPNOW_HIGH_QUEUE_SIZE, sizeof(espnow_event_t));
+    s_comm_events     = xSemaphoreCreateCounting(ESPNOW_QUEUE_SIZE + ESPNOW_HIGH_QUEUE_SIZE, 0);
+    if (s_comm_queue == NULL || s_comm_queue_high == NULL || s_comm_events == NULL) {
         log_e("Create mutex fail");
         return ESP_FAIL;
     }
 
-    /* init peer data */
-    for (uint8_t i = 0; i < PEER_DATA_TABLE_ENTRIES; i++) {
-        memset(peer_data_table[i].mac_addr, 0xFF, ESP_NOW_ETH_ALEN);
+    s_state_update_mutex = xSemaphoreCreateMutex();
+    if (s_state_update_mutex == NULL) {
+        log_e("Create mutex fail");
+        return ESP_FAIL;
     }
 
+    s_packet_pool_free = xQueueCreate(ESPNOW_PACKET_POOL_SIZE, sizeof(uint8_t));
+    if (s_packet_pool_free == NULL) {
+        log_e("Create packet pool fail");
+        return ESP_FAIL;
+    }
+    for (uint8_t i = 0; i < ESPNOW_PACKET_POOL_SIZE; i++) {
+        packet_pool_free(i);
+    }
+
+    /* init peer data */
+    peer_table_init();
+    timesync_init();
+    relay_init();
+
     if (!has_external_power) {
         /* If we're not a controller, the first peer is ourself */
-        memcpy(peer_data_table[0].mac_addr, my_mac_addr, ESP_NOW_ETH_ALEN);
-        peer_data_table[0].latency_us    = 0;
-        peer_data_table[0].rssi          = 0;
-        peer_data_table[0].valid_version = true;
+        peer_data_t *self;
+        ESP_ERROR_CHECK(get_or_create_peer_info(my_mac_addr, &self));
+        self->latency_us    = 0;
+        self->rssi          = 0;
+        self->valid_version = true;
         update_my_info();
     }
+    peer_table_publish_snapshot();
 
-    /* Initialize ESPNOW and register sending and receiving callback function. */
-    ESP_ERROR_CHECK(esp_now_init());
-    ESP_ERROR_CHECK(esp_now_register_send_cb(espnow_send_cb));
-    ESP_ERROR_CHECK(esp_now_register_recv_cb(espnow_recv_cb));
-
-#if CONFIG_ESPNOW_ENABLE_POWER_SAVE
-    ESP_ERROR_CHECK(esp_now_set_wake_window(CONFIG_ESPNOW_WAKE_WINDOW));
-    ESP_ERROR_CHECK(esp_wifi_connectionless_module_set_wake_interval(CONFIG_ESPNOW_WAKE_INTERVAL));
-#endif
-    /* Set primary master key. */
-    ESP_ERROR_CHECK(esp_now_set_pmk((uint8_t *)CONFIG_ESPNOW_PMK));
-
-    /* Add broadcast peer information to peer list. */
-    esp_now_peer_info_t *peer = malloc_peer_info(s_broadcast_mac);
-    ESP_ERROR_CHECK(esp_now_add_peer(peer));
-    free(peer);
+    /* Start receiving and register the broadcast peer */
+    static const transport_callbacks_t callbacks = {
+        .receive   = espnow_recv_cb,
+        .send_done = espnow_send_cb,
+        .rssi      = espnow_rssi_cb,
+    };
+    ESP_ERROR_CHECK(transport->init(&callbacks));
 
-    xTaskCreate(&comm_task, "comm_task", 2400, NULL, TASK_PRIO_COMM, NULL);
+    xTaskCreate(&comm_task, "comm_task", COMM_TASK_STACK_SIZE, NULL, TASK_PRIO_COMM, &s_comm_task);
 
     return ESP_OK;
 }
 
-typedef struct
-{
-    unsigned frame_ctrl  : 16;   // 2 bytes / 16 bit fields
-    unsigned duration_id : 16;   // 2 bytes / 16 bit fields
-    uint8_t addr1[6];            // receiver address
-    uint8_t addr2[6];            // sender address
-    uint8_t addr3[6];            // filtering address
-    unsigned sequence_ctrl : 16; // 2 bytes / 16 bit fields
-} wifi_ieee80211_mac_hdr_t;      // 24 bytes
-
-typedef struct
-{
-    wifi_ieee80211_mac_hdr_t hdr;
-    unsigned category_code : 8; // 1 byte / 8 bit fields
-    uint8_t oui[3];             // 3 bytes / 24 bit fields
-    uint8_t payload[0];
-} wifi_ieee80211_packet_t;
-
-void promiscuous_rx_cb(void *buf, wifi_promiscuous_pkt_type_t type) {
-    if (type != WIFI_PKT_MGMT) {
-        /* Should never happen because we are filtering */
-        return;
-    }
-
-    static const uint8_t ACTION_SUBTYPE  = 0xd0;
-    static const uint8_t ESPRESSIF_OUI[] = { 0x18, 0xfe, 0x34 };
-    static peer_data_t *peer_data;
-
-    const wifi_promiscuous_pkt_t *ppkt  = (wifi_promiscuous_pkt_t *)buf;
-    const wifi_ieee80211_packet_t *ipkt = (wifi_ieee80211_packet_t *)ppkt->payload;
-    const wifi_ieee80211_mac_hdr_t *hdr = &ipkt->hdr;
-
-    // Only continue processing if this is an action frame containing the Espressif OUI.
-    if ((ACTION_SUBTYPE == (hdr->frame_ctrl & 0xFF)) && memcmp(ipkt->oui, ESPRESSIF_OUI, 3) == 0) {
-        if (get_peer_info(hdr->addr2, &peer_data) == ESP_OK) {
-            peer_data->rssi = ppkt->rx_ctrl.rssi;
-            log_v("Packet from %2x:%2x:%2x:%2x:%2x:%2x: RSSI = %ddBm", hdr->addr2[0], hdr->addr2[1], hdr->addr2[2], hdr->addr2[3], hdr->addr2[4], hdr->addr2[5], ppkt->rx_ctrl.rssi);
-        }
-    }
-}
-
-/* WiFi should start before using ESPNOW */
 void comm_setup(void) {
-    ESP_ERROR_CHECK(esp_netif_init());
-    ESP_ERROR_CHECK(esp_event_loop_create_default());
-    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
-
-    ESP_ERROR_CHECK(esp_wifi_init(&cfg));
-
-    ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
-
-    ESP_ERROR_CHECK(esp_wifi_set_mode(ESPNOW_WIFI_MODE));
-
-    ESP_ERROR_CHECK(esp_wifi_start());
-
-    ESP_ERROR_CHECK(esp_wifi_set_channel(CONFIG_ESPNOW_CHANNEL, WIFI_SECOND_CHAN_NONE));
-
-    ESP_ERROR_CHECK(esp_wifi_set_promiscuous(true));
+    transport->start();
 
-    wifi_promiscuous_filter_t filter = { .filter_mask = WIFI_PROMIS_FILTER_MASK_MGMT };
-    ESP_ERROR_CHECK(esp_wifi_set_promiscuous_filter(&filter));
+    channel_init();
 
-    ESP_ERROR_CHECK(esp_wifi_set_promiscuous_rx_cb(&promiscuous_rx_cb));
+    phy_init();
 
-#if CONFIG_ESPNOW_ENABLE_LONG_RANGE
-    ESP_ERROR_CHECK(esp_wifi_set_protocol(ESPNOW_WIFI_IF, WIFI_PROTOCOL_11B | WIFI_PROTOCOL_11G | WIFI_PROTOCOL_11N | WIFI_PROTOCOL_LR));
-#endif
+    /* Before comm_task starts, it may scan right away */
+    ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_SCAN_DONE, &wifi_scan_done_cb, NULL));
 
     espnow_init();
 }
\ No newline at end of file
@@ -0,0 +1,99 @@
+#include "comm_scheduler.h"
+
+/* Binary min-heap of the scheduled jobs, ordered by due time */
+static comm_job_t *heap[COMM_SCHEDULER_MAX_JOBS];
+static uint8_t heap_size = 0;
+
+/* Compare in a way that survives the millis() overflow */
+static inline bool due_before(const comm_job_t *a, const comm_job_t *b) {
+    return (long)(a->due - b->due) < 0;
+}
+
+static inline void heap_set(uint8_t index, comm_job_t *job) {
+    heap[index]     = job;
+    job->heap_index = index;
+}
+
+static void sift_up(uint8_t index) {
+    comm_job_t *job = heap[index];
+    while (index > 0) {
+        uint8_t parent = (index - 1) / 2;
+        if (!due_before(job, heap[parent])) { break; }
+        heap_set(index, heap[parent]);
+        index = parent;
+    }
+    heap_set(index, job);
+}
+
+static void sift_down(uint8_t index) {
+    comm_job_t *job = heap[index];
+    while (true) {
+        uint8_t child = 2 * index + 1;
+        if (child >= heap_size) { break; }
+        if (child + 1 < heap_size && due_before(heap[child + 1], heap[child])) { child++; }
+        if (!due_before(heap[child], job)) { break; }
+        heap_set(index, heap[child]);
+        index = child;
+    }
+    heap_set(index, job);
+}
+
+void comm_schedule(comm_job_t *job, unsigned long delay_ms) {
+    job->due = millis() + delay_ms;
+
+    if (job->heap_index < 0) {
+        if (heap_size >= COMM_SCHEDULER_MAX_JOBS) {
+            log_e("Cannot schedule job %s, too many jobs.", job->name);
+            return;
+        }
+        heap_set(heap_size++, job);
+    }
+
+    /* The job may have moved in either direction */
+    sift_up(job->heap_index);
+    sift_down(job->heap_index);
+}
+
+void comm_unschedule(comm_job_t *job) {
+    if (job->heap_index < 0) { return; }
+
+    uint8_t index   = job->heap_index;
+    job->heap_index = -1;
+    heap_size--;
+    if (index < heap_size) {
+        /* Fill the hole with the last job and restore the heap order around it */
+        comm_job_t *moved = heap[heap_size];
+        heap_set(index, moved);
+        sift_up(index);
+        sift_down(moved->heap_index);
+    }
+}
+
+bool comm_is_scheduled(const comm_job_t *job) {
+    return job->heap_index >= 0;
+}
+
+TickType_t comm_scheduler_ticks_until_next(unsigned long time) {
+    if (heap_size == 0) {
+        return portMAX_DELAY;
+    }
+
+    long remaining = (long)(heap[0]->due - time);
+    if (remaining <= 0) {
+        return 0;
+    }
+    /* Round up, so we don't wake up just before the job is due */
+    return (remaining + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS;
+}
+
+void comm_scheduler_run_due(unsigned long time) {
+    while (heap_size > 0 && (long)(heap[0]->due - time) <= 0) {
+        comm_job_t *job = heap[0];
+        comm_unschedule(job);
+
+        unsigned long next = job->run(time);
+        if (next != COMM_JOB_STOP && !comm_is_scheduled(job)) {
+            comm_schedule(job, next);
+        }
+    }
+}
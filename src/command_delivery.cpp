@@ -0,0 +1,234 @@
+#include "command_delivery.h"
+#include "comm_scheduler.h"
+#include "relay.h"
+#include "power_save.h"
+#include "bluetooth.h"
+#include "esp_mac.h"
+#include "esp_random.h"
+#include <sys/param.h>
+
+static_assert(COMMAND_SEQ_WINDOW == 8 * sizeof(((peer_state_t *)0)->command_seq_window), "COMMAND_SEQ_WINDOW must match command_seq_window");
+
+typedef struct {
+    bool in_use;
+    uint8_t mac_addr[ESP_NOW_ETH_ALEN];
+    uint16_t seq;
+    command_t command;
+    uint8_t attempts;
+    uint8_t repeats;            // Transmissions of a broadcast
+    unsigned long next_attempt; // millis() of the next transmission
+    int len;
+    espnow_data_t frame;
+} pending_command_t;
+
+/* Only touched by comm_task */
+static pending_command_t s_pending[COMMAND_MAX_PENDING];
+
+/* Status history and sequence numbers are used from the USB and bluetooth tasks, too */
+static portMUX_TYPE s_delivery_lock = portMUX_INITIALIZER_UNLOCKED;
+static command_delivery_t s_history[COMMAND_DELIVERY_HISTORY];
+static uint8_t s_history_next  = 0;
+static uint8_t s_history_count = 0;
+static uint16_t s_next_seq     = 0;
+static bool s_seq_initialized  = false;
+
+uint16_t command_delivery_next_seq() {
+    portENTER_CRITICAL(&s_delivery_lock);
+    if (!s_seq_initialized) {
+        /* Don't start at the same number after every restart, receivers may still remember it */
+        s_next_seq        = esp_random();
+        s_seq_initialized = true;
+    }
+    uint16_t seq = s_next_seq++;
+    portEXIT_CRITICAL(&s_delivery_lock);
+    return seq;
+}
+
+void command_delivery_record(const uint8_t *mac_addr, uint16_t seq, command_t command, command_status_t status) {
+    portENTER_CRITICAL(&s_delivery_lock);
+    command_delivery_t *delivery = &s_history[s_history_next];
+    memcpy(delivery->mac_addr, mac_addr, ESP_NOW_ETH_ALEN);
+    delivery->seq      = seq;
+    delivery->command  = command;
+    delivery->status   = status;
+    delivery->attempts = 0;
+    s_history_next     = (s_history_next + 1) % COMMAND_DELIVERY_HISTORY;
+    if (s_history_count < COMMAND_DELIVERY_HISTORY) { s_history_count++; }
+    portEXIT_CRITICAL(&s_delivery_lock);
+}
+
+uint8_t get_command_deliveries(command_delivery_t *deliveries, uint8_t max_entries) {
+    portENTER_CRITICAL(&s_delivery_lock);
+    uint8_t count = MIN(s_history_count, max_entries);
+    for (uint8_t i = 0; i < count; i++) {
+        deliveries[i] = s_history[(s_history_next + COMMAND_DELIVERY_HISTORY - 1 - i) % COMMAND_DELIVERY_HISTORY];
+    }
+    portEXIT_CRITICAL(&s_delivery_lock);
+    return count;
+}
+
+static void update_status(const pending_command_t *pending, command_status_t status) {
+    command_delivery_t delivery;
+    bool found = false;
+
+    portENTER_CRITICAL(&s_delivery_lock);
+    for (uint8_t i = 0; i < s_history_count; i++) {
+        command_delivery_t *entry = &s_history[i];
+        if (entry->seq == pending->seq && memcmp(entry->mac_addr, pending->mac_addr, ESP_NOW_ETH_ALEN) == 0) {
+            entry->status   = status;
+            entry->attempts = pending->attempts;
+            delivery        = *entry;
+            found           = true;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&s_delivery_lock);
+
+    if (found && status != COMMAND_STATUS_PENDING) {
+        bluetooth_notify_command_delivery(&delivery);
+    }
+}
+
+static inline bool is_broadcast(const pending_command_t *pending) {
+    return memcmp(pending->mac_addr, s_broadcast_mac, ESP_NOW_ETH_ALEN) == 0;
+}
+
+static void transmit(pending_command_t *pending, unsigned long time) {
+    /* Relays forward a retransmission only if it is marked as one */
+    if (pending->frame.type == ESP_DATA_TYPE_MULTICAST_COMMAND) {
+        pending->frame.payload.multicast_command.attempt = pending->attempts;
+    } else {
+        pending->frame.payload.command_frame.attempt = pending->attempts;
+    }
+
+    esp_err_t ret = relay_send(pending->mac_addr, &pending->frame, pending->len);
+    if (ret != ESP_OK) {
+        log_e("Send error: %s", esp_err_to_name(ret));
+    }
+
+    pending->attempts++;
+    /* Broadcasts are just repeated, unicasts back off exponentially */
+    pending->next_attempt = time + (is_broadcast(pending) ? COMMAND_RETRY_INITIAL_MS : (COMMAND_RETRY_INITIAL_MS << (pending->attempts - 1)));
+}
+
+static void finish(pending_command_t *pending, command_status_t status) {
+    update_status(pending, status);
+    pending->in_use = false;
+}
+
+static unsigned long retry_job(unsigned long time) {
+    unsigned long next = COMM_JOB_STOP;
+
+    for (uint8_t i = 0; i < COMMAND_MAX_PENDING; i++) {
+        pending_command_t *pending = &s_pending[i];
+        if (!pending->in_use) { continue; }
+
+        if ((long)(pending->next_attempt - time) <= 0) {
+            if (is_broadcast(pending)) {
+                if (pending->attempts >= pending->repeats) {
+                    finish(pending, COMMAND_STATUS_SENT);
+                    continue;
+                }
+            } else if (pending->attempts >= COMMAND_MAX_ATTEMPTS) {
+                log_w("Command %d to " MACSTR " was not acknowledged after %d attempts.", pending->command, MAC2STR(pending->mac_addr), pending->attempts);
+                comm_stats.tx_command_failed++;
+                finish(pending, COMMAND_STATUS_FAILED);
+                continue;
+            } else {
+                comm_stats.tx_command_retries++;
+            }
+
+            transmit(pending, time);
+            update_status(pending, COMMAND_STATUS_PENDING);
+        }
+
+        next = MIN(next, pending->next_attempt - time);
+    }
+
+    return next;
+}
+
+static comm_job_t s_retry_job = COMM_JOB("command_retry", retry_job);
+
+void command_delivery_start(const uint8_t *mac_addr, uint16_t seq, command_t command, const espnow_data_t *frame, int len) {
+    pending_command_t *pending = NULL;
+    for (uint8_t i = 0; i < COMMAND_MAX_PENDING; i++) {
+        if (!s_pending[i].in_use) {
+            pending = &s_pending[i];
+            break;
+        }
+    }
+
+    if (pending == NULL) {
+        /* Report it like any other failure, the host may retry later */
+        log_e("Too many commands in flight. Dropping command to " MACSTR ".", MAC2STR(mac_addr));
+        pending_command_t dropped;
+        memcpy(dropped.mac_addr, mac_addr, ESP_NOW_ETH_ALEN);
+        dropped.seq      = seq;
+        dropped.attempts = 0;
+        comm_stats.tx_command_failed++;
+        update_status(&dropped, COMMAND_STATUS_FAILED);
+        return;
+    }
+
+    pending->in_use = true;
+    memcpy(pending->mac_addr, mac_addr, ESP_NOW_ETH_ALEN);
+    pending->seq      = seq;
+    pending->command  = command;
+    pending->attempts = 0;
+    pending->len      = len;
+    pending->frame    = *frame;
+
+    /* Dozing buzzers only listen now and then, the repetitions must cover their whole wake interval */
+    unsigned long time = millis();
+    pending->repeats   = MAX(COMMAND_BROADCAST_REPEATS, power_save_broadcast_repeats(time));
+
+    transmit(pending, time);
+    /* Let the job figure out when it is due next */
+    comm_schedule(&s_retry_job, 0);
+}
+
+void command_delivery_receive_ack(const uint8_t *mac_addr, const payload_command_ack_t *ack) {
+    for (uint8_t i = 0; i < COMMAND_MAX_PENDING; i++) {
+        pending_command_t *pending = &s_pending[i];
+        if (pending->in_use && pending->seq == ack->seq && memcmp(pending->mac_addr, mac_addr, ESP_NOW_ETH_ALEN) == 0) {
+            log_d("Command %d to " MACSTR " acknowledged after %d attempt(s) (result=%d).", pending->command, MAC2STR(mac_addr), pending->attempts, ack->result);
+            finish(pending, ack->result == COMMAND_RESULT_REJECTED ? COMMAND_STATUS_REJECTED : COMMAND_STATUS_DELIVERED);
+            return;
+        }
+    }
+
+    log_v("Received acknowledgement for unknown command %d from " MACSTR, ack->seq, MAC2STR(mac_addr));
+}
+
+bool command_delivery_is_duplicate(peer_state_t *peer_state, uint16_t seq) {
+    if (!peer_state->has_command_seq) {
+        peer_state->command_seq        = seq;
+        peer_state->command_seq_window = 1;
+        peer_state->has_command_seq    = true;
+        return false;
+    }
+
+    int16_t diff = (int16_t)(seq - peer_state->command_seq);
+    if (diff > 0) {
+        /* Newer than anything before, slide the window */
+        peer_state->command_seq_window = diff >= COMMAND_SEQ_WINDOW ? 0 : peer_state->command_seq_window << diff;
+        peer_state->command_seq_window |= 1;
+        peer_state->command_seq = seq;
+        return false;
+    }
+
+    if (-diff >= COMMAND_SEQ_WINDOW) {
+        /* Far too old for a retransmission, the sender probably restarted -> start over */
+        peer_state->command_seq        = seq;
+        peer_state->command_seq_window = 1;
+        return false;
+    }
+
+    uint16_t bit = 1 << -diff;
+    if (peer_state->command_seq_window & bit) {
+        return true;
+    }
+    peer_state->command_seq_window |= bit;
+    return false;
+}
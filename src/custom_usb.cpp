@@ -4,6 +4,12 @@
 
 #include "Arduino.h"
 #include "comm.h"
+#include "command_delivery.h"
+#include "link_stats.h"
+#include "peer_table.h"
+#include "channel.h"
+#include "journal.h"
+#include "buzz_trace.h"
 #include "tusb.h"
 #include "esp32-hal-tinyusb.h"
 #include <nvm.h>
@@ -127,12 +133,22 @@ static void vendorDataCallback(void *arg, esp_event_base_t event_base, int32_t e
 }
 
 enum USB_REQUEST_VENDOR_DEVICE : uint8_t {
-    USB_REQUEST_VENDOR_DEVICE_VERSION      = 0x00,
-    USB_REQUEST_VENDOR_DEVICE_CONFIG       = 0x10,
-    USB_REQUEST_VENDOR_DEVICE_NETWORK_INFO = 0x20,
-    USB_REQUEST_VENDOR_DEVICE_SEND_COMMAND = 0x30,
+    USB_REQUEST_VENDOR_DEVICE_VERSION        = 0x00,
+    USB_REQUEST_VENDOR_DEVICE_CONFIG         = 0x10,
+    USB_REQUEST_VENDOR_DEVICE_NETWORK_INFO   = 0x20,
+    USB_REQUEST_VENDOR_DEVICE_COMM_STATS     = 0x21,
+    USB_REQUEST_VENDOR_DEVICE_PEER_LINK      = 0x22,
+    USB_REQUEST_VENDOR_DEVICE_JOURNAL        = 0x23,
+    USB_REQUEST_VENDOR_DEVICE_BUZZ_LATENCY   = 0x24,
+    USB_REQUEST_VENDOR_DEVICE_SEND_COMMAND   = 0x30,
+    USB_REQUEST_VENDOR_DEVICE_COMMAND_STATUS = 0x31,
+    USB_REQUEST_VENDOR_DEVICE_SEND_MULTICAST = 0x32,
+    USB_REQUEST_VENDOR_DEVICE_COMMAND_SEQ    = 0x33,
 };
 
+/* Of the last command the host sent, for USB_REQUEST_VENDOR_DEVICE_COMMAND_SEQ */
+static int32_t s_last_command_seq = -1;
+
 static const char *strRequestDirections[] = { "OUT", "IN" };
 static const char *strRequestTypes[]      = { "STANDARD", "CLASS", "VENDOR", "INVALID" };
 static const char *strRequestRecipients[] = { "DEVICE", "INTERFACE", "ENDPOINT", "OTHER" };
@@ -191,6 +207,24 @@ bool vendorRequestCallback(uint8_t rhport, uint8_t requestStage, arduino_usb_con
 
                         break;
 
+                    case COMMAND_SWITCH_CHANNEL:
+                        /* IN: the current channel, OUT: move the network to the given channel (0: the quietest one) */
+                        if (request->wLength != sizeof(uint8_t)) {
+                            log_d("invalid length %d, expected %d", request->wLength, sizeof(uint8_t));
+                            break;
+                        }
+
+                        static uint8_t channel;
+                        if (requestStage == CONTROL_STAGE_SETUP) {
+                            channel = channel_current();
+                            result  = Vendor.sendResponse(rhport, request, &channel, sizeof(channel));
+                        } else if (requestStage == CONTROL_STAGE_ACK && request->bmRequestDirection == REQUEST_DIRECTION_OUT) {
+                            result = requestChannelMigration(channel);
+                        } else {
+                            result = true;
+                        }
+                        break;
+
                     case COMMAND_SET_GAME_CONFIG:
                         if (request->wLength != sizeof(game_config_t)) {
                             log_d("invalid length %d, expected %d", request->wLength, sizeof(game_config_t));
@@ -227,18 +261,76 @@ bool vendorRequestCallback(uint8_t rhport, uint8_t requestStage, arduino_usb_con
             case USB_REQUEST_VENDOR_DEVICE_NETWORK_INFO:
                 if (requestStage != CONTROL_STAGE_SETUP) { return true; }
 
-                if ((request->wLength != sizeof(peer_data_t) && request->wLength != sizeof(peer_data_table)) || request->wIndex >= PEER_DATA_TABLE_ENTRIES) {
-                    log_v("invalid length %d, expected %d", request->wLength, sizeof(peer_data_t));
+                /* Paged: wIndex is the first entry, wLength a multiple of sizeof(peer_data_t). The response ends with the table. */
+                if (request->wLength == 0 || request->wLength % sizeof(peer_data_t) != 0 || request->wIndex >= PEER_DATA_TABLE_ENTRIES) {
+                    log_v("invalid length %d, expected a multiple of %d", request->wLength, sizeof(peer_data_t));
+                    break;
+                }
+
+                {
+                    static peer_data_t peer_data_snapshot[PEER_DATA_TABLE_ENTRIES];
+                    uint8_t count = MIN(request->wLength / sizeof(peer_data_t), (size_t)(PEER_DATA_TABLE_ENTRIES - request->wIndex));
+                    peer_table_read_snapshot(peer_data_snapshot, request->wIndex, count);
+
+                    log_v("sending %d byte response", count * sizeof(peer_data_t));
+                    result = Vendor.sendResponse(rhport, request, peer_data_snapshot, count * sizeof(peer_data_t));
+                }
+                break;
+            case USB_REQUEST_VENDOR_DEVICE_COMM_STATS:
+                /* Hosts may read a prefix, so new counters can be appended without breaking older hosts */
+                if (request->bmRequestDirection == REQUEST_DIRECTION_OUT) { return false; }
+                if (requestStage != CONTROL_STAGE_SETUP) { return true; }
+
+                static comm_stats_t comm_stats_copy;
+                comm_stats_copy = comm_stats;
+                result          = Vendor.sendResponse(rhport, request, &comm_stats_copy, MIN(request->wLength, sizeof(comm_stats_t)));
+                break;
+            case USB_REQUEST_VENDOR_DEVICE_PEER_LINK:
+                /* Link statistics of peer_data_table[wIndex] */
+                if (request->bmRequestDirection == REQUEST_DIRECTION_OUT) { return false; }
+                if (requestStage != CONTROL_STAGE_SETUP) { return true; }
+
+                if (request->wLength != sizeof(peer_link_stats_t) || request->wIndex >= PEER_DATA_TABLE_ENTRIES) {
+                    log_v("invalid length %d, expected %d", request->wLength, sizeof(peer_link_stats_t));
                     break;
                 }
 
-                log_v("sending %d byte response", sizeof(peer_data_t));
-                cleanup_peer_list();
-                if (request->wLength == sizeof(peer_data_t)) {
-                    result = Vendor.sendResponse(rhport, request, &peer_data_table[request->wIndex], sizeof(peer_data_t));
-                } else if (request->wLength == sizeof(peer_data_table)) {
-                    result = Vendor.sendResponse(rhport, request, &peer_data_table, sizeof(peer_data_table));
+                static peer_link_stats_t peer_link_stats;
+                if (get_peer_link_stats(request->wIndex, &peer_link_stats) != ESP_OK) {
+                    log_v("no peer at %u", request->wIndex);
+                    break;
                 }
+                result = Vendor.sendResponse(rhport, request, &peer_link_stats, sizeof(peer_link_stats_t));
+                break;
+            case USB_REQUEST_VENDOR_DEVICE_JOURNAL:
+                /* The buzz journal from sequence number (wIndex << 16 | wValue) on: a journal_page_header_t, followed by as
+                 * many entries as fit into wLength */
+                if (request->bmRequestDirection == REQUEST_DIRECTION_OUT) { return false; }
+                if (requestStage != CONTROL_STAGE_SETUP) { return true; }
+
+                if (request->wLength < sizeof(journal_page_header_t)) {
+                    log_v("invalid length %d, expected at least %d", request->wLength, sizeof(journal_page_header_t));
+                    break;
+                }
+
+                static struct {
+                    journal_page_header_t header;
+                    journal_entry_t entries[JOURNAL_ENTRIES];
+                } __attribute__((packed)) journal_page;
+                {
+                    uint8_t max_entries = MIN((request->wLength - sizeof(journal_page_header_t)) / sizeof(journal_entry_t), (size_t)JOURNAL_ENTRIES);
+                    uint8_t count       = journal_read((uint32_t)request->wIndex << 16 | request->wValue, &journal_page.header, journal_page.entries, max_entries);
+                    result              = Vendor.sendResponse(rhport, request, &journal_page, sizeof(journal_page_header_t) + count * sizeof(journal_entry_t));
+                }
+                break;
+            case USB_REQUEST_VENDOR_DEVICE_BUZZ_LATENCY:
+                /* Per stage latency histograms of buzzes (buzz_trace_stats_t). Hosts may read a prefix. */
+                if (request->bmRequestDirection == REQUEST_DIRECTION_OUT) { return false; }
+                if (requestStage != CONTROL_STAGE_SETUP) { return true; }
+
+                static buzz_trace_stats_t buzz_trace_stats;
+                buzz_trace_read(&buzz_trace_stats);
+                result = Vendor.sendResponse(rhport, request, &buzz_trace_stats, MIN(request->wLength, sizeof(buzz_trace_stats_t)));
                 break;
             case USB_REQUEST_VENDOR_DEVICE_SEND_COMMAND:
                 if (request->wLength < 7 || request->bmRequestDirection != REQUEST_DIRECTION_OUT) {
@@ -254,9 +346,43 @@ bool vendorRequestCallback(uint8_t rhport, uint8_t requestStage, arduino_usb_con
                 if (requestStage == CONTROL_STAGE_SETUP) {
                     result = Vendor.sendResponse(rhport, request, &command_to_send, request->wLength);
                 } else if (requestStage == CONTROL_STAGE_ACK) {
-                    executeCommand(command_to_send.dst_mac_addr, &command_to_send.command, request->wLength - sizeof(command_to_send.dst_mac_addr));
+                    executeCommand(command_to_send.dst_mac_addr, &command_to_send.command, request->wLength - sizeof(command_to_send.dst_mac_addr), &s_last_command_seq);
+                }
+
+                break;
+            case USB_REQUEST_VENDOR_DEVICE_SEND_MULTICAST:
+                /* flags, num_targets, num_targets MAC addresses, command (see executeMulticastCommand) */
+                static uint8_t multicast_to_send[2 + MULTICAST_MAX_TARGETS * ESP_NOW_ETH_ALEN + sizeof(payload_command_t)];
+                if (request->wLength < 3 || request->wLength > sizeof(multicast_to_send) || request->bmRequestDirection != REQUEST_DIRECTION_OUT) {
+                    break;
                 }
+                result = true;
 
+                if (requestStage == CONTROL_STAGE_SETUP) {
+                    result = Vendor.sendResponse(rhport, request, multicast_to_send, request->wLength);
+                } else if (requestStage == CONTROL_STAGE_ACK) {
+                    executeMulticastCommand(multicast_to_send, request->wLength, &s_last_command_seq);
+                }
+
+                break;
+            case USB_REQUEST_VENDOR_DEVICE_COMMAND_SEQ:
+                /* The sequence number of the last command sent with USB_REQUEST_VENDOR_DEVICE_SEND_COMMAND or
+                 * USB_REQUEST_VENDOR_DEVICE_SEND_MULTICAST, to find it in the delivery status (int32_t, -1 if it was not relayed) */
+                if (request->bmRequestDirection == REQUEST_DIRECTION_OUT || request->wLength != sizeof(s_last_command_seq)) { return false; }
+                if (requestStage != CONTROL_STAGE_SETUP) { return true; }
+
+                result = Vendor.sendResponse(rhport, request, &s_last_command_seq, sizeof(s_last_command_seq));
+                break;
+            case USB_REQUEST_VENDOR_DEVICE_COMMAND_STATUS:
+                /* Delivery status of the recently relayed commands, newest first */
+                if (requestStage != CONTROL_STAGE_SETUP) { return true; }
+                if (request->bmRequestDirection != REQUEST_DIRECTION_IN) { break; }
+
+                static command_delivery_t deliveries[COMMAND_DELIVERY_HISTORY];
+                {
+                    uint8_t count = get_command_deliveries(deliveries, COMMAND_DELIVERY_HISTORY);
+                    result        = Vendor.sendResponse(rhport, request, deliveries, MIN(request->wLength, count * sizeof(command_delivery_t)));
+                }
                 break;
             default:
                 result = false;
@@ -0,0 +1,172 @@
+#include "dispatcher.h"
+#include "battery.h"
+#include "bluetooth.h"
+#include "modes/IMode.h"
+#include <sys/param.h>
+
+static QueueHandle_t s_queue;
+static unsigned long s_mode_due         = 0; // millis() at which the mode's timer is due
+static bool s_mode_timer                = true;
+static unsigned long s_housekeeping_due = 0;
+
+/* The latest decision posted, taken by the main loop */
+static portMUX_TYPE s_decision_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint8_t s_decision_arbiter[ESP_NOW_ETH_ALEN];
+static payload_buzz_decision_t s_decision;
+static bool s_decision_pending = false;
+
+/* Compare in a way that survives the millis() overflow */
+static inline bool is_due(unsigned long due, unsigned long time) {
+    return (long)(time - due) >= 0;
+}
+
+static TickType_t ticks_until(unsigned long due, unsigned long time) {
+    return is_due(due, time) ? 0 : pdMS_TO_TICKS(due - time);
+}
+
+static bool post(const dispatcher_event_t *evt) {
+    if (s_queue == NULL) {
+        return false; // Before dispatcher_setup, the first dispatcher_run catches up
+    }
+    if (xQueueSend(s_queue, evt, 0) != pdTRUE) {
+        if (evt->type != DISPATCHER_EVENT_WAKE) {
+            log_w("Dispatcher queue full, dropping event %d", evt->type);
+        }
+        return false;
+    }
+    return true;
+}
+
+void dispatcher_setup() {
+    s_queue = xQueueCreate(DISPATCHER_QUEUE_SIZE, sizeof(dispatcher_event_t));
+    if (s_queue == NULL) {
+        log_e("Create dispatcher queue fail");
+        ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+    }
+}
+
+void dispatcher_wake() {
+    dispatcher_event_t evt;
+    evt.type = DISPATCHER_EVENT_WAKE;
+    post(&evt);
+}
+
+void dispatcher_post_button(button_t button, bool pressed, int64_t time_us, bool to_mode) {
+    dispatcher_event_t evt;
+    evt.type                = DISPATCHER_EVENT_BUTTON;
+    evt.info.button.button  = button;
+    evt.info.button.pressed = pressed;
+    evt.info.button.to_mode = to_mode;
+    evt.info.button.time_us = time_us;
+    post(&evt);
+}
+
+void dispatcher_post_peer_state(const uint8_t *mac_addr) {
+    dispatcher_event_t evt;
+    evt.type = DISPATCHER_EVENT_PEER_STATE;
+    memcpy(evt.info.mac_addr, mac_addr, ESP_NOW_ETH_ALEN);
+    post(&evt);
+}
+
+void dispatcher_post_buzz(const uint8_t *mac_addr, const payload_buzz_t *buzz) {
+    dispatcher_event_t evt;
+    evt.type = DISPATCHER_EVENT_BUZZ;
+    memcpy(evt.info.buzz.mac_addr, mac_addr, ESP_NOW_ETH_ALEN);
+    evt.info.buzz.buzz = *buzz;
+    post(&evt);
+}
+
+bool dispatcher_post_command(command_t command) {
+    dispatcher_event_t evt;
+    evt.type         = DISPATCHER_EVENT_COMMAND;
+    evt.info.command = command;
+    return post(&evt);
+}
+
+void dispatcher_post_decision(const uint8_t *arbiter, const payload_buzz_decision_t *decision) {
+    portENTER_CRITICAL(&s_decision_lock);
+    memcpy(s_decision_arbiter, arbiter, ESP_NOW_ETH_ALEN);
+    s_decision         = *decision;
+    s_decision_pending = true;
+    portEXIT_CRITICAL(&s_decision_lock);
+
+    dispatcher_event_t evt;
+    evt.type = DISPATCHER_EVENT_DECISION;
+    post(&evt);
+}
+
+static void dispatch(const dispatcher_event_t *evt) {
+    switch (evt->type) {
+        case DISPATCHER_EVENT_WAKE:
+            break;
+        case DISPATCHER_EVENT_BUTTON:
+            if (evt->info.button.to_mode) {
+                get_current_mode()->onButton(evt->info.button.button, evt->info.button.pressed, evt->info.button.time_us);
+            }
+            s_housekeeping_due = millis();
+            break;
+        case DISPATCHER_EVENT_PEER_STATE:
+            {
+                peer_data_t *peer_data;
+                if (get_peer_info(evt->info.mac_addr, &peer_data) == ESP_OK && peer_data->valid_version) {
+                    get_current_mode()->onPeerState(peer_data);
+                }
+            }
+            break;
+        case DISPATCHER_EVENT_BUZZ:
+            get_current_mode()->onReceiveBuzz(evt->info.buzz.mac_addr, &evt->info.buzz.buzz);
+            break;
+        case DISPATCHER_EVENT_COMMAND:
+            get_current_mode()->onCommand(evt->info.command);
+            break;
+        case DISPATCHER_EVENT_DECISION:
+            {
+                uint8_t arbiter[ESP_NOW_ETH_ALEN];
+                payload_buzz_decision_t decision;
+                portENTER_CRITICAL(&s_decision_lock);
+                bool pending = s_decision_pending;
+                memcpy(arbiter, s_decision_arbiter, ESP_NOW_ETH_ALEN);
+                decision           = s_decision;
+                s_decision_pending = false;
+                portEXIT_CRITICAL(&s_decision_lock);
+
+                if (pending) {
+                    get_current_mode()->onBuzzDecision(arbiter, &decision);
+                }
+            }
+            break;
+        default:
+            log_e("Dispatcher event type error: %d", evt->type);
+            break;
+    }
+}
+
+void dispatcher_run(TickType_t max_ticks) {
+    unsigned long time = millis();
+    TickType_t ticks   = MIN(max_ticks, ticks_until(s_housekeeping_due, time));
+    if (s_mode_timer) {
+        ticks = MIN(ticks, ticks_until(s_mode_due, time));
+    }
+
+    /* Every event may have moved the mode's deadline, so it is asked again after them */
+    dispatcher_event_t evt;
+    bool dispatched = false;
+    while (xQueueReceive(s_queue, &evt, dispatched ? 0 : ticks) == pdTRUE) {
+        dispatch(&evt);
+        dispatched = true;
+    }
+
+    time = millis();
+    if (is_due(s_housekeeping_due, time)) {
+        battery_loop();
+        button_loop();
+        bluetooth_loop();
+        s_housekeeping_due = time + (button_pressed(BUTTON_BACK) ? DISPATCHER_BUTTON_HELD_MS : DISPATCHER_HOUSEKEEPING_MS);
+    }
+
+    if (dispatched || (s_mode_timer && is_due(s_mode_due, time))) {
+        unsigned long delay_ms = get_current_mode()->onTimer(time);
+        s_mode_timer           = delay_ms != DISPATCHER_NO_TIMER;
+        s_mode_due             = time + delay_ms;
+    }
+}
@@ -0,0 +1,46 @@
+#include "journal.h"
+#include "timesync.h"
+#include "battery.h"
+#include <sys/param.h>
+
+static portMUX_TYPE s_journal_lock = portMUX_INITIALIZER_UNLOCKED;
+static journal_entry_t s_entries[JOURNAL_ENTRIES];
+static uint32_t s_next_seq = 0;
+
+void journal_record(journal_event_t event, const uint8_t *mac_addr, uint8_t arg, uint32_t value) {
+    journal_record_at(event, timesync_now_us(), mac_addr, arg, value);
+}
+
+void journal_record_at(journal_event_t event, int64_t time_us, const uint8_t *mac_addr, uint8_t arg, uint32_t value) {
+    if (!has_external_power) {
+        return; // Nobody reads the journal of a buzzer
+    }
+
+    portENTER_CRITICAL(&s_journal_lock);
+    journal_entry_t *entry = &s_entries[s_next_seq % JOURNAL_ENTRIES];
+    entry->seq             = s_next_seq++;
+    entry->time_us         = time_us;
+    memcpy(entry->mac_addr, mac_addr, ESP_NOW_ETH_ALEN);
+    entry->event = event;
+    entry->arg   = arg;
+    entry->value = value;
+    portEXIT_CRITICAL(&s_journal_lock);
+}
+
+uint8_t journal_read(uint32_t cursor, journal_page_header_t *header, journal_entry_t *entries, uint8_t max_entries) {
+    portENTER_CRITICAL(&s_journal_lock);
+    header->next_seq  = s_next_seq;
+    header->first_seq = s_next_seq > JOURNAL_ENTRIES ? s_next_seq - JOURNAL_ENTRIES : 0;
+
+    /* A cursor ahead of the journal belongs to a previous boot, start over */
+    if (cursor < header->first_seq || cursor > header->next_seq) {
+        cursor = header->first_seq;
+    }
+
+    uint8_t count = MIN(header->next_seq - cursor, (uint32_t)max_entries);
+    for (uint8_t i = 0; i < count; i++) {
+        entries[i] = s_entries[(cursor + i) % JOURNAL_ENTRIES];
+    }
+    portEXIT_CRITICAL(&s_journal_lock);
+    return count;
+}
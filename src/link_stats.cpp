@@ -0,0 +1,111 @@
+#include "link_stats.h"
+#include "rssi_filter.h"
+#include "tx.h"
+#include <Arduino.h>
+
+static inline void ewma(uint16_t *avg, int32_t sample, uint8_t gain_shift) {
+    *avg = (uint16_t)((int32_t)*avg + ((sample - (int32_t)*avg) >> gain_shift));
+}
+
+static void adapt_ping_interval(peer_link_t *link, bool stable) {
+    uint32_t min_interval = pingInterval;
+    uint32_t max_interval = (uint32_t)pingInterval * PING_MAX_INTERVAL_FACTOR;
+
+    if (link->ping_interval_ms == 0) {
+        link->ping_interval_ms = min_interval;
+    }
+    /* Back off slowly while stable, react quickly otherwise */
+    link->ping_interval_ms = stable ? link->ping_interval_ms + link->ping_interval_ms / 2 : link->ping_interval_ms / 2;
+    link->ping_interval_ms = constrain(link->ping_interval_ms, min_interval, max_interval);
+}
+
+void link_stats_ping_sent(peer_link_t *link, unsigned long time) {
+    if (link->ping_outstanding) {
+        /* The previous ping was never answered */
+        link->pings_lost++;
+        ewma(&link->loss, 65535, LINK_LOSS_GAIN_SHIFT);
+        adapt_ping_interval(link, false);
+    } else if (link->pings_sent > 0) {
+        ewma(&link->loss, 0, LINK_LOSS_GAIN_SHIFT);
+    }
+
+    link->pings_sent++;
+    link->ping_outstanding = true;
+    link->last_ping_at     = time;
+}
+
+void link_stats_pong_received(peer_link_t *link) {
+    link->ping_outstanding = false;
+}
+
+void link_stats_latency_sample(peer_link_t *link, uint16_t rtt_us) {
+    if (!link->has_latency) {
+        link->latency_avg_us    = rtt_us;
+        link->latency_jitter_us = rtt_us / 2;
+        link->latency_min_us    = rtt_us;
+        link->latency_max_us    = rtt_us;
+        link->has_latency       = true;
+        return;
+    }
+
+    int32_t deviation = abs((int32_t)rtt_us - (int32_t)link->latency_avg_us);
+    bool stable       = deviation <= 2 * link->latency_jitter_us + LINK_JITTER_FLOOR_US && link->loss < LINK_UNSTABLE_LOSS;
+
+    /* Jitter first, it is relative to the previous average */
+    ewma(&link->latency_jitter_us, deviation, LINK_JITTER_GAIN_SHIFT);
+    ewma(&link->latency_avg_us, rtt_us, LINK_LATENCY_GAIN_SHIFT);
+    link->latency_min_us = MIN(link->latency_min_us, rtt_us);
+    link->latency_max_us = max(link->latency_max_us, rtt_us);
+
+    adapt_ping_interval(link, stable);
+}
+
+uint32_t link_stats_ping_urgency(peer_link_t *link, unsigned long time) {
+    if (link->pings_sent == 0) {
+        /* Never pinged, learn about the link quickly */
+        return UINT32_MAX;
+    }
+    if (link->ping_interval_ms == 0) {
+        link->ping_interval_ms = pingInterval;
+    }
+    return (uint32_t)(((uint64_t)(time - link->last_ping_at) << 8) / link->ping_interval_ms);
+}
+
+esp_err_t get_peer_link_stats(uint8_t index, peer_link_stats_t *stats) {
+    peer_data_t snapshot;
+    peer_link_snapshot_t link_snapshot;
+    peer_table_read_link_snapshot(index, &snapshot, &link_snapshot);
+    if (!link_snapshot.used) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    /* The RSSI and tx counters have their own seqlocks and check the entry's generation against the live one */
+    const peer_data_t *peer_data = &peer_data_table[index];
+    const peer_link_t *link      = &link_snapshot.link;
+
+    memcpy(stats->mac_addr, snapshot.mac_addr, ESP_NOW_ETH_ALEN);
+    stats->latency_avg_us    = link->latency_avg_us;
+    stats->latency_jitter_us = link->latency_jitter_us;
+    stats->latency_min_us    = link->latency_min_us;
+    stats->latency_max_us    = link->latency_max_us;
+    stats->loss_permille     = (uint32_t)link->loss * 1000 / 65535;
+    stats->pings_sent        = link->pings_sent;
+    stats->pings_lost        = link->pings_lost;
+    stats->ping_interval_ms  = link->ping_interval_ms;
+
+    rssi_stats_t rssi = {};
+    rssi_filter_read(peer_data, &rssi);
+    stats->rssi_avg = rssi.avg;
+    stats->rssi_min = rssi.min;
+    stats->rssi_max = rssi.max;
+
+    stats->relay_hops       = link_snapshot.relay_hops;
+    stats->relay_latency_us = link_snapshot.relay_latency_us;
+
+    get_peer_tx_stats(peer_data, stats);
+
+    if (get_peer_generation(peer_data) != link_snapshot.generation) {
+        return ESP_ERR_INVALID_STATE; // Reassigned since the snapshot, the RSSI and tx counters are of the new peer
+    }
+    return ESP_OK;
+}
@@ -12,6 +12,10 @@
 #include "freertos/semphr.h"
 #include "esp_task_wdt.h"
 #include "modes/IMode.h"
+#include "dispatcher.h"
+#ifdef CONFIG_PM_ENABLE
+#include "esp_pm.h"
+#endif
 
 static RTC_NOINIT_ATTR uint8_t boot_attempts = 0;
 void check_safe_mode() {
@@ -34,6 +38,29 @@ void check_safe_mode() {
     }
 }
 
+#ifdef CONFIG_PM_ENABLE
+#if ESP_IDF_VERSION < ESP_IDF_VERSION_VAL(5, 0, 0)
+#if CONFIG_IDF_TARGET_ESP32C3
+typedef esp_pm_config_esp32c3_t esp_pm_config_t;
+#elif CONFIG_IDF_TARGET_ESP32S3
+typedef esp_pm_config_esp32s3_t esp_pm_config_t;
+#endif
+#endif
+
+/* Lets the CPU clock down and enter light sleep whenever all tasks are blocked. The radio keeps it awake unless it is
+ * dozing (see power_save.h), the buttons wake it up. */
+static void pm_setup() {
+    esp_pm_config_t pm_config;
+    pm_config.max_freq_mhz       = getCpuFrequencyMhz();
+    pm_config.min_freq_mhz       = getXtalFrequencyMhz();
+    pm_config.light_sleep_enable = true;
+    esp_err_t ret                = esp_pm_configure(&pm_config);
+    if (ret != ESP_OK) {
+        log_e("Configure power management fail: %s", esp_err_to_name(ret));
+    }
+}
+#endif
+
 void setup(void) {
     Serial.begin(9600);
 
@@ -44,6 +71,12 @@ void setup(void) {
 
     nvm_setup();
     battery_setup();
+#ifdef CONFIG_PM_ENABLE
+    if (!has_external_power) {
+        pm_setup();
+    }
+#endif
+    dispatcher_setup();
     button_setup();
     led_setup();
     mode_setup();
@@ -58,10 +91,7 @@ static esp_err_t print_real_time_stats(TickType_t xTicksToWait);
 #endif
 
 void loop() {
-    battery_loop();
-    button_loop();
-    bluetooth_loop();
-    get_current_mode()->loop();
+    dispatcher_run(pdMS_TO_TICKS(1000)); // Wakes up at least every second for the checks below
 
     if (boot_attempts > 0 && millis() > 30000) {
         log_d("Boot seems successful.");
@@ -1,11 +1,12 @@
 #include "modes/IMode.h"
 #include "nvm.h"
+#include "journal.h"
 
 static IMode *modes[node_mode_t::NUM_MODES] = { 0 };
 IMode *get_mode(node_mode_t modeIdx) {
     IMode *mode = modes[modeIdx];
     if (mode == nullptr) {
-        log_e("Mode %d not initialized", mode);
+        log_e("Mode %d not initialized", modeIdx);
     }
     return mode;
 }
@@ -21,6 +22,8 @@ void set_mode(node_mode_t mode) {
 
         get_current_mode()->setup();
         nvm_save();
+        dispatcher_wake();
+        journal_record(JOURNAL_MODE_CHANGE, my_mac_addr, mode, 0);
     }
 }
 
@@ -30,11 +33,17 @@ IMode::IMode(node_mode_t mode) { modes[mode] = this; }
 // node_mode_state_t IMode::getState() { return this->state; }
 
 void IMode::_setState(node_mode_state_t state) {
-    if (state.raw != this->state.raw) {
+    bool changed = state.raw != this->state.raw;
+    if (changed) {
         this->last_state_change = millis();
     }
 
-    this->state = state;
+    __atomic_store_n(&this->state.raw, state.raw, __ATOMIC_RELAXED);
+
+    /* The mode's timer depends on the state */
+    if (changed) {
+        dispatcher_wake();
+    }
 }
 
 unsigned long IMode::getTimeSinceLastStateChange() { return millis() - this->last_state_change; }
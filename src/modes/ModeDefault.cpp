@@ -2,55 +2,341 @@
 #include "nvm.h"
 #include "led.h"
 #include "custom_usb.h"
-
-static CEveryNMillis buzzStateUpdate(ACCOUNCEMENT_INTERVAL_WHILE_ACTIVE);
-
-bool lastPushedBuzzerButton = false; /* Whether or not the buzzer button was pushed last loop iteration */
+#include "timesync.h"
+#include "power_save.h"
+#include "arbitration.h"
+#include "journal.h"
+#include "buzz_trace.h"
+#include "esp_timer.h"
+#include "dispatcher.h"
+#include "esp_mac.h"
+#include <sys/param.h>
+#include <inttypes.h>
 
 unsigned long buzzer_active_until   = 0;
 unsigned long buzzer_disabled_until = 0;
 
+/* The claims are changed in the main loop and read by the USB task (getRanking) */
+static portMUX_TYPE claims_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static inline bool claim_before(const buzz_claim_t *a, const buzz_claim_t *b) {
+    if (a->press_time_us != b->press_time_us) {
+        return a->press_time_us < b->press_time_us;
+    }
+    return memcmp(a->mac_addr, b->mac_addr, ESP_NOW_ETH_ALEN) < 0;
+}
+
+/* Presses the key of mac_addr's buzz */
+static void press_key(const uint8_t *mac_addr, const key_config_t *key_config) {
+#ifdef CONFIG_TINYUSB_ENABLED
+    if ((key_config->modifiers & (1 << 0)) != 0) Keyboard.press(KEY_LEFT_CTRL);
+    if ((key_config->modifiers & (1 << 1)) != 0) Keyboard.press(KEY_LEFT_ALT);
+    if ((key_config->modifiers & (1 << 2)) != 0) Keyboard.press(KEY_LEFT_SHIFT);
+    if ((key_config->modifiers & (1 << 3)) != 0) Keyboard.press(KEY_LEFT_GUI);
+    if ((key_config->modifiers & (1 << 4)) != 0) Keyboard.press(KEY_RIGHT_CTRL);
+    if ((key_config->modifiers & (1 << 5)) != 0) Keyboard.press(KEY_RIGHT_ALT);
+    if ((key_config->modifiers & (1 << 6)) != 0) Keyboard.press(KEY_RIGHT_SHIFT);
+    if ((key_config->modifiers & (1 << 7)) != 0) Keyboard.press(KEY_RIGHT_GUI);
+
+    buzz_trace_key_pressed(mac_addr);
+    Keyboard.pressRaw(key_config->scan_code);
+    Keyboard.releaseAll();
+#else
+    (void)key_config; /* Silence "unused parameter" warning */
+    /* Without USB (e.g. in the simulator), this is where the key would be pressed */
+    buzz_trace_key_pressed(mac_addr);
+#endif
+}
+
 ModeDefault::ModeDefault() : IMode(MODE_DEFAULT) {
 }
 
 void ModeDefault::onReceiveState(peer_data_t *previous_state, payload_node_info_t *received_state) {
     node_state_default_t peer_previous_state = previous_state->node_info.current_mode_state.node_state_default;
 
-    unsigned long time = millis();
+    /* Normally the key is pressed when the arbitration is decided. Without a round (i.e. the claim was lost), fall back
+     * to pressing it when the peer becomes active. This stays in comm_task, the host should not wait for the main loop. */
+    if (this->getState<node_state_default_t>() != MODE_DEFAULT_STATE_BUZZER_ACTIVE &&
+        received_state->current_mode_state.node_state_default == MODE_DEFAULT_STATE_BUZZER_ACTIVE &&
+        peer_previous_state != MODE_DEFAULT_STATE_BUZZER_ACTIVE && !this->round_open) {
+        press_key(previous_state->mac_addr, &received_state->key_config);
+    }
+}
+
+void ModeDefault::onPeerState(peer_data_t *peer_data) {
+    payload_node_info_t *node_info = &peer_data->node_info;
+    unsigned long time             = millis();
 
-    // Handle state data
     if (this->getState<node_state_default_t>() != MODE_DEFAULT_STATE_BUZZER_ACTIVE &&
-        received_state->current_mode_state.node_state_default == MODE_DEFAULT_STATE_BUZZER_ACTIVE) {
+        node_info->current_mode_state.node_state_default == MODE_DEFAULT_STATE_BUZZER_ACTIVE &&
+        node_info->buzzer_active_remaining_ms > 0 &&
+        this->buzzer_disabled_until < time + node_info->buzzer_active_remaining_ms) {
+        reset_shutdown_timer();
+        // time_of_last_keep_alive_communication = time; // This is a notable event -> reset shutdown timer
 
-#ifdef CONFIG_TINYUSB_ENABLED
-        if (peer_previous_state != MODE_DEFAULT_STATE_BUZZER_ACTIVE) {
-            if ((received_state->key_config.modifiers & (1 << 0)) != 0) Keyboard.press(KEY_LEFT_CTRL);
-            if ((received_state->key_config.modifiers & (1 << 1)) != 0) Keyboard.press(KEY_LEFT_ALT);
-            if ((received_state->key_config.modifiers & (1 << 2)) != 0) Keyboard.press(KEY_LEFT_SHIFT);
-            if ((received_state->key_config.modifiers & (1 << 3)) != 0) Keyboard.press(KEY_LEFT_GUI);
-            if ((received_state->key_config.modifiers & (1 << 4)) != 0) Keyboard.press(KEY_RIGHT_CTRL);
-            if ((received_state->key_config.modifiers & (1 << 5)) != 0) Keyboard.press(KEY_RIGHT_ALT);
-            if ((received_state->key_config.modifiers & (1 << 6)) != 0) Keyboard.press(KEY_RIGHT_SHIFT);
-            if ((received_state->key_config.modifiers & (1 << 7)) != 0) Keyboard.press(KEY_RIGHT_GUI);
-
-            Keyboard.pressRaw(received_state->key_config.scan_code);
-            Keyboard.releaseAll();
+        if (!nvm_data.game_config.can_buzz_while_other_is_active) {
+            this->buzzer_disabled_until = time + node_info->buzzer_active_remaining_ms;
+            this->setState(MODE_DEFAULT_STATE_DISABLED);
+            log_d("Received buzz from other node. Disabling for %dms", node_info->buzzer_active_remaining_ms);
         }
-#else
-        (void)peer_previous_state; /* Silence "unused variable" warning */
-#endif
+    }
+}
 
-        if (received_state->buzzer_active_remaining_ms > 0 &&
-            this->buzzer_disabled_until < time + received_state->buzzer_active_remaining_ms) {
-            reset_shutdown_timer();
-            // time_of_last_keep_alive_communication = time; // This is a notable event -> reset shutdown timer
+void ModeDefault::onReceiveBuzz(const uint8_t *mac_addr, const payload_buzz_t *buzz) {
+    log_d("Received buzz claim from " MACSTR " (press_time=%" PRId64 "us, stratum=%d)", MAC2STR(mac_addr), buzz->press_time_us, buzz->stratum);
 
-            if (!nvm_data.game_config.can_buzz_while_other_is_active) {
-                this->buzzer_disabled_until = time + received_state->buzzer_active_remaining_ms;
-                this->setState(MODE_DEFAULT_STATE_DISABLED);
-                log_d("Received buzz from other node. Disabling for %dms", received_state->buzzer_active_remaining_ms);
-            }
+    portENTER_CRITICAL(&claims_lock);
+    bool late = this->addClaim(mac_addr, buzz->press_time_us) && this->round_decided;
+    portEXIT_CRITICAL(&claims_lock);
+
+    if (late && arbitration_is_arbiter()) {
+        this->sendDecision(); // With the claim behind the winner
+    }
+}
+
+void ModeDefault::onBuzzDecision(const uint8_t *arbiter, const payload_buzz_decision_t *decision) {
+    if (arbitration_is_arbiter()) {
+        return; // Ours is the decision that counts
+    }
+
+    portENTER_CRITICAL(&claims_lock);
+    bool known = this->has_decision && memcmp(this->decision_arbiter, arbiter, ESP_NOW_ETH_ALEN) == 0;
+    int16_t age = known ? (int16_t)(this->decision_round - decision->round) : -1;
+    bool update = age == 0 && this->round_open && this->round_by_arbiter;
+    if (age > 0 || (age == 0 && !update)) {
+        portEXIT_CRITICAL(&claims_lock);
+        return; // A late copy, of a round that is over
+    }
+
+    /* A new decision is for the round we are in, unless that one followed the arbiter already */
+    bool new_round    = !update && (!this->round_open || this->round_by_arbiter);
+    bool was_decided  = this->round_decided && !new_round;
+    int64_t my_press  = INT64_MIN;
+    uint8_t winner[ESP_NOW_ETH_ALEN];
+    memcpy(winner, this->claims[0].mac_addr, ESP_NOW_ETH_ALEN);
+    for (uint8_t i = 0; i < this->num_claims && !new_round; i++) {
+        if (memcmp(this->claims[i].mac_addr, my_mac_addr, ESP_NOW_ETH_ALEN) == 0) {
+            my_press = this->claims[i].press_time_us;
+        }
+    }
+    if (new_round) {
+        this->round_won  = false;
+        this->round_lost = false;
+    }
+
+    bool my_claim_ranked = false;
+    for (uint8_t i = 0; i < decision->num_ranked; i++) {
+        memcpy(this->claims[i].mac_addr, decision->ranking[i].mac_addr, ESP_NOW_ETH_ALEN);
+        this->claims[i].press_time_us = decision->press_time_us + decision->ranking[i].delay_us;
+        my_claim_ranked |= memcmp(this->claims[i].mac_addr, my_mac_addr, ESP_NOW_ETH_ALEN) == 0;
+    }
+    this->num_claims       = decision->num_ranked;
+    this->round_open       = true;
+    this->round_decided    = true;
+    this->round_by_arbiter = true;
+    this->claim_pending    = false;
+    if (my_press != INT64_MIN && !my_claim_ranked) {
+        /* The arbiter has not heard our claim yet, it will rank it behind the winner as well */
+        this->addClaim(my_mac_addr, my_press);
+    }
+    bool newly_decided = !was_decided || memcmp(winner, this->claims[0].mac_addr, ESP_NOW_ETH_ALEN) != 0;
+    if (newly_decided) {
+        this->round_decided_at = millis();
+    }
+
+    this->has_decision   = true;
+    this->decision_round = decision->round;
+    memcpy(this->decision_arbiter, arbiter, ESP_NOW_ETH_ALEN);
+    portEXIT_CRITICAL(&claims_lock);
+
+    this->followRanking(newly_decided);
+}
+
+/* Must be called with claims_lock held. Returns whether the claim was added. */
+bool ModeDefault::addClaim(const uint8_t *mac_addr, int64_t press_time_us) {
+    /* While we doze, the claims of others reach us later */
+    int64_t window_us = BUZZ_ARBITRATION_WINDOW_US + power_save_extra_latency_us();
+
+    if (!this->round_open) {
+        this->num_claims        = 0;
+        this->round_open        = true;
+        this->round_decided     = false;
+        this->round_deadline_us = press_time_us + window_us;
+        this->round_won         = false;
+        this->round_lost        = false;
+        this->round_by_arbiter  = false;
+    }
+
+    uint8_t index;
+    for (index = 0; index < this->num_claims; index++) {
+        if (memcmp(this->claims[index].mac_addr, mac_addr, ESP_NOW_ETH_ALEN) == 0) {
+            /* One claim per node and round */
+            return false;
+        }
+    }
+
+    buzz_claim_t claim;
+    memcpy(claim.mac_addr, mac_addr, ESP_NOW_ETH_ALEN);
+    claim.press_time_us = press_time_us;
+
+    /* Find the claim's rank. Once decided, the winner is final and late claims can only be runners-up. */
+    index = this->num_claims;
+    while (index > (this->round_decided ? 1 : 0) && claim_before(&claim, &this->claims[index - 1])) {
+        index--;
+    }
+    if (index >= BUZZ_MAX_CLAIMS) { return false; }
+
+    uint8_t moved = MIN(this->num_claims, BUZZ_MAX_CLAIMS - 1) - index;
+    memmove(&this->claims[index + 1], &this->claims[index], moved * sizeof(buzz_claim_t));
+    this->claims[index] = claim;
+    this->num_claims    = index + 1 + moved;
+
+    if (!this->round_decided && press_time_us + window_us < this->round_deadline_us) {
+        this->round_deadline_us = press_time_us + window_us;
+    }
+    return true;
+}
+
+void ModeDefault::decideRound(unsigned long time) {
+    portENTER_CRITICAL(&claims_lock);
+    this->round_decided    = true;
+    this->round_decided_at = time;
+    this->claim_pending    = false;
+    portEXIT_CRITICAL(&claims_lock);
+
+    if (arbitration_is_arbiter()) {
+        this->rounds_decided++;
+        this->sendDecision();
+    } else if (arbitration_has_arbiter()) {
+        log_w("No decision of the arbiter, deciding the round on our own.");
+    }
+    this->followRanking(true);
+}
+
+void ModeDefault::sendDecision() {
+    payload_buzz_decision_t decision;
+    decision.round   = this->rounds_decided;
+    decision.attempt = 0; // Counted by comm_task
+
+    portENTER_CRITICAL(&claims_lock);
+    decision.num_ranked    = this->num_claims;
+    decision.press_time_us = this->claims[0].press_time_us;
+    for (uint8_t i = 0; i < this->num_claims; i++) {
+        int64_t delay_us = this->claims[i].press_time_us - decision.press_time_us;
+        memcpy(decision.ranking[i].mac_addr, this->claims[i].mac_addr, ESP_NOW_ETH_ALEN);
+        decision.ranking[i].delay_us = (int32_t)MAX(MIN(delay_us, (int64_t)INT32_MAX), (int64_t)INT32_MIN);
+    }
+    portEXIT_CRITICAL(&claims_lock);
+
+    send_buzz_decision(&decision);
+}
+
+/* Buzzes or locks us out as the ranking says, again only if a new ranking changes our part */
+void ModeDefault::followRanking(bool newly_decided) {
+    int8_t my_rank = -1;
+    buzz_claim_t winner;
+    uint8_t num_claims;
+
+    portENTER_CRITICAL(&claims_lock);
+    winner     = this->claims[0];
+    num_claims = this->num_claims;
+    for (uint8_t i = 0; i < num_claims; i++) {
+        if (memcmp(this->claims[i].mac_addr, my_mac_addr, ESP_NOW_ETH_ALEN) == 0) {
+            my_rank = i;
+        }
+    }
+    portEXIT_CRITICAL(&claims_lock);
+
+    if (newly_decided) {
+        log_i("Buzz arbitration: " MACSTR " wins (%d claims, we are %d).", MAC2STR(winner.mac_addr), num_claims, my_rank);
+        journal_record(JOURNAL_ROUND_DECIDED, winner.mac_addr, num_claims, 0);
+    }
+
+    if (my_rank == 0) {
+        if (!this->round_won) {
+            this->round_won  = true;
+            this->round_lost = false;
+            this->buzz();
+        }
+        return;
+    }
+
+    if (newly_decided) {
+        peer_data_t *peer_data;
+        if (get_peer_info(winner.mac_addr, &peer_data) == ESP_OK) {
+            press_key(winner.mac_addr, &peer_data->node_info.key_config);
+        }
+    }
+
+    /* A runner-up, or overruled by the arbiter after deciding on our own */
+    if ((my_rank > 0 || this->round_won) && !this->round_lost) {
+        this->loseRound();
+    }
+}
+
+void ModeDefault::loseRound() {
+    this->round_won  = false;
+    this->round_lost = true;
+    if (nvm_data.game_config.can_buzz_while_other_is_active) {
+        this->buzz();
+    } else {
+        /* Until the winner's state update tells us how long it stays active */
+        this->buzzer_disabled_until = this->round_decided_at + nvm_data.game_config.buzzer_active_time;
+        this->setState(MODE_DEFAULT_STATE_DISABLED);
+    }
+}
+
+uint8_t ModeDefault::getRanking(buzz_claim_t *ranking, uint8_t max_entries) {
+    portENTER_CRITICAL(&claims_lock);
+    uint8_t num_ranked = this->round_decided ? MIN(this->num_claims, max_entries) : 0;
+    memcpy(ranking, this->claims, num_ranked * sizeof(buzz_claim_t));
+    portEXIT_CRITICAL(&claims_lock);
+    return num_ranked;
+}
+
+bool ModeDefault::sendClaim(int64_t press_local_us) {
+    if (this->getState<node_state_default_t>() != MODE_DEFAULT_STATE_IDLE) {
+        return false;
+    }
+    int64_t press_time_us = timesync_local_to_network_us(press_local_us);
+
+    portENTER_CRITICAL(&claims_lock);
+    /* The button task and the main loop (holding the button) may both see the same press */
+    if (this->claim_pending || press_local_us - this->last_press_local_us < BUTTON_DEBOUNCE_US) {
+        portEXIT_CRITICAL(&claims_lock);
+        return false;
+    }
+    this->last_press_local_us = press_local_us;
+    this->claim_press_time_us = press_time_us;
+    this->claim_pending       = true;
+    this->claim_unregistered  = true;
+    portEXIT_CRITICAL(&claims_lock);
+
+    send_buzz_claim(press_time_us, press_local_us);
+    return true;
+}
+
+void ModeDefault::registerClaim() {
+    portENTER_CRITICAL(&claims_lock);
+    if (!this->claim_unregistered) {
+        portEXIT_CRITICAL(&claims_lock);
+        return;
+    }
+    this->claim_unregistered = false;
+    int64_t press_time_us    = this->claim_press_time_us;
+    bool added          = this->addClaim(my_mac_addr, press_time_us);
+    bool late           = this->round_decided; // Only after addClaim, which may have opened a new round
+    this->claim_pending = !late;
+    portEXIT_CRITICAL(&claims_lock);
+
+    journal_record_at(JOURNAL_BUZZ_CLAIM, press_time_us, my_mac_addr, 0, 0);
+
+    if (late) {
+        /* The round is already decided, we can only be a runner-up */
+        if (added && arbitration_is_arbiter()) {
+            this->sendDecision();
         }
+        this->loseRound();
     }
 }
 
@@ -120,61 +406,118 @@ void ModeDefault::update_my_info(payload_node_info_t *node_info) {
 
 void ModeDefault::setActive(bool active) {
     if (active) {
-        this->setState(MODE_DEFAULT_STATE_DISABLED);
         this->buzzer_disabled_until = -1UL;
+        this->setState(MODE_DEFAULT_STATE_DISABLED);
     } else {
-        this->setState(MODE_DEFAULT_STATE_IDLE);
         this->buzzer_disabled_until = 0;
+        this->setState(MODE_DEFAULT_STATE_IDLE);
     }
 }
 
-void ModeDefault::loop() {
-    unsigned long time = millis();
-
-    if (this->getState<node_state_default_t>() == MODE_DEFAULT_STATE_BUZZER_ACTIVE && buzzStateUpdate) {
-        send_state_update();
-    }
+unsigned long ModeDefault::onTimer(unsigned long time) {
+    unsigned long next = DISPATCHER_NO_TIMER;
 
-    static CEveryNMillis debounceBuzzerButton(50);
+    /* In case the button event was dropped */
+    this->registerClaim();
 
-    if (this->getState<node_state_default_t>() == MODE_DEFAULT_STATE_BUZZER_ACTIVE && time > this->buzzer_active_until) {
-        log_d("Time's up! On cooldown for a bit.");
-        this->setState(MODE_DEFAULT_STATE_DISABLED);
-        if (this->buzzer_disabled_until != -1UL) {
-            this->buzzer_disabled_until = time + nvm_data.game_config.deactivation_time_after_buzzing;
+    if (this->round_open && !this->round_decided) {
+        int64_t remaining_us = this->round_deadline_us - timesync_now_us();
+        if (arbitration_is_arbiter()) {
+            remaining_us += BUZZ_DECISION_DELAY_MS * 1000LL;
+        } else if (arbitration_has_arbiter()) {
+            /* The arbiter decides, unless it stays silent */
+            remaining_us += BUZZ_DECISION_TIMEOUT_MS * 1000LL;
+        }
+        if (remaining_us <= 0) {
+            this->decideRound(time);
+        } else {
+            next = MIN(next, (unsigned long)(remaining_us / 1000) + 1);
         }
-        send_state_update();
     }
-
-    if (this->getState<node_state_default_t>() == MODE_DEFAULT_STATE_DISABLED && time > this->buzzer_disabled_until) {
-        log_d("Re-enabling.");
-        this->setState(MODE_DEFAULT_STATE_IDLE);
-        send_state_update();
+    if (this->round_open && this->round_decided) {
+        unsigned long round_time = (unsigned long)nvm_data.game_config.buzzer_active_time + nvm_data.game_config.deactivation_time_after_buzzing;
+        if (time - this->round_decided_at > round_time) {
+            /* Keep the claims, so the ranking of the last round can still be read */
+            this->round_open = false;
+        } else {
+            next = MIN(next, round_time - (time - this->round_decided_at) + 1);
+        }
     }
 
-    if (digitalRead(BUZZER_BUTTON_PIN) == LOW) {
-        if (!lastPushedBuzzerButton || !nvm_data.game_config.must_release_before_pressing) {
-            if (this->getState<node_state_default_t>() == MODE_DEFAULT_STATE_IDLE) {
-                this->buzz();
+    if (this->getState<node_state_default_t>() == MODE_DEFAULT_STATE_BUZZER_ACTIVE) {
+        if (time > this->buzzer_active_until) {
+            log_d("Time's up! On cooldown for a bit.");
+            this->setState(MODE_DEFAULT_STATE_DISABLED);
+            if (this->buzzer_disabled_until != -1UL) {
+                this->buzzer_disabled_until = time + nvm_data.game_config.deactivation_time_after_buzzing;
             }
+            send_state_update();
+        } else {
+            if ((long)(time - this->state_update_at) >= 0) {
+                send_state_update();
+                this->state_update_at = time + ACCOUNCEMENT_INTERVAL_WHILE_ACTIVE;
+            }
+            next = MIN(next, MIN(this->state_update_at - time, this->buzzer_active_until - time + 1));
         }
-        lastPushedBuzzerButton = true;
-        debounceBuzzerButton.reset();
-    } else {
-        if (debounceBuzzerButton) {
-            lastPushedBuzzerButton = false;
+    }
+
+    if (this->getState<node_state_default_t>() == MODE_DEFAULT_STATE_DISABLED && this->buzzer_disabled_until != -1UL) {
+        if (time > this->buzzer_disabled_until) {
+            log_d("Re-enabling.");
+            this->setState(MODE_DEFAULT_STATE_IDLE);
+            send_state_update();
+        } else {
+            next = MIN(next, this->buzzer_disabled_until - time + 1);
         }
     }
+
+    /* Holding the button down buzzes again as soon as we can, unless it must be released first */
+    if (!nvm_data.game_config.must_release_before_pressing && button_pressed(BUTTON_BUZZER) && this->sendClaim(esp_timer_get_time())) {
+        this->registerClaim();
+    }
+
+    return next;
+}
+
+void ModeDefault::onButtonEdge(button_t button, bool pressed, int64_t time_us) {
+    /* Every node ranks the claim by its press time, but the others decide once the window after the earliest claim is
+     * over: send it right away */
+    if (button == BUTTON_BUZZER && pressed) {
+        this->sendClaim(time_us);
+    }
+}
+
+void ModeDefault::onButton(button_t button, bool pressed, int64_t time_us) {
+    /* The claim onButtonEdge sent */
+    this->registerClaim();
+}
+
+void ModeDefault::onCommand(command_t command) {
+    switch (command) {
+        case COMMAND_BUZZ:
+            this->buzz();
+            break;
+        case COMMAND_SET_INACTIVE:
+            this->setActive(true);
+            send_state_update();
+            break;
+        case COMMAND_SET_ACTIVE:
+            this->setActive(false);
+            send_state_update();
+            break;
+        default:
+            break;
+    }
 }
 
 void ModeDefault::buzz() {
     log_i("BUZZ! Sending state update");
 
-    unsigned long time = millis();
-    this->setState(MODE_DEFAULT_STATE_BUZZER_ACTIVE);
+    unsigned long time        = millis();
     this->buzzer_active_until = time + nvm_data.game_config.buzzer_active_time;
+    this->state_update_at     = time + ACCOUNCEMENT_INTERVAL_WHILE_ACTIVE;
+    this->setState(MODE_DEFAULT_STATE_BUZZER_ACTIVE);
     send_state_update();
-    buzzStateUpdate.reset();
 
     /* This is notable! Reset shutdown timer */
     reset_shutdown_timer();
@@ -14,13 +14,15 @@ const CRGB simonSaysColors[] = {
 };
 uint8_t simonSaysColorIndex = 0;
 
-void ModeSimonSays::loop() {
-    EVERY_N_MILLIS(500) {
+unsigned long ModeSimonSays::onTimer(unsigned long time) {
+    if ((long)(time - this->next_color_at) >= 0) {
         simonSaysColorIndex++;
         if (simonSaysColorIndex >= sizeof(simonSaysColors) / sizeof(CRGB)) {
             simonSaysColorIndex = 0;
         }
+        this->next_color_at = time + 500;
     }
+    return this->next_color_at - time;
 }
 
 void ModeSimonSays::display() {
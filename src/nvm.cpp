@@ -21,10 +21,28 @@ void nvm_setup() {
                 .buzz_effect                     = EFFECT_FLASH_WHITE,
                 .can_buzz_while_other_is_active  = false,
                 .must_release_before_pressing    = true,
+                .crc                             = 0, // Only checked in COMMAND_SET_GAME_CONFIG
             },
-            .key_config = { .modifiers = 0, .scan_code = 0 }
+            .key_config            = { .modifiers = 0, .scan_code = 0 },
+            .relay_mode            = RELAY_MODE_OFF,
+            .channel               = CONFIG_ESPNOW_CHANNEL,
+            .phy_mode              = PHY_MODE_FAST,
+            .power_save            = POWER_SAVE_OFF,
+            .power_save_latency_ms = POWER_SAVE_DEFAULT_BUZZ_LATENCY_MS,
         };
 
+        nvm_save();
+    } else if (nvm_data.relay_mode > RELAY_MODE_ON || nvm_data.channel == 0xFF || nvm_data.phy_mode > PHY_MODE_LONG_RANGE ||
+               nvm_data.power_save > POWER_SAVE_ON || nvm_data.power_save_latency_ms < POWER_SAVE_MIN_BUZZ_LATENCY_MS ||
+               nvm_data.power_save_latency_ms > POWER_SAVE_MAX_BUZZ_LATENCY_MS) {
+        /* Written by an older firmware, the new fields are still erased */
+        if (nvm_data.relay_mode > RELAY_MODE_ON) { nvm_data.relay_mode = RELAY_MODE_OFF; }
+        if (nvm_data.channel == 0xFF) { nvm_data.channel = CONFIG_ESPNOW_CHANNEL; }
+        if (nvm_data.phy_mode > PHY_MODE_LONG_RANGE) { nvm_data.phy_mode = PHY_MODE_FAST; }
+        if (nvm_data.power_save > POWER_SAVE_ON) { nvm_data.power_save = POWER_SAVE_OFF; }
+        if (nvm_data.power_save_latency_ms < POWER_SAVE_MIN_BUZZ_LATENCY_MS || nvm_data.power_save_latency_ms > POWER_SAVE_MAX_BUZZ_LATENCY_MS) {
+            nvm_data.power_save_latency_ms = POWER_SAVE_DEFAULT_BUZZ_LATENCY_MS;
+        }
         nvm_save();
     }
 }
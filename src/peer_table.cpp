@@ -0,0 +1,246 @@
+#include "peer_table.h"
+
+#define PEER_INDEX_EMPTY         0xFF
+#define PEER_INDEX_READ_ATTEMPTS 2 // Concurrent lookups that overlap a change of the index are retried this often
+
+static_assert((PEER_INDEX_BUCKETS & (PEER_INDEX_BUCKETS - 1)) == 0, "PEER_INDEX_BUCKETS must be a power of two");
+static_assert(PEER_INDEX_BUCKETS >= 2 * PEER_DATA_TABLE_ENTRIES, "PEER_INDEX_BUCKETS is too small for the peer table");
+static_assert(PEER_INDEX_BUCKETS <= 256, "Buckets must be addressable by uint8_t");
+static_assert(PEER_DATA_TABLE_ENTRIES < PEER_INDEX_EMPTY, "Peer table entries must be addressable by uint8_t");
+
+peer_data_t peer_data_table[PEER_DATA_TABLE_ENTRIES];
+static peer_state_t peer_states[PEER_DATA_TABLE_ENTRIES];
+
+/* Hot lookup data, kept apart from peer_data_table: the MAC of every used entry packed into an integer,
+ * and the index buckets pointing into the table (linear probing, PEER_INDEX_EMPTY marks a free bucket). */
+static uint64_t peer_keys[PEER_DATA_TABLE_ENTRIES];
+static bool peer_used[PEER_DATA_TABLE_ENTRIES];
+static uint8_t peer_index[PEER_INDEX_BUCKETS];
+static uint32_t peer_generation[PEER_DATA_TABLE_ENTRIES];
+/* Odd while comm_task changes peer_keys or peer_index, concurrent lookups check it before and after (a seqlock) */
+static uint32_t peer_index_seq;
+
+/* Published copies of peer_data_table. snapshot_seq is odd while one is being written: buffer (seq / 2) % 2 is the
+ * current one, the other one is written next. */
+static peer_data_t snapshots[2][PEER_DATA_TABLE_ENTRIES];
+static peer_link_snapshot_t link_snapshots[2][PEER_DATA_TABLE_ENTRIES];
+static uint32_t snapshot_seq;
+static bool snapshot_due = true;
+
+static inline uint64_t mac_to_key(const uint8_t *mac_addr) {
+    uint64_t key = 0;
+    memcpy(&key, mac_addr, ESP_NOW_ETH_ALEN);
+    return key;
+}
+
+static inline uint8_t bucket_of(uint64_t key) {
+    /* The NIC specific (last) bytes of a MAC are the most random ones, fold everything into 32 bits and use a multiplicative hash */
+    uint32_t folded = (uint32_t)(key >> 16) ^ (uint32_t)key;
+    return ((folded * 2654435761u) >> 24) & (PEER_INDEX_BUCKETS - 1);
+}
+
+/* Returns the bucket holding key, or the empty bucket where it would be inserted */
+static uint8_t find_bucket(uint64_t key) {
+    uint8_t bucket = bucket_of(key);
+    while (peer_index[bucket] != PEER_INDEX_EMPTY && peer_keys[peer_index[bucket]] != key) {
+        bucket = (bucket + 1) & (PEER_INDEX_BUCKETS - 1);
+    }
+    return bucket;
+}
+
+static inline void index_write_begin() {
+    __atomic_store_n(&peer_index_seq, peer_index_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void index_write_end() {
+    __atomic_store_n(&peer_index_seq, peer_index_seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Buckets and keys may be written concurrently, every access of the reader is atomic */
+static uint8_t find_entry_concurrent(uint64_t key) {
+    uint8_t bucket = bucket_of(key);
+    for (uint16_t probes = 0; probes < PEER_INDEX_BUCKETS; probes++) {
+        uint8_t entry = __atomic_load_n(&peer_index[bucket], __ATOMIC_RELAXED);
+        if (entry == PEER_INDEX_EMPTY) {
+            break;
+        }
+        if (entry < PEER_DATA_TABLE_ENTRIES && __atomic_load_n(&peer_keys[entry], __ATOMIC_RELAXED) == key) {
+            return entry;
+        }
+        bucket = (bucket + 1) & (PEER_INDEX_BUCKETS - 1);
+    }
+    return PEER_INDEX_EMPTY;
+}
+
+void peer_table_init() {
+    memset(peer_index, PEER_INDEX_EMPTY, sizeof(peer_index));
+    memset(peer_used, 0, sizeof(peer_used));
+    for (uint8_t i = 0; i < PEER_DATA_TABLE_ENTRIES; i++) {
+        memset(peer_data_table[i].mac_addr, 0xFF, ESP_NOW_ETH_ALEN);
+    }
+}
+
+peer_state_t *get_peer_state(const peer_data_t *peer_data) {
+    return &peer_states[peer_data - peer_data_table];
+}
+
+uint32_t get_peer_generation(const peer_data_t *peer_data) {
+    return __atomic_load_n(&peer_generation[peer_data - peer_data_table], __ATOMIC_ACQUIRE);
+}
+
+esp_err_t get_peer_info(const uint8_t *mac_addr, peer_data_t **data) {
+    if (mac_addr == NULL || data == NULL) {
+        return ESP_ERR_ESPNOW_ARG;
+    }
+
+    uint8_t entry = peer_index[find_bucket(mac_to_key(mac_addr))];
+    if (entry == PEER_INDEX_EMPTY) {
+        return ESP_ERR_ESPNOW_NOT_FOUND;
+    }
+
+    *data = &peer_data_table[entry];
+    return ESP_OK;
+}
+
+esp_err_t get_peer_info_concurrent(const uint8_t *mac_addr, peer_data_t **data) {
+    if (mac_addr == NULL || data == NULL) {
+        return ESP_ERR_ESPNOW_ARG;
+    }
+
+    uint64_t key = mac_to_key(mac_addr);
+    for (uint8_t attempt = 0; attempt < PEER_INDEX_READ_ATTEMPTS; attempt++) {
+        uint32_t seq = __atomic_load_n(&peer_index_seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            /* We may have preempted comm_task in the middle of the change, waiting would never end */
+            return ESP_ERR_INVALID_STATE;
+        }
+        uint8_t entry = find_entry_concurrent(key);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&peer_index_seq, __ATOMIC_RELAXED) != seq) {
+            continue;
+        }
+        if (entry == PEER_INDEX_EMPTY) {
+            return ESP_ERR_ESPNOW_NOT_FOUND;
+        }
+        *data = &peer_data_table[entry];
+        return ESP_OK;
+    }
+    return ESP_ERR_INVALID_STATE;
+}
+
+esp_err_t get_or_create_peer_info(const uint8_t *mac_addr, peer_data_t **data) {
+    if (mac_addr == NULL || data == NULL) {
+        return ESP_ERR_ESPNOW_ARG;
+    }
+
+    uint64_t key   = mac_to_key(mac_addr);
+    uint8_t bucket = find_bucket(key);
+    if (peer_index[bucket] != PEER_INDEX_EMPTY) {
+        *data = &peer_data_table[peer_index[bucket]];
+        return ESP_OK;
+    }
+
+    for (uint8_t i = 0; i < PEER_DATA_TABLE_ENTRIES; i++) {
+        if (!peer_used[i]) {
+            memset(&peer_data_table[i], 0, sizeof(peer_data_t));
+            memset(&peer_states[i], 0, sizeof(peer_state_t));
+            memcpy(&peer_data_table[i].mac_addr, mac_addr, ESP_NOW_ETH_ALEN);
+
+            index_write_begin();
+            __atomic_store_n(&peer_keys[i], key, __ATOMIC_RELAXED);
+            peer_used[i] = true;
+            __atomic_store_n(&peer_generation[i], peer_generation[i] + 1, __ATOMIC_RELEASE);
+            __atomic_store_n(&peer_index[bucket], i, __ATOMIC_RELAXED);
+            index_write_end();
+            peer_table_changed();
+
+            *data = &(peer_data_table[i]);
+            return ESP_OK;
+        }
+    }
+
+    return ESP_ERR_ESPNOW_FULL;
+}
+
+void peer_table_changed() {
+    __atomic_store_n(&snapshot_due, true, __ATOMIC_RELAXED);
+}
+
+bool peer_table_snapshot_due() {
+    return __atomic_load_n(&snapshot_due, __ATOMIC_RELAXED);
+}
+
+void peer_table_publish_snapshot() {
+    uint32_t seq = snapshot_seq;
+
+    /* Cleared first, a change from another task while we copy is published next time */
+    __atomic_store_n(&snapshot_due, false, __ATOMIC_RELAXED);
+    __atomic_store_n(&snapshot_seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(snapshots[(seq / 2 + 1) % 2], peer_data_table, sizeof(peer_data_table));
+    for (uint8_t i = 0; i < PEER_DATA_TABLE_ENTRIES; i++) {
+        peer_link_snapshot_t *link = &link_snapshots[(seq / 2 + 1) % 2][i];
+        link->used                 = peer_used[i];
+        link->generation           = peer_generation[i];
+        link->link                 = peer_states[i].link;
+        link->relay_hops           = peer_states[i].relay_hops;
+        link->relay_latency_us     = peer_states[i].relay_latency_us;
+    }
+    __atomic_store_n(&snapshot_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void peer_table_read_snapshot(peer_data_t *dst, uint8_t first, uint8_t count) {
+    uint32_t seq;
+    do {
+        seq = __atomic_load_n(&snapshot_seq, __ATOMIC_ACQUIRE) & ~1u;
+        memcpy(dst, &snapshots[(seq / 2) % 2][first], count * sizeof(peer_data_t));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        /* Our buffer is only written again once the next snapshot has been completed, so a single publish is fine */
+    } while (__atomic_load_n(&snapshot_seq, __ATOMIC_RELAXED) - seq > 2);
+}
+
+void peer_table_read_link_snapshot(uint8_t index, peer_data_t *data, peer_link_snapshot_t *link) {
+    uint32_t seq;
+    do {
+        seq   = __atomic_load_n(&snapshot_seq, __ATOMIC_ACQUIRE) & ~1u;
+        *data = snapshots[(seq / 2) % 2][index];
+        *link = link_snapshots[(seq / 2) % 2][index];
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&snapshot_seq, __ATOMIC_RELAXED) - seq > 2);
+}
+
+esp_err_t remove_peer_info(const uint8_t *mac_addr) {
+    if (mac_addr == NULL) {
+        return ESP_ERR_ESPNOW_ARG;
+    }
+
+    uint8_t bucket = find_bucket(mac_to_key(mac_addr));
+    uint8_t entry  = peer_index[bucket];
+    if (entry == PEER_INDEX_EMPTY) {
+        return ESP_ERR_ESPNOW_NOT_FOUND;
+    }
+
+    memset(peer_data_table[entry].mac_addr, 0xFF, ESP_NOW_ETH_ALEN);
+    peer_used[entry] = false;
+
+    /* Backward shift deletion: move following entries of the probe sequence up, so no tombstones are needed. Concurrent
+     * lookups may miss an entry while it moves, they retry or fail. */
+    index_write_begin();
+    uint8_t hole = bucket;
+    uint8_t next = (hole + 1) & (PEER_INDEX_BUCKETS - 1);
+    while (peer_index[next] != PEER_INDEX_EMPTY) {
+        uint8_t home = bucket_of(peer_keys[peer_index[next]]);
+        /* Only move the entry if its home bucket is not within (hole, next] */
+        if (((next - home) & (PEER_INDEX_BUCKETS - 1)) >= ((next - hole) & (PEER_INDEX_BUCKETS - 1))) {
+            __atomic_store_n(&peer_index[hole], peer_index[next], __ATOMIC_RELAXED);
+            hole = next;
+        }
+        next = (next + 1) & (PEER_INDEX_BUCKETS - 1);
+    }
+    __atomic_store_n(&peer_index[hole], (uint8_t)PEER_INDEX_EMPTY, __ATOMIC_RELAXED);
+    index_write_end();
+    peer_table_changed();
+
+    return ESP_OK;
+}
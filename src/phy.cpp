@@ -0,0 +1,196 @@
+#include "phy.h"
+#include "peer_table.h"
+#include "rssi_filter.h"
+#include "comm_scheduler.h"
+#include "power_save.h"
+#include "timesync.h"
+#include "battery.h"
+#include "esp_wifi.h"
+#include "esp32-hal-log.h"
+#include <nvm.h>
+
+static phy_mode_t s_mode = PHY_MODE_FAST;
+
+/* Only used by comm_task */
+static phy_mode_t s_pending_mode;
+static phy_mode_t s_previous_mode;
+static unsigned long s_last_heard;
+static unsigned long s_switched_at;
+static unsigned long s_hold_off_until;
+static bool s_fallback_armed;
+static uint8_t s_peers_before; // Peers heard directly in the PHY_FALLBACK_TIMEOUT_MS before the switch
+
+static inline const char *phy_name(phy_mode_t mode) {
+    return mode == PHY_MODE_LONG_RANGE ? "long range" : "fast";
+}
+
+static void set_mode(phy_mode_t mode) {
+    esp_err_t ret = esp_wifi_config_espnow_rate(ESPNOW_WIFI_IF, mode == PHY_MODE_LONG_RANGE ? WIFI_PHY_RATE_LORA_500K : WIFI_PHY_RATE_1M_L);
+    if (ret != ESP_OK) {
+        log_e("Cannot switch to the %s PHY: %s", phy_name(mode), esp_err_to_name(ret));
+        return;
+    }
+    s_mode = mode;
+}
+
+static void save_mode() {
+    if (nvm_data.phy_mode != s_mode) {
+        nvm_data.phy_mode = s_mode;
+        nvm_save();
+    }
+}
+
+static uint8_t peers_heard_since(unsigned long since) {
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < PEER_DATA_TABLE_ENTRIES; i++) {
+        peer_state_t *peer_state = get_peer_state(&peer_data_table[i]);
+        if (peer_state->heard_direct && (long)(peer_state->last_direct_at - since) >= 0) {
+            count++;
+        }
+    }
+    return count;
+}
+
+/* The PHY the links ask for. Between the thresholds, the current one is kept. */
+static phy_mode_t wanted_mode(unsigned long time) {
+    bool any_weak   = false;
+    bool all_strong = true;
+    uint8_t peers   = 0;
+
+    for (uint8_t i = 0; i < PEER_DATA_TABLE_ENTRIES; i++) {
+        peer_data_t *peer_data   = &peer_data_table[i];
+        peer_state_t *peer_state = get_peer_state(peer_data);
+        if (!peer_data->valid_version || !peer_state->heard_direct || time - peer_state->last_direct_at > RELAY_DIRECT_TIMEOUT_MS) {
+            continue;
+        }
+
+        rssi_stats_t rssi;
+        if (!rssi_filter_read(peer_data, &rssi) || rssi.samples < RSSI_WINDOW_SIZE) {
+            continue;
+        }
+
+        peers++;
+        if (rssi.avg < PHY_LR_RSSI_DBM || peer_state->link.loss > PHY_LR_LOSS) {
+            any_weak = true;
+        }
+        if (rssi.avg < PHY_FAST_RSSI_DBM || peer_state->link.loss > PHY_FAST_LOSS) {
+            all_strong = false;
+        }
+    }
+
+    if (peers == 0) {
+        return s_mode;
+    }
+    if (any_weak) {
+        return PHY_MODE_LONG_RANGE;
+    }
+    return all_strong ? PHY_MODE_FAST : s_mode;
+}
+
+/* Controller only: moves the network to another PHY */
+static void migrate(phy_mode_t mode) {
+    payload_command_t command = {
+        .command = COMMAND_SET_PHY,
+        .args    = {},
+    };
+    command.args.set_phy.mode  = mode;
+    command.args.set_phy.at_us = timesync_now_us() + PHY_SWITCH_DELAY_MS * 1000LL;
+
+    log_i("Moving the network to the %s PHY.", phy_name(mode));
+    executeCommand(s_broadcast_mac, &command, sizeof(payload_command_t)); // Switches us as well
+}
+
+static unsigned long switch_job(unsigned long time) {
+    if (s_pending_mode == s_mode) {
+        return COMM_JOB_STOP;
+    }
+
+    log_i("Switching to the %s PHY.", phy_name(s_pending_mode));
+    s_previous_mode  = s_mode;
+    s_peers_before   = peers_heard_since(time - PHY_FALLBACK_TIMEOUT_MS);
+    s_switched_at    = time;
+    s_fallback_armed = true;
+    set_mode(s_pending_mode);
+    save_mode();
+    comm_stats.phy_switches++;
+    return COMM_JOB_STOP;
+}
+
+/* Checks a switch for silent peers, and lets the controller pick the PHY */
+static unsigned long evaluate_job(unsigned long time);
+
+static comm_job_t s_switch_job   = COMM_JOB("phy_switch", switch_job);
+static comm_job_t s_evaluate_job = COMM_JOB("phy_evaluate", evaluate_job);
+
+static unsigned long evaluate_job(unsigned long time) {
+    if (comm_is_scheduled(&s_switch_job)) {
+        return PHY_EVALUATE_INTERVAL_MS;
+    }
+
+    if (s_fallback_armed) {
+        if (time - s_switched_at < PHY_FALLBACK_TIMEOUT_MS) {
+            return PHY_FALLBACK_TIMEOUT_MS - (time - s_switched_at);
+        }
+        s_fallback_armed = false;
+
+        /* A dozing buzzer hears too little to tell */
+        bool silent = has_external_power ? peers_heard_since(s_switched_at) < s_peers_before : !power_save_dozing() && (long)(s_last_heard - s_switched_at) < 0;
+        if (silent) {
+            log_w("Peers went silent on the %s PHY, going back.", phy_name(s_mode));
+            comm_stats.phy_fallbacks++;
+            s_hold_off_until = time + PHY_HOLD_OFF_MS;
+            if (has_external_power) {
+                migrate(s_previous_mode);
+            } else {
+                /* Nobody to tell, and no reason to wait */
+                set_mode(s_previous_mode);
+                save_mode();
+            }
+            return PHY_EVALUATE_INTERVAL_MS;
+        }
+    }
+
+    /* Dozing buzzers are not pinged, their links are not measured meanwhile */
+    if (has_external_power && (long)(time - s_hold_off_until) >= 0 && !power_save_network_dozing(time)) {
+        phy_mode_t mode = wanted_mode(time);
+        if (mode != s_mode) {
+            migrate(mode);
+        }
+    }
+    return PHY_EVALUATE_INTERVAL_MS;
+}
+
+void phy_init() {
+    /* Accept both PHYs at all times, only the rate we send with is switched */
+    ESP_ERROR_CHECK(esp_wifi_set_protocol(ESPNOW_WIFI_IF, WIFI_PROTOCOL_11B | WIFI_PROTOCOL_11G | WIFI_PROTOCOL_11N | WIFI_PROTOCOL_LR));
+}
+
+phy_mode_t phy_current() {
+    return s_mode;
+}
+
+void phy_start() {
+    /* The rate can only be configured once ESP-NOW is initialized */
+    set_mode(nvm_data.phy_mode == PHY_MODE_LONG_RANGE ? PHY_MODE_LONG_RANGE : PHY_MODE_FAST);
+
+    s_last_heard     = millis();
+    s_hold_off_until = s_last_heard;
+    comm_schedule(&s_evaluate_job, PHY_EVALUATE_INTERVAL_MS);
+}
+
+void phy_heard_peer(unsigned long time) {
+    s_last_heard = time;
+}
+
+void phy_schedule_switch(phy_mode_t mode, int64_t at_us) {
+    if (mode != PHY_MODE_FAST && mode != PHY_MODE_LONG_RANGE) {
+        log_e("Invalid PHY mode %d", mode);
+        return;
+    }
+
+    /* As for channel switches: without a synced clock, the command went out well before the switch */
+    int64_t delay_us = (timesync_is_synced() || timesync_is_master()) ? at_us - timesync_now_us() : PHY_SWITCH_DELAY_MS * 1000LL / 2;
+
+    s_pending_mode = mode;
+    comm_schedule(&s_switch_job, delay_us > 0 ? delay_us / 1000 : 0);
+}
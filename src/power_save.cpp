@@ -0,0 +1,164 @@
+#include "power_save.h"
+#include "comm_scheduler.h"
+#include "relay.h"
+#include "timesync.h"
+#include "battery.h"
+#include "journal.h"
+#include "esp_now.h"
+#include "esp_wifi.h"
+#include "esp_timer.h"
+#include "esp32-hal-log.h"
+#include <nvm.h>
+#include <sys/param.h>
+#include <inttypes.h>
+
+#define POWER_SAVE_ALWAYS_AWAKE 65535 // A wake window this long keeps the radio on
+
+static_assert(POWER_SAVE_WAKE_WINDOW_MS > COMMAND_RETRY_INITIAL_MS, "Repeated frames must not fall between two wake windows");
+static_assert(POWER_SAVE_WAKE_WINDOW_MS + POWER_SAVE_MAX_BUZZ_LATENCY_MS < POWER_SAVE_ALWAYS_AWAKE, "Wake interval out of range");
+static_assert((POWER_SAVE_WAKE_WINDOW_MS + POWER_SAVE_MAX_BUZZ_LATENCY_MS) / COMMAND_RETRY_INITIAL_MS + 1 < UINT8_MAX, "Too many repetitions per wake interval");
+
+/* Read by other tasks */
+static bool s_dozing;
+static uint32_t s_woke_at; // millis()
+
+/* Only used by comm_task */
+static uint16_t s_wake_interval_ms;
+static bool s_round_open;
+static unsigned long s_round_opened_at;
+static unsigned long s_last_activity;
+static unsigned long s_doze_started_at;
+
+static inline bool power_save_enabled() {
+    return nvm_data.power_save == POWER_SAVE_ON;
+}
+
+/* A claim sent right after a wake window reaches a dozing buzzer in the next one */
+static inline uint16_t wake_interval_ms() {
+    return POWER_SAVE_WAKE_WINDOW_MS + nvm_data.power_save_latency_ms;
+}
+
+static void apply_wake_interval() {
+    uint16_t interval = wake_interval_ms();
+    if (interval == s_wake_interval_ms) { return; }
+
+    log_d("Wake interval %dms.", interval);
+    ESP_ERROR_CHECK(esp_wifi_connectionless_module_set_wake_interval(interval));
+    if (s_dozing) {
+        ESP_ERROR_CHECK(esp_now_set_wake_window(POWER_SAVE_WAKE_WINDOW_MS));
+    }
+    s_wake_interval_ms = interval;
+}
+
+bool power_save_network_dozing(unsigned long time) {
+    if (!power_save_enabled()) {
+        return false;
+    }
+    if (s_round_open && time - s_round_opened_at < POWER_SAVE_ROUND_TIMEOUT_MS) {
+        return false;
+    }
+    return time - s_last_activity >= POWER_SAVE_IDLE_TIMEOUT_MS;
+}
+
+static void set_dozing(bool dozing, unsigned long time) {
+    if (dozing == s_dozing) { return; }
+
+    if (dozing) {
+        log_d("Idle, dozing.");
+        /* Promiscuous mode would keep the radio on */
+        ESP_ERROR_CHECK(esp_wifi_set_promiscuous(false));
+        ESP_ERROR_CHECK(esp_now_set_wake_window(POWER_SAVE_WAKE_WINDOW_MS));
+        s_doze_started_at = time;
+    } else {
+        log_d("Waking up after %lums.", time - s_doze_started_at);
+        ESP_ERROR_CHECK(esp_now_set_wake_window(POWER_SAVE_ALWAYS_AWAKE));
+        ESP_ERROR_CHECK(esp_wifi_set_promiscuous(true));
+        comm_stats.ps_dozing_ms += time - s_doze_started_at;
+        __atomic_store_n(&s_woke_at, (uint32_t)time, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&s_dozing, dozing, __ATOMIC_RELEASE);
+}
+
+static unsigned long doze_job(unsigned long time) {
+    bool dozing = !has_external_power && !relay_enabled() && power_save_network_dozing(time);
+    set_dozing(dozing, time);
+
+    if (dozing || !power_save_enabled()) {
+        /* Waking up is triggered by power_save_activity() and friends */
+        return COMM_JOB_STOP;
+    }
+    if (s_round_open) {
+        return POWER_SAVE_ROUND_TIMEOUT_MS - MIN(time - s_round_opened_at, POWER_SAVE_ROUND_TIMEOUT_MS - 1);
+    }
+    return POWER_SAVE_IDLE_TIMEOUT_MS - MIN(time - s_last_activity, POWER_SAVE_IDLE_TIMEOUT_MS - 1);
+}
+
+static comm_job_t s_doze_job = COMM_JOB("power_save_doze", doze_job);
+
+void power_save_start() {
+    /* Not dozing yet, but count the boot as activity so buzzers join the network first */
+    apply_wake_interval();
+    ESP_ERROR_CHECK(esp_now_set_wake_window(POWER_SAVE_ALWAYS_AWAKE));
+    power_save_activity(millis());
+}
+
+void power_save_activity(unsigned long time) {
+    s_last_activity = time;
+    power_save_update();
+}
+
+void power_save_set_round(bool open, unsigned long time) {
+    log_d("Round %s.", open ? "started" : "ended");
+    s_round_open      = open;
+    s_round_opened_at = time;
+    if (!open) {
+        /* Stay awake a little longer, a late buzz is likely right after a round */
+        s_last_activity = time;
+    }
+    power_save_update();
+}
+
+void power_save_update() {
+    apply_wake_interval(); // May have been changed by COMMAND_SET_POWER_SAVE
+    comm_schedule(&s_doze_job, 0);
+}
+
+uint8_t power_save_broadcast_repeats(unsigned long time) {
+    if (!power_save_network_dozing(time)) {
+        return 1;
+    }
+    return wake_interval_ms() / COMMAND_RETRY_INITIAL_MS + 1;
+}
+
+uint32_t power_save_claim_received(const payload_buzz_t *buzz, int64_t rx_local_us) {
+    if (buzz->stratum == TIMESYNC_STRATUM_UNSYNCED || !(timesync_is_synced() || timesync_is_master())) {
+        return JOURNAL_LATENCY_UNKNOWN; // The press time means nothing to us
+    }
+
+    int64_t latency_us = timesync_local_to_network_us(rx_local_us) - buzz->press_time_us;
+    if (latency_us < 0) {
+        latency_us = 0; // Within the sync error
+    }
+    latency_us = MIN(latency_us, (int64_t)UINT32_MAX - 1);
+
+    comm_stats.buzz_latency_us  = (int32_t)comm_stats.buzz_latency_us + (((int32_t)latency_us - (int32_t)comm_stats.buzz_latency_us) >> 3);
+    comm_stats.buzz_latency_max = MAX(comm_stats.buzz_latency_max, (uint32_t)latency_us);
+    if (latency_us > nvm_data.power_save_latency_ms * 1000LL + BUZZ_ARBITRATION_WINDOW_US) {
+        log_w("Buzz claim arrived after %" PRId64 "us, later than the arbitration window allows.", latency_us);
+        comm_stats.buzz_claims_late++;
+    }
+    return (uint32_t)latency_us;
+}
+
+bool power_save_dozing() {
+    return __atomic_load_n(&s_dozing, __ATOMIC_ACQUIRE);
+}
+
+uint32_t power_save_extra_latency_us() {
+    /* Claims sent while we were dozing may still be on their way */
+    uint32_t latency_ms = nvm_data.power_save_latency_ms;
+    if (power_save_dozing() || (uint32_t)millis() - __atomic_load_n(&s_woke_at, __ATOMIC_RELAXED) < latency_ms) {
+        return latency_ms * 1000;
+    }
+    return 0;
+}
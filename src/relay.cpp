@@ -0,0 +1,234 @@
+#include "relay.h"
+#include "timesync.h"
+#include "tx.h"
+#include "esp_crc.h"
+#include "esp32-hal-log.h"
+#include <nvm.h>
+
+static_assert(RELAY_SEEN_TIMEOUT_MS >= COMMAND_RETRY_INITIAL_MS * ((1 << (COMMAND_MAX_ATTEMPTS - 1)) - 1), "Copies of a command must be recognized until its last retransmission");
+
+typedef struct {
+    uint8_t origin[ESP_NOW_ETH_ALEN];
+    espnow_data_type_t type;
+    uint8_t attempt; // Latest transmission of the frame seen so far
+    uint32_t id;
+    unsigned long time;
+} relay_seen_t;
+
+/* Only used by comm_task */
+static relay_seen_t s_seen[RELAY_SEEN_CACHE_SIZE];
+static uint8_t s_seen_next;
+static espnow_data_t s_envelope;
+
+static inline bool is_broadcast(const uint8_t *mac_addr) {
+    return memcmp(mac_addr, s_broadcast_mac, ESP_NOW_ETH_ALEN) == 0;
+}
+
+/* Identifies a frame by its origin's sequence number where it has one, and by its CRC otherwise. Sets attempt to the
+ * frame's retry marker, 0 for frames that are never retransmitted. */
+static uint32_t frame_id(const espnow_data_t *frame, int len, uint8_t *attempt) {
+    *attempt = 0;
+    switch (frame->type) {
+        case ESP_DATA_TYPE_COMMAND:
+            if (len >= (int)offsetof(espnow_data_t, payload.command_frame.command)) {
+                *attempt = frame->payload.command_frame.attempt;
+                return frame->payload.command_frame.seq;
+            }
+            break;
+        case ESP_DATA_TYPE_COMMAND_ACK:
+            if (len >= (int)ESPNOW_DATA_SIZE(command_ack)) {
+                *attempt = frame->payload.command_ack.attempt;
+                return frame->payload.command_ack.seq;
+            }
+            break;
+        case ESP_DATA_TYPE_MULTICAST_COMMAND:
+            if (len >= (int)offsetof(espnow_data_t, payload.multicast_command.targets)) {
+                *attempt = frame->payload.multicast_command.attempt;
+                return frame->payload.multicast_command.seq;
+            }
+            break;
+        case ESP_DATA_TYPE_BUZZ:
+            if (len >= (int)ESPNOW_DATA_SIZE(buzz)) {
+                *attempt = frame->payload.buzz.attempt;
+                return frame->payload.buzz.trace_id;
+            }
+            break;
+        case ESP_DATA_TYPE_BUZZ_DECISION:
+            if (len >= (int)BUZZ_DECISION_SIZE(0)) {
+                *attempt = frame->payload.buzz_decision.attempt;
+                return frame->payload.buzz_decision.round;
+            }
+            break;
+        default:
+            break;
+    }
+    return esp_crc32_le(0, (const uint8_t *)frame, len);
+}
+
+/* Returns whether this transmission of the frame was seen before, and remembers it. Copies of a frame are recognized
+ * for RELAY_SEEN_TIMEOUT_MS, while a later attempt (a retransmission by the origin) is never taken for a copy. */
+static bool check_seen(const uint8_t *origin, const espnow_data_t *frame, int len, unsigned long time) {
+    uint8_t attempt;
+    uint32_t id = frame_id(frame, len, &attempt);
+    for (uint8_t i = 0; i < RELAY_SEEN_CACHE_SIZE; i++) {
+        relay_seen_t *seen = &s_seen[i];
+        if (seen->id == id && seen->type == frame->type && time - seen->time < RELAY_SEEN_TIMEOUT_MS && memcmp(seen->origin, origin, ESP_NOW_ETH_ALEN) == 0) {
+            if ((int8_t)(attempt - seen->attempt) <= 0) {
+                return true;
+            }
+            seen->attempt = attempt;
+            seen->time    = time;
+            return false;
+        }
+    }
+
+    relay_seen_t *seen = &s_seen[s_seen_next];
+    s_seen_next        = (s_seen_next + 1) % RELAY_SEEN_CACHE_SIZE;
+    memcpy(seen->origin, origin, ESP_NOW_ETH_ALEN);
+    seen->type    = frame->type;
+    seen->attempt = attempt;
+    seen->id      = id;
+    seen->time    = time;
+    return false;
+}
+
+/* Frames that are meant for everyone in range, and hence for everyone out of range as well */
+static bool is_relayable(const espnow_data_t *data) {
+    switch (data->type) {
+        case ESP_DATA_TYPE_JOIN_ANNOUNCEMENT:
+        case ESP_DATA_TYPE_STATE_UPDATE:
+        case ESP_DATA_TYPE_STATE_DELTA:
+        case ESP_DATA_TYPE_BUZZ:
+        case ESP_DATA_TYPE_BUZZ_DECISION:
+        case ESP_DATA_TYPE_MULTICAST_COMMAND:
+            return true;
+        case ESP_DATA_TYPE_COMMAND:
+            /* Unicast commands request an acknowledgement, broadcast ones don't */
+            return (data->payload.command_frame.flags & COMMAND_FLAG_ACK_REQUESTED) == 0;
+        default:
+            return false;
+    }
+}
+
+static void send_envelope(uint8_t ttl, uint8_t hops, const uint8_t *origin, const uint8_t *dst, int64_t stamp_us, const uint8_t *frame, int len) {
+    payload_relay_t *relay = &s_envelope.payload.relay;
+    s_envelope.type        = ESP_DATA_TYPE_RELAY;
+    relay->ttl             = ttl;
+    relay->hops            = hops;
+    relay->stamp_us        = stamp_us;
+    memcpy(relay->origin, origin, ESP_NOW_ETH_ALEN);
+    memcpy(relay->dst, dst, ESP_NOW_ETH_ALEN);
+    memmove(relay->frame, frame, len);
+
+    esp_err_t ret = tx_send(s_broadcast_mac, &s_envelope, RELAY_FRAME_OFFSET + len, TX_PRIO_HIGH);
+    if (ret == ESP_OK) {
+        comm_stats.tx_relayed++;
+    } else {
+        log_e("Send error: %s", esp_err_to_name(ret));
+    }
+}
+
+void relay_init() {
+    memset(s_seen, 0, sizeof(s_seen));
+    s_seen_next = 0;
+}
+
+bool relay_enabled() {
+    return nvm_data.relay_mode == RELAY_MODE_ON;
+}
+
+void relay_set_mode(relay_mode_t mode) {
+    if (nvm_data.relay_mode != mode) {
+        log_d("Relay mode %s.", mode == RELAY_MODE_ON ? "enabled" : "disabled");
+        nvm_data.relay_mode = mode;
+        nvm_save();
+    }
+}
+
+void relay_handle_direct(const uint8_t *src, const espnow_data_t *data, int len, int64_t rx_time_us, unsigned long time) {
+    peer_data_t *peer_data;
+    if (get_peer_info(src, &peer_data) == ESP_OK) {
+        peer_state_t *peer_state   = get_peer_state(peer_data);
+        peer_state->heard_direct   = true;
+        peer_state->last_direct_at = time;
+        peer_state->relay_hops     = 0;
+    }
+
+    /* Remember it either way, so relayed copies are recognized */
+    bool seen = check_seen(src, data, len, time);
+    if (seen || !relay_enabled() || !is_relayable(data) || (size_t)len > RELAY_MAX_FRAME_LEN) {
+        return;
+    }
+
+    int64_t stamp_us = timesync_is_synced() ? timesync_local_to_network_us(rx_time_us) : 0;
+    send_envelope(RELAY_MAX_HOPS - 1, 1, src, s_broadcast_mac, stamp_us, (const uint8_t *)data, len);
+}
+
+bool relay_handle_envelope(espnow_data_t *data, int *len, uint8_t *origin, int64_t rx_time_us, unsigned long time) {
+    payload_relay_t *relay = &data->payload.relay;
+    int frame_len          = *len - (int)RELAY_FRAME_OFFSET;
+    if (frame_len <= 0 || relay->frame[0] == ESP_DATA_TYPE_RELAY || relay->frame[0] >= ESP_DATA_TYPE_MAX || relay->hops == 0) {
+        log_e("Received malformed relay envelope.");
+        return false;
+    }
+    if (memcmp(relay->origin, my_mac_addr, ESP_NOW_ETH_ALEN) == 0) {
+        return false; // Our own frame came back
+    }
+    if (check_seen(relay->origin, (const espnow_data_t *)relay->frame, frame_len, time)) {
+        comm_stats.rx_relay_dups++;
+        return false;
+    }
+    comm_stats.rx_relayed++;
+
+    bool for_me     = memcmp(relay->dst, my_mac_addr, ESP_NOW_ETH_ALEN) == 0;
+    bool for_anyone = for_me || is_broadcast(relay->dst);
+    if (!for_me && relay->ttl > 0 && relay_enabled()) {
+        send_envelope(relay->ttl - 1, relay->hops + 1, relay->origin, relay->dst, relay->stamp_us, relay->frame, frame_len);
+    }
+
+    int64_t latency_us = -1;
+    if (relay->stamp_us != 0 && timesync_is_synced()) {
+        latency_us = timesync_local_to_network_us(rx_time_us) - relay->stamp_us;
+        if (latency_us >= 0) {
+            /* EWMA with gain 1/8 */
+            int32_t per_hop_us          = latency_us / relay->hops;
+            comm_stats.relay_latency_us = (int32_t)comm_stats.relay_latency_us + ((per_hop_us - (int32_t)comm_stats.relay_latency_us) >> 3);
+        }
+    }
+
+    peer_data_t *peer_data;
+    if (get_peer_info(relay->origin, &peer_data) == ESP_OK) {
+        peer_state_t *peer_state = get_peer_state(peer_data);
+        if (!peer_state->heard_direct || time - peer_state->last_direct_at > RELAY_DIRECT_TIMEOUT_MS) {
+            peer_state->relay_hops = relay->hops;
+        }
+        if (latency_us >= 0) {
+            peer_state->relay_latency_us = MIN(latency_us, 65535);
+        }
+        peer_table_changed();
+    }
+
+    if (!for_anyone) {
+        return false;
+    }
+
+    memcpy(origin, relay->origin, ESP_NOW_ETH_ALEN);
+    memmove(data, relay->frame, frame_len);
+    *len = frame_len;
+    return true;
+}
+
+esp_err_t relay_send(const uint8_t *dst, const espnow_data_t *data, size_t len) {
+    peer_data_t *peer_data;
+    if (is_broadcast(dst) || len > RELAY_MAX_FRAME_LEN || get_peer_info(dst, &peer_data) != ESP_OK || !relay_is_indirect(get_peer_state(peer_data))) {
+        return tx_send(dst, data, len, TX_PRIO_HIGH);
+    }
+
+    int64_t stamp_us = timesync_is_synced() ? timesync_now_us() : 0;
+    send_envelope(RELAY_MAX_HOPS - 1, 1, my_mac_addr, dst, stamp_us, (const uint8_t *)data, len);
+    return ESP_OK;
+}
+
+bool relay_is_indirect(const peer_state_t *peer_state) {
+    return peer_state->relay_hops > 0;
+}
@@ -0,0 +1,78 @@
+#include "rssi_filter.h"
+#include "peer_table.h"
+#include <sys/param.h>
+
+typedef struct {
+    uint32_t seq;        // Odd while an update is in progress
+    uint32_t generation; // Generation of the peer table entry the samples belong to
+    int16_t avg_q4;      // EWMA in 1/16 dBm
+    int8_t window[RSSI_WINDOW_SIZE];
+    uint8_t window_pos;
+    rssi_stats_t stats;
+} rssi_filter_t;
+
+static rssi_filter_t filters[PEER_DATA_TABLE_ENTRIES];
+
+void rssi_filter_update(const peer_data_t *peer_data, int8_t rssi) {
+    rssi_filter_t *filter = &filters[peer_data - peer_data_table];
+    uint32_t generation   = get_peer_generation(peer_data);
+    uint32_t seq          = filter->seq;
+
+    __atomic_store_n(&filter->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    if (filter->generation != generation) {
+        /* First sample of this peer */
+        filter->generation    = generation;
+        filter->avg_q4        = rssi * 16;
+        filter->window_pos    = 0;
+        filter->stats.samples = 0;
+        memset(filter->window, rssi, sizeof(filter->window));
+    }
+
+    filter->avg_q4 += (rssi * 16 - filter->avg_q4) >> RSSI_EWMA_GAIN_SHIFT;
+    filter->window[filter->window_pos] = rssi;
+    filter->window_pos                 = (filter->window_pos + 1) % RSSI_WINDOW_SIZE;
+
+    int8_t min = rssi, max = rssi;
+    for (uint8_t i = 0; i < RSSI_WINDOW_SIZE; i++) {
+        min = MIN(min, filter->window[i]);
+        max = MAX(max, filter->window[i]);
+    }
+
+    filter->stats.avg  = (filter->avg_q4 + 8) >> 4;
+    filter->stats.min  = min;
+    filter->stats.max  = max;
+    filter->stats.last = rssi;
+    if (filter->stats.samples < UINT16_MAX) {
+        filter->stats.samples++;
+    }
+
+    __atomic_store_n(&filter->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+bool rssi_filter_read(const peer_data_t *peer_data, rssi_stats_t *stats) {
+    const rssi_filter_t *filter = &filters[peer_data - peer_data_table];
+    uint32_t generation         = get_peer_generation(peer_data);
+
+    for (uint8_t i = 0; i < RSSI_READ_MAX_RETRIES; i++) {
+        uint32_t seq = __atomic_load_n(&filter->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue; // Update in progress
+        }
+
+        rssi_stats_t copy = filter->stats;
+        bool current      = filter->generation == generation;
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&filter->seq, __ATOMIC_RELAXED) == seq) {
+            if (!current) {
+                return false;
+            }
+            *stats = copy;
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,277 @@
+#include "timesync.h"
+#include "esp_timer.h"
+#include "esp_mac.h"
+#include "battery.h"
+#include <inttypes.h>
+#include <sys/param.h>
+
+typedef struct {
+    int64_t local_us;  // Our local clock when the sample was taken
+    int64_t offset_us; // Source's network time minus our local clock
+    uint32_t rtt_us;   // Round trip time of the exchange, the smaller the more accurate the offset
+} timesync_sample_t;
+
+/* Model of the network time: local + anchor_offset + (local - anchor_local) * drift, plus what is left of the slew (the
+ * difference to the previous model, shrinking linearly to 0 from slew_start to slew_start + slew_duration).
+ * It is read from any task, so it is only ever accessed within s_timesync_lock. */
+static portMUX_TYPE s_timesync_lock = portMUX_INITIALIZER_UNLOCKED;
+static int64_t s_anchor_local_us    = 0;
+static int64_t s_anchor_offset_us   = 0;
+static int32_t s_drift_ppb          = 0;
+static int64_t s_slew_us            = 0;
+static int64_t s_slew_start_us      = 0;
+static int64_t s_slew_duration_us   = 0;
+static uint8_t s_stratum            = TIMESYNC_STRATUM_UNSYNCED;
+
+/* Everything below is only touched by comm_task */
+static timesync_sample_t s_samples[TIMESYNC_SAMPLES];
+static uint8_t s_num_samples = 0;
+static uint8_t s_next_sample = 0;
+
+static timesync_sample_t s_drift_base; // Sample that the next drift measurement is relative to
+static bool s_has_drift_base = false;
+static bool s_has_drift      = false;
+
+static bool s_is_master  = false;
+static bool s_has_source = false;
+static bool s_synced     = false; // Whether we have applied a sample from the current source
+static uint8_t s_source_mac[ESP_NOW_ETH_ALEN];
+static uint8_t s_source_stratum = TIMESYNC_STRATUM_UNSYNCED;
+
+void timesync_init() {
+    portENTER_CRITICAL(&s_timesync_lock);
+    s_anchor_local_us  = esp_timer_get_time();
+    s_anchor_offset_us = 0;
+    s_drift_ppb        = 0;
+    s_slew_us          = 0;
+    s_slew_duration_us = 0;
+    s_stratum          = TIMESYNC_STRATUM_UNSYNCED;
+    portEXIT_CRITICAL(&s_timesync_lock);
+}
+
+/* Within s_timesync_lock */
+static int64_t network_us_locked(int64_t local_us) {
+    int64_t network_us = local_us + s_anchor_offset_us + (local_us - s_anchor_local_us) * s_drift_ppb / 1000000000LL;
+    if (s_slew_duration_us > 0 && local_us - s_slew_start_us < s_slew_duration_us) {
+        int64_t elapsed_us = MAX(local_us - s_slew_start_us, 0);
+        network_us += s_slew_us - s_slew_us * elapsed_us / s_slew_duration_us;
+    }
+    return network_us;
+}
+
+int64_t timesync_local_to_network_us(int64_t local_us) {
+    portENTER_CRITICAL(&s_timesync_lock);
+    int64_t network_us = network_us_locked(local_us);
+    portEXIT_CRITICAL(&s_timesync_lock);
+    return network_us;
+}
+
+int64_t timesync_now_us() {
+    return timesync_local_to_network_us(esp_timer_get_time());
+}
+
+bool timesync_is_synced() {
+    return timesync_stratum() != TIMESYNC_STRATUM_UNSYNCED;
+}
+
+bool timesync_is_master() {
+    return s_is_master;
+}
+
+uint8_t timesync_stratum() {
+    portENTER_CRITICAL(&s_timesync_lock);
+    uint8_t stratum = s_stratum;
+    portEXIT_CRITICAL(&s_timesync_lock);
+    return stratum;
+}
+
+const uint8_t *timesync_source() {
+    return s_has_source ? s_source_mac : NULL;
+}
+
+static void set_stratum(uint8_t stratum) {
+    portENTER_CRITICAL(&s_timesync_lock);
+    s_stratum = stratum;
+    portEXIT_CRITICAL(&s_timesync_lock);
+}
+
+/* Controllers are preferred as master, ties are broken by the lower MAC */
+static bool ranks_before(node_type_t a_type, const uint8_t *a_mac, node_type_t b_type, const uint8_t *b_mac) {
+    if (a_type != b_type) {
+        return a_type == NODE_TYPE_CONTROLLER;
+    }
+    return memcmp(a_mac, b_mac, ESP_NOW_ETH_ALEN) < 0;
+}
+
+void timesync_select_source() {
+    node_type_t my_type = has_external_power ? NODE_TYPE_CONTROLLER : NODE_TYPE_BUZZER;
+
+    bool is_master          = true;
+    peer_data_t *source     = NULL;
+    peer_state_t *source_st = NULL;
+    for (uint8_t i = 0; i < PEER_DATA_TABLE_ENTRIES; i++) {
+        peer_data_t *peer_data = &peer_data_table[i];
+        if (!peer_data->valid_version ||
+            memcmp(peer_data->mac_addr, s_broadcast_mac, ESP_NOW_ETH_ALEN) == 0 ||
+            memcmp(peer_data->mac_addr, my_mac_addr, ESP_NOW_ETH_ALEN) == 0) {
+            continue;
+        }
+
+        if (ranks_before(peer_data->node_info.node_type, peer_data->mac_addr, my_type, my_mac_addr)) {
+            is_master = false;
+        }
+
+        peer_state_t *peer_state = get_peer_state(peer_data);
+        if (!peer_state->has_stratum || peer_state->stratum >= TIMESYNC_STRATUM_UNSYNCED - 1) {
+            continue;
+        }
+        if (source == NULL ||
+            peer_state->stratum < source_st->stratum ||
+            (peer_state->stratum == source_st->stratum && ranks_before(peer_data->node_info.node_type, peer_data->mac_addr, source->node_info.node_type, source->mac_addr))) {
+            source    = peer_data;
+            source_st = peer_state;
+        }
+    }
+
+    if (is_master) {
+        /* Our network time simply keeps running as it is, so the others don't see a jump when the master changes */
+        if (!s_is_master) {
+            log_i("Time sync: we are the time master now.");
+        }
+        s_is_master  = true;
+        s_has_source = false;
+        s_synced     = false;
+        set_stratum(0);
+        return;
+    }
+    s_is_master = false;
+
+    if (source == NULL) {
+        if (s_has_source) {
+            log_w("Time sync: lost time source " MACSTR ".", MAC2STR(s_source_mac));
+        }
+        s_has_source = false;
+        s_synced     = false;
+        set_stratum(TIMESYNC_STRATUM_UNSYNCED);
+        return;
+    }
+
+    if (!s_has_source || memcmp(s_source_mac, source->mac_addr, ESP_NOW_ETH_ALEN) != 0) {
+        log_i("Time sync: using " MACSTR " (stratum %d) as time source.", MAC2STR(source->mac_addr), source_st->stratum);
+        memcpy(s_source_mac, source->mac_addr, ESP_NOW_ETH_ALEN);
+        s_has_source = true;
+        s_synced     = false;
+
+        /* Samples against another source are not comparable, but our crystal's drift still applies */
+        s_num_samples    = 0;
+        s_next_sample    = 0;
+        s_has_drift_base = false;
+    }
+    s_source_stratum = source_st->stratum;
+    set_stratum(s_synced ? s_source_stratum + 1 : TIMESYNC_STRATUM_UNSYNCED);
+}
+
+static void add_sample(const timesync_sample_t *sample) {
+    s_samples[s_next_sample] = *sample;
+    s_next_sample            = (s_next_sample + 1) % TIMESYNC_SAMPLES;
+    if (s_num_samples < TIMESYNC_SAMPLES) { s_num_samples++; }
+
+    /* Min-RTT filter: the sample with the smallest RTT has the smallest asymmetry error (prefer the newest one on ties) */
+    const timesync_sample_t *best = NULL;
+    for (uint8_t i = 0; i < s_num_samples; i++) {
+        const timesync_sample_t *candidate = &s_samples[i];
+        if (best == NULL || candidate->rtt_us < best->rtt_us || (candidate->rtt_us == best->rtt_us && candidate->local_us > best->local_us)) {
+            best = candidate;
+        }
+    }
+
+    if (s_synced && best->local_us == s_anchor_local_us) {
+        /* Model is already based on this sample */
+        return;
+    }
+
+    int32_t drift_ppb = s_drift_ppb;
+    if (!s_has_drift_base) {
+        s_drift_base     = *best;
+        s_has_drift_base = true;
+    } else if (best->local_us - s_drift_base.local_us >= TIMESYNC_MIN_DRIFT_BASE) {
+        int64_t measured_ppb = (best->offset_us - s_drift_base.offset_us) * 1000000000LL / (best->local_us - s_drift_base.local_us);
+        if (measured_ppb > -TIMESYNC_MAX_DRIFT_PPB && measured_ppb < TIMESYNC_MAX_DRIFT_PPB) {
+            /* Smooth, a single sample still has a few us of error */
+            drift_ppb   = s_has_drift ? drift_ppb + (int32_t)(measured_ppb - drift_ppb) / 4 : (int32_t)measured_ppb;
+            s_has_drift = true;
+        } else {
+            log_w("Time sync: ignoring implausible drift of %" PRId64 "ppb.", measured_ppb);
+        }
+        s_drift_base = *best;
+    }
+
+    /* Continue from where the previous model is now. Slewing back at up to half the clock rate never turns it around. */
+    int64_t now_us = esp_timer_get_time();
+    portENTER_CRITICAL(&s_timesync_lock);
+    int64_t before_us  = network_us_locked(now_us);
+    s_anchor_local_us  = best->local_us;
+    s_anchor_offset_us = best->offset_us;
+    s_drift_ppb        = drift_ppb;
+    s_slew_duration_us = 0;
+
+    int64_t slew_us     = before_us - network_us_locked(now_us);
+    int64_t duration_us = (slew_us < 0 ? -slew_us : slew_us) * 1000000LL / TIMESYNC_SLEW_PPM;
+    if (duration_us > TIMESYNC_MAX_SLEW_US) {
+        /* Ahead is stepped right away */
+        duration_us = slew_us < 0 ? 0 : MAX(TIMESYNC_MAX_SLEW_US, 2 * slew_us);
+    }
+    s_slew_us          = slew_us;
+    s_slew_start_us    = now_us;
+    s_slew_duration_us = duration_us;
+    s_stratum          = s_source_stratum + 1;
+    portEXIT_CRITICAL(&s_timesync_lock);
+
+    if (!s_synced) {
+        log_i("Time sync: synced to " MACSTR " (offset=%" PRId64 "us, rtt=%" PRIu32 "us).", MAC2STR(s_source_mac), best->offset_us, best->rtt_us);
+    }
+    if (duration_us >= TIMESYNC_MAX_SLEW_US) {
+        log_d("Time sync: slewing %" PRId64 "us over %" PRId64 "ms.", -slew_us, duration_us / 1000);
+    }
+    s_synced = true;
+}
+
+void timesync_prepare_ping(const peer_state_t *peer_state, payload_ping_pong_t *ping) {
+    int64_t now_us = esp_timer_get_time();
+
+    ping->stratum     = timesync_stratum();
+    ping->tx_local_us = (uint32_t)now_us;
+    if (ping->stage == PING_PONG_STAGE_PING) {
+        ping->echo_us = 0;
+        ping->hold_us = 0;
+    } else {
+        ping->echo_us = peer_state->ping_echo_us;
+        ping->hold_us = (uint32_t)now_us - peer_state->ping_rx_us;
+    }
+    ping->tx_network_us = timesync_local_to_network_us(now_us);
+}
+
+void timesync_receive_ping(const peer_data_t *peer_data, peer_state_t *peer_state, const payload_ping_pong_t *ping, int64_t rx_local_us) {
+    peer_state->stratum      = ping->stratum;
+    peer_state->has_stratum  = true;
+    peer_state->ping_echo_us = ping->tx_local_us;
+    peer_state->ping_rx_us   = (uint32_t)rx_local_us;
+
+    if (ping->echo_us == 0 || ping->stratum == TIMESYNC_STRATUM_UNSYNCED) { return; }
+    if (!s_has_source || memcmp(peer_data->mac_addr, s_source_mac, ESP_NOW_ETH_ALEN) != 0) { return; }
+
+    /* Our clock is only compared to itself here, so 32 bits are plenty */
+    uint32_t round_trip_us = (uint32_t)rx_local_us - ping->echo_us;
+    if (round_trip_us <= ping->hold_us) { return; }
+
+    timesync_sample_t sample = {
+        .local_us  = rx_local_us,
+        .offset_us = 0,
+        .rtt_us    = round_trip_us - ping->hold_us,
+    };
+    if (sample.rtt_us > TIMESYNC_MAX_RTT_US) { return; }
+
+    /* Assume symmetric paths: the source's clock advanced by half the RTT since it sent the frame */
+    sample.offset_us = ping->tx_network_us + sample.rtt_us / 2 - rx_local_us;
+    add_sample(&sample);
+}
@@ -0,0 +1,149 @@
+#include <stdlib.h>
+#include <string.h>
+#include "esp_event.h"
+#include "esp_netif.h"
+#include "esp_wifi.h"
+#include "esp_now.h"
+#include "esp32-hal-log.h"
+#include "comm.h"
+#include "transports/TransportEspNow.h"
+
+static void (*s_rssi_cb)(const uint8_t *mac_addr, int8_t rssi);
+
+typedef struct
+{
+    unsigned frame_ctrl  : 16;   // 2 bytes / 16 bit fields
+    unsigned duration_id : 16;   // 2 bytes / 16 bit fields
+    uint8_t addr1[6];            // receiver address
+    uint8_t addr2[6];            // sender address
+    uint8_t addr3[6];            // filtering address
+    unsigned sequence_ctrl : 16; // 2 bytes / 16 bit fields
+} wifi_ieee80211_mac_hdr_t;      // 24 bytes
+
+typedef struct
+{
+    wifi_ieee80211_mac_hdr_t hdr;
+    unsigned category_code : 8; // 1 byte / 8 bit fields
+    uint8_t oui[3];             // 3 bytes / 24 bit fields
+    uint8_t payload[0];
+} wifi_ieee80211_packet_t;
+
+static void promiscuous_rx_cb(void *buf, wifi_promiscuous_pkt_type_t type) {
+    if (type != WIFI_PKT_MGMT) {
+        /* Should never happen because we are filtering */
+        return;
+    }
+
+    static const uint8_t ACTION_SUBTYPE  = 0xd0;
+    static const uint8_t ESPRESSIF_OUI[] = { 0x18, 0xfe, 0x34 };
+
+    const wifi_promiscuous_pkt_t *ppkt  = (wifi_promiscuous_pkt_t *)buf;
+    const wifi_ieee80211_packet_t *ipkt = (wifi_ieee80211_packet_t *)ppkt->payload;
+    const wifi_ieee80211_mac_hdr_t *hdr = &ipkt->hdr;
+
+    // Only continue processing if this is an action frame containing the Espressif OUI.
+    if ((ACTION_SUBTYPE == (hdr->frame_ctrl & 0xFF)) && memcmp(ipkt->oui, ESPRESSIF_OUI, 3) == 0) {
+        s_rssi_cb(hdr->addr2, ppkt->rx_ctrl.rssi);
+    }
+}
+
+static esp_now_peer_info_t *malloc_peer_info(const uint8_t *mac) {
+    esp_now_peer_info_t *peer = (esp_now_peer_info_t *)malloc(sizeof(esp_now_peer_info_t));
+    if (peer == NULL) {
+        log_e("Malloc peer information fail");
+        return NULL;
+    }
+    memset(peer, 0, sizeof(esp_now_peer_info_t));
+    peer->channel = 0; // Whatever channel we are on, it changes (see channel.h)
+    peer->ifidx   = ESPNOW_WIFI_IF;
+
+    peer->encrypt = false;
+#ifdef CONFIG_ESPNOW_ENCRYPT
+    if (memcmp(mac, s_broadcast_mac, ESP_NOW_ETH_ALEN) != 0) {
+        peer->encrypt = true;
+        memcpy(peer->lmk, CONFIG_ESPNOW_LMK, ESP_NOW_KEY_LEN);
+    }
+#endif
+
+    memcpy(peer->peer_addr, mac, ESP_NOW_ETH_ALEN);
+
+    return peer;
+}
+
+/* WiFi should start before using ESPNOW */
+void TransportEspNow::start() {
+    ESP_ERROR_CHECK(esp_netif_init());
+    ESP_ERROR_CHECK(esp_event_loop_create_default());
+    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+
+    ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+
+    ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
+
+    ESP_ERROR_CHECK(esp_wifi_set_mode(ESPNOW_WIFI_MODE));
+
+    ESP_ERROR_CHECK(esp_wifi_start());
+}
+
+esp_err_t TransportEspNow::init(const transport_callbacks_t *callbacks) {
+    s_rssi_cb = callbacks->rssi;
+
+    ESP_ERROR_CHECK(esp_wifi_set_promiscuous(true));
+
+    wifi_promiscuous_filter_t filter = { .filter_mask = WIFI_PROMIS_FILTER_MASK_MGMT };
+    ESP_ERROR_CHECK(esp_wifi_set_promiscuous_filter(&filter));
+
+    ESP_ERROR_CHECK(esp_wifi_set_promiscuous_rx_cb(&promiscuous_rx_cb));
+
+    /* Initialize ESPNOW and register sending and receiving callback function. */
+    ESP_ERROR_CHECK(esp_now_init());
+    ESP_ERROR_CHECK(esp_now_register_send_cb(callbacks->send_done));
+    ESP_ERROR_CHECK(esp_now_register_recv_cb(callbacks->receive));
+
+    /* Set primary master key. */
+    ESP_ERROR_CHECK(esp_now_set_pmk((uint8_t *)CONFIG_ESPNOW_PMK));
+
+    /* Add broadcast peer information to peer list. */
+    return addPeer(s_broadcast_mac);
+}
+
+esp_err_t TransportEspNow::send(const uint8_t *mac_addr, const uint8_t *data, size_t len) {
+    return esp_now_send(mac_addr, data, len);
+}
+
+esp_err_t TransportEspNow::addPeer(const uint8_t *mac_addr) {
+    esp_now_peer_info_t *peer = malloc_peer_info(mac_addr);
+    if (peer == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    esp_err_t ret = esp_now_add_peer(peer);
+    free(peer);
+    return ret;
+}
+
+esp_err_t TransportEspNow::delPeer(const uint8_t *mac_addr) {
+    return esp_now_del_peer(mac_addr);
+}
+
+bool TransportEspNow::hasPeer(const uint8_t *mac_addr) {
+    return esp_now_is_peer_exist(mac_addr);
+}
+
+esp_err_t TransportEspNow::fetchPeer(bool from_head, uint8_t *mac_addr) {
+    esp_now_peer_info_t peer;
+    esp_err_t ret = esp_now_fetch_peer(from_head, &peer);
+    if (ret == ESP_OK) {
+        memcpy(mac_addr, peer.peer_addr, ESP_NOW_ETH_ALEN);
+    }
+    return ret;
+}
+
+uint8_t TransportEspNow::peerCount() {
+    esp_now_peer_num_t peer_num;
+    ESP_ERROR_CHECK(esp_now_get_peer_num(&peer_num));
+    return peer_num.total_num - 1;
+}
+
+#ifndef TRANSPORT_UDP
+ITransport *transport = new TransportEspNow();
+#endif
@@ -0,0 +1,222 @@
+#ifdef TRANSPORT_UDP
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "esp32-hal-log.h"
+#include "comm.h"
+#include "transports/TransportUdp.h"
+
+typedef struct {
+    uint8_t src[ESP_NOW_ETH_ALEN];
+    uint8_t dst[ESP_NOW_ETH_ALEN];
+    uint8_t data[ESP_NOW_MAX_DATA_LEN];
+} __attribute__((packed)) udp_frame_t;
+
+#define UDP_FRAME_HEADER (offsetof(udp_frame_t, data))
+
+typedef struct {
+    uint16_t len;
+    udp_frame_t frame;
+} udp_tx_entry_t;
+
+static int s_socket = -1;
+static struct sockaddr_in s_group;
+static transport_callbacks_t s_callbacks;
+static QueueHandle_t s_tx_queue;
+
+static portMUX_TYPE s_peers_mux = portMUX_INITIALIZER_UNLOCKED;
+static uint8_t s_peers[ESP_NOW_MAX_TOTAL_PEER_NUM][ESP_NOW_ETH_ALEN];
+static bool s_peer_used[ESP_NOW_MAX_TOTAL_PEER_NUM];
+static uint8_t s_fetch_index;
+
+/* Only with s_peers_mux held */
+static int find_peer(const uint8_t *mac_addr) {
+    for (int i = 0; i < ESP_NOW_MAX_TOTAL_PEER_NUM; i++) {
+        if (s_peer_used[i] && memcmp(s_peers[i], mac_addr, ESP_NOW_ETH_ALEN) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void udp_rx_task(void *arg) {
+    udp_frame_t frame;
+    while (true) {
+        ssize_t len = recv(s_socket, &frame, sizeof(frame), 0);
+        if (len < 0) {
+            if (errno != EINTR) { log_e("UDP receive failed: %s", strerror(errno)); }
+            continue;
+        }
+        /* Our own datagrams come back, too */
+        if (len <= (ssize_t)UDP_FRAME_HEADER || memcmp(frame.src, my_mac_addr, ESP_NOW_ETH_ALEN) == 0) {
+            continue;
+        }
+
+        /* Like the promiscuous callback, this sees frames for other nodes */
+        s_callbacks.rssi(frame.src, TRANSPORT_UDP_RSSI);
+        if (memcmp(frame.dst, my_mac_addr, ESP_NOW_ETH_ALEN) == 0 || memcmp(frame.dst, s_broadcast_mac, ESP_NOW_ETH_ALEN) == 0) {
+            s_callbacks.receive(frame.src, frame.data, len - UDP_FRAME_HEADER);
+        }
+    }
+}
+
+static void udp_tx_task(void *arg) {
+    udp_tx_entry_t entry;
+    while (true) {
+        xQueueReceive(s_tx_queue, &entry, portMAX_DELAY);
+
+        ssize_t sent = sendto(s_socket, &entry.frame, UDP_FRAME_HEADER + entry.len, 0, (struct sockaddr *)&s_group, sizeof(s_group));
+        if (sent < 0) {
+            log_w("UDP send failed: %s", strerror(errno));
+        }
+        s_callbacks.send_done(entry.frame.dst, sent < 0 ? ESP_NOW_SEND_FAIL : ESP_NOW_SEND_SUCCESS);
+    }
+}
+
+void TransportUdp::start() {
+    s_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (s_socket < 0) {
+        log_e("Create UDP socket fail: %s", strerror(errno));
+        ESP_ERROR_CHECK(ESP_FAIL);
+    }
+
+    /* Every node on this host binds the same port and joins the group on the loopback interface */
+    int reuse = 1;
+    setsockopt(s_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct sockaddr_in local = {};
+    local.sin_family         = AF_INET;
+    local.sin_addr.s_addr    = htonl(INADDR_ANY);
+    local.sin_port           = htons(TRANSPORT_UDP_PORT);
+    if (bind(s_socket, (struct sockaddr *)&local, sizeof(local)) < 0) {
+        log_e("Bind UDP socket fail: %s", strerror(errno));
+        ESP_ERROR_CHECK(ESP_FAIL);
+    }
+
+    struct ip_mreq membership = {};
+    membership.imr_multiaddr.s_addr = inet_addr(TRANSPORT_UDP_GROUP);
+    membership.imr_interface.s_addr = htonl(INADDR_LOOPBACK);
+    struct in_addr interface        = { .s_addr = htonl(INADDR_LOOPBACK) };
+    uint8_t loop                    = 1;
+    uint8_t ttl                     = 0; // Never leaves the host
+    if (setsockopt(s_socket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) < 0 ||
+        setsockopt(s_socket, IPPROTO_IP, IP_MULTICAST_IF, &interface, sizeof(interface)) < 0 ||
+        setsockopt(s_socket, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0 ||
+        setsockopt(s_socket, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0) {
+        log_e("Join multicast group " TRANSPORT_UDP_GROUP " fail: %s", strerror(errno));
+        ESP_ERROR_CHECK(ESP_FAIL);
+    }
+
+    s_group.sin_family      = AF_INET;
+    s_group.sin_addr.s_addr = inet_addr(TRANSPORT_UDP_GROUP);
+    s_group.sin_port        = htons(TRANSPORT_UDP_PORT);
+}
+
+esp_err_t TransportUdp::init(const transport_callbacks_t *callbacks) {
+    s_callbacks = *callbacks;
+
+    s_tx_queue = xQueueCreate(TRANSPORT_UDP_TX_BUFFERS, sizeof(udp_tx_entry_t));
+    if (s_tx_queue == NULL) {
+        log_e("Create UDP send queue fail");
+        return ESP_FAIL;
+    }
+
+    esp_err_t ret = addPeer(s_broadcast_mac);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    xTaskCreate(&udp_rx_task, "udp_rx", 4096, NULL, TASK_PRIO_COMM + 1, NULL);
+    xTaskCreate(&udp_tx_task, "udp_tx", 4096, NULL, TASK_PRIO_COMM + 1, NULL);
+    return ESP_OK;
+}
+
+esp_err_t TransportUdp::send(const uint8_t *mac_addr, const uint8_t *data, size_t len) {
+    if (mac_addr == NULL || data == NULL || len == 0 || len > ESP_NOW_MAX_DATA_LEN) {
+        return ESP_ERR_ESPNOW_ARG;
+    }
+    if (!hasPeer(mac_addr)) {
+        return ESP_ERR_ESPNOW_NOT_FOUND;
+    }
+
+    udp_tx_entry_t entry;
+    entry.len = len;
+    memcpy(entry.frame.src, my_mac_addr, ESP_NOW_ETH_ALEN);
+    memcpy(entry.frame.dst, mac_addr, ESP_NOW_ETH_ALEN);
+    memcpy(entry.frame.data, data, len);
+    return xQueueSend(s_tx_queue, &entry, 0) == pdTRUE ? ESP_OK : ESP_ERR_ESPNOW_NO_MEM;
+}
+
+esp_err_t TransportUdp::addPeer(const uint8_t *mac_addr) {
+    esp_err_t ret = ESP_ERR_ESPNOW_FULL;
+    portENTER_CRITICAL(&s_peers_mux);
+    if (find_peer(mac_addr) >= 0) {
+        ret = ESP_ERR_ESPNOW_EXIST;
+    } else {
+        for (int i = 0; i < ESP_NOW_MAX_TOTAL_PEER_NUM; i++) {
+            if (!s_peer_used[i]) {
+                memcpy(s_peers[i], mac_addr, ESP_NOW_ETH_ALEN);
+                s_peer_used[i] = true;
+                ret            = ESP_OK;
+                break;
+            }
+        }
+    }
+    portEXIT_CRITICAL(&s_peers_mux);
+    return ret;
+}
+
+esp_err_t TransportUdp::delPeer(const uint8_t *mac_addr) {
+    portENTER_CRITICAL(&s_peers_mux);
+    int i = find_peer(mac_addr);
+    if (i >= 0) {
+        s_peer_used[i] = false;
+    }
+    portEXIT_CRITICAL(&s_peers_mux);
+    return i >= 0 ? ESP_OK : ESP_ERR_ESPNOW_NOT_FOUND;
+}
+
+bool TransportUdp::hasPeer(const uint8_t *mac_addr) {
+    portENTER_CRITICAL(&s_peers_mux);
+    bool exists = find_peer(mac_addr) >= 0;
+    portEXIT_CRITICAL(&s_peers_mux);
+    return exists;
+}
+
+esp_err_t TransportUdp::fetchPeer(bool from_head, uint8_t *mac_addr) {
+    esp_err_t ret = ESP_ERR_ESPNOW_NOT_FOUND;
+    portENTER_CRITICAL(&s_peers_mux);
+    if (from_head) {
+        s_fetch_index = 0;
+    }
+    for (; s_fetch_index < ESP_NOW_MAX_TOTAL_PEER_NUM; s_fetch_index++) {
+        if (s_peer_used[s_fetch_index] && memcmp(s_peers[s_fetch_index], s_broadcast_mac, ESP_NOW_ETH_ALEN) != 0) {
+            memcpy(mac_addr, s_peers[s_fetch_index++], ESP_NOW_ETH_ALEN);
+            ret = ESP_OK;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&s_peers_mux);
+    return ret;
+}
+
+uint8_t TransportUdp::peerCount() {
+    uint8_t count = 0;
+    portENTER_CRITICAL(&s_peers_mux);
+    for (int i = 0; i < ESP_NOW_MAX_TOTAL_PEER_NUM; i++) {
+        count += s_peer_used[i] && memcmp(s_peers[i], s_broadcast_mac, ESP_NOW_ETH_ALEN) != 0;
+    }
+    portEXIT_CRITICAL(&s_peers_mux);
+    return count;
+}
+
+ITransport *transport = new TransportUdp();
+
+#endif
@@ -0,0 +1,126 @@
+#include "tx.h"
+#include "phy.h"
+#include "transports/ITransport.h"
+#include "esp_mac.h"
+#include "esp32-hal-log.h"
+#include <sys/param.h>
+
+typedef struct {
+    uint32_t generation; // Generation of the peer table entry the counters belong to
+    uint8_t in_flight;
+    uint32_t sent;
+    uint32_t acked;
+    uint32_t failed;
+    uint32_t airtime_us;
+} tx_counters_t;
+
+/* One entry per peer table entry, and one for broadcasts */
+#define TX_BROADCAST_ENTRY PEER_DATA_TABLE_ENTRIES
+
+static tx_counters_t s_counters[PEER_DATA_TABLE_ENTRIES + 1];
+static uint8_t s_in_flight;
+
+static tx_counters_t *counters_of(const uint8_t *mac_addr) {
+    if (memcmp(mac_addr, s_broadcast_mac, ESP_NOW_ETH_ALEN) == 0) {
+        return &s_counters[TX_BROADCAST_ENTRY];
+    }
+
+    peer_data_t *peer_data;
+    if (get_peer_info(mac_addr, &peer_data) != ESP_OK) {
+        return NULL;
+    }
+
+    tx_counters_t *counters = &s_counters[peer_data - peer_data_table];
+    uint32_t generation     = get_peer_generation(peer_data);
+    if (__atomic_load_n(&counters->generation, __ATOMIC_RELAXED) != generation) {
+        /* The entry belongs to another peer now. Frames of the previous one still in flight may skew the new counters
+         * slightly, they are statistics only. */
+        memset(counters, 0, sizeof(tx_counters_t));
+        __atomic_store_n(&counters->generation, generation, __ATOMIC_RELAXED);
+    }
+    return counters;
+}
+
+static uint32_t airtime_us(size_t len) {
+    uint32_t bits = (len + TX_FRAME_OVERHEAD) * 8;
+    /* 1 Mbit/s, or 500 kbit/s in long range mode */
+    return TX_PREAMBLE_US + (phy_current() == PHY_MODE_LONG_RANGE ? 2 * bits : bits);
+}
+
+esp_err_t tx_send(const uint8_t *mac_addr, const espnow_data_t *data, size_t len, tx_prio_t prio) {
+    if (prio == TX_PRIO_LOW && __atomic_load_n(&s_in_flight, __ATOMIC_RELAXED) >= TX_LOW_PRIO_MAX_IN_FLIGHT) {
+        log_v("Deferring frame to " MACSTR ", %d frames in flight.", MAC2STR(mac_addr), s_in_flight);
+        comm_stats.tx_deferred++;
+        return ESP_ERR_ESPNOW_NO_MEM;
+    }
+
+    /* Count it before sending, the send callback may come before the transport returns */
+    uint8_t in_flight = __atomic_add_fetch(&s_in_flight, 1, __ATOMIC_RELAXED);
+    if (in_flight > comm_stats.tx_in_flight_peak) {
+        comm_stats.tx_in_flight_peak = in_flight;
+    }
+
+    esp_err_t ret = transport->send(mac_addr, (const uint8_t *)data, len);
+    for (uint8_t retry = 0; ret == ESP_ERR_ESPNOW_NO_MEM && prio == TX_PRIO_HIGH && retry < TX_HIGH_PRIO_RETRIES; retry++) {
+        vTaskDelay(1);
+        ret = transport->send(mac_addr, (const uint8_t *)data, len);
+    }
+
+    if (ret != ESP_OK) {
+        __atomic_sub_fetch(&s_in_flight, 1, __ATOMIC_RELAXED);
+        if (ret == ESP_ERR_ESPNOW_NO_MEM) {
+            comm_stats.tx_no_mem++;
+        }
+        return ret;
+    }
+
+    uint32_t airtime = airtime_us(len);
+    comm_stats.tx_airtime_us += airtime;
+
+    tx_counters_t *counters = counters_of(mac_addr);
+    if (counters != NULL) {
+        __atomic_fetch_add(&counters->in_flight, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&counters->sent, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&counters->airtime_us, airtime, __ATOMIC_RELAXED);
+    }
+    return ESP_OK;
+}
+
+void tx_send_done(const uint8_t *mac_addr, esp_now_send_status_t status) {
+    __atomic_sub_fetch(&s_in_flight, 1, __ATOMIC_RELAXED);
+
+    if (status != ESP_NOW_SEND_SUCCESS) {
+        comm_stats.tx_failed++;
+    }
+
+    tx_counters_t *counters = counters_of(mac_addr);
+    if (counters == NULL) { return; }
+
+    /* Never below zero, the counters may have been reset for a new peer meanwhile */
+    uint8_t peer_in_flight = __atomic_load_n(&counters->in_flight, __ATOMIC_RELAXED);
+    while (peer_in_flight > 0 && !__atomic_compare_exchange_n(&counters->in_flight, &peer_in_flight, peer_in_flight - 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+    __atomic_fetch_add(status == ESP_NOW_SEND_SUCCESS ? &counters->acked : &counters->failed, 1, __ATOMIC_RELAXED);
+}
+
+uint8_t tx_in_flight() {
+    return __atomic_load_n(&s_in_flight, __ATOMIC_RELAXED);
+}
+
+void get_peer_tx_stats(const peer_data_t *peer_data, peer_link_stats_t *stats) {
+    const tx_counters_t *counters = &s_counters[peer_data - peer_data_table];
+    if (__atomic_load_n(&counters->generation, __ATOMIC_RELAXED) != get_peer_generation(peer_data)) {
+        /* Nothing sent to this peer yet */
+        stats->tx_in_flight  = 0;
+        stats->tx_sent       = 0;
+        stats->tx_acked      = 0;
+        stats->tx_failed     = 0;
+        stats->tx_airtime_ms = 0;
+        return;
+    }
+
+    stats->tx_in_flight  = __atomic_load_n(&counters->in_flight, __ATOMIC_RELAXED);
+    stats->tx_sent       = __atomic_load_n(&counters->sent, __ATOMIC_RELAXED);
+    stats->tx_acked      = __atomic_load_n(&counters->acked, __ATOMIC_RELAXED);
+    stats->tx_failed     = __atomic_load_n(&counters->failed, __ATOMIC_RELAXED);
+    stats->tx_airtime_ms = __atomic_load_n(&counters->airtime_us, __ATOMIC_RELAXED) / 1000;
+}
@@ -0,0 +1,177 @@
+#!/usr/bin/env python3
+"""
+Measures how long the node network takes to converge after a mass power-on.
+
+Connect the controller via USB, start this script and then switch on the buzzers. The script polls the
+controller's peer table (vendor request 0x20) and prints every peer as it appears. The network counts as
+converged once --expected peers are known (or, without --expected, once the peer count did not change for
+--settle seconds). The controller's comm stats (vendor request 0x21) are printed for the measurement period,
+including how many join replies were sent and how many were saved by the join storm suppression.
+
+Requires pyusb (pip install pyusb).
+"""
+
+import argparse
+import struct
+import sys
+import time
+
+import usb.core
+import usb.util
+
+VENDOR_ID = 0xCAFE
+
+REQUEST_VERSION = 0x00
+REQUEST_NETWORK_INFO = 0x20
+REQUEST_COMM_STATS = 0x21
+
+# peer_data_t (include/comm.h): mac_addr, last_seen, last_sent_ping_us, latency_us, rssi, valid_version, node_info
+PEER_DATA_FORMAT = "<6sIIHbB20s"
+PEER_DATA_SIZE = struct.calcsize(PEER_DATA_FORMAT)
+
+# comm_stats_t (include/comm.h), in declaration order. Hosts may read a prefix, so older firmware just reports fewer.
+COMM_STATS_FIELDS = [
+    ("rx_frames", "I"),
+    ("rx_pool_exhausted", "I"),
+    ("rx_queue_full", "I"),
+    ("rx_oversized", "I"),
+    ("rx_pool_peak_in_use", "B"),
+    ("tx_keyframes", "I"),
+    ("tx_deltas", "I"),
+    ("rx_deltas_dropped", "I"),
+    ("tx_command_retries", "I"),
+    ("tx_command_failed", "I"),
+    ("rx_command_dups", "I"),
+    ("rx_high_frames", "I"),
+    ("rx_high_dropped", "I"),
+    ("tx_cb_queue_full", "I"),
+    ("rx_joins", "I"),
+    ("tx_join_replies", "I"),
+    ("join_replies_saved", "I"),
+    ("rx_relayed", "I"),
+    ("tx_relayed", "I"),
+    ("rx_relay_dups", "I"),
+    ("relay_latency_us", "I"),
+    ("phy_switches", "I"),
+    ("phy_fallbacks", "I"),
+    ("buzz_latency_us", "I"),
+    ("buzz_latency_max", "I"),
+    ("buzz_claims_late", "I"),
+    ("ps_dozing_ms", "I"),
+    ("tx_failed", "I"),
+    ("tx_deferred", "I"),
+    ("tx_no_mem", "I"),
+    ("tx_airtime_us", "I"),
+    ("tx_in_flight_peak", "B"),
+    ("rx_peer_table_full", "I"),
+]
+COMM_STATS_SIZE = struct.calcsize("<" + "".join(f for _, f in COMM_STATS_FIELDS))
+# Fields holding a current value rather than a counter
+COMM_STATS_GAUGES = {"rx_pool_peak_in_use", "tx_in_flight_peak", "relay_latency_us", "buzz_latency_us", "buzz_latency_max"}
+
+BROADCAST_MAC = b"\xff" * 6
+
+
+def vendor_in(dev, request, index, length):
+    request_type = usb.util.build_request_type(usb.util.CTRL_IN, usb.util.CTRL_TYPE_VENDOR, usb.util.CTRL_RECIPIENT_DEVICE)
+    return bytes(dev.ctrl_transfer(request_type, request, 0, index, length))
+
+
+def read_peers(dev):
+    """Returns the set of known peer MACs with a valid version"""
+    peers = set()
+    index = 0
+    while True:
+        try:
+            data = vendor_in(dev, REQUEST_NETWORK_INFO, index, PEER_DATA_SIZE)
+        except usb.core.USBError:
+            break  # Past the end of the peer table
+        if len(data) < PEER_DATA_SIZE:
+            break
+        mac, _, _, _, _, valid_version, _ = struct.unpack(PEER_DATA_FORMAT, data)
+        if mac != BROADCAST_MAC and valid_version:
+            peers.add(mac)
+        index += 1
+    return peers
+
+
+def read_comm_stats(dev):
+    data = vendor_in(dev, REQUEST_COMM_STATS, 0, COMM_STATS_SIZE)
+    stats = {}
+    offset = 0
+    for name, fmt in COMM_STATS_FIELDS:
+        size = struct.calcsize("<" + fmt)
+        if offset + size > len(data):
+            break
+        (stats[name],) = struct.unpack_from("<" + fmt, data, offset)
+        offset += size
+    return stats
+
+
+def format_mac(mac):
+    return ":".join(f"{b:02x}" for b in mac)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--expected", type=int, help="number of peers (besides the controller) the network converges to")
+    parser.add_argument("--settle", type=float, default=5.0, help="[s] peer count must be stable this long without --expected")
+    parser.add_argument("--timeout", type=float, default=120.0, help="[s] give up after this long")
+    parser.add_argument("--interval", type=float, default=0.05, help="[s] polling interval")
+    args = parser.parse_args()
+
+    dev = usb.core.find(idVendor=VENDOR_ID)
+    if dev is None:
+        sys.exit("No controller found.")
+
+    version = vendor_in(dev, REQUEST_VERSION, 0, 1)[0]
+    print(f"Controller found (version 0x{version:02x}).")
+
+    known = read_peers(dev)
+    stats_before = read_comm_stats(dev)
+    print(f"{len(known)} peer(s) already known. Switch on the buzzers now...")
+
+    start = None
+    last_change = time.monotonic()
+    converged_at = None
+    while True:
+        now = time.monotonic()
+        peers = read_peers(dev)
+
+        for mac in sorted(peers - known):
+            if start is None:
+                start = now
+            print(f"{(now - start) * 1000:8.0f}ms  + {format_mac(mac)} ({len(peers)} peers)")
+        for mac in sorted(known - peers):
+            print(f"{(now - (start or now)) * 1000:8.0f}ms  - {format_mac(mac)} ({len(peers)} peers)")
+        if peers != known:
+            last_change = now
+        known = peers
+
+        if start is not None:
+            if args.expected is not None and len(known) >= args.expected:
+                converged_at = now
+                break
+            if args.expected is None and now - last_change >= args.settle:
+                converged_at = last_change
+                break
+            if now - start > args.timeout:
+                break
+
+        time.sleep(args.interval)
+
+    if converged_at is None:
+        print(f"Not converged after {args.timeout:.0f}s ({len(known)} peers).")
+    else:
+        print(f"Converged to {len(known)} peers after {(converged_at - start) * 1000:.0f}ms.")
+
+    stats_after = read_comm_stats(dev)
+    print("Controller comm stats during the measurement:")
+    for name, _ in COMM_STATS_FIELDS:
+        if name in stats_after and name in stats_before:
+            value = stats_after[name] if name in COMM_STATS_GAUGES else stats_after[name] - stats_before[name]
+            print(f"  {name:20} {value}")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,133 @@
+#!/usr/bin/env python3
+"""
+Prints the controller's buzz latency histograms (vendor request 0x24): per stage of a buzz, from the button read on the
+buzzer to the key press sent to the host, the number of samples, mean, p50, p90, p99 and maximum.
+
+Connect the controller via USB and buzz a few times. The histograms count everything since the controller booted; with
+--interval, the script keeps printing the histograms of each interval instead. Percentiles are the upper bound of the
+bucket they fall into, so they are accurate to about 20% (see include/buzz_trace.h).
+
+Requires pyusb (pip install pyusb).
+"""
+
+import argparse
+import struct
+import sys
+import time
+
+import usb.core
+import usb.util
+
+VENDOR_ID = 0xCAFE
+
+REQUEST_VERSION = 0x00
+REQUEST_BUZZ_LATENCY = 0x24
+
+# buzz_trace_stats_t and buzz_trace_histogram_t (include/buzz_trace.h)
+STATS_HEADER_FORMAT = "<BBBBIII"
+STATS_HEADER_SIZE = struct.calcsize(STATS_HEADER_FORMAT)
+HISTOGRAM_HEADER_FORMAT = "<IIQ"
+HISTOGRAM_HEADER_SIZE = struct.calcsize(HISTOGRAM_HEADER_FORMAT)
+MAX_STAGES = 8
+MAX_BUCKETS = 128
+
+STAGES = ["press -> send", "send -> receive", "receive -> dispatch", "dispatch -> key", "press -> key"]
+
+
+def vendor_in(dev, request, value, index, length):
+    request_type = usb.util.build_request_type(usb.util.CTRL_IN, usb.util.CTRL_TYPE_VENDOR, usb.util.CTRL_RECIPIENT_DEVICE)
+    return bytes(dev.ctrl_transfer(request_type, request, value, index, length))
+
+
+def bucket_upper_us(bucket, sub_buckets):
+    """Exclusive upper bound of a bucket (see buzz_trace_bucket())"""
+    if bucket < sub_buckets:
+        return bucket + 1
+    sub_bits = sub_buckets.bit_length() - 1
+    exponent = bucket // sub_buckets + sub_bits - 1
+    return (sub_buckets + bucket % sub_buckets + 1) << (exponent - sub_bits)
+
+
+def read_stats(dev):
+    length = STATS_HEADER_SIZE + MAX_STAGES * (HISTOGRAM_HEADER_SIZE + MAX_BUCKETS * 4)
+    data = vendor_in(dev, REQUEST_BUZZ_LATENCY, 0, 0, length)
+    stages, buckets, sub_buckets, _, started, unsynced, keyed = struct.unpack_from(STATS_HEADER_FORMAT, data)
+
+    histograms = []
+    offset = STATS_HEADER_SIZE
+    for _ in range(stages):
+        count, max_us, sum_us = struct.unpack_from(HISTOGRAM_HEADER_FORMAT, data, offset)
+        counts = struct.unpack_from(f"<{buckets}I", data, offset + HISTOGRAM_HEADER_SIZE)
+        histograms.append({"count": count, "max_us": max_us, "sum_us": sum_us, "buckets": list(counts)})
+        offset += HISTOGRAM_HEADER_SIZE + buckets * 4
+    return {"sub_buckets": sub_buckets, "started": started, "unsynced": unsynced, "keyed": keyed, "histograms": histograms}
+
+
+def difference(stats, baseline):
+    """The stats of the samples recorded since baseline. The maximum is still the overall one."""
+    result = dict(stats, histograms=[])
+    for key in ("started", "unsynced", "keyed"):
+        result[key] = stats[key] - baseline[key]
+    for histogram, previous in zip(stats["histograms"], baseline["histograms"]):
+        result["histograms"].append({
+            "count": histogram["count"] - previous["count"],
+            "max_us": histogram["max_us"],
+            "sum_us": histogram["sum_us"] - previous["sum_us"],
+            "buckets": [a - b for a, b in zip(histogram["buckets"], previous["buckets"])],
+        })
+    return result
+
+
+def percentile_us(histogram, sub_buckets, fraction):
+    rank = fraction * histogram["count"]
+    seen = 0
+    for bucket, count in enumerate(histogram["buckets"]):
+        seen += count
+        if count > 0 and seen >= rank:
+            return min(bucket_upper_us(bucket, sub_buckets), histogram["max_us"])
+    return histogram["max_us"]
+
+
+def format_us(us):
+    return f"{us / 1000:9.2f}ms"
+
+
+def print_stats(stats):
+    print(f"{stats['started']} claims received ({stats['unsynced']} without network time), {stats['keyed']} keys pressed")
+    print(f"{'stage':20} {'samples':>8} {'mean':>11} {'p50':>11} {'p90':>11} {'p99':>11} {'max':>11}")
+    for index, histogram in enumerate(stats["histograms"]):
+        name = STAGES[index] if index < len(STAGES) else f"stage {index}"
+        if histogram["count"] == 0:
+            print(f"{name:20} {0:8}")
+            continue
+        percentiles = [format_us(percentile_us(histogram, stats["sub_buckets"], p)) for p in (0.5, 0.9, 0.99)]
+        print(f"{name:20} {histogram['count']:8} {format_us(histogram['sum_us'] / histogram['count'])} {' '.join(percentiles)} {format_us(histogram['max_us'])}")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--interval", type=float, help="[s] keep printing the histograms of each interval")
+    args = parser.parse_args()
+
+    dev = usb.core.find(idVendor=VENDOR_ID)
+    if dev is None:
+        sys.exit("No controller found.")
+
+    version = vendor_in(dev, REQUEST_VERSION, 0, 0, 1)[0]
+    print(f"Controller found (version 0x{version:02x}).")
+
+    stats = read_stats(dev)
+    print_stats(stats)
+    while args.interval:
+        time.sleep(args.interval)
+        baseline, stats = stats, read_stats(dev)
+        if stats["started"] < baseline["started"]:
+            print("Controller restarted.")
+            print_stats(stats)
+            continue
+        print()
+        print_stats(difference(stats, baseline))
+
+
+if __name__ == "__main__":
+    main()
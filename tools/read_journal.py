@@ -0,0 +1,111 @@
+#!/usr/bin/env python3
+"""
+Prints the controller's buzz journal (vendor request 0x23): buzz claims, arbitration decisions, buzzer state and mode
+changes, and round starts and ends, with the network time they happened at.
+
+Connect the controller via USB. The script prints everything still in the journal and, with --follow, keeps printing
+new entries as they are recorded. Entries that were overwritten before they could be read are reported as a gap.
+
+Requires pyusb (pip install pyusb).
+"""
+
+import argparse
+import struct
+import sys
+import time
+
+import usb.core
+import usb.util
+
+VENDOR_ID = 0xCAFE
+
+REQUEST_VERSION = 0x00
+REQUEST_JOURNAL = 0x23
+
+# journal_page_header_t and journal_entry_t (include/journal.h)
+JOURNAL_HEADER_FORMAT = "<II"
+JOURNAL_HEADER_SIZE = struct.calcsize(JOURNAL_HEADER_FORMAT)
+JOURNAL_ENTRY_FORMAT = "<Iq6sBBI"
+JOURNAL_ENTRY_SIZE = struct.calcsize(JOURNAL_ENTRY_FORMAT)
+JOURNAL_ENTRIES = 128
+JOURNAL_LATENCY_UNKNOWN = 0xFFFFFFFF
+
+MODES = ["default", "simon says"]
+
+
+def describe(event, arg, value):
+    if event == 0:
+        return "buzz claim" + ("" if value == JOURNAL_LATENCY_UNKNOWN else f" (latency {value}us)")
+    if event == 1:
+        return f"wins the round ({arg} claims)"
+    if event == 2:
+        return f"active for {value}ms"
+    if event == 3:
+        return "locked out"
+    if event == 4:
+        return "released"
+    if event == 5:
+        return f"mode {MODES[arg] if arg < len(MODES) else arg}"
+    if event == 6:
+        return "round start"
+    if event == 7:
+        return "round end"
+    return f"unknown event {event}"
+
+
+def vendor_in(dev, request, value, index, length):
+    request_type = usb.util.build_request_type(usb.util.CTRL_IN, usb.util.CTRL_TYPE_VENDOR, usb.util.CTRL_RECIPIENT_DEVICE)
+    return bytes(dev.ctrl_transfer(request_type, request, value, index, length))
+
+
+def read_journal(dev, cursor):
+    """Returns the next sequence number and the entries from sequence number cursor on"""
+    length = JOURNAL_HEADER_SIZE + JOURNAL_ENTRIES * JOURNAL_ENTRY_SIZE
+    data = vendor_in(dev, REQUEST_JOURNAL, cursor & 0xFFFF, cursor >> 16, length)
+    _, next_seq = struct.unpack_from(JOURNAL_HEADER_FORMAT, data)
+    entries = [
+        struct.unpack_from(JOURNAL_ENTRY_FORMAT, data, offset)
+        for offset in range(JOURNAL_HEADER_SIZE, len(data) - JOURNAL_ENTRY_SIZE + 1, JOURNAL_ENTRY_SIZE)
+    ]
+    return next_seq, entries
+
+
+def format_mac(mac):
+    return ":".join(f"{b:02x}" for b in mac)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--follow", action="store_true", help="keep printing new entries")
+    parser.add_argument("--interval", type=float, default=0.5, help="[s] polling interval with --follow")
+    args = parser.parse_args()
+
+    dev = usb.core.find(idVendor=VENDOR_ID)
+    if dev is None:
+        sys.exit("No controller found.")
+
+    version = vendor_in(dev, REQUEST_VERSION, 0, 0, 1)[0]
+    print(f"Controller found (version 0x{version:02x}).")
+
+    cursor = 0
+    while True:
+        next_seq, entries = read_journal(dev, cursor)
+        if next_seq < cursor:
+            print("Controller restarted.")
+            cursor = 0
+            continue
+
+        for seq, time_us, mac, event, arg, value in entries:
+            if seq > cursor:
+                print(f"... {seq - cursor} entries lost")
+            print(f"{seq:6}  {time_us / 1e6:12.6f}s  {format_mac(mac)}  {describe(event, arg, value)}")
+            cursor = seq + 1
+
+        if not args.follow:
+            break
+        if cursor == next_seq:
+            time.sleep(args.interval)
+
+
+if __name__ == "__main__":
+    main()
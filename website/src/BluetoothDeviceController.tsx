@@ -2,7 +2,7 @@ import { Button } from "@nextui-org/react";
 import { Buffer } from 'buffer';
 import { useCallback, useEffect, useState } from "react";
 import DeviceNetworkInfo from "./DeviceNetworkInfo";
-import { arr_peer_data_t, peer_data_t } from "./util";
+import { arr_peer_data_t, peer_data_t, peer_list_page_header_t } from "./util";
 
 interface BluetoothDeviceControllerProps {
     // onConnect: (device: BluetoothDevice) => void;
@@ -87,13 +87,28 @@ export const BluetoothDeviceController = (props: BluetoothDeviceControllerProps)
     const readPeerList = useCallback(async () => {
         if (!peerListCharacteristic) { return; }
 
-        peerListCharacteristic.readValue().then(data => {
+        /* The peer list is read in pages, every read returns the next one. Keep reading until every page was seen. */
+        try {
+            const pages = new Map<number, peer_data_t[]>();
+            let total = 1;
+            let seen = 0;
+            for (let reads = 0; seen < total && reads < 2 * total; reads++) {
+                const buf = Buffer.from((await peerListCharacteristic.readValue()).buffer);
+                const header = new peer_list_page_header_t(buf);
+                const entries = new arr_peer_data_t(buf.subarray(peer_list_page_header_t.baseSize)).peer_data_t;
+
+                total = header.total;
+                if (!pages.has(header.first)) {
+                    pages.set(header.first, entries);
+                    seen += entries.length;
+                }
+            }
+
             console.log("Got updated peer list");
-            const peers = new arr_peer_data_t(Buffer.from(data.buffer)).peer_data_t;
-            setPeers(peers);
-        }).catch(e => {
+            setPeers(Array.from(pages.keys()).sort((a, b) => a - b).flatMap(first => pages.get(first)!));
+        } catch (e) {
             // console.log(e);
-        });
+        }
 
     }, [peerListCharacteristic, setPeers]);
 
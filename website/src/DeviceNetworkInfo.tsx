@@ -2,7 +2,7 @@ import { Button, Card, CardBody, CardFooter, CardHeader, Chip, Divider, Dropdown
 import { Buffer } from 'buffer';
 import classNames from "classnames";
 import { useCallback, useEffect, useMemo, useRef, useState } from "react";
-import { ArrowClockwise, Command, InfoCircle, Option, Palette, Power, Reception0, Reception1, Reception2, Reception3, Reception4, Shift } from 'react-bootstrap-icons';
+import { ArrowClockwise, Broadcast, Command, InfoCircle, Option, Palette, Power, Reception0, Reception1, Reception2, Reception3, Reception4, Shift } from 'react-bootstrap-icons';
 import { CirclePicker } from 'react-color';
 import { DeviceInfo, EXPECTED_DEVICE_VERSION, arr_peer_data_t, command_t, isBroadcastMac, isZeroMac, key_config_t, key_modifier_t, node_info_t, node_mode_t, node_state_default_t, node_type_t, peer_data_t } from "./util";
 
@@ -93,6 +93,8 @@ export function PeerInfo(props: PeerInfoProps) {
         "setColor": () => setShowColorPicker(true),
         "setKeyConfig": () => setShowKeybindPicker(true),
         "setMode": () => sendCommand(peer, [command_t.COMMAND_SET_MODE]),
+        "relayOn": () => sendCommand(peer, [command_t.COMMAND_SET_RELAY_MODE, 1]),
+        "relayOff": () => sendCommand(peer, [command_t.COMMAND_SET_RELAY_MODE, 0]),
         "reset": () => sendCommand(peer, [command_t.COMMAND_RESET]),
         "shutdown": () => sendCommand(peer, [command_t.COMMAND_SHUTDOWN])
     }), [sendCommand, setShowKeybindPicker, setShowColorPicker]);
@@ -142,6 +144,8 @@ export function PeerInfo(props: PeerInfoProps) {
                     <DropdownMenu onAction={key => menuActions[key as keyof typeof menuActions]()} aria-label="Buzzer Optionen">
                         <DropdownItem key="setColor" startContent={<Palette />}>Farbe</DropdownItem>
                         <DropdownItem showDivider key="setKeyConfig" startContent={<Command />}>Keybind setzen</DropdownItem>
+                        <DropdownItem key="relayOn" startContent={<Broadcast />}>Als Relay verwenden</DropdownItem>
+                        <DropdownItem showDivider key="relayOff" startContent={<Broadcast />}>Relay beenden</DropdownItem>
                         <DropdownItem key="reset" startContent={<ArrowClockwise />}>Reset</DropdownItem>
                         <DropdownItem key="shutdown" className="text-danger" color='danger' startContent={<Power />}>Ausschalten</DropdownItem>
                     </DropdownMenu>
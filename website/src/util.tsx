@@ -1,7 +1,7 @@
 import Struct, { ExtractType, typed } from "typed-struct";
 export const BROADCAST_MAC = new Uint8Array([0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF]);
 
-export const EXPECTED_DEVICE_VERSION = 0x13;
+export const EXPECTED_DEVICE_VERSION = 0x19;
 
 export function isBroadcastMac(mac_addr: Uint8Array) {
     return mac_addr.every(x => x === 0xFF);
@@ -23,9 +23,15 @@ export enum command_t {
     COMMAND_SET_COLOR = 0x20,
     COMMAND_SET_GAME_CONFIG = 0x21,
     COMMAND_SET_KEY_CONFIG = 0x22,
+    COMMAND_SET_RELAY_MODE = 0x23,
+    COMMAND_SWITCH_CHANNEL = 0x24,
+    COMMAND_SET_PHY = 0x25,
+    COMMAND_SET_POWER_SAVE = 0x26,
     COMMAND_BUZZ = 0x30,
     COMMAND_SET_INACTIVE = 0x31,
     COMMAND_SET_ACTIVE = 0x32,
+    COMMAND_ROUND_START = 0x33,
+    COMMAND_ROUND_END = 0x34,
     COMMAND_RESET = 0x40,
     COMMAND_SHUTDOWN = 0x50,
     COMMAND_SET_MODE = 0x60,
@@ -117,6 +123,12 @@ export const arr_peer_data_t = new Struct('arr_peer_data_t')
     .compile();
 export type arr_peer_data_t = ExtractType<typeof arr_peer_data_t>;
 
+export const peer_list_page_header_t = new Struct('peer_list_page_header_t')
+    .UInt8('first')     // Table index of the page's first entry
+    .UInt8('total')     // Number of entries in the table
+    .compile();
+export type peer_list_page_header_t = ExtractType<typeof peer_list_page_header_t>;
+
 
 export function uint16_t(value: number) {
     const buffer = new ArrayBuffer(2);